@@ -0,0 +1,540 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "basin.h"
+#include "mem.h"
+
+/*
+Basins are found in three phases:
+  1. every cell picks its receiver, the lowest strictly lower 4-neighbour
+     (the same neighbours the simulation exchanges water with). NODATA cells
+     get receiver -1 and are never chosen as a receiver, so they end up in no
+     basin. A cell without a lower neighbour is a sink and drains to itself,
+     unless it lies on a flat: a 4-connected area of equal height. Flats are
+     resolved serially by a breadth-first search over equal heights. It starts
+     from the flat's outlets, the cells of the flat that do have a lower
+     neighbour, so every other cell drains towards its nearest outlet. A flat
+     without an outlet drains to its first cell in row-major order, which
+     becomes the one sink of the whole flat.
+  2. each tile is labelled on its own: cells are joined with their receiver
+     whenever it lies in the same tile, so every tile ends up as a forest whose
+     roots are either sinks or exit cells draining into another tile
+  3. a serial merge links each exit root to the root of its receiver's tile and
+     compresses the paths, leaving every tile root pointing at its sink
+Phases 1, 2 and the final labelling touch disjoint cells per tile and run in
+parallel; only the flat cells and the tile perimeters are handled serially.
+*/
+
+// Receiver of a flat cell that has not been resolved yet
+#define BASIN_FLAT -2
+
+typedef struct {
+    const pointcloud_t *pc;
+    int rows, cols;
+    int tile;               // tile edge length
+    int tiles_x, tiles_y;   // number of tiles along each axis
+    int *recv;              // receiver of every cell
+    int *parent;            // union-find parent, tile root after phase 2
+    int *labels;            // output basin ids
+    int *tile_sinks;        // flat cells per tile, then sinks per tile, then the first basin id of the tile
+} basin_job_t;
+
+static void tile_bounds(const basin_job_t *job, int t, int *r0, int *r1, int *c0, int *c1) {
+    int ty = t / job->tiles_x;
+    int tx = t % job->tiles_x;
+    *r0 = ty * job->tile;
+    *c0 = tx * job->tile;
+    *r1 = *r0 + job->tile < job->rows ? *r0 + job->tile : job->rows;
+    *c1 = *c0 + job->tile < job->cols ? *c0 + job->tile : job->cols;
+}
+
+// Whether valid cell j, a 4-neighbour of a cell of height z, is on the same flat
+static int basin_same_height(const basin_job_t *job, int j, double z) {
+    const pcd_t *points = job->pc->points.data;
+    return POINTCLOUD_VALID(job->pc->valid, j) && points[j].z == z;
+}
+
+// Fills nb with the 4-neighbours of cell i in west, east, north, south order
+// Returns: the number of neighbours
+static int basin_neighbours(const basin_job_t *job, int i, int nb[4]) {
+    int row = i / job->cols, col = i % job->cols, k = 0;
+    if (col > 0) nb[k++] = i - 1;
+    if (col < job->cols - 1) nb[k++] = i + 1;
+    if (row > 0) nb[k++] = i - job->cols;
+    if (row < job->rows - 1) nb[k++] = i + job->cols;
+    return k;
+}
+
+// Phase 1: steepest descent receivers, with flat cells left as BASIN_FLAT
+static void basin_receivers(void *arg, int thread, int nthreads) {
+    basin_job_t *job = arg;
+    const pcd_t *points = job->pc->points.data;
+    const uint64_t *valid = job->pc->valid;
+    int cols = job->cols;
+    int ntiles = job->tiles_x * job->tiles_y;
+
+    for (int t = thread; t < ntiles; t += nthreads) {
+        int r0, r1, c0, c1;
+        int flats = 0;
+        tile_bounds(job, t, &r0, &r1, &c0, &c1);
+
+        // Steepest descent receiver; ties resolve in west, east, north, south order
+        for (int row = r0; row < r1; row++) {
+            for (int col = c0; col < c1; col++) {
+                int i = row * cols + col;
+                double z = points[i].z;
+                double best = 0.0;
+                int r = i;
+
+                if (!POINTCLOUD_VALID(valid, i)) {
+                    job->recv[i] = -1;
+                    continue;
+                }
+
+                if (col > 0 && POINTCLOUD_VALID(valid, i - 1) && z - points[i - 1].z > best) {
+                    best = z - points[i - 1].z;
+                    r = i - 1;
+                }
+                if (col < cols - 1 && POINTCLOUD_VALID(valid, i + 1) && z - points[i + 1].z > best) {
+                    best = z - points[i + 1].z;
+                    r = i + 1;
+                }
+                if (row > 0 && POINTCLOUD_VALID(valid, i - cols) && z - points[i - cols].z > best) {
+                    best = z - points[i - cols].z;
+                    r = i - cols;
+                }
+                if (row < job->rows - 1 && POINTCLOUD_VALID(valid, i + cols) &&
+                    z - points[i + cols].z > best) {
+                    r = i + cols;
+                }
+
+                if (r == i) {
+                    int nb[4], k = basin_neighbours(job, i, nb);
+                    while (k-- > 0 && r == i) {
+                        r = basin_same_height(job, nb[k], z) ? BASIN_FLAT : i;
+                    }
+                    flats += r == BASIN_FLAT;
+                }
+                job->recv[i] = r;
+            }
+        }
+        job->tile_sinks[t] = flats;
+    }
+}
+
+/**
+ * Resolves the flats left by phase 1 in a breadth-first search over equal
+ * heights: cells drain towards the nearest outlet of their flat, and flats
+ * without an outlet towards their first cell, which becomes their sink
+ * Returns: 0 on success, -1 if the search queue cannot be allocated
+ */
+static int basin_resolve_flats(basin_job_t *job) {
+    const pcd_t *points = job->pc->points.data;
+    size_t n = (size_t)job->rows * job->cols;
+    int *queue = mem_alloc(MEM_ANALYSIS, n * sizeof(int));
+    if (!queue) {
+        return -1;
+    }
+
+    // Outlets first, in row-major order, so the search is the same on any thread count
+    size_t head = 0, tail = 0;
+    int nb[4];
+    for (size_t i = 0; i < n; i++) {
+        if (job->recv[i] < 0 || job->recv[i] == (int)i) {
+            continue;
+        }
+        for (int k = basin_neighbours(job, (int)i, nb); k-- > 0;) {
+            if (job->recv[nb[k]] == BASIN_FLAT && points[nb[k]].z == points[i].z) {
+                queue[tail++] = (int)i;
+                break;
+            }
+        }
+    }
+
+    size_t next = 0;    // first cell that may still be on an unresolved flat
+    for (;;) {
+        while (head < tail) {
+            int i = queue[head++];
+            int count = basin_neighbours(job, i, nb);
+            for (int k = 0; k < count; k++) {
+                int j = nb[k];
+                if (job->recv[j] == BASIN_FLAT && points[j].z == points[i].z) {
+                    job->recv[j] = i;
+                    queue[tail++] = j;
+                }
+            }
+        }
+
+        // What is left belongs to flats without an outlet
+        while (next < n && job->recv[next] != BASIN_FLAT) {
+            next++;
+        }
+        if (next == n) {
+            break;
+        }
+        job->recv[next] = (int)next;
+        queue[tail++] = (int)next;
+    }
+
+    mem_free(queue);
+    return 0;
+}
+
+// Phase 2: the tile-local union-find
+static void basin_tile_pass(void *arg, int thread, int nthreads) {
+    basin_job_t *job = arg;
+    int cols = job->cols;
+    int ntiles = job->tiles_x * job->tiles_y;
+
+    for (int t = thread; t < ntiles; t += nthreads) {
+        int r0, r1, c0, c1;
+        tile_bounds(job, t, &r0, &r1, &c0, &c1);
+        for (int row = r0; row < r1; row++) {
+            for (int col = c0; col < c1; col++) {
+                job->parent[row * cols + col] = -1;
+            }
+        }
+
+        // Resolve each cell's root inside the tile, compressing the path behind it
+        int sinks = 0;
+        for (int row = r0; row < r1; row++) {
+            for (int col = c0; col < c1; col++) {
+                int i = row * cols + col;
+                if (job->parent[i] != -1 || job->recv[i] < 0) {
+                    continue;
+                }
+
+                int j = i, root;
+                for (;;) {
+                    if (job->parent[j] != -1) {
+                        root = job->parent[j];
+                        break;
+                    }
+                    int r = job->recv[j];
+                    int rr = r / cols, rc = r % cols;
+                    if (r == j || rr < r0 || rr >= r1 || rc < c0 || rc >= c1) {
+                        root = j;
+                        break;
+                    }
+                    j = r;
+                }
+
+                for (j = i; job->parent[j] == -1; j = job->recv[j]) {
+                    job->parent[j] = root;
+                    if (j == root) {
+                        break;
+                    }
+                }
+            }
+        }
+
+        for (int row = r0; row < r1; row++) {
+            for (int col = c0; col < c1; col++) {
+                int i = row * cols + col;
+                if (job->recv[i] == i) {
+                    sinks++;
+                }
+            }
+        }
+        job->tile_sinks[t] = sinks;
+    }
+}
+
+// Numbers the sinks of each tile starting at the tile's first basin id
+static void basin_number_sinks(void *arg, int thread, int nthreads) {
+    basin_job_t *job = arg;
+    int ntiles = job->tiles_x * job->tiles_y;
+
+    for (int t = thread; t < ntiles; t += nthreads) {
+        int r0, r1, c0, c1;
+        int id = job->tile_sinks[t];
+        tile_bounds(job, t, &r0, &r1, &c0, &c1);
+        for (int row = r0; row < r1; row++) {
+            for (int col = c0; col < c1; col++) {
+                int i = row * job->cols + col;
+                if (job->recv[i] == i) {
+                    job->labels[i] = id++;
+                }
+            }
+        }
+    }
+}
+
+// Final labelling: tile root -> sink -> basin id. Sinks already hold their id.
+static void basin_label_cells(void *arg, int thread, int nthreads) {
+    basin_job_t *job = arg;
+    int ntiles = job->tiles_x * job->tiles_y;
+
+    for (int t = thread; t < ntiles; t += nthreads) {
+        int r0, r1, c0, c1;
+        tile_bounds(job, t, &r0, &r1, &c0, &c1);
+        for (int row = r0; row < r1; row++) {
+            for (int col = c0; col < c1; col++) {
+                int i = row * job->cols + col;
+                if (job->recv[i] < 0) {
+                    job->labels[i] = -1;
+                } else if (job->recv[i] != i) {
+                    int sink = job->parent[job->parent[i]];
+                    job->labels[i] = job->labels[sink];
+                }
+            }
+        }
+    }
+}
+
+static int basin_find(int *parent, int x) {
+    int root = x;
+    while (parent[root] != root) {
+        root = parent[root];
+    }
+    while (parent[x] != root) {
+        int next = parent[x];
+        parent[x] = root;
+        x = next;
+    }
+    return root;
+}
+
+// Phase 3: joins exit roots on the tile perimeters with their downstream tiles
+static void basin_merge(basin_job_t *job) {
+    int ntiles = job->tiles_x * job->tiles_y;
+    int cols = job->cols;
+
+    // Link every exit root to the tile root of its receiver
+    for (int t = 0; t < ntiles; t++) {
+        int r0, r1, c0, c1;
+        tile_bounds(job, t, &r0, &r1, &c0, &c1);
+        for (int row = r0; row < r1; row++) {
+            int step = (row == r0 || row == r1 - 1) ? 1 : c1 - c0 - 1;
+            for (int col = c0; col < c1; col += step > 0 ? step : 1) {
+                int i = row * cols + col;
+                if (job->parent[i] == i && job->recv[i] != i) {
+                    job->parent[i] = job->parent[job->recv[i]];
+                }
+            }
+        }
+    }
+
+    // Point every exit root straight at its sink
+    for (int t = 0; t < ntiles; t++) {
+        int r0, r1, c0, c1;
+        tile_bounds(job, t, &r0, &r1, &c0, &c1);
+        for (int row = r0; row < r1; row++) {
+            int step = (row == r0 || row == r1 - 1) ? 1 : c1 - c0 - 1;
+            for (int col = c0; col < c1; col += step > 0 ? step : 1) {
+                int i = row * cols + col;
+                if (job->recv[i] >= 0 && job->recv[i] != i && job->parent[i] != i) {
+                    basin_find(job->parent, i);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Labels every cell with the drainage basin it belongs to under steepest descent
+ * Inputs:
+ *  - pc: initialized point cloud (heights and current water depths are used)
+ *  - tile: tile edge length in cells, 0 for BASIN_TILE
+ *  - nthreads: number of worker threads, 0 for the default
+ * Output: basin labels and per-basin table, or NULL on failure
+ */
+basin_map_t* basin_label(const pointcloud_t *pc, int tile, int nthreads) {
+    if (!pc || !pc->points.data || pc->rows <= 0 || pc->cols <= 0 ||
+        (long)pc->rows * pc->cols != pc->points.size) {
+        fprintf(stderr, "Invalid parameters passed to basin_label\n");
+        return NULL;
+    }
+
+    basin_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.pc = pc;
+    job.rows = pc->rows;
+    job.cols = pc->cols;
+    job.tile = tile > 0 ? tile : BASIN_TILE;
+    job.tiles_x = (job.cols + job.tile - 1) / job.tile;
+    job.tiles_y = (job.rows + job.tile - 1) / job.tile;
+    if (nthreads <= 0) {
+        nthreads = defaultThreadCount();
+    }
+
+    size_t n = (size_t)job.rows * job.cols;
+    int ntiles = job.tiles_x * job.tiles_y;
+    job.recv = mem_alloc(MEM_ANALYSIS, n * sizeof(int));
+    job.parent = mem_alloc(MEM_ANALYSIS, n * sizeof(int));
+    job.tile_sinks = mem_alloc(MEM_ANALYSIS, ntiles * sizeof(int));
+    basin_map_t *bm = mem_calloc(MEM_ANALYSIS, 1, sizeof(basin_map_t));
+    if (bm) {
+        bm->labels = mem_alloc(MEM_ANALYSIS, n * sizeof(int));
+    }
+    if (!job.recv || !job.parent || !job.tile_sinks || !bm || !bm->labels) {
+        fprintf(stderr, "Failed to allocate basin labelling buffers\n");
+        mem_free(job.recv);
+        mem_free(job.parent);
+        mem_free(job.tile_sinks);
+        basin_map_free(bm);
+        return NULL;
+    }
+    job.labels = bm->labels;
+    bm->rows = job.rows;
+    bm->cols = job.cols;
+
+    parallelRun(nthreads, basin_receivers, &job);
+    int flats = 0;
+    for (int t = 0; t < ntiles; t++) {
+        flats += job.tile_sinks[t];
+    }
+    if (flats > 0 && basin_resolve_flats(&job) != 0) {
+        fprintf(stderr, "Failed to allocate basin labelling buffers\n");
+        mem_free(job.recv);
+        mem_free(job.parent);
+        mem_free(job.tile_sinks);
+        basin_map_free(bm);
+        return NULL;
+    }
+    parallelRun(nthreads, basin_tile_pass, &job);
+
+    // Exclusive prefix sum of the sink counts gives each tile its first basin id
+    int count = 0;
+    for (int t = 0; t < ntiles; t++) {
+        int sinks = job.tile_sinks[t];
+        job.tile_sinks[t] = count;
+        count += sinks;
+    }
+
+    parallelRun(nthreads, basin_number_sinks, &job);
+    basin_merge(&job);
+    parallelRun(nthreads, basin_label_cells, &job);
+
+    // Per-basin statistics
+    bm->count = count;
+    bm->basins = mem_calloc(MEM_ANALYSIS, count > 0 ? count : 1, sizeof(basin_t));
+    if (!bm->basins) {
+        mem_free(job.recv);
+        mem_free(job.parent);
+        mem_free(job.tile_sinks);
+        basin_map_free(bm);
+        return NULL;
+    }
+
+    double cell_w = job.cols > 1 ? (pc->stats.max_x - pc->stats.min_x) / (job.cols - 1) : 1.0;
+    double cell_h = job.rows > 1 ? (pc->stats.max_y - pc->stats.min_y) / (job.rows - 1) : 1.0;
+    double cell_area = cell_w * cell_h;
+    const pcd_t *points = pc->points.data;
+
+    for (size_t i = 0; i < n; i++) {
+        if (bm->labels[i] < 0) {
+            continue;
+        }
+        basin_t *b = &bm->basins[bm->labels[i]];
+        if (job.recv[i] == (int)i) {
+            b->sink = (int)i;
+            b->sink_height = points[i].z;
+        }
+        b->cells++;
+        b->volume += points[i].wd;
+    }
+    for (int id = 0; id < count; id++) {
+        bm->basins[id].area = bm->basins[id].cells * cell_area;
+        bm->basins[id].volume *= cell_area;
+    }
+
+    mem_free(job.recv);
+    mem_free(job.parent);
+    mem_free(job.tile_sinks);
+    return bm;
+}
+
+void basin_map_free(basin_map_t *bm) {
+    if (!bm) {
+        return;
+    }
+    mem_free(bm->labels);
+    mem_free(bm->basins);
+    mem_free(bm);
+}
+
+/**
+ * Writes the per-basin table as CSV, one row per basin
+ * Returns: 0 on success, -1 on failure
+ */
+int basin_write_table(const basin_map_t *bm, FILE *stream) {
+    if (!bm || !stream) {
+        return -1;
+    }
+
+    fprintf(stream, "basin,sink_row,sink_col,sink_height,cells,area,volume\n");
+    for (int id = 0; id < bm->count; id++) {
+        const basin_t *b = &bm->basins[id];
+        fprintf(stream, "%d,%d,%d,%.6f,%ld,%.6f,%.6f\n", id,
+                b->sink / bm->cols, b->sink % bm->cols, b->sink_height,
+                b->cells, b->area, b->volume);
+    }
+    return ferror(stream) ? -1 : 0;
+}
+
+/**
+ * Writes the basin-id raster as row-major little-endian int32 values
+ * Returns: 0 on success, -1 on failure
+ */
+int basin_write_labels(const basin_map_t *bm, const char *filename) {
+    if (!bm || !filename) {
+        return -1;
+    }
+
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s\n", filename);
+        return -1;
+    }
+
+    size_t n = (size_t)bm->rows * bm->cols;
+    int ok = fwrite(bm->labels, sizeof(int), n, f) == n;
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Error: Failed to write %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Renders the basin raster with a distinct color per basin, one pixel per cell.
+ * The first grid row is drawn at the bottom, matching imagePointCloud.
+ */
+void imageBasins(const basin_map_t *bm, char *filename) {
+    if (!bm || !filename) {
+        fprintf(stderr, "Invalid parameters passed to imageBasins\n");
+        return;
+    }
+
+    Bitmap *bmp = bm_create(bm->cols, bm->rows);
+    if (!bmp) {
+        fprintf(stderr, "Failed to create bitmap\n");
+        return;
+    }
+
+    uint32_t *pixels = (uint32_t *)bm_raw_data(bmp);
+    for (int row = 0; row < bm->rows; row++) {
+        uint32_t *line = pixels + (size_t)(bm->rows - 1 - row) * bm->cols;
+        for (int col = 0; col < bm->cols; col++) {
+            int label = bm->labels[row * bm->cols + col];
+            if (label < 0) {
+                line[col] = bm_rgb(0, 0, 0);
+                continue;
+            }
+
+            // Golden-ratio hue spacing keeps neighbouring ids apart
+            double hue = (label * 0.618033988749895) * 360.0;
+            hue -= 360.0 * (int)(hue / 360.0);
+            line[col] = bm_hsl(hue, 65.0, 55.0);
+        }
+    }
+
+    printf("Saving basin map to %s...\n", filename);
+    if (!bm_save(bmp, filename)) {
+        fprintf(stderr, "Failed to save bitmap\n");
+    }
+
+    bm_free(bmp);
+}
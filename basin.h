@@ -0,0 +1,34 @@
+#ifndef BASIN_H
+#define BASIN_H
+
+#include <stdio.h>
+#include "pointcloud.h"
+
+// Default edge length (in cells) of the square tiles labelled independently
+#define BASIN_TILE 256
+
+// Per-basin statistics
+typedef struct {
+    int sink;           // grid index of the cell the basin drains to
+    long cells;         // number of cells draining to the sink
+    double area;        // planimetric area (cells * cell area)
+    double volume;      // water volume currently held (sum of water depth * cell area)
+    double sink_height; // terrain height at the sink
+} basin_t;
+
+// Drainage basin labelling of a grid
+typedef struct {
+    int rows;           // grid rows
+    int cols;           // grid columns
+    int *labels;        // basin id of every cell, row-major, -1 for NODATA
+    basin_t *basins;    // table indexed by basin id
+    int count;          // number of basins
+} basin_map_t;
+
+basin_map_t* basin_label(const pointcloud_t *pc, int tile, int nthreads);
+void basin_map_free(basin_map_t *bm);
+int basin_write_table(const basin_map_t *bm, FILE *stream);
+int basin_write_labels(const basin_map_t *bm, const char *filename);
+void imageBasins(const basin_map_t *bm, char *filename);
+
+#endif // BASIN_H
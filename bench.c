@@ -0,0 +1,565 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "bmp.h"
+#include "pointcloud.h"
+#include "render.h"
+#include "sim.h"
+
+/*
+Benchmark suite, built and run by `make bench`.
+Every case runs warm-up repetitions that are not timed, then timed
+repetitions summarized by their min, median, mean and standard deviation.
+Throughput is the work of one repetition over the median time.
+
+Usage: ./benchmark [--json FILE] [--filter TEXT]
+  --json FILE    also write the results as JSON
+  --filter TEXT  only run the cases whose name contains TEXT
+*/
+
+#define BENCH_MAX_RESULTS 64
+#define BENCH_MAX_REPS 64
+
+// Summary of one case
+typedef struct {
+    char name[32];          // what is measured
+    char param[32];         // size or variant
+    int reps;               // timed repetitions
+    double min, median, mean, stddev;   // seconds per repetition
+    double work;            // units of work per repetition
+    const char *unit;       // unit of work
+    const char *extra_name; // name of an extra figure of the case, or NULL
+    double extra;
+} bench_result_t;
+
+// One repetition of a case; returns 1 on success, 0 on failure
+typedef int (*bench_fn)(void *ctx);
+
+static bench_result_t bench_results[BENCH_MAX_RESULTS];
+static int bench_count;
+static const char *bench_filter;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int bench_selected(const char *name) {
+    return !bench_filter || strstr(name, bench_filter);
+}
+
+static int bench_compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Runs and summarizes one case, then prints it
+ * Inputs:
+ *  - name, param: what is measured and its size or variant
+ *  - warmup: untimed repetitions first
+ *  - reps: timed repetitions
+ *  - fn, ctx: one repetition and its state
+ *  - work, unit: units of work per repetition
+ * Returns: the result, to add an extra figure to, or NULL when a repetition failed
+ */
+static bench_result_t* bench_run(const char *name, const char *param, int warmup, int reps,
+                                 bench_fn fn, void *ctx, double work, const char *unit) {
+    if (bench_count == BENCH_MAX_RESULTS) {
+        return NULL;
+    }
+    reps = reps < 1 ? 1 : (reps > BENCH_MAX_REPS ? BENCH_MAX_REPS : reps);
+
+    double samples[BENCH_MAX_REPS];
+    int ok = 1;
+    int saved = quietStdout();
+    for (int r = 0; ok && r < warmup; r++) {
+        ok = fn(ctx);
+    }
+    for (int r = 0; ok && r < reps; r++) {
+        double t0 = now();
+        ok = fn(ctx);
+        samples[r] = now() - t0;
+    }
+    loudStdout(saved);
+    if (!ok) {
+        fprintf(stderr, "%s %s failed\n", name, param);
+        return NULL;
+    }
+
+    bench_result_t *res = &bench_results[bench_count++];
+    memset(res, 0, sizeof(*res));
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    snprintf(res->param, sizeof(res->param), "%s", param);
+    res->reps = reps;
+    res->work = work;
+    res->unit = unit;
+
+    double sum = 0, sq = 0;
+    for (int r = 0; r < reps; r++) {
+        sum += samples[r];
+    }
+    res->mean = sum / reps;
+    for (int r = 0; r < reps; r++) {
+        sq += (samples[r] - res->mean) * (samples[r] - res->mean);
+    }
+    res->stddev = reps > 1 ? sqrt(sq / (reps - 1)) : 0.0;
+    qsort(samples, reps, sizeof(double), bench_compare);
+    res->min = samples[0];
+    res->median = reps % 2 ? samples[reps / 2] : (samples[reps / 2 - 1] + samples[reps / 2]) / 2;
+
+    printf("%-22s %-16s %10.3f ms median %10.3f min %8.3f sd %10.2f M%s/s\n",
+           res->name, res->param, res->median * 1e3, res->min * 1e3, res->stddev * 1e3,
+           res->work / res->median / 1e6, res->unit);
+    return res;
+}
+
+// Writes every result as JSON
+static int bench_write_json(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        return -1;
+    }
+    fprintf(f, "{\n  \"threads\": %d,\n  \"benchmarks\": [", defaultThreadCount());
+    for (int i = 0; i < bench_count; i++) {
+        const bench_result_t *r = &bench_results[i];
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"param\": \"%s\", \"reps\": %d, "
+                   "\"min_s\": %.9g, \"median_s\": %.9g, \"mean_s\": %.9g, \"stddev_s\": %.9g, "
+                   "\"work\": %.0f, \"unit\": \"%s\", \"per_s\": %.9g",
+                i ? "," : "", r->name, r->param, r->reps, r->min, r->median, r->mean, r->stddev,
+                r->work, r->unit, r->work / r->median);
+        if (r->extra_name) {
+            fprintf(f, ", \"%s\": %.9g", r->extra_name, r->extra);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Failed to write %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Counts the encoded bytes without keeping them
+static int count_bytes(void *data, int len, void *context) {
+    (void)data;
+    *(long *)context += len;
+    return 1;
+}
+
+// Cheap deterministic per-pixel texture in [0, 1)
+static double texture(unsigned x, unsigned y) {
+    unsigned h = x * 374761393u + y * 668265263u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    return ((h ^ (h >> 16)) & 0xFFFF) / 65536.0;
+}
+
+// Smooth hills with a little texture, about 0 to 1
+static double terrain_height(int x, int y, int size) {
+    double u = (double)x / size, v = (double)y / size;
+    return 0.5 + 0.3 * sin(6.1 * u) * cos(4.3 * v) + 0.1 * sin(23.0 * u + 17.0 * v) +
+           0.04 * texture(x, y);
+}
+
+/**
+ * Builds a frame of palette indices that looks like the water renderings:
+ * smooth terrain shades with a little texture, and water pooled in the lows
+ */
+static unsigned char* make_frame(int size) {
+    unsigned char *pixels = malloc((size_t)size * size);
+    if (!pixels) {
+        return NULL;
+    }
+
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            double h = terrain_height(x, y, size);
+            int shade = (int)(h * (RENDER_SHADES - 1) + 0.5);
+            shade = shade < 0 ? 0 : (shade >= RENDER_SHADES ? RENDER_SHADES - 1 : shade);
+            int level = (int)((0.45 - h) * 4.0 * (RENDER_WATER_LEVELS - 1));
+            level = level < 0 ? 0 : (level >= RENDER_WATER_LEVELS ? RENDER_WATER_LEVELS - 1 : level);
+            pixels[(size_t)y * size + x] = (unsigned char)(shade * RENDER_WATER_LEVELS + level);
+        }
+    }
+    return pixels;
+}
+
+/**
+ * Writes a size x size grid of the same terrain in the ordered input format
+ * Returns: the text, with its length in *len, or NULL on failure
+ */
+static char* make_terrain_text(int size, size_t *len) {
+    char *text = NULL;
+    FILE *f = open_memstream(&text, len);
+    if (!f) {
+        return NULL;
+    }
+    fprintf(f, "%d\n", size);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            fprintf(f, "%.1f %.1f %.6f\n", 445000.0 + x, 4651000.0 + y,
+                    300.0 + 40.0 * terrain_height(x, y, size));
+        }
+    }
+    if (fclose(f) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+// Input text of a grid, and the state the engine cases run on
+typedef struct {
+    char *text;
+    size_t len;
+    pointcloud_t *pc;       // grid read from the text
+    sim_grid_t *sim;
+    int count;              // elements added by the list growth case
+} grid_case_t;
+
+static int parse_text(grid_case_t *g, pointcloud_t **pc) {
+    FILE *f = fmemopen(g->text, g->len, "r");
+    if (!f) {
+        return 0;
+    }
+    *pc = readPointCloudData(f);
+    fclose(f);
+    return *pc != NULL;
+}
+
+static int run_parse(void *ctx) {
+    pointcloud_t *pc;
+    if (!parse_text(ctx, &pc)) {
+        return 0;
+    }
+    pointcloud_free(pc);
+    return 1;
+}
+
+static int run_list_growth(void *ctx) {
+    grid_case_t *g = ctx;
+    List l;
+    if (!listInit(&l, sizeof(pcd_t))) {
+        return 0;
+    }
+    pcd_t point = {0};
+    for (int i = 0; i < g->count; i++) {
+        point.x = i;
+        listAddEnd(&l, &point);
+    }
+    int ok = l.size == g->count;
+    listFree(&l);
+    return ok;
+}
+
+static int run_initialize(void *ctx) {
+    return initializeWatershed(((grid_case_t *)ctx)->pc) == 0;
+}
+
+static int run_watershed_step(void *ctx) {
+    watershedStep(((grid_case_t *)ctx)->pc);
+    return 1;
+}
+
+static int run_sim_step(void *ctx) {
+    sim_grid_step(((grid_case_t *)ctx)->sim);
+    return 1;
+}
+
+static int run_image_terrain(void *ctx) {
+    imagePointCloud(((grid_case_t *)ctx)->pc, "bench_terrain.gif");
+    return 1;
+}
+
+static int run_image_water(void *ctx) {
+    imagePointCloudWater(((grid_case_t *)ctx)->pc, 4.0, "bench_water.gif");
+    return 1;
+}
+
+// Parsing, list growth, set-up, steps and images of the point cloud engine
+static void bench_engine(void) {
+    const int sizes[] = {256, 512, 1024};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int size = sizes[s];
+        char param[32];
+        snprintf(param, sizeof(param), "%dx%d", size, size);
+        double cells = (double)size * size;
+
+        grid_case_t g = {0};
+        g.text = make_terrain_text(size, &g.len);
+        int saved = quietStdout();
+        int ok = g.text && parse_text(&g, &g.pc) && initializeWatershed(g.pc) == 0;
+        loudStdout(saved);
+        if (!ok) {
+            fprintf(stderr, "Failed to build a %s grid\n", param);
+            free(g.text);
+            pointcloud_free(g.pc);
+            continue;
+        }
+        watershedAddUniformWater(g.pc, 2.0);
+
+        if (bench_selected("parse")) {
+            bench_run("parse", param, 1, size < 1024 ? 5 : 3, run_parse, &g, g.len, "bytes");
+        }
+        if (bench_selected("list_growth")) {
+            g.count = size * size;
+            bench_run("list_growth", param, 1, 10, run_list_growth, &g, cells, "elements");
+        }
+        if (bench_selected("initializeWatershed")) {
+            bench_run("initializeWatershed", param, 1, 10, run_initialize, &g, cells, "cells");
+            watershedAddUniformWater(g.pc, 2.0);
+        }
+        if (bench_selected("watershedStep")) {
+            bench_run("watershedStep", param, 2, 10, run_watershed_step, &g, cells, "cells");
+        }
+        if (bench_selected("sim_grid_step")) {
+            g.sim = sim_grid_create(g.pc);
+            if (g.sim) {
+                bench_run("sim_grid_step", param, 2, 20, run_sim_step, &g, cells, "cells");
+            }
+            sim_grid_free(g.sim);
+        }
+        if (bench_selected("imagePointCloud")) {
+            bench_run("imagePointCloud", param, 1, 5, run_image_terrain, &g, cells, "cells");
+            remove("bench_terrain.gif");
+        }
+        if (bench_selected("imagePointCloudWater")) {
+            bench_run("imagePointCloudWater", param, 1, 5, run_image_water, &g, cells, "cells");
+            remove("bench_water.gif");
+        }
+
+        free(g.text);
+        pointcloud_free(g.pc);
+    }
+}
+
+// An indexed frame and its palette
+typedef struct {
+    int size;
+    unsigned char *frame;
+    bm_color_t palette[256];
+    long bytes;             // encoded size of the last repetition
+} gif_case_t;
+
+static int run_gif_encode(void *ctx) {
+    gif_case_t *c = ctx;
+    c->bytes = 0;
+    return bm_write_gif_indexed(count_bytes, &c->bytes, c->size, c->size, c->frame, c->palette, 256, -1);
+}
+
+// GIF encoding of one indexed frame
+static void bench_gif(int size, int reps) {
+    gif_case_t c = {.size = size, .frame = make_frame(size)};
+    if (!c.frame) {
+        fprintf(stderr, "Failed to allocate a %dx%d frame\n", size, size);
+        return;
+    }
+    for (int i = 0; i < 256; i++) {
+        c.palette[i] = bm_rgb(i, i, 255 - i);
+    }
+
+    char param[32];
+    snprintf(param, sizeof(param), "%dx%d", size, size);
+    bench_result_t *res = bench_run("gif_encode", param, 1, reps, run_gif_encode, &c,
+                                    (double)size * size, "pixels");
+    if (res) {
+        res->extra_name = "bytes";
+        res->extra = c.bytes;
+    }
+    free(c.frame);
+}
+
+// Full-color bitmap with the same content as make_frame
+static Bitmap* make_bitmap(int size, const bm_color_t palette[256]) {
+    unsigned char *frame = make_frame(size);
+    Bitmap *b = frame ? bm_create(size, size) : NULL;
+    if (b) {
+        bm_color_t *pixels = (bm_color_t *)bm_raw_data(b);
+        for (size_t p = 0; p < (size_t)size * size; p++) {
+            pixels[p] = palette[frame[p]];
+        }
+    }
+    free(frame);
+    return b;
+}
+
+// A bitmap saved in one format
+typedef struct {
+    Bitmap *b;
+    const char *ext;
+    char filename[64];
+    BmMemSink sink;
+} save_case_t;
+
+static int run_save_file(void *ctx) {
+    save_case_t *c = ctx;
+    return bm_save(c->b, c->filename);
+}
+
+static int run_save_memory(void *ctx) {
+    save_case_t *c = ctx;
+    c->sink.len = 0;
+    return bm_save_custom(c->b, bm_mem_write, &c->sink, c->ext);
+}
+
+/**
+ * Saving a full-color bitmap with bm_save, through the encoder's output buffer
+ * to a file, and with bm_save_custom into a memory sink
+ */
+static void bench_save(const char *ext, int size, int reps) {
+    bm_color_t palette[256];
+    for (int i = 0; i < 256; i++) {
+        palette[i] = bm_rgb(i, i, 255 - i);
+    }
+    save_case_t c = {.b = make_bitmap(size, palette), .ext = ext};
+    if (!c.b) {
+        fprintf(stderr, "Failed to allocate a %dx%d bitmap\n", size, size);
+        return;
+    }
+    snprintf(c.filename, sizeof(c.filename), "bench_save.%s", ext);
+
+    // The encoded size is the work of both cases
+    char name[32], param[32];
+    snprintf(name, sizeof(name), "save_%s", ext);
+    if (run_save_memory(&c)) {
+        snprintf(param, sizeof(param), "%dx%d file", size, size);
+        bench_run(name, param, 1, reps, run_save_file, &c, c.sink.len, "bytes");
+        remove(c.filename);
+        snprintf(param, sizeof(param), "%dx%d memory", size, size);
+        bench_run(name, param, 1, reps, run_save_memory, &c, c.sink.len, "bytes");
+    } else {
+        fprintf(stderr, "Saving %s failed: %s\n", ext, bm_get_error());
+    }
+    free(c.sink.data);
+    bm_free(c.b);
+}
+
+// Photo-like bitmap with tens of thousands of colors: smooth hue gradients plus noise
+static Bitmap* make_photo(int size) {
+    Bitmap *b = bm_create(size, size);
+    if (!b) {
+        return NULL;
+    }
+    bm_color_t *pixels = (bm_color_t *)bm_raw_data(b);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            double u = (double)x / size, v = (double)y / size;
+            double n = 24.0 * (texture(x, y) - 0.5);
+            int r = (int)(128 + 100 * sin(5.0 * u + 2.0 * v) + n);
+            int g = (int)(128 + 90 * cos(3.0 * v - 4.0 * u * v) + n);
+            int bl = (int)(120 + 80 * sin(7.0 * u * u + 3.0 * v) + n);
+            r = r < 0 ? 0 : (r > 255 ? 255 : r);
+            g = g < 0 ? 0 : (g > 255 ? 255 : g);
+            bl = bl < 0 ? 0 : (bl > 255 ? 255 : bl);
+            pixels[(size_t)y * size + x] = bm_rgb(r, g, bl);
+        }
+    }
+    return b;
+}
+
+// Mean squared error per channel of mapping every pixel to its nearest palette color
+static double palette_mse(Bitmap *b, BmPalette *pal) {
+    const bm_color_t *pixels = (const bm_color_t *)bm_raw_data(b);
+    size_t count = (size_t)bm_width(b) * bm_height(b);
+    double sum = 0;
+    for (size_t p = 0; p < count; p++) {
+        bm_color_t c = bm_palette_nearest_color(pal, pixels[p]);
+        unsigned char r0, g0, b0, r1, g1, b1;
+        bm_get_rgb(pixels[p], &r0, &g0, &b0);
+        bm_get_rgb(c, &r1, &g1, &b1);
+        sum += (r0 - r1) * (r0 - r1) + (g0 - g1) * (g0 - g1) + (b0 - b1) * (b0 - b1);
+    }
+    return sum / (3.0 * count);
+}
+
+// A bitmap reduced to 256 colors by one method
+typedef struct {
+    Bitmap *b;
+    const char *method;
+    BmPalette *pal;         // palette of the last repetition
+} quantize_case_t;
+
+static int run_quantize(void *ctx) {
+    quantize_case_t *c = ctx;
+    if (c->pal) {
+        bm_palette_release(c->pal);
+    }
+    c->pal = !strcmp(c->method, "kmeans") ? bm_quantize_kmeans(c->b, 256) :
+             !strcmp(c->method, "uniform") ? bm_quantize_uniform(c->b, 256) :
+             bm_quantize_mediancut(c->b, 256, 0);
+    return c->pal != NULL;
+}
+
+/**
+ * Reducing a full-color bitmap to a 256-color palette, with the error of the
+ * palette. k-means is only run at small sizes, where it finishes in
+ * reasonable time.
+ */
+static void bench_quantize(const char *method, int size, int reps) {
+    quantize_case_t c = {.b = make_photo(size), .method = method};
+    if (!c.b) {
+        fprintf(stderr, "Failed to allocate a %dx%d bitmap\n", size, size);
+        return;
+    }
+
+    char name[32], param[32];
+    snprintf(name, sizeof(name), "quantize_%s", method);
+    snprintf(param, sizeof(param), "%dx%d", size, size);
+    bench_result_t *res = bench_run(name, param, 0, reps, run_quantize, &c, (double)size * size, "pixels");
+    if (res) {
+        res->extra_name = "mse";
+        res->extra = palette_mse(c.b, c.pal);
+    }
+    if (c.pal) {
+        bm_palette_release(c.pal);
+    }
+    bm_free(c.b);
+}
+
+int main(int argc, char *argv[]) {
+    const char *json = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json = argv[++i];
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            bench_filter = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--json FILE] [--filter TEXT]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bench_engine();
+
+    if (bench_selected("gif_encode")) {
+        bench_gif(800, 10);
+        bench_gif(4096, 3);
+    }
+
+    const char *formats[] = {"gif", "bmp", "tga", "ppm"};
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "save_%s", formats[i]);
+        if (bench_selected(name)) {
+            bench_save(formats[i], 800, 5);
+        }
+    }
+
+    if (bench_selected("quantize")) {
+        bench_quantize("kmeans", 128, 1);
+        bench_quantize("uniform", 128, 3);
+        bench_quantize("mediancut", 128, 3);
+        bench_quantize("uniform", 4096, 1);
+        bench_quantize("mediancut", 4096, 3);
+    }
+
+    if (json && bench_write_json(json) != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -13,6 +13,10 @@
 #include <float.h>
 #include <assert.h>
 
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
 #ifdef USESDL
 #  ifdef ANDROID
 #    include <SDL.h>
@@ -25,6 +29,11 @@
 #   include <png.h>
 #endif
 
+#ifdef USEPTHREADS
+#   include <pthread.h>
+#   include <unistd.h>
+#endif
+
 #ifdef USEJPG
 #   include <jpeglib.h>
 #   include <setjmp.h>
@@ -72,7 +81,14 @@ Still, it is here if you need it
 #endif
 
 #if BM_LAST_ERROR
+/* Each thread keeps its own last error, so bitmaps can be encoded in parallel */
+#  if defined(__GNUC__)
+static __thread const char *bm_last_error = "no error";
+#  elif defined(_MSC_VER)
+static __declspec(thread) const char *bm_last_error = "no error";
+#  else
 static const char *bm_last_error = "no error";
+#  endif
 #  define SET_ERROR(e) bm_last_error = e
 #else
 #  define SET_ERROR(e) (void)e
@@ -160,8 +176,15 @@ struct bitmap_palette {
 
     /* Array of colors */
     bm_color_t *colors;
+
+    /* Nearest-color cache, built on demand by bm_palette_nearest_index()
+        and dropped whenever a color changes. Building it writes to the
+        palette, so a palette is only safe on one thread at a time */
+    struct palette_lut *lut;
 };
 
+static void pal_lut_free(struct palette_lut *lut);
+
 #pragma pack(push, 1) /* Don't use any padding (Windows compilers) */
 
 /* Data structures for the header of BMP files. */
@@ -903,7 +926,92 @@ error:
     goto end;
 }
 
+/* Output buffering: the encoders emit headers, LZW codes and pixels through
+a bm_write_fun, many of them a byte at a time. bm_save_custom() and the GIF
+writers put a bm_buffer in front of the caller's function so that it only
+sees writes of BM_BUFFER_SIZE bytes, plus whatever is left at the end. */
+#define BM_BUFFER_SIZE (64 * 1024)
+
+struct bm_buffer {
+    bm_write_fun writef;
+    void *context;
+    int len;
+    int ok;     /* 0 once a write has failed; later writes are dropped */
+    unsigned char data[BM_BUFFER_SIZE];
+};
+
+static struct bm_buffer *bm_buffer_open(bm_write_fun writef, void *context) {
+    struct bm_buffer *buf = CAST(struct bm_buffer *)(malloc(sizeof *buf));
+    if(!buf)
+        return NULL;
+    buf->writef = writef;
+    buf->context = context;
+    buf->len = 0;
+    buf->ok = 1;
+    return buf;
+}
+
+static int bm_buffer_flush(struct bm_buffer *buf) {
+    if(buf->ok && buf->len > 0)
+        buf->ok = buf->writef(buf->data, buf->len, buf->context);
+    buf->len = 0;
+    return buf->ok;
+}
+
+static int bm_buffer_write(void *data, int len, void *context) {
+    struct bm_buffer *buf = CAST(struct bm_buffer *)(context);
+    if(buf->len + len > BM_BUFFER_SIZE) {
+        if(!bm_buffer_flush(buf))
+            return 0;
+        if(len >= BM_BUFFER_SIZE) {
+            /* Too big to be worth copying */
+            buf->ok = buf->writef(data, len, buf->context);
+            return buf->ok;
+        }
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return buf->ok;
+}
+
+/* Flushes and frees the buffer; returns 0 if any write failed */
+static int bm_buffer_close(struct bm_buffer *buf) {
+    int ok = bm_buffer_flush(buf);
+    free(buf);
+    if(!ok)
+        SET_ERROR("unable to write output");
+    return ok;
+}
+
+int bm_mem_write(void *data, int len, void *context) {
+    BmMemSink *sink = CAST(BmMemSink *)(context);
+    if(sink->len + len > sink->cap) {
+        size_t cap = sink->cap ? sink->cap : 4096;
+        unsigned char *grown;
+        while(cap < sink->len + len)
+            cap *= 2;
+        grown = CAST(unsigned char *)(sink->grow ? sink->grow(sink->data, cap) : realloc(sink->data, cap));
+        if(!grown) {
+            SET_ERROR("out of memory");
+            return 0;
+        }
+        sink->data = grown;
+        sink->cap = cap;
+    }
+    memcpy(sink->data + sink->len, data, len);
+    sink->len += len;
+    return 1;
+}
+
 static int put_byte(char byte, bm_write_fun writef, void *context) {
+    if(writef == bm_buffer_write) {
+        /* Skips the call for the common case of a buffer with room */
+        struct bm_buffer *buf = CAST(struct bm_buffer *)(context);
+        if(buf->len < BM_BUFFER_SIZE) {
+            buf->data[buf->len++] = byte;
+            return buf->ok;
+        }
+    }
     return writef(&byte, 1, context);
 }
 
@@ -961,8 +1069,7 @@ static void swap_stb_bytes(int w, int h, unsigned char *data) {
 #endif
 }
 
-int bm_save_custom(Bitmap *b, bm_write_fun cb, void *context, const char *ext) {
-    SET_ERROR("no error");
+static int bm_save_encoded(Bitmap *b, bm_write_fun cb, void *context, const char *ext) {
     if(!bm_stricmp(ext, "gif"))
         return bm_save_gif(b, cb, context);
     else if(!bm_stricmp(ext, "pcx"))
@@ -1003,6 +1110,19 @@ int bm_save_custom(Bitmap *b, bm_write_fun cb, void *context, const char *ext) {
         return bm_save_bmp(b, cb, context);
 }
 
+int bm_save_custom(Bitmap *b, bm_write_fun cb, void *context, const char *ext) {
+    struct bm_buffer *buf;
+    int ret;
+
+    SET_ERROR("no error");
+    /* A memory sink gains nothing from another copy */
+    if(cb == bm_mem_write || !(buf = bm_buffer_open(cb, context)))
+        return bm_save_encoded(b, cb, context, ext);
+
+    ret = bm_save_encoded(b, bm_buffer_write, buf, ext);
+    return bm_buffer_close(buf) && ret;
+}
+
 int bm_save(Bitmap *b, const char *fname) {
     int ret;
     FILE *f;
@@ -2663,30 +2783,39 @@ static unsigned char *lzw_decode_bytes(unsigned char *bytes, int data_len, int c
     return out;
 }
 
-static void lzw_emit_code(unsigned char **buffer, int *buf_size, int *pos, int c, int bits) {
-    int i, m;
-    for(i = *pos, m = 1; i < *pos + bits; i++, m <<= 1) {
-        int byte = i >> 3;
-        int bit = i & 0x07;
-        if(!bit) {
-            if(byte == *buf_size) {
-                *buf_size <<= 1;
-                unsigned char *tmp = CAST(unsigned char *)(realloc(*buffer, *buf_size));
-                if (!tmp) {
-                    free(*buffer);
-                    return;
-                }
-                *buffer = tmp;
-            }
-            assert(byte < *buf_size);
-            (*buffer)[byte] = 0x00;
-        }
-        if (c & m) {
-            assert(byte < *buf_size);
-            (*buffer)[byte] |= (1 << bit);
+/* The encoder's dictionary is an open addressing hash table keyed by
+(prefix code, byte). GIF codes are at most 12 bits, so 8192 slots keep it
+at most half full. */
+#define LZW_HASH_BITS 13
+#define LZW_HASH_SIZE (1 << LZW_HASH_BITS)
+
+typedef struct {
+    unsigned char *data;
+    int len, cap;
+    unsigned int bits;  /* pending bits, least significant first */
+    int nbits;
+} lzw_writer;
+
+static int lzw_put_code(lzw_writer *w, int code, int bits) {
+    w->bits |= (unsigned int)code << w->nbits;
+    w->nbits += bits;
+    while(w->nbits >= 8) {
+        if(w->len == w->cap) {
+            unsigned char *tmp = CAST(unsigned char *)(realloc(w->data, w->cap * 2));
+            if(!tmp)
+                return 0;
+            w->data = tmp;
+            w->cap *= 2;
         }
+        w->data[w->len++] = w->bits & 0xFF;
+        w->bits >>= 8;
+        w->nbits -= 8;
     }
-    *pos += bits;
+    return 1;
+}
+
+static unsigned int lzw_hash(int key) {
+    return ((unsigned int)key * 2654435761u) >> (32 - LZW_HASH_BITS);
 }
 
 static unsigned char *lzw_encode_bytes(unsigned char *bytes, int data_len, int code_size, int *out_len) {
@@ -2696,156 +2825,109 @@ static unsigned char *lzw_encode_bytes(unsigned char *bytes, int data_len, int c
     int clr = 1 << code_size;
     int end = clr + 1;
 
-    /* dictionary */
-    int i, di, dict_size = 1 << (code_size + 1);
-    gif_dict *dict = CAST(gif_dict*)(realloc(NULL, dict_size * sizeof *dict));
-    if (!dict)
-        return NULL;
-
-    int buf_size = 4;
-    int pos = 0;
-    unsigned char *buffer = CAST(unsigned char *)(realloc(NULL, buf_size));
-    if (!buffer) {
-        free(dict);
-        return NULL;
-    }
+    /* dictionary: keys[] holds (prefix << 8 | byte) + 1, 0 for an empty slot */
+    int next = end + 1, dict_size = 1 << (code_size + 1);
+    int *keys = CAST(int *)(calloc(LZW_HASH_SIZE, sizeof *keys));
+    short *codes = CAST(short *)(malloc(LZW_HASH_SIZE * sizeof *codes));
 
-    int ii, string, prev, tlen;
+    int ii, string = -1, ok;
+    lzw_writer w;
 
     *out_len = 0;
-
-    /* Initialize the dictionary */
-    for(di = 0; di < dict_size; di++) {
-        dict[di].prev = -1;
-        dict[di].code = di;
+    w.cap = data_len / 2 + 16;
+    w.len = 0;
+    w.bits = 0;
+    w.nbits = 0;
+    w.data = CAST(unsigned char *)(malloc(w.cap));
+    if(!keys || !codes || !w.data) {
+        free(keys);
+        free(codes);
+        free(w.data);
+        return NULL;
     }
-    di = end+1;
-
-    dict[clr].prev = -1;
-    dict[clr].code = -1;
-    dict[end].prev = -1;
-    dict[end].code = -1;
 
-    string = -1;
-    prev = clr;
+    ok = lzw_put_code(&w, clr, code_size + 1);
 
-    lzw_emit_code(&buffer, &buf_size, &pos, clr, code_size + 1);
+    for(ii = 0; ii < data_len && ok; ii++) {
+        int character = bytes[ii], key;
+        unsigned int h;
 
-    for(ii = 0; ii < data_len; ii++) {
-        int character, res;
-reread:
-        character = bytes[ii];
-
-        /* Find it in the dictionary; If the entry is in the dict, it can't be
-        before dict[string], therefore we can eliminate the first couple of entries. */
-        for(res = -1, i = string>0?string:0; i < di; i++) {
-            assert(i < dict_size);
-            if(dict[i].prev == string && dict[i].code == character) {
-                res = i;
-                break;
-            }
+        /* A single byte is its own code */
+        if(string < 0) {
+            string = character;
+            continue;
         }
 
-        if(res >= 0) {
+        key = ((string << 8) | character) + 1;
+        for(h = lzw_hash(key); keys[h] && keys[h] != key; h = (h + 1) & (LZW_HASH_SIZE - 1))
+            ;
+        if(keys[h]) {
             /* Found */
-            string = res;
-            prev = res;
-        } else {
-            /* Not found */
-            lzw_emit_code(&buffer, &buf_size, &pos, prev, code_size + 1);
-
-            /* update the dictionary */
-            if(di == dict_size) {
-                /* Resize the dictionary */
-                if(code_size < 11) {
-                    code_size++;
-                    dict_size = 1 << (code_size + 1);
-                    gif_dict *tmp = CAST(gif_dict*)(realloc(dict, dict_size * sizeof *dict));
-                    if (!tmp) {
-                        free(dict);
-                        return NULL;
-                    }
-                    dict = tmp;
-                } else {
-                    /* lzw_emit_code a clear code */
-                    lzw_emit_code(&buffer, &buf_size, &pos, clr,code_size + 1);
-                    code_size = base_size;
-                    dict_size = 1 << (code_size + 1);
-                    di = end + 1;
-                    string = -1;
-                    prev = clr;
-                    goto reread;
-                }
-            }
+            string = codes[h];
+            continue;
+        }
 
-            dict[di].prev = string;
-            dict[di].code = character;
-            di++;
+        /* Not found */
+        ok = lzw_put_code(&w, string, code_size + 1);
 
-            string = character;
-            prev = character;
+        /* update the dictionary */
+        if(next == dict_size) {
+            if(code_size < 11) {
+                code_size++;
+                dict_size <<= 1;
+            } else {
+                /* Full: emit a clear code and start over from this byte */
+                ok = ok && lzw_put_code(&w, clr, code_size + 1);
+                code_size = base_size;
+                dict_size = 1 << (code_size + 1);
+                next = end + 1;
+                memset(keys, 0, LZW_HASH_SIZE * sizeof *keys);
+                string = character;
+                continue;
+            }
         }
-    }
 
-    lzw_emit_code(&buffer, &buf_size, &pos, prev, code_size + 1);
-    lzw_emit_code(&buffer, &buf_size, &pos, end, code_size + 1);
+        keys[h] = key;
+        codes[h] = next++;
+        string = character;
+    }
 
-    /* Total length */
-    tlen = (pos >> 3);
-    if(pos & 0x07) tlen++;
-    *out_len = tlen;
+    ok = ok && lzw_put_code(&w, string >= 0 ? string : clr, code_size + 1);
+    ok = ok && lzw_put_code(&w, end, code_size + 1);
+    /* Pad the last partial byte */
+    ok = ok && (w.nbits == 0 || lzw_put_code(&w, 0, 8 - w.nbits));
 
-    free(dict);
+    free(keys);
+    free(codes);
+    if(!ok) {
+        free(w.data);
+        return NULL;
+    }
 
-    return buffer;
+    *out_len = w.len;
+    return w.data;
 }
 
-static int bm_save_gif(Bitmap *b, bm_write_fun writef, void *context) {
+/* Writes the GIF header, logical screen descriptor and global color table
+of color_count entries; bg is the background index, or -1 for none.
+Returns the LZW minimum code size for the images, or 0 on failure. */
+static int gif_write_header(int w, int h, const struct rgb_triplet gct[256], int color_count,
+        int bg, bm_write_fun writef, void *context) {
     GIF gif;
-    GIF_GCE gce;
-    GIF_ID gif_id;
-    int sgct, bg;
+    int sgct;
     unsigned char code_size = 0x08;
 
-    BmPalette *palette;
-    struct palette_mapping mapping[256];
-    int color_count;
-
-    /* For encoding */
-    int len = 0, x, y, p;
-    unsigned char *bytes, *pixels;
-
     memcpy(gif.header.signature, "GIF", 3);
     memcpy(gif.header.version, "89a", 3);
     gif.version = gif_89a;
-    gif.lsd.width = b->w;
-    gif.lsd.height = b->h;
+    gif.lsd.width = w;
+    gif.lsd.height = h;
     gif.lsd.background = 0;
     gif.lsd.par = 0;
 
     /* Using global color table, color resolution = 8-bits */
     gif.lsd.fields = 0xF0;
 
-    palette = bm_get_palette(b);
-    if(!palette) {
-        if(!bm_make_palette(b))
-            return 0;
-        palette = bm_get_palette(b);
-        assert(palette);
-    }
-
-    if(bm_palette_count(palette) > 256) {
-        SET_ERROR("too many palette colors to save GIF");
-        return 0;
-    }
-
-    /* Copy the image and dither it to match the palette */
-    b = bm_copy(b);
-    bm_reduce_palette(b, palette);
-
-    if(!make_palette_mapping(palette, mapping, &color_count))
-        return 0;
-
     if(color_count > 128) {
         sgct = 256;
         gif.lsd.fields |= 0x07;
@@ -2871,60 +2953,44 @@ static int bm_save_gif(Bitmap *b, bm_write_fun writef, void *context) {
         code_size = 3;
     }
 
-    /* See if we can find the background color in the palette */
-#ifndef IGNORE_ALPHA
-    bg = b->color & 0x00FFFFFF;
-#else
-    bg = b->color;
-#endif
-    bg = get_palette_mapping(mapping, bg, color_count);
     if(bg >= 0) {
         gif.lsd.background = bg;
     }
 
-    /* Map the pixels in the image to their palette indices */
-    pixels = CAST(unsigned char*)(malloc(b->w * b->h));
-    for(y = 0, p = 0; y < b->h; y++) {
-        for(x = 0; x < b->w; x++) {
-            int i, c = BM_GET(b, x, y);
-            i = get_palette_mapping(mapping, c, color_count);
-            /* At this point in time, the color MUST be in the palette */
-            assert(i >= 0 && i < color_count);
-            assert(i < sgct);
-            pixels[p++] = i;
-        }
+    /* Save the header and global color table */
+    assert(sgct <= 256);
+    if(!writef(&gif.header, sizeof gif.header, context) ||
+        !writef(&gif.lsd, sizeof gif.lsd, context) ||
+        !writef((void *)gct, sizeof gct[0] * sgct, context)) {
+        SET_ERROR("couldn't write GIF header");
+        return 0;
     }
-    assert(p == b->w * b->h);
 
-    {
-        /* Save the header and global color table */
-        struct rgb_triplet gct[256];
-        triplets_from_palette(palette, gct);
+    return code_size;
+}
 
-        assert(sgct <= 256);
+/* Writes one image: graphic control extension, image descriptor and the LZW
+compressed w*h indices placed at (left, top). delay is in 1/100 s, disposal is
+the GCE disposal method, transparent the transparent index or -1. */
+static int gif_write_image(int left, int top, int w, int h, const unsigned char *pixels,
+        int code_size, int delay, int disposal, int transparent,
+        bm_write_fun writef, void *context) {
+    GIF_GCE gce;
+    GIF_ID gif_id;
 
-        if(!writef(&gif.header, sizeof gif.header, context) ||
-            !writef(&gif.lsd, sizeof gif.lsd, context) ||
-            !writef(gct, sizeof gct[0] * sgct, context)) {
-            SET_ERROR("couldn't write GIF header");
-            return 0;
-        }
-    }
+    /* For encoding */
+    int len = 0, p;
+    unsigned char *bytes;
 
-    /* Nothing of use here */
     gce.block_size = 4;
-    gce.fields = 0;
-    gce.delay = 0;
-#if SAVE_GIF_TRANSPARENT
-    if(bg >= 0) {
+    gce.fields = (disposal & 0x07) << 2;
+    gce.delay = delay;
+    if(transparent >= 0) {
         gce.fields |= 0x01;
-        gce.trans_index = bg;
+        gce.trans_index = transparent;
     } else {
         gce.trans_index = 0;
     }
-#else
-    gce.trans_index = 0;
-#endif
     gce.terminator = 0x00;
 
     put_byte(0x21, writef, context);
@@ -2934,10 +3000,10 @@ static int bm_save_gif(Bitmap *b, bm_write_fun writef, void *context) {
     }
 
     gif_id.separator = 0x2C;
-    gif_id.left = 0x00;
-    gif_id.top = 0x00;
-    gif_id.width = b->w;
-    gif_id.height = b->h;
+    gif_id.left = left;
+    gif_id.top = top;
+    gif_id.width = w;
+    gif_id.height = h;
     /* Not using local color table or interlacing */
     gif_id.fields = 0;
     if(!writef(&gif_id, sizeof gif_id, context)) {
@@ -2948,8 +3014,9 @@ static int bm_save_gif(Bitmap *b, bm_write_fun writef, void *context) {
     put_byte(code_size, writef, context);
 
     /* Perform the LZW compression */
-    bytes = lzw_encode_bytes(pixels, b->w * b->h, code_size, &len);
-    free(pixels);
+    bytes = lzw_encode_bytes((unsigned char *)pixels, w * h, code_size, &len);
+    if(!bytes)
+        return 0;
 
     /* Write out the data sub-blocks */
     for(p = 0; p < len; p++) {
@@ -2965,13 +3032,284 @@ static int bm_save_gif(Bitmap *b, bm_write_fun writef, void *context) {
     }
     free(bytes);
 
-    put_byte(0x00, writef, context); /* terminating block */
+    return put_byte(0x00, writef, context); /* terminating block */
+}
+
+/* Writes a GIF of w*h palette indices with the global color table gct of
+color_count entries. bg is the background index, or -1 for none; transparent
+is the index marked transparent in the graphic control extension, or -1. */
+static int gif_write_indexed(int w, int h, const unsigned char *pixels,
+        const struct rgb_triplet gct[256], int color_count, int bg, int transparent,
+        bm_write_fun writef, void *context) {
+    int code_size = gif_write_header(w, h, gct, color_count, bg, writef, context);
+    if(!code_size)
+        return 0;
+
+    if(!gif_write_image(0, 0, w, h, pixels, code_size, 0, 0, transparent, writef, context))
+        return 0;
+
+    return put_byte(0x3B, writef, context); /* trailer byte */
+}
+
+static int bm_save_gif(Bitmap *b, bm_write_fun writef, void *context) {
+    int bg, transparent = -1, ok;
+
+    BmPalette *palette;
+    struct palette_mapping mapping[256];
+    struct rgb_triplet gct[256];
+    int color_count;
+
+    int x, y, p;
+    unsigned char *pixels;
+
+    palette = bm_get_palette(b);
+    if(!palette) {
+        if(!bm_make_palette(b))
+            return 0;
+        palette = bm_get_palette(b);
+        assert(palette);
+    }
+
+    if(bm_palette_count(palette) > 256) {
+        SET_ERROR("too many palette colors to save GIF");
+        return 0;
+    }
+
+    /* Copy the image and dither it to match the palette */
+    b = bm_copy(b);
+    bm_reduce_palette(b, palette);
+
+    if(!make_palette_mapping(palette, mapping, &color_count)) {
+        bm_free(b);
+        return 0;
+    }
+    triplets_from_palette(palette, gct);
+
+    /* See if we can find the background color in the palette */
+#ifndef IGNORE_ALPHA
+    bg = b->color & 0x00FFFFFF;
+#else
+    bg = b->color;
+#endif
+    bg = get_palette_mapping(mapping, bg, color_count);
+#if SAVE_GIF_TRANSPARENT
+    transparent = bg;
+#endif
+
+    /* Map the pixels in the image to their palette indices */
+    pixels = CAST(unsigned char*)(malloc(b->w * b->h));
+    for(y = 0, p = 0; y < b->h; y++) {
+        for(x = 0; x < b->w; x++) {
+            int i, c = BM_GET(b, x, y);
+            i = get_palette_mapping(mapping, c, color_count);
+            /* At this point in time, the color MUST be in the palette */
+            assert(i >= 0 && i < color_count);
+            pixels[p++] = i;
+        }
+    }
+    assert(p == b->w * b->h);
 
-    put_byte(0x3B, writef, context); /* trailer byte */
+    ok = gif_write_indexed(b->w, b->h, pixels, gct, color_count, bg, transparent, writef, context);
 
+    free(pixels);
     bm_free(b);
 
-    return 1;
+    return ok;
+}
+
+int bm_write_gif_indexed(bm_write_fun fun, void *context, int w, int h,
+        const unsigned char *pixels, const bm_color_t *palette, int ncolors, int transparent) {
+    struct rgb_triplet gct[256];
+    struct bm_buffer *buf;
+    int i, ok;
+
+    SET_ERROR("no error");
+    if(w <= 0 || h <= 0 || !pixels || !palette || ncolors < 1 || ncolors > 256 ||
+            transparent >= ncolors) {
+        SET_ERROR("invalid parameters for indexed GIF");
+        return 0;
+    }
+
+    memset(gct, 0, sizeof gct);
+    for(i = 0; i < ncolors; i++) {
+        bm_get_rgb(palette[i], &gct[i].r, &gct[i].g, &gct[i].b);
+    }
+
+    if(fun == bm_mem_write || !(buf = bm_buffer_open(fun, context)))
+        return gif_write_indexed(w, h, pixels, gct, ncolors, transparent, transparent, fun, context);
+    ok = gif_write_indexed(w, h, pixels, gct, ncolors, transparent, transparent,
+                           bm_buffer_write, buf);
+    return bm_buffer_close(buf) && ok;
+}
+
+int bm_save_gif_indexed(const char *fname, int w, int h,
+        const unsigned char *pixels, const bm_color_t *palette, int ncolors, int transparent) {
+    int ret;
+    FILE *f = fopen(fname, "wb");
+    if(!f) {
+        SET_ERROR("unable to open file for output");
+        return 0;
+    }
+
+    ret = bm_write_gif_indexed(bm_file_cb, f, w, h, pixels, palette, ncolors, transparent);
+
+    if(fclose(f) != 0)
+        ret = 0;
+    return ret;
+}
+
+struct bm_gif_anim {
+    FILE *f;
+    struct bm_buffer *out;  /* buffers the writes to f, flushed after every frame */
+    int w, h;
+    int code_size;
+    int frames;
+    unsigned char *prev;    /* indices of the previous frame */
+    unsigned char *rect;    /* scratch for the changed rectangle */
+};
+
+BmGifAnim *bm_gif_anim_open(const char *fname, int w, int h,
+        const bm_color_t *palette, int ncolors, int loops) {
+    struct rgb_triplet gct[256];
+    BmGifAnim *ga;
+    int i;
+
+    SET_ERROR("no error");
+    if(w <= 0 || h <= 0 || w > 0xFFFF || h > 0xFFFF || !palette || ncolors < 1 || ncolors > 256) {
+        SET_ERROR("invalid parameters for animated GIF");
+        return NULL;
+    }
+
+    ga = CAST(BmGifAnim *)(calloc(1, sizeof *ga));
+    if(!ga) {
+        SET_ERROR("out of memory");
+        return NULL;
+    }
+    ga->w = w;
+    ga->h = h;
+    ga->prev = CAST(unsigned char *)(malloc((size_t)w * h));
+    ga->rect = CAST(unsigned char *)(malloc((size_t)w * h));
+    ga->f = fopen(fname, "wb");
+    ga->out = ga->f ? bm_buffer_open(bm_file_cb, ga->f) : NULL;
+    if(!ga->prev || !ga->rect || !ga->out) {
+        SET_ERROR(ga->f ? "out of memory" : "unable to open file for output");
+        if(ga->f)
+            fclose(ga->f);
+        free(ga->out);
+        free(ga->prev);
+        free(ga->rect);
+        free(ga);
+        return NULL;
+    }
+
+    memset(gct, 0, sizeof gct);
+    for(i = 0; i < ncolors; i++) {
+        bm_get_rgb(palette[i], &gct[i].r, &gct[i].g, &gct[i].b);
+    }
+    ga->code_size = gif_write_header(w, h, gct, ncolors, -1, bm_buffer_write, ga->out);
+
+    /* NETSCAPE2.0 application extension with the loop count */
+    if(ga->code_size && loops >= 0) {
+        unsigned char ext[19] = {0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E',
+                                 '2', '.', '0', 0x03, 0x01, 0, 0, 0x00};
+        ext[16] = loops & 0xFF;
+        ext[17] = (loops >> 8) & 0xFF;
+        if(!bm_buffer_write(ext, sizeof ext, ga->out))
+            ga->code_size = 0;
+    }
+
+    if(!ga->code_size || !bm_buffer_flush(ga->out)) {
+        fclose(ga->f);
+        ga->f = NULL;
+        bm_gif_anim_close(ga);
+        return NULL;
+    }
+    return ga;
+}
+
+int bm_gif_anim_frame(BmGifAnim *ga, const unsigned char *pixels, int delay, int transparent) {
+    int x, y, x0, x1, y0, y1, rw, rh, ok;
+    const unsigned char *cur, *old;
+    unsigned char *out;
+
+    if(!ga || !ga->f || !pixels) {
+        SET_ERROR("invalid parameters for animated GIF frame");
+        return 0;
+    }
+
+    /* Frames are drawn over their predecessors (disposal 1, "do not dispose") */
+    if(ga->frames == 0 || transparent < 0) {
+        ok = gif_write_image(0, 0, ga->w, ga->h, pixels, ga->code_size, delay, 1, -1,
+                             bm_buffer_write, ga->out);
+        memcpy(ga->prev, pixels, (size_t)ga->w * ga->h);
+        ga->frames++;
+        return bm_buffer_flush(ga->out) && ok;
+    }
+
+    /* Bounding rectangle of the pixels that changed */
+    y0 = ga->h;
+    y1 = -1;
+    x0 = ga->w;
+    x1 = -1;
+    for(y = 0; y < ga->h; y++) {
+        cur = pixels + (size_t)y * ga->w;
+        old = ga->prev + (size_t)y * ga->w;
+        if(!memcmp(cur, old, ga->w))
+            continue;
+        if(y0 == ga->h)
+            y0 = y;
+        y1 = y;
+        for(x = 0; x < x0 && cur[x] == old[x]; x++)
+            ;
+        x0 = x < x0 ? x : x0;
+        for(x = ga->w - 1; x > x1 && cur[x] == old[x]; x--)
+            ;
+        x1 = x > x1 ? x : x1;
+    }
+
+    if(y1 < 0) {
+        /* Nothing changed: a single transparent pixel keeps the frame's delay */
+        unsigned char t = transparent;
+        ok = gif_write_image(0, 0, 1, 1, &t, ga->code_size, delay, 1, transparent,
+                             bm_buffer_write, ga->out);
+        ga->frames++;
+        return bm_buffer_flush(ga->out) && ok;
+    }
+
+    /* Unchanged pixels inside the rectangle become transparent */
+    rw = x1 - x0 + 1;
+    rh = y1 - y0 + 1;
+    out = ga->rect;
+    for(y = y0; y <= y1; y++) {
+        cur = pixels + (size_t)y * ga->w;
+        old = ga->prev + (size_t)y * ga->w;
+        for(x = x0; x <= x1; x++) {
+            *out++ = cur[x] == old[x] ? transparent : cur[x];
+        }
+        memcpy(ga->prev + (size_t)y * ga->w + x0, cur + x0, rw);
+    }
+
+    ok = gif_write_image(x0, y0, rw, rh, ga->rect, ga->code_size, delay, 1, transparent,
+                         bm_buffer_write, ga->out);
+    ga->frames++;
+    return bm_buffer_flush(ga->out) && ok;
+}
+
+int bm_gif_anim_close(BmGifAnim *ga) {
+    int ok = 1;
+    if(!ga)
+        return 0;
+    if(ga->f) {
+        ok = put_byte(0x3B, bm_buffer_write, ga->out); /* trailer byte */
+        ok = bm_buffer_flush(ga->out) && ok;
+        if(fclose(ga->f) != 0)
+            ok = 0;
+    }
+    free(ga->out);
+    free(ga->prev);
+    free(ga->rect);
+    free(ga);
+    return ok;
 }
 
 /* PCX support
@@ -6716,37 +7054,11 @@ void bm_reduce_palette_OD8(Bitmap *b, BmPalette *pal) {
 }
 
 void bm_reduce_palette_nearest(Bitmap *b, BmPalette *pal) {
-    int i, k;
-    int np = bm_pixel_count(b), nc = bm_palette_count(pal);
+    int i;
+    int np = bm_pixel_count(b);
     bm_color_t *bytes = (bm_color_t *)bm_raw_data(b);
     for(i = 0; i < np; i++) {
-        unsigned char iR, iG, iB;
-        bm_get_rgb(bytes[i], &iR, &iG, &iB);
-
-#if RGB_BETTER_COMPARE
-        double minD = INT_MAX;
-#else
-        int minD = INT_MAX;
-#endif
-        int dk = 0;
-        for(k = 0; k < nc; k++) {
-            unsigned char pR, pG, pB;
-            bm_get_rgb(bm_palette_get(pal, k), &pR, &pG, &pB);
-            int dR = (int)iR - (int)pR;
-            int dG = (int)iG - (int)pG;
-            int dB = (int)iB - (int)pB;
-#if RGB_BETTER_COMPARE
-            int rmean = ((int)iR + (int)pR) / 2;
-            double d = sqrt( (((512 + rmean)*dR*dR)>>8) + 4*dG*dG + (((767-rmean)*dB*dB)>>8) );
-#else
-            int d = dR*dR + dG*dG + dB*dB;
-#endif
-            if(d < minD) {
-                minD = d;
-                dk = k;
-            }
-        }
-        bytes[i] = bm_palette_get(pal, dk);
+        bytes[i] = bm_palette_get(pal, bm_palette_nearest_index(pal, bytes[i]));
     }
 }
 
@@ -6769,6 +7081,7 @@ BmPalette *bm_palette_create(unsigned int ncolors) {
     }
 
     pal->ref_count = 1;
+    pal->lut = NULL;
     return pal;
 }
 
@@ -6783,6 +7096,7 @@ unsigned int bm_palette_release(BmPalette *pal) {
     assert(pal->ref_count > 0);
     pal->ref_count--;
     if(!pal->ref_count) {
+        pal_lut_free(pal->lut);
         free(pal->colors);
         free(pal);
         return 0;
@@ -6798,6 +7112,8 @@ int bm_palette_count(BmPalette *pal) {
 int bm_palette_add(BmPalette *pal, bm_color_t color) {
     int index = pal->ncolors++;
     color &= 0xFFFFFF;
+    pal_lut_free(pal->lut);
+    pal->lut = NULL;
     if(pal->ncolors >= pal->acolors) {
         pal->acolors <<= 1;
         bm_color_t *tcolors = realloc(pal->colors, pal->acolors * sizeof *pal->colors);
@@ -6814,6 +7130,8 @@ int bm_palette_set(BmPalette *pal, int index, bm_color_t color) {
     if(index < 0 || index >= pal->ncolors)
         return -1;
     pal->colors[index] = color;
+    pal_lut_free(pal->lut);
+    pal->lut = NULL;
     return index;
 }
 
@@ -6824,58 +7142,241 @@ bm_color_t bm_palette_get(BmPalette *pal, int index) {
     return pal->colors[index];
 }
 
-/* At some point I experimented with whether a kd-tree would
-improve the performance. It didn't.
-See commit cae63c0a1fad72a76c1e913c8ee26e1293888de0 */
-unsigned int bm_palette_nearest_index(BmPalette *pal, bm_color_t color) {
-    int i, m = 0;
+/* Nearest-color cache of a palette.
+RGB space is cut into 32x32x32 cells of 8x8x8 colors, and each cell lists the
+palette entries that can be the nearest to some color in it: those whose
+smallest possible distance to the cell is no larger than the largest distance
+from the cell to the entry that is nearest in the worst case. A lookup then only
+compares the color with its cell's short list, in palette order, so it finds
+exactly the index the full scan would. The lists are built the first time a
+cell is hit, so small images only pay for the cells they use, and the cache is
+kept with the palette, so all the images that share a palette share it. Since
+lookups write to the cache, a shared palette must not be used by several
+threads at once.
+(At some point I experimented with whether a kd-tree would improve the
+performance. It didn't. See commit cae63c0a1fad72a76c1e913c8ee26e1293888de0) */
+#define PAL_LUT_BITS 5
+#define PAL_LUT_CELLS (1 << (3 * PAL_LUT_BITS))
+#define PAL_LUT_SHIFT (8 - PAL_LUT_BITS)
+
+struct palette_lut {
+    int ncolors;
+    int *pr, *pg, *pb;      /* channels of every palette color */
+    int *first;             /* start of each cell's list in the pool, -1 until built */
+    int *count;             /* length of each cell's list */
+    int *index;             /* pool: palette index of each list entry... */
+    int *r, *g, *b;         /* ...and its channels, for the distance loop */
+    int len, cap;
+};
+
+static void pal_lut_free(struct palette_lut *lut) {
+    if(!lut)
+        return;
+    free(lut->pr);
+    free(lut->pg);
+    free(lut->pb);
+    free(lut->first);
+    free(lut->count);
+    free(lut->index);
+    free(lut->r);
+    free(lut->g);
+    free(lut->b);
+    free(lut);
+}
+
+/* The distance that colors are compared by; see RGB_BETTER_COMPARE.
+The square root of the weighted distance is left out: it doesn't change which
+color is nearest */
+static int pal_distance(int R1, int G1, int B1, int R2, int G2, int B2) {
+    int r = R1 - R2, g = G1 - G2, b = B1 - B2;
 #if RGB_BETTER_COMPARE
-    unsigned char R1, G1, B1, R2, G2, B2;
-    int rmean, r, g, b;
-    double d, md = 1e10;
-    bm_get_rgb(color, &R1, &G1, &B1);
+    int rmean = (R1 + R2) / 2;
+    return (((512 + rmean)*r*r)>>8) + 4*g*g + (((767-rmean)*b*b)>>8);
+#else
+    return r*r + g*g + b*b;
+#endif
+}
+
+/* Smallest (far = 0) or largest (far = 1) distance between palette color p and
+any color in the cell whose channels run from lo[] to lo[] + 7 */
+static int pal_cell_bound(const int lo[3], int pR, int pG, int pB, int far) {
+    const int p[3] = {pR, pG, pB};
+    int d[3], c;
+    for(c = 0; c < 3; c++) {
+        int hi = lo[c] + (1 << PAL_LUT_SHIFT) - 1;
+        if(far)
+            d[c] = MAX(abs(p[c] - lo[c]), abs(p[c] - hi));
+        else
+            d[c] = p[c] < lo[c] ? lo[c] - p[c] : (p[c] > hi ? p[c] - hi : 0);
+    }
+#if RGB_BETTER_COMPARE
+    {
+        /* The red and blue weights depend on the mean red, which ranges
+            over the cell as well */
+        int hi = lo[0] + (1 << PAL_LUT_SHIFT) - 1;
+        int rmean = far ? (hi + pR) / 2 : (lo[0] + pR) / 2;
+        int bmean = far ? (lo[0] + pR) / 2 : (hi + pR) / 2;
+        return (((512 + rmean)*d[0]*d[0])>>8) + 4*d[1]*d[1] + (((767-bmean)*d[2]*d[2])>>8);
+    }
+#else
+    return d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+#endif
+}
+
+static struct palette_lut *pal_lut_create(BmPalette *pal) {
+    int i;
+    struct palette_lut *lut = CAST(struct palette_lut *)(calloc(1, sizeof *lut));
+    if(!lut)
+        return NULL;
+    lut->ncolors = pal->ncolors;
+    lut->pr = CAST(int *)(malloc(pal->ncolors * sizeof *lut->pr));
+    lut->pg = CAST(int *)(malloc(pal->ncolors * sizeof *lut->pg));
+    lut->pb = CAST(int *)(malloc(pal->ncolors * sizeof *lut->pb));
+    lut->first = CAST(int *)(malloc(PAL_LUT_CELLS * sizeof *lut->first));
+    lut->count = CAST(int *)(calloc(PAL_LUT_CELLS, sizeof *lut->count));
+    if(!lut->pr || !lut->pg || !lut->pb || !lut->first || !lut->count) {
+        pal_lut_free(lut);
+        return NULL;
+    }
     for(i = 0; i < pal->ncolors; i++) {
-        bm_get_rgb(pal->colors[i], &R2, &G2, &B2);
+        unsigned char R, G, B;
+        bm_get_rgb(pal->colors[i], &R, &G, &B);
+        lut->pr[i] = R;
+        lut->pg[i] = G;
+        lut->pb[i] = B;
+    }
+    for(i = 0; i < PAL_LUT_CELLS; i++)
+        lut->first[i] = -1;
+    return lut;
+}
+
+/* Appends one entry to the pool of candidate lists */
+static int pal_lut_push(struct palette_lut *lut, int i) {
+    if(lut->len == lut->cap) {
+        int cap = lut->cap ? lut->cap * 2 : 1024;
+        int *index = CAST(int *)(realloc(lut->index, cap * sizeof *index));
+        int *r = index ? CAST(int *)(realloc(lut->r, cap * sizeof *r)) : NULL;
+        int *g = r ? CAST(int *)(realloc(lut->g, cap * sizeof *g)) : NULL;
+        int *b = g ? CAST(int *)(realloc(lut->b, cap * sizeof *b)) : NULL;
+        /* Whatever was reallocated is kept, so nothing leaks on failure */
+        if(index) lut->index = index;
+        if(r) lut->r = r;
+        if(g) lut->g = g;
+        if(b) lut->b = b;
+        if(!b)
+            return 0;
+        lut->cap = cap;
+    }
+    lut->index[lut->len] = i;
+    lut->r[lut->len] = lut->pr[i];
+    lut->g[lut->len] = lut->pg[i];
+    lut->b[lut->len] = lut->pb[i];
+    lut->len++;
+    return 1;
+}
 
-        rmean = (R1 + R2) / 2;
-        r = R1 - R2;
-        g = G1 - G2;
-        b = B1 - B2;
-        d = sqrt( (((512 + rmean)*r*r)>>8) + 4*g*g + (((767-rmean)*b*b)>>8) );
+/* Builds the candidate list of one cell */
+static int pal_lut_build(struct palette_lut *lut, int cell) {
+    int lo[3], i, worst = INT_MAX, first = lut->len;
+    lo[0] = (cell >> (2 * PAL_LUT_BITS)) << PAL_LUT_SHIFT;
+    lo[1] = ((cell >> PAL_LUT_BITS) & ((1 << PAL_LUT_BITS) - 1)) << PAL_LUT_SHIFT;
+    lo[2] = (cell & ((1 << PAL_LUT_BITS) - 1)) << PAL_LUT_SHIFT;
 
-        if(d < md) {
-            md = d;
-            m = i;
+    for(i = 0; i < lut->ncolors; i++) {
+        int d = pal_cell_bound(lo, lut->pr[i], lut->pg[i], lut->pb[i], 1);
+        if(d < worst)
+            worst = d;
+    }
+    for(i = 0; i < lut->ncolors; i++) {
+        if(pal_cell_bound(lo, lut->pr[i], lut->pg[i], lut->pb[i], 0) <= worst &&
+                !pal_lut_push(lut, i)) {
+            lut->len = first;
+            return 0;
         }
     }
-#else
-    /* This path just takes the euclidean distance */
-    bm_color_t dr, dg, db;
-    bm_color_t r0 = (color >> 16) & 0xFF,
-        g0 = (color >> 8) & 0xFF,
-        b0 = (color >> 0) & 0xFF;
+    lut->first[cell] = first;
+    lut->count[cell] = lut->len - first;
+    return 1;
+}
 
-    int md = INT_MAX;
-    for(i = 0; i < pal->ncolors; i++) {
-        color = pal->colors[i];
-        dr = r0 - ((color >> 16) & 0xFF);
-        dg = g0 - ((color >> 8) & 0xFF);
-        db = b0 - ((color >> 0) & 0xFF);
-        int d = dr * dr + dg * dg + db * db;
+#if defined(__SSE2__)
+/* Low 32 bits of the lane-wise products; SSE2 only multiplies two lanes at a time */
+static __m128i pal_mullo_epi32(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#endif
 
-        /* another thing that didn't improve performance as I expected:
+/* Nearest of the n pool entries from first on; the earliest wins a tie */
+static int pal_lut_nearest(const struct palette_lut *lut, int first, int n, int R, int G, int B) {
+    int k = 0, md = INT_MAX, m = 0;
+    const int *pr = lut->r + first, *pg = lut->g + first, *pb = lut->b + first;
+#if defined(__SSE2__)
+    {
+        const __m128i vR = _mm_set1_epi32(R), vG = _mm_set1_epi32(G), vB = _mm_set1_epi32(B);
+        int d[4], j;
+        for(; k + 4 <= n; k += 4) {
+            __m128i cr = _mm_loadu_si128((const __m128i *)(pr + k));
+            __m128i cg = _mm_loadu_si128((const __m128i *)(pg + k));
+            __m128i cb = _mm_loadu_si128((const __m128i *)(pb + k));
+            __m128i r = _mm_sub_epi32(vR, cr), g = _mm_sub_epi32(vG, cg), b = _mm_sub_epi32(vB, cb);
+            __m128i r2 = pal_mullo_epi32(r, r), g2 = pal_mullo_epi32(g, g), b2 = pal_mullo_epi32(b, b);
+#if RGB_BETTER_COMPARE
+            __m128i rmean = _mm_srai_epi32(_mm_add_epi32(vR, cr), 1);
+            __m128i wr = _mm_add_epi32(_mm_set1_epi32(512), rmean);
+            __m128i wb = _mm_sub_epi32(_mm_set1_epi32(767), rmean);
+            __m128i dist = _mm_add_epi32(_mm_srli_epi32(pal_mullo_epi32(wr, r2), 8),
+                                         _mm_add_epi32(_mm_slli_epi32(g2, 2),
+                                                       _mm_srli_epi32(pal_mullo_epi32(wb, b2), 8)));
+#else
+            __m128i dist = _mm_add_epi32(r2, _mm_add_epi32(g2, b2));
+#endif
+            _mm_storeu_si128((__m128i *)d, dist);
+            for(j = 0; j < 4; j++) {
+                if(d[j] < md) {
+                    md = d[j];
+                    m = k + j;
+                }
+            }
+        }
+    }
+#endif
+    for(; k < n; k++) {
+        int d = pal_distance(R, G, B, pr[k], pg[k], pb[k]);
+        if(d < md) {
+            md = d;
+            m = k;
+        }
+    }
+    return lut->index[first + m];
+}
 
-        if(!d) return i;
+unsigned int bm_palette_nearest_index(BmPalette *pal, bm_color_t color) {
+    int i, m = 0, md = INT_MAX, cell;
+    unsigned char R1, G1, B1, R2, G2, B2;
+    struct palette_lut *lut;
 
-        It seems that for colorful images the color is unlikely
-        to be in the palette, so it has to go through the whole palette
-        anyway, but then add this check on each iteration. */
+    bm_get_rgb(color, &R1, &G1, &B1);
+    if(!pal->lut && pal->ncolors > 0)
+        pal->lut = pal_lut_create(pal);
+    lut = pal->lut;
+    cell = ((R1 >> PAL_LUT_SHIFT) << (2 * PAL_LUT_BITS)) |
+           ((G1 >> PAL_LUT_SHIFT) << PAL_LUT_BITS) | (B1 >> PAL_LUT_SHIFT);
+    if(lut && (lut->first[cell] >= 0 || pal_lut_build(lut, cell)))
+        return pal_lut_nearest(lut, lut->first[cell], lut->count[cell], R1, G1, B1);
+
+    /* Out of memory for the cache: scan the whole palette */
+    for(i = 0; i < pal->ncolors; i++) {
+        int d;
+        bm_get_rgb(pal->colors[i], &R2, &G2, &B2);
+        d = pal_distance(R1, G1, B1, R2, G2, B2);
         if(d < md) {
             md = d;
             m = i;
         }
     }
-#endif
     return m;
 }
 
@@ -6927,7 +7428,9 @@ int bm_make_palette(Bitmap *b) {
         memcpy(palette->colors, colors, ncolors * sizeof colors[0]);
     } else {
         /* More than 256 colors in the image */
-        palette = bm_quantize_uniform(b, 256);
+        palette = bm_quantize_mediancut(b, 256, 0);
+        if(!palette)
+            return 0;
         ncolors = palette->ncolors;
     }
 
@@ -7365,7 +7868,7 @@ BmPalette *bm_quantize_uniform(Bitmap *b, int K) {
     }
 
     for(i = 0; i < K; i++) {
-        int x = i * (np - 1) / (K - 1);
+        int x = (int)((long long)i * (np - 1) / (K - 1));
         palette->colors[i] = pixels[x];
     }
 
@@ -7390,6 +7893,368 @@ BmPalette *bm_quantize_random(Bitmap *b, int K) {
     return palette;
 }
 
+/* Median cut over a color histogram.
+The image is counted into hash tables, one per thread over its share of the
+pixels, which are then merged. Colors are binned at HIST_BITS bits per channel,
+and each bin keeps the sum of the exact colors that fell in it, so bins average
+to their true mean color. Median cut then works on the bins instead of the
+pixels: the box with the most pixels times the widest channel range is split at
+the weighted median of that channel until there are K boxes. The box means
+become the palette, which a few k-means passes over the bins then refine.
+The passes use plain RGB distance, the error that k-means minimizes. */
+#define HIST_BITS           6
+#define HIST_EMPTY          0xFFFFFFFFu
+#define MEDIANCUT_PASSES    4
+#define MEDIANCUT_MIN_SHARE 65536   /* pixels per thread below which more threads don't pay */
+
+struct hist_slot {
+    unsigned int key;       /* binned color, HIST_EMPTY if the slot is free */
+    unsigned int count;
+    double sum[3];          /* sums of the exact R, G, B of the bin's pixels */
+};
+
+struct color_hist {
+    struct hist_slot *slots;
+    unsigned int mask;      /* number of slots - 1 */
+    unsigned int used;
+};
+
+static int hist_init(struct color_hist *h, unsigned int nslots) {
+    unsigned int i;
+    h->slots = CAST(struct hist_slot *)(calloc(nslots, sizeof *h->slots));
+    h->mask = nslots - 1;
+    h->used = 0;
+    if(!h->slots)
+        return 0;
+    for(i = 0; i < nslots; i++)
+        h->slots[i].key = HIST_EMPTY;
+    return 1;
+}
+
+static void hist_free(struct color_hist *h) {
+    free(h->slots);
+    h->slots = NULL;
+}
+
+static unsigned int hist_key(bm_color_t c) {
+    const unsigned int drop = 8 - HIST_BITS, mask = (1u << HIST_BITS) - 1;
+    return ((c >> (16 + drop)) & mask) << (2 * HIST_BITS) |
+           ((c >> (8 + drop)) & mask) << HIST_BITS |
+           ((c >> drop) & mask);
+}
+
+/* Returns the slot of a key, claiming a free one for a new key; NULL if out of memory */
+static struct hist_slot *hist_find(struct color_hist *h, unsigned int key) {
+    unsigned int x = key * 2654435761u, i = (x ^ (x >> 15)) & h->mask;
+    while(h->slots[i].key != key && h->slots[i].key != HIST_EMPTY)
+        i = (i + 1) & h->mask;
+    if(h->slots[i].key == HIST_EMPTY) {
+        /* Keep the table at most half full */
+        if(2 * (h->used + 1) > h->mask + 1) {
+            struct color_hist grown;
+            unsigned int j;
+            if(!hist_init(&grown, 2 * (h->mask + 1)))
+                return NULL;
+            for(j = 0; j <= h->mask; j++) {
+                if(h->slots[j].key != HIST_EMPTY)
+                    *hist_find(&grown, h->slots[j].key) = h->slots[j];
+            }
+            hist_free(h);
+            *h = grown;
+            return hist_find(h, key);
+        }
+        h->slots[i].key = key;
+        h->used++;
+    }
+    return &h->slots[i];
+}
+
+struct hist_job {
+    const bm_color_t *pixels;
+    int start, end;
+    struct color_hist hist;
+    int ok;
+};
+
+/* Counts the colors of one share of the pixels; runs of one color are counted at once */
+static void *hist_count(void *arg) {
+    struct hist_job *job = CAST(struct hist_job *)(arg);
+    unsigned int run = 0;
+    bm_color_t color = 0;
+    int i;
+
+    job->ok = hist_init(&job->hist, 1024);
+    for(i = job->start; job->ok && i <= job->end; i++) {
+        bm_color_t c = i < job->end ? job->pixels[i] & 0xFFFFFF : HIST_EMPTY;
+        if(c != color && run) {
+            struct hist_slot *slot = hist_find(&job->hist, hist_key(color));
+            if(!slot) {
+                job->ok = 0;
+                break;
+            }
+            slot->count += run;
+            slot->sum[0] += (double)((color >> 16) & 0xFF) * run;
+            slot->sum[1] += (double)((color >> 8) & 0xFF) * run;
+            slot->sum[2] += (double)(color & 0xFF) * run;
+            run = 0;
+        }
+        color = c;
+        run++;
+    }
+    return NULL;
+}
+
+struct hist_entry {
+    unsigned char c[3];     /* mean R, G, B of the bin */
+    unsigned int count;
+    double sum[3];
+};
+
+struct mc_box {
+    int start, end;         /* histogram entries in the box */
+    double count;           /* pixels in the box */
+    int channel;            /* widest channel */
+    int range;              /* extent of the widest channel */
+};
+
+static int hist_cmp_r(const void *ap, const void *bp) {
+    return ((const struct hist_entry *)ap)->c[0] - ((const struct hist_entry *)bp)->c[0];
+}
+static int hist_cmp_g(const void *ap, const void *bp) {
+    return ((const struct hist_entry *)ap)->c[1] - ((const struct hist_entry *)bp)->c[1];
+}
+static int hist_cmp_b(const void *ap, const void *bp) {
+    return ((const struct hist_entry *)ap)->c[2] - ((const struct hist_entry *)bp)->c[2];
+}
+
+static void mc_box_measure(const struct hist_entry *entries, struct mc_box *box) {
+    int lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0}, i, c;
+    box->count = 0;
+    for(i = box->start; i < box->end; i++) {
+        for(c = 0; c < 3; c++) {
+            lo[c] = MIN(lo[c], entries[i].c[c]);
+            hi[c] = MAX(hi[c], entries[i].c[c]);
+        }
+        box->count += entries[i].count;
+    }
+    box->channel = 0;
+    for(c = 1; c < 3; c++) {
+        if(hi[c] - lo[c] > hi[box->channel] - lo[box->channel])
+            box->channel = c;
+    }
+    box->range = hi[box->channel] - lo[box->channel];
+}
+
+/* Splits the histogram entries into at most K boxes; returns the number of boxes */
+static int mc_split(struct hist_entry *entries, int n, struct mc_box *boxes, int K) {
+    static int (*const cmp[3])(const void *, const void *) = {hist_cmp_r, hist_cmp_g, hist_cmp_b};
+    int nboxes = 1;
+
+    boxes[0].start = 0;
+    boxes[0].end = n;
+    mc_box_measure(entries, &boxes[0]);
+    while(nboxes < K) {
+        int i, best = -1, m;
+        double half, cum = 0;
+        struct mc_box *box;
+        for(i = 0; i < nboxes; i++) {
+            if(boxes[i].range > 0 && (best < 0 ||
+                    boxes[i].count * boxes[i].range > boxes[best].count * boxes[best].range))
+                best = i;
+        }
+        if(best < 0)
+            break;  /* every box holds a single color */
+
+        box = &boxes[best];
+        qsort(entries + box->start, box->end - box->start, sizeof *entries, cmp[box->channel]);
+        half = box->count / 2;
+        for(m = box->start; m < box->end - 1; m++) {
+            cum += entries[m].count;
+            if(cum >= half)
+                break;
+        }
+        /* Both halves keep at least one entry */
+        m = MAX(m + 1, box->start + 1);
+        m = MIN(m, box->end - 1);
+
+        boxes[nboxes].start = m;
+        boxes[nboxes].end = box->end;
+        box->end = m;
+        mc_box_measure(entries, box);
+        mc_box_measure(entries, &boxes[nboxes]);
+        nboxes++;
+    }
+    return nboxes;
+}
+
+static bm_color_t mc_mean(const double sum[3], double count) {
+    return bm_rgb((int)(sum[0] / count + 0.5), (int)(sum[1] / count + 0.5), (int)(sum[2] / count + 0.5));
+}
+
+BmPalette *bm_quantize_mediancut(Bitmap *b, int K, int nthreads) {
+    int np = bm_pixel_count(b), i, t, n, nboxes, pass;
+    const bm_color_t *pixels = (const bm_color_t *)bm_raw_data(b);
+    struct hist_job *jobs;
+    struct hist_entry *entries = NULL;
+    struct mc_box *boxes = NULL;
+    BmPalette *palette = NULL;
+    double *sums = NULL;
+    int ok = 1;
+
+    assert(K > 1 && K <= MAX_K);
+#ifdef USEPTHREADS
+    if(nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    nthreads = 1;
+#endif
+    nthreads = MAX(1, MIN(nthreads, np / MEDIANCUT_MIN_SHARE + 1));
+
+    jobs = CAST(struct hist_job *)(calloc(nthreads, sizeof *jobs));
+    if(!jobs) {
+        SET_ERROR("out of memory");
+        return NULL;
+    }
+    for(t = 0; t < nthreads; t++) {
+        jobs[t].pixels = pixels;
+        jobs[t].start = (int)((long long)np * t / nthreads);
+        jobs[t].end = (int)((long long)np * (t + 1) / nthreads);
+    }
+
+    /* Count the shares in parallel; the calling thread takes the first */
+#ifdef USEPTHREADS
+    {
+        pthread_t *threads = CAST(pthread_t *)(calloc(nthreads, sizeof *threads));
+        int started = 1;
+        while(threads && started < nthreads &&
+                pthread_create(&threads[started], NULL, hist_count, &jobs[started]) == 0)
+            started++;
+        /* Shares whose thread could not start are counted here */
+        for(t = threads ? started : 1; t < nthreads; t++)
+            hist_count(&jobs[t]);
+        hist_count(&jobs[0]);
+        for(t = 1; threads && t < started; t++)
+            pthread_join(threads[t], NULL);
+        free(threads);
+    }
+#else
+    hist_count(&jobs[0]);
+#endif
+
+    /* Merge into the first table */
+    for(t = 0; t < nthreads; t++)
+        ok = ok && jobs[t].ok;
+    for(t = 1; ok && t < nthreads; t++) {
+        unsigned int j;
+        for(j = 0; ok && j <= jobs[t].hist.mask; j++) {
+            const struct hist_slot *from = &jobs[t].hist.slots[j];
+            struct hist_slot *to;
+            if(from->key == HIST_EMPTY)
+                continue;
+            if(!(to = hist_find(&jobs[0].hist, from->key))) {
+                ok = 0;
+                break;
+            }
+            to->count += from->count;
+            to->sum[0] += from->sum[0];
+            to->sum[1] += from->sum[1];
+            to->sum[2] += from->sum[2];
+        }
+    }
+    for(t = 1; t < nthreads; t++)
+        hist_free(&jobs[t].hist);
+    if(!ok)
+        goto done;
+
+    n = (int)jobs[0].hist.used;
+    entries = CAST(struct hist_entry *)(malloc(n * sizeof *entries));
+    boxes = CAST(struct mc_box *)(malloc(K * sizeof *boxes));
+    sums = CAST(double *)(malloc(4 * K * sizeof *sums));
+    if(!entries || !boxes || !sums) {
+        ok = 0;
+        goto done;
+    }
+    for(i = 0, t = 0; i <= (int)jobs[0].hist.mask; i++) {
+        const struct hist_slot *slot = &jobs[0].hist.slots[i];
+        if(slot->key != HIST_EMPTY) {
+            struct hist_entry *e = &entries[t++];
+            bm_get_rgb(mc_mean(slot->sum, slot->count), &e->c[0], &e->c[1], &e->c[2]);
+            e->count = slot->count;
+            memcpy(e->sum, slot->sum, sizeof e->sum);
+        }
+    }
+    hist_free(&jobs[0].hist);
+
+    nboxes = mc_split(entries, n, boxes, K);
+    palette = bm_palette_create(nboxes);
+    if(!palette) {
+        ok = 0;
+        goto done;
+    }
+    for(i = 0; i < nboxes; i++) {
+        double sum[3] = {0, 0, 0};
+        for(t = boxes[i].start; t < boxes[i].end; t++) {
+            sum[0] += entries[t].sum[0];
+            sum[1] += entries[t].sum[1];
+            sum[2] += entries[t].sum[2];
+        }
+        bm_palette_set(palette, i, mc_mean(sum, boxes[i].count));
+    }
+
+    /* k-means over the bins */
+    for(pass = 0; pass < MEDIANCUT_PASSES; pass++) {
+        int changed = 0;
+        memset(sums, 0, 4 * nboxes * sizeof *sums);
+        for(i = 0; i < n; i++) {
+            const unsigned char *c = entries[i].c;
+            int k, nearest = 0, best = INT_MAX;
+            double *s;
+            for(k = 0; k < nboxes && best > 0; k++) {
+                bm_color_t p = palette->colors[k];
+                int dr = (int)((p >> 16) & 0xFF) - c[0];
+                int dg = (int)((p >> 8) & 0xFF) - c[1];
+                int db = (int)(p & 0xFF) - c[2];
+                int d = dr * dr + dg * dg + db * db;
+                if(d < best) {
+                    best = d;
+                    nearest = k;
+                }
+            }
+            s = sums + 4 * nearest;
+            s[0] += entries[i].sum[0];
+            s[1] += entries[i].sum[1];
+            s[2] += entries[i].sum[2];
+            s[3] += entries[i].count;
+        }
+        for(i = 0; i < nboxes; i++) {
+            bm_color_t c;
+            if(sums[4 * i + 3] == 0)
+                continue;
+            c = mc_mean(sums + 4 * i, sums[4 * i + 3]);
+            if((c & 0xFFFFFF) != (bm_palette_get(palette, i) & 0xFFFFFF)) {
+                bm_palette_set(palette, i, c);
+                changed = 1;
+            }
+        }
+        if(!changed)
+            break;
+    }
+
+done:
+    if(!ok) {
+        SET_ERROR("out of memory");
+        hist_free(&jobs[0].hist);
+        if(palette)
+            bm_palette_release(palette);
+        palette = NULL;
+    }
+    free(jobs);
+    free(entries);
+    free(boxes);
+    free(sums);
+    return palette;
+}
+
 void bm_set_palette(Bitmap *b, BmPalette *pal) {
     assert(b);
     if(pal)
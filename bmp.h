@@ -12,6 +12,8 @@
  * * JPG support is optional through [libjpeg][]. Use `-DUSEJPG` when compiling.
  * * Alternatively, JPG and PNG files can be loaded through [stb_image.h][stb_image].
  *    Put `stb_image.h` in the same directory as `bmp.c` and compile with `-DUSESTB`.
+ * * `bm_quantize_mediancut()` counts colors on several threads when compiled
+ *    with `-DUSEPTHREADS` (link with `-lpthread`).
  *
  * [libpng]: http://www.libpng.org/pub/png/libpng.html
  * [libjpeg]: http://www.ijg.org/
@@ -134,6 +136,12 @@ typedef struct bitmap_font {
  *
  * Structure that contains a palette.
  *
+ * A palette is not thread-safe. Its reference count is a plain integer, and
+ * looking up a color in it, which `bm_reduce_palette()` and its variants do
+ * and which saving a bitmap with a palette as a GIF or PCX does, fills in the
+ * palette's nearest-color cache. A palette that several threads use must be
+ * used by one of them at a time; otherwise give each thread its own palette.
+ *
  * See the section on [Palette Functions](#palette-functions) for more details.
  */
 typedef struct bitmap_palette BmPalette;
@@ -382,11 +390,109 @@ int bm_savef(Bitmap *b, const char *fname, ...);
  * * `context` is the pointer passed through directly from `bm_save_custom()`
  *
  * The `bm_write_fun` should return 1 on success, 0 on failure.
+ *
+ * The encoders' output is collected in a 64 KB buffer, so `fun` is called with large
+ * blocks rather than once per header field or byte. To encode into memory instead,
+ * pass `bm_mem_write()` and a `BmMemSink`; that output is not buffered twice.
  */
 typedef int (*bm_write_fun)(void *data, int len, void *context);
 
 int bm_save_custom(Bitmap *b, bm_write_fun fun, void *context, const char *ext);
 
+/**
+ * #### `typedef struct bm_mem_sink BmMemSink;`
+ *
+ * Growable memory buffer that `bm_mem_write()` appends encoded bytes to.
+ *
+ * Start from a zeroed `BmMemSink`. The encoded file is in the first `len` bytes
+ * of `data`. Set `len` to 0 to reuse the buffer, and `free()` `data` when done.
+ *
+ * To have the buffer come from another allocator, set `grow` to a function
+ * that behaves like `realloc()` and release `data` the way that allocator wants.
+ */
+typedef struct bm_mem_sink {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    void *(*grow)(void *data, size_t size); /* NULL for realloc() */
+} BmMemSink;
+
+/**
+ * #### `int bm_mem_write(void *data, int len, void *context)`
+ *
+ * A `bm_write_fun` for `bm_save_custom()` and `bm_write_gif_indexed()` that appends
+ * the bytes to the `BmMemSink` passed as `context`, so a file can be encoded
+ * without any system calls and written later in one go.
+ *
+ * Returns 1 on success, 0 if the buffer could not grow.
+ */
+int bm_mem_write(void *data, int len, void *context);
+
+/**
+ * #### `int bm_save_gif_indexed(const char *fname, int w, int h, const unsigned char *pixels, const bm_color_t *palette, int ncolors, int transparent)`
+ *
+ * Saves a `w` x `h` image that is already mapped to palette indices as a GIF
+ * file named `fname`, one byte per pixel in `pixels`. The `ncolors` (at most 256)
+ * colors in `palette` become the global color table as they are, so no palette
+ * is built and nothing is quantized or dithered. Every index must be below `ncolors`.
+ *
+ * `transparent` is the index to mark as transparent, or -1 for none.
+ *
+ * Returns 1 on success, 0 on failure.
+ */
+int bm_save_gif_indexed(const char *fname, int w, int h,
+        const unsigned char *pixels, const bm_color_t *palette, int ncolors, int transparent);
+
+/**
+ * #### `int bm_write_gif_indexed(bm_write_fun fun, void *context, int w, int h, const unsigned char *pixels, const bm_color_t *palette, int ncolors, int transparent)`
+ *
+ * Like `bm_save_gif_indexed()`, but the bytes are written through `fun` as in `bm_save_custom()`.
+ */
+int bm_write_gif_indexed(bm_write_fun fun, void *context, int w, int h,
+        const unsigned char *pixels, const bm_color_t *palette, int ncolors, int transparent);
+
+/**
+ * #### `typedef struct bm_gif_anim BmGifAnim;`
+ *
+ * Writer for an animated GIF, created by `bm_gif_anim_open()`.
+ */
+typedef struct bm_gif_anim BmGifAnim;
+
+/**
+ * #### `BmGifAnim *bm_gif_anim_open(const char *fname, int w, int h, const bm_color_t *palette, int ncolors, int loops)`
+ *
+ * Starts an animated GIF file named `fname` of `w` x `h` palette-indexed frames
+ * sharing the global color table `palette` of `ncolors` colors.
+ * `loops` is the number of times to repeat the animation (0 repeats forever),
+ * or -1 to omit the looping extension and play it once.
+ *
+ * Returns the writer, or `NULL` on failure.
+ */
+BmGifAnim *bm_gif_anim_open(const char *fname, int w, int h,
+        const bm_color_t *palette, int ncolors, int loops);
+
+/**
+ * #### `int bm_gif_anim_frame(BmGifAnim *ga, const unsigned char *pixels, int delay, int transparent)`
+ *
+ * Appends a full `w` x `h` frame of palette indices, shown for `delay` hundredths of a second.
+ *
+ * Only the bounding rectangle of the pixels that differ from the previous frame is
+ * encoded, with the unchanged pixels inside it set to the `transparent` index.
+ * `transparent` must be an index the frames never use; pass -1 to always write full frames.
+ *
+ * Returns 1 on success, 0 on failure.
+ */
+int bm_gif_anim_frame(BmGifAnim *ga, const unsigned char *pixels, int delay, int transparent);
+
+/**
+ * #### `int bm_gif_anim_close(BmGifAnim *ga)`
+ *
+ * Writes the GIF trailer, closes the file and frees the writer.
+ *
+ * Returns 1 on success, 0 on failure.
+ */
+int bm_gif_anim_close(BmGifAnim *ga);
+
 /**
  * ### Reference Counting Functions
  *
@@ -1034,7 +1140,7 @@ unsigned int bm_palette_release(BmPalette *pal);
  * * If `b` has 256 colors or less, then the generated palette
  *   contains only those colors.
  * * If `b` has more than 256 colors, then a palette will be created
- *   through `bm_quantize_uniform()`
+ *   through `bm_quantize_mediancut()`
  *
  * The generated palette can be retrieved through `bm_get_palette()`
  */
@@ -1080,6 +1186,12 @@ bm_color_t bm_palette_get(BmPalette *pal, int index);
  * #### `unsigned int bm_palette_nearest_index(BmPalette *pal, bm_color_t color)`
  *
  * Finds the index of the color in the palette `pal` that is closest to `color`.
+ *
+ * The first lookup gives the palette a cache that narrows each part of the RGB
+ * cube down to the few palette colors that can be nearest to it. Every image
+ * dithered or reduced with the same palette reuses it, and `bm_palette_add()`
+ * and `bm_palette_set()` discard it. Because lookups fill in the cache, a palette
+ * must not be searched from several threads at once, even when nobody changes it.
  */
 unsigned int bm_palette_nearest_index(BmPalette *pal, bm_color_t color);
 
@@ -1156,6 +1268,26 @@ BmPalette *bm_quantize(Bitmap *b, int n);
  */
 BmPalette *bm_quantize_kmeans(Bitmap *b, int K);
 
+/**
+ * #### `BmPalette *bm_quantize_mediancut(Bitmap *b, int K, int nthreads)`
+ *
+ * Creates a palette of at most `K` colors from the bitmap `b`. The colors of
+ * the image are counted into a histogram of bins 6 bits per channel wide,
+ * each remembering the mean of its pixels, which
+ * [Median Cut](https://en.wikipedia.org/wiki/Median_cut) splits into `K` boxes.
+ * A few k-means passes over the histogram then refine the box means.
+ *
+ * Only the histogram is sorted and clustered, not the pixels, so it is much
+ * faster than `bm_quantize_kmeans()` on large images, with similar quality.
+ *
+ * The pixels are counted by `nthreads` threads, or by one thread per processor
+ * if `nthreads` is 0. Threads need `-DUSEPTHREADS` when compiling; without it
+ * the pixels are counted on the calling thread.
+ *
+ * Returns `NULL` if it runs out of memory.
+ */
+BmPalette *bm_quantize_mediancut(Bitmap *b, int K, int nthreads);
+
 /**
  * #### `BmPalette *bm_quantize_uniform(Bitmap *b, int K)`
  *
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "trace.h"
+#include "mem.h"
+
+/**
+ * FNV-1a hash over a block of memory, used to detect torn or corrupted payloads
+ */
+static uint64_t checkpoint_hash(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Writes the pending snapshot to the temporary file, flushes it to disk and
+ * renames it over the final path so a crash never leaves a partial checkpoint.
+ * Returns 0 on success, -1 on failure
+ */
+static int checkpoint_write_file(checkpoint_writer_t *cw) {
+    size_t payload = cw->count * sizeof(double);
+    cw->header.checksum = checkpoint_hash(cw->snapshot, payload);
+
+    FILE *f = fopen(cw->tmp_path, "wb");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open checkpoint file %s\n", cw->tmp_path);
+        return -1;
+    }
+
+    int ok = fwrite(&cw->header, sizeof(cw->header), 1, f) == 1 &&
+             fwrite(cw->snapshot, payload, 1, f) == 1 &&
+             fflush(f) == 0 &&
+             fsync(fileno(f)) == 0;
+
+    if (fclose(f) != 0) {
+        ok = 0;
+    }
+    if (!ok || rename(cw->tmp_path, cw->path) != 0) {
+        fprintf(stderr, "Error: Failed to write checkpoint %s\n", cw->path);
+        remove(cw->tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static void* checkpoint_writer_main(void *arg) {
+    checkpoint_writer_t *cw = arg;
+    trace_thread_name("checkpoint");
+
+    pthread_mutex_lock(&cw->lock);
+    for (;;) {
+        while (!cw->pending && !cw->stop) {
+            pthread_cond_wait(&cw->cond, &cw->lock);
+        }
+        if (!cw->pending) {
+            break;  // stop requested and nothing left to write
+        }
+
+        // The snapshot belongs to this thread until pending is cleared, so
+        // the file can be written without holding the lock
+        pthread_mutex_unlock(&cw->lock);
+        double start = trace_begin();
+        int result = checkpoint_write_file(cw);
+        trace_end("checkpoint write", start, NULL, 0);
+        pthread_mutex_lock(&cw->lock);
+
+        if (result == 0) {
+            cw->written++;
+        } else {
+            cw->failed++;
+        }
+        cw->pending = 0;
+    }
+    pthread_mutex_unlock(&cw->lock);
+    return NULL;
+}
+
+/**
+ * Creates a checkpoint writer and starts its background thread
+ * Inputs:
+ *  - path: checkpoint file to maintain (always holds the latest complete checkpoint)
+ *  - count: number of cells in the water field
+ * Output: the writer, or NULL on failure
+ */
+checkpoint_writer_t* checkpoint_writer_create(const char *path, size_t count) {
+    if (!path || count == 0) {
+        return NULL;
+    }
+
+    checkpoint_writer_t *cw = mem_calloc(MEM_ENCODE, 1, sizeof(checkpoint_writer_t));
+    if (!cw) {
+        return NULL;
+    }
+
+    size_t len = strlen(path);
+    cw->path = mem_alloc(MEM_ENCODE, len + 1);
+    cw->tmp_path = mem_alloc(MEM_ENCODE, len + 5);
+    cw->snapshot = mem_alloc(MEM_ENCODE, count * sizeof(double));
+    if (!cw->path || !cw->tmp_path || !cw->snapshot) {
+        mem_free(cw->path);
+        mem_free(cw->tmp_path);
+        mem_free(cw->snapshot);
+        mem_free(cw);
+        return NULL;
+    }
+    memcpy(cw->path, path, len + 1);
+    snprintf(cw->tmp_path, len + 5, "%s.tmp", path);
+    cw->count = count;
+
+    pthread_mutex_init(&cw->lock, NULL);
+    pthread_cond_init(&cw->cond, NULL);
+    if (pthread_create(&cw->thread, NULL, checkpoint_writer_main, cw) != 0) {
+        fprintf(stderr, "Error: Failed to start checkpoint writer thread\n");
+        pthread_mutex_destroy(&cw->lock);
+        pthread_cond_destroy(&cw->cond);
+        mem_free(cw->path);
+        mem_free(cw->tmp_path);
+        mem_free(cw->snapshot);
+        mem_free(cw);
+        return NULL;
+    }
+
+    return cw;
+}
+
+/**
+ * Snapshots the water field and run parameters for the writer thread.
+ * The copy is a single pass over the points; if the previous checkpoint is
+ * still being written the snapshot is skipped instead of stalling the caller.
+ * Inputs:
+ *  - cw: checkpoint writer
+ *  - pc: point cloud being simulated
+ *  - step: index of the last completed step
+ *  - iter: total steps of the run
+ *  - iwater: initial water amount of the run
+ * Returns: 1 if the snapshot was queued, 0 if it was skipped, -1 on invalid input
+ */
+int checkpoint_writer_submit(checkpoint_writer_t *cw, const pointcloud_t *pc,
+                             long step, long iter, double iwater) {
+    if (!cw || !pc || !pc->points.data || (size_t)pc->points.size != cw->count) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cw->lock);
+    int busy = cw->pending;
+    pthread_mutex_unlock(&cw->lock);
+
+    if (busy) {
+        cw->skipped++;
+        return 0;
+    }
+
+    const pcd_t *points = pc->points.data;
+    for (size_t i = 0; i < cw->count; i++) {
+        cw->snapshot[i] = points[i].wd;
+    }
+
+    checkpoint_header_t *h = &cw->header;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic));
+    h->version = CHECKPOINT_VERSION;
+    h->header_size = sizeof(checkpoint_header_t);
+    h->rows = pc->rows;
+    h->cols = pc->cols;
+    h->step = step;
+    h->iter = iter;
+    h->iwater = iwater;
+    h->water_coef = pc->water_coef;
+    h->evap_coef = pc->evap_coef;
+
+    pthread_mutex_lock(&cw->lock);
+    cw->pending = 1;
+    pthread_cond_signal(&cw->cond);
+    pthread_mutex_unlock(&cw->lock);
+
+    return 1;
+}
+
+/**
+ * Waits for any pending checkpoint to reach the disk, stops the writer thread
+ * and releases the writer
+ */
+void checkpoint_writer_free(checkpoint_writer_t *cw) {
+    if (!cw) {
+        return;
+    }
+
+    pthread_mutex_lock(&cw->lock);
+    cw->stop = 1;
+    pthread_cond_signal(&cw->cond);
+    pthread_mutex_unlock(&cw->lock);
+    pthread_join(cw->thread, NULL);
+
+    if (cw->skipped > 0) {
+        printf("Checkpoints: %d written, %d skipped while the writer was busy\n",
+               cw->written, cw->skipped);
+    }
+
+    pthread_mutex_destroy(&cw->lock);
+    pthread_cond_destroy(&cw->cond);
+    mem_free(cw->path);
+    mem_free(cw->tmp_path);
+    mem_free(cw->snapshot);
+    mem_free(cw);
+}
+
+/**
+ * Maps a checkpoint file read-only and validates its header and payload
+ * Input: path of the checkpoint file
+ * Output: the mapped checkpoint, or NULL if it is missing or invalid
+ */
+checkpoint_t* checkpoint_open(const char *path) {
+    if (!path) {
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open checkpoint %s\n", path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(checkpoint_header_t)) {
+        fprintf(stderr, "Error: Checkpoint %s is truncated\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map checkpoint %s\n", path);
+        return NULL;
+    }
+
+    const checkpoint_header_t *h = map;
+    size_t cells = (size_t)h->rows * (size_t)h->cols;
+    if (memcmp(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != CHECKPOINT_VERSION ||
+        h->header_size != sizeof(checkpoint_header_t) ||
+        h->rows <= 0 || h->cols <= 0 ||
+        (size_t)st.st_size != h->header_size + cells * sizeof(double)) {
+        fprintf(stderr, "Error: %s is not a valid checkpoint\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    const double *water = (const double *)((const char *)map + h->header_size);
+    if (checkpoint_hash(water, cells * sizeof(double)) != h->checksum) {
+        fprintf(stderr, "Error: Checkpoint %s failed its checksum\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    checkpoint_t *ck = mem_alloc(MEM_ENCODE, sizeof(checkpoint_t));
+    if (!ck) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    ck->header = h;
+    ck->water = water;
+    ck->map = map;
+    ck->map_size = st.st_size;
+    return ck;
+}
+
+/**
+ * Copies the checkpointed water field and coefficients into the point cloud
+ * Inputs:
+ *  - ck: mapped checkpoint
+ *  - pc: initialized point cloud with the same grid dimensions
+ * Returns: 0 on success, -1 if the checkpoint does not match the grid
+ */
+int checkpoint_restore(const checkpoint_t *ck, pointcloud_t *pc) {
+    if (!ck || !pc || !pc->points.data) {
+        return -1;
+    }
+
+    const checkpoint_header_t *h = ck->header;
+    if (h->rows != pc->rows || h->cols != pc->cols ||
+        (long)h->rows * h->cols != pc->points.size) {
+        fprintf(stderr, "Error: Checkpoint grid %d x %d does not match input grid %d x %d\n",
+                h->rows, h->cols, pc->rows, pc->cols);
+        return -1;
+    }
+
+    pcd_t *points = pc->points.data;
+    for (int i = 0; i < pc->points.size; i++) {
+        points[i].wd = ck->water[i];
+    }
+    update_watershed_coefficients(pc, h->water_coef, h->evap_coef);
+
+    return 0;
+}
+
+void checkpoint_close(checkpoint_t *ck) {
+    if (!ck) {
+        return;
+    }
+    munmap(ck->map, ck->map_size);
+    mem_free(ck);
+}
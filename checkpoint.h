@@ -0,0 +1,65 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "pointcloud.h"
+
+#define CHECKPOINT_MAGIC "TFCKPT01"
+#define CHECKPOINT_VERSION 1
+
+// On-disk header of a checkpoint file. It is written in native (little-endian)
+// byte order and is followed by rows * cols doubles holding the water depth of
+// every cell in row-major order.
+typedef struct {
+    char magic[8];          // CHECKPOINT_MAGIC, not NUL terminated
+    uint32_t version;       // CHECKPOINT_VERSION
+    uint32_t header_size;   // sizeof(checkpoint_header_t), offset of the payload
+    int32_t rows;           // grid rows the water field belongs to
+    int32_t cols;           // grid columns the water field belongs to
+    int64_t step;           // index of the last completed step
+    int64_t iter;           // total number of steps requested for the run
+    double iwater;          // initial water amount of the run
+    double water_coef;      // water flow coefficient
+    double evap_coef;       // evaporation coefficient
+    uint64_t checksum;      // FNV-1a hash of the water payload
+} checkpoint_header_t;
+
+// Background checkpoint writer. The step loop copies the water field into the
+// snapshot buffer and a dedicated thread writes it out, so the loop never waits
+// on the disk.
+typedef struct {
+    char *path;                 // final checkpoint path
+    char *tmp_path;             // file written first, then renamed over path
+    double *snapshot;           // water field handed over to the writer thread
+    size_t count;               // number of cells in the snapshot
+    checkpoint_header_t header; // header belonging to the snapshot
+    int pending;                // 1 while the writer owns the snapshot
+    int stop;                   // asks the writer thread to exit
+    int written;                // number of checkpoints written
+    int skipped;                // snapshots dropped because the writer was busy
+    int failed;                 // number of failed writes
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} checkpoint_writer_t;
+
+// Read-only view of a checkpoint file mapped into memory
+typedef struct {
+    const checkpoint_header_t *header;
+    const double *water;        // rows * cols water depths
+    void *map;                  // base of the mapping
+    size_t map_size;            // length of the mapping
+} checkpoint_t;
+
+checkpoint_writer_t* checkpoint_writer_create(const char *path, size_t count);
+int checkpoint_writer_submit(checkpoint_writer_t *cw, const pointcloud_t *pc,
+                             long step, long iter, double iwater);
+void checkpoint_writer_free(checkpoint_writer_t *cw);
+
+checkpoint_t* checkpoint_open(const char *path);
+int checkpoint_restore(const checkpoint_t *ck, pointcloud_t *pc);
+void checkpoint_close(checkpoint_t *ck);
+
+#endif // CHECKPOINT_H
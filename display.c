@@ -4,18 +4,17 @@
 
 int main() {
     // Read point cloud data from stdin
-    List* pointList = readPointCloudData(stdin);
-    if (pointList == NULL) {
+    pointcloud_t* pc = readPointCloudData(stdin);
+    if (pc == NULL) {
         printf("Error: Failed to read point cloud data\n");
         return 1;
     }
 
     // Create the image
-    imagePointCloud(pointList, "out.gif");
+    imagePointCloud(pc, "out.gif");
 
     // Clean up
-    free(pointList->data);
-    free(pointList);
+    pointcloud_free(pc);
 
     return 0;
 }
\ No newline at end of file
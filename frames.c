@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include "util.h"
+#include "prof.h"
+#include "trace.h"
+#include "mem.h"
+#include "frames.h"
+
+// Waits on a semaphore, retrying when a signal interrupts the wait
+static void frame_sem_wait(sem_t *sem) {
+    while (sem_wait(sem) != 0 && errno == EINTR) {
+    }
+}
+
+/**
+ * Pops a value the caller knows is in the queue. A pop can still come back
+ * empty while another thread is half way through its push, so it is retried.
+ */
+static void* frame_queue_take(mpmc_queue_t *q) {
+    void *value;
+    while (!mpmc_queue_pop(q, &value)) {
+        sched_yield();
+    }
+    return value;
+}
+
+// Y4M frame marker that precedes each frame's planes
+#define FRAME_Y4M_MARKER "FRAME\n"
+
+// Grows a slot's output buffer, which is charged to the encoders
+static void* frame_out_grow(void *data, size_t size) {
+    return mem_realloc(MEM_ENCODE, data, size);
+}
+
+// Renders a slot's snapshot and encodes it as a GIF or a Y4M frame; animation
+// frames are encoded when they are appended
+static void frame_encode(frame_writer_t *fw, frame_slot_t *slot) {
+    const render_ctx_t *rc = fw->rc;
+    // One thread per frame; the encoder pool already runs frames in parallel
+    slot->ok = render_compose(rc, slot->wd, sizeof(double), fw->maxwd, slot->indices, 1);
+
+    prof_mark_t start;
+    prof_begin(&start);
+    slot->out.len = 0;
+    if (!slot->ok) {
+        return;
+    }
+    if (fw->output == FRAME_FILES) {
+        slot->ok = bm_write_gif_indexed(bm_mem_write, &slot->out, rc->width, rc->height,
+                                        slot->indices, rc->palette, 256, -1);
+    } else if (fw->output == FRAME_Y4M) {
+        // The same slot buffer is reused for every frame
+        size_t marker = strlen(FRAME_Y4M_MARKER);
+        size_t len = marker + render_yuv_size(rc);
+        if (slot->out.cap < len) {
+            mem_free(slot->out.data);
+            slot->out.data = mem_alloc(MEM_ENCODE, len);
+            slot->out.cap = slot->out.data ? len : 0;
+        }
+        slot->ok = slot->out.data && render_yuv420(rc, slot->indices, slot->out.data + marker);
+        if (slot->ok) {
+            memcpy(slot->out.data, FRAME_Y4M_MARKER, marker);
+            slot->out.len = len;
+        }
+    }
+    if (fw->output != FRAME_ANIMATION && slot->ok) {
+        prof_end(PROF_ENCODE, &start, slot->out.len);
+    }
+}
+
+/**
+ * Waits until every earlier frame has been written, then writes this one.
+ * Only the thread whose turn it is gets past the wait, so the file output and
+ * the animation need no further locking.
+ */
+static void frame_commit(frame_writer_t *fw, frame_slot_t *slot) {
+    double wait = trace_begin();
+    pthread_mutex_lock(&fw->lock);
+    while (slot->seq != fw->next_write) {
+        pthread_cond_wait(&fw->turn, &fw->lock);
+    }
+    pthread_mutex_unlock(&fw->lock);
+    trace_end("frame turn wait", wait, "frame", slot->seq);
+    double write = trace_begin();
+
+    int ok = slot->ok;
+    if (fw->output == FRAME_ANIMATION) {
+        // The animation writes straight to its file, so only its time is known
+        prof_mark_t start;
+        prof_begin(&start);
+        ok = ok && render_anim_frame(fw->rc, slot->indices);
+        if (ok) {
+            prof_end(PROF_ENCODE, &start, 0);
+        }
+    } else if (fw->output == FRAME_Y4M) {
+        ok = ok && fwrite(slot->out.data, 1, slot->out.len, fw->stream) == slot->out.len;
+    } else if (ok) {
+        FILE *f = fopen(slot->filename, "wb");
+        ok = f && fwrite(slot->out.data, 1, slot->out.len, f) == slot->out.len;
+        if (f && fclose(f) != 0) {
+            ok = 0;
+        }
+        if (ok) {
+            printf("Generated: %s\n", slot->filename);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Failed to write frame %s\n",
+                fw->output == FRAME_ANIMATION ? "to the animation" :
+                fw->output == FRAME_Y4M ? "to the video stream" : slot->filename);
+    }
+
+    trace_end("frame write", write, "frame", slot->seq);
+
+    pthread_mutex_lock(&fw->lock);
+    fw->next_write++;
+    if (ok) {
+        fw->written++;
+    } else {
+        fw->failed++;
+    }
+    pthread_cond_broadcast(&fw->turn);
+    pthread_mutex_unlock(&fw->lock);
+}
+
+static void* frame_encoder_main(void *arg) {
+    frame_writer_t *fw = arg;
+    trace_thread_name("encoder");
+
+    for (;;) {
+        frame_sem_wait(&fw->job_count);
+        frame_slot_t *slot = frame_queue_take(&fw->jobs);
+        if (!slot) {
+            break;  // every frame queued before the stop has been taken
+        }
+
+        double start = trace_begin();
+        frame_encode(fw, slot);
+        trace_end("frame encode", start, "frame", slot->seq);
+        frame_commit(fw, slot);
+
+        mpmc_queue_push(&fw->free_slots, slot);
+        sem_post(&fw->free_count);
+    }
+    return NULL;
+}
+
+// Frees the slots and queues; the threads must not be running
+static void frame_writer_release(frame_writer_t *fw) {
+    for (int i = 0; fw->slots && i < fw->nslots; i++) {
+        mem_free(fw->slots[i].wd);
+        mem_free(fw->slots[i].indices);
+        mem_free(fw->slots[i].out.data);
+    }
+    mem_free(fw->slots);
+    mem_free(fw->threads);
+    mpmc_queue_destroy(&fw->free_slots);
+    mpmc_queue_destroy(&fw->jobs);
+    mem_free(fw);
+}
+
+/**
+ * Creates a frame writer and starts its encoder threads
+ * Inputs:
+ *  - rc: render context of the grid; it must outlive the writer and, for
+ *    FRAME_ANIMATION, already have its animation open
+ *  - count: number of cells in the water field
+ *  - maxwd: depth drawn as full blue
+ *  - output: FRAME_FILES for a GIF per frame, FRAME_ANIMATION to append to rc's
+ *    animation, or FRAME_Y4M to write a video stream, whose header goes out first
+ *  - stream: destination of the Y4M stream, NULL for the other outputs
+ *  - nthreads: number of encoder threads, 0 for defaultThreadCount()
+ * Output: the writer, or NULL on failure
+ */
+frame_writer_t* frame_writer_create(render_ctx_t *rc, size_t count, double maxwd,
+                                    frame_output_t output, FILE *stream, int nthreads) {
+    if (!rc || count == 0 || nthreads < 0 || (output == FRAME_ANIMATION && !rc->anim) ||
+        (output == FRAME_Y4M && !stream)) {
+        fprintf(stderr, "Invalid parameters passed to frame_writer_create\n");
+        return NULL;
+    }
+    if (nthreads == 0) {
+        nthreads = defaultThreadCount();
+    }
+
+    // The queues keep their positions on separate cache lines, which takes
+    // more alignment than malloc gives
+    frame_writer_t *fw = mem_alloc_aligned(MEM_ENCODE, _Alignof(frame_writer_t), sizeof(frame_writer_t));
+    if (!fw) {
+        return NULL;
+    }
+    memset(fw, 0, sizeof(frame_writer_t));
+    fw->rc = rc;
+    fw->count = count;
+    fw->maxwd = maxwd;
+    fw->output = output;
+    fw->stream = stream;
+    fw->nthreads = nthreads;
+    // Two frames per encoder keep every thread busy while the step loop
+    // fills the next snapshot
+    fw->nslots = 2 * nthreads;
+
+    size_t pixels = (size_t)rc->width * rc->height;
+    fw->slots = mem_calloc(MEM_ENCODE, fw->nslots, sizeof(frame_slot_t));
+    fw->threads = mem_calloc(MEM_ENCODE, nthreads, sizeof(pthread_t));
+    int ok = fw->slots && fw->threads &&
+             mpmc_queue_init(&fw->free_slots, fw->nslots) &&
+             mpmc_queue_init(&fw->jobs, fw->nslots + nthreads);
+    for (int i = 0; ok && i < fw->nslots; i++) {
+        frame_slot_t *slot = &fw->slots[i];
+        slot->wd = mem_alloc(MEM_ENCODE, count * sizeof(double));
+        slot->indices = mem_alloc(MEM_ENCODE, pixels);
+        slot->out.grow = frame_out_grow;
+        ok = slot->wd && slot->indices;
+        if (ok) {
+            // Pixels no point maps to are never composited
+            memset(slot->indices, RENDER_EMPTY, pixels);
+            mpmc_queue_push(&fw->free_slots, slot);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to allocate frame writer\n");
+        frame_writer_release(fw);
+        return NULL;
+    }
+
+    if (output == FRAME_Y4M && !render_y4m_header(rc, stream)) {
+        fprintf(stderr, "Error: Failed to write the video stream header\n");
+        frame_writer_release(fw);
+        return NULL;
+    }
+
+    sem_init(&fw->free_count, 0, fw->nslots);
+    sem_init(&fw->job_count, 0, 0);
+    pthread_mutex_init(&fw->lock, NULL);
+    pthread_cond_init(&fw->turn, NULL);
+
+    int started = 0;
+    while (started < nthreads &&
+           pthread_create(&fw->threads[started], NULL, frame_encoder_main, fw) == 0) {
+        started++;
+    }
+    if (started < nthreads) {
+        fprintf(stderr, "Error: Failed to start frame encoder threads\n");
+        fw->nthreads = started;
+        frame_writer_free(fw);
+        return NULL;
+    }
+
+    return fw;
+}
+
+/**
+ * Snapshots the water field and queues it as the next frame. Waits for an
+ * encoder to finish a frame when all slots are in use.
+ * Inputs:
+ *  - fw: frame writer
+ *  - wd: water depth of every cell, fw->count values
+ *  - filename: output file of the frame, only used for FRAME_FILES
+ * Returns: 1 if the frame was queued, -1 on invalid input
+ */
+int frame_writer_submit(frame_writer_t *fw, const double *wd, const char *filename) {
+    if (!fw || !wd || (fw->output == FRAME_FILES && !filename)) {
+        return -1;
+    }
+
+    if (sem_trywait(&fw->free_count) != 0) {
+        // Every slot is busy; the steps stall until an encoder frees one
+        fw->stalls++;
+        double wait = trace_begin();
+        frame_sem_wait(&fw->free_count);
+        trace_end("frame slot wait", wait, "frame", (long)fw->submitted);
+    }
+    frame_slot_t *slot = frame_queue_take(&fw->free_slots);
+
+    memcpy(slot->wd, wd, fw->count * sizeof(double));
+    snprintf(slot->filename, sizeof(slot->filename), "%s", filename ? filename : "");
+    slot->seq = fw->submitted++;
+
+    // jobs holds every slot plus the stop markers, so it cannot be full
+    mpmc_queue_push(&fw->jobs, slot);
+    sem_post(&fw->job_count);
+    return 1;
+}
+
+/**
+ * Waits for every queued frame to be written, stops the encoder threads and
+ * releases the writer
+ */
+void frame_writer_free(frame_writer_t *fw) {
+    if (!fw) {
+        return;
+    }
+
+    // One stop marker per thread, queued behind the remaining frames
+    for (int i = 0; i < fw->nthreads; i++) {
+        mpmc_queue_push(&fw->jobs, NULL);
+        sem_post(&fw->job_count);
+    }
+    for (int i = 0; i < fw->nthreads; i++) {
+        pthread_join(fw->threads[i], NULL);
+    }
+
+    if (fw->output == FRAME_Y4M && fflush(fw->stream) != 0) {
+        fprintf(stderr, "Error: Failed to write the video stream\n");
+    }
+    if (fw->stalls > 0 || fw->failed > 0) {
+        printf("Frames: %d written, %d failed, the step loop waited for an encoder %d times\n",
+               fw->written, fw->failed, fw->stalls);
+    }
+
+    sem_destroy(&fw->free_count);
+    sem_destroy(&fw->job_count);
+    pthread_mutex_destroy(&fw->lock);
+    pthread_cond_destroy(&fw->turn);
+    frame_writer_release(fw);
+}
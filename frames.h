@@ -0,0 +1,62 @@
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "render.h"
+#include "queue.h"
+
+// Where a frame writer sends the frames
+typedef enum {
+    FRAME_FILES,            // one GIF file per frame
+    FRAME_ANIMATION,        // appended to the render context's open animation
+    FRAME_Y4M,              // raw YUV 4:2:0 frames on a YUV4MPEG2 stream
+} frame_output_t;
+
+// One output frame in flight: the water snapshot it is made from and the
+// rendered and encoded results
+typedef struct {
+    long seq;               // submission order; frames are written in this order
+    char filename[256];     // output file, only used for FRAME_FILES
+    double *wd;             // water depth of every cell at the time of the snapshot
+    uint8_t *indices;       // composited frame
+    BmMemSink out;          // encoded GIF, or the Y4M frame
+    int ok;                 // 0 if encoding failed
+} frame_slot_t;
+
+// Asynchronous frame writer. The step loop copies the water field into a free
+// slot and queues it; a pool of encoder threads renders and compresses the
+// queued frames in parallel and writes them out in submission order. When all
+// slots are in use the step loop waits for one, which bounds the memory used.
+typedef struct {
+    render_ctx_t *rc;           // projection and palette shared by all frames
+    size_t count;               // number of cells in a snapshot
+    double maxwd;               // depth drawn as full blue
+    frame_output_t output;      // where the frames go
+    FILE *stream;               // Y4M stream, only used for FRAME_Y4M
+    int nthreads;               // encoder threads
+    int nslots;                 // frames that can be in flight
+    frame_slot_t *slots;
+    mpmc_queue_t free_slots;    // slots the step loop can fill
+    mpmc_queue_t jobs;          // filled slots waiting for an encoder, NULL stops one
+    sem_t free_count;           // number of slots in free_slots
+    sem_t job_count;            // number of entries in jobs
+    long submitted;             // frames queued so far
+    long next_write;            // seq of the next frame to write, guarded by lock
+    int written;                // frames written, guarded by lock
+    int failed;                 // frames that could not be encoded or written, guarded by lock
+    int stalls;                 // submissions that had to wait for a free slot
+    pthread_mutex_t lock;
+    pthread_cond_t turn;        // signalled whenever next_write advances
+    pthread_t *threads;
+} frame_writer_t;
+
+frame_writer_t* frame_writer_create(render_ctx_t *rc, size_t count, double maxwd,
+                                    frame_output_t output, FILE *stream, int nthreads);
+int frame_writer_submit(frame_writer_t *fw, const double *wd, const char *filename);
+void frame_writer_free(frame_writer_t *fw);
+
+#endif // FRAMES_H
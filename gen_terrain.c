@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "synth.h"
+#include "raster.h"
+#include "prof.h"
+
+void print_usage() {
+    printf("Usage: ./gen_terrain [options] <ofile>\n");
+    printf("  ofile          - Output file; .f32 or .f64 writes a raster with an ENVI header, anything else text\n");
+    printf("Options:\n");
+    printf("  --size N       - Grid edge length in cells (default 1000)\n");
+    printf("  --seed S       - Seed of the noise and of the feature placement (default 1)\n");
+    printf("  --octaves K    - Noise octaves (default 6)\n");
+    printf("  --wavelength W - Wavelength of the first octave in cells (default size / 4)\n");
+    printf("  --base H       - Mean height (default 300)\n");
+    printf("  --relief H     - Largest departure of the noise from the mean height (default 50)\n");
+    printf("  --basins N     - Number of basins (default 8)\n");
+    printf("  --plateaus N   - Number of plateaus (default 4)\n");
+    printf("  --holes N      - Number of NODATA holes (default 0)\n");
+    printf("  --cell SIZE    - Cell edge length in map units (default 1)\n");
+    printf("  --origin X Y   - Map position of the north-west cell (default 445000.5 4650999.5)\n");
+    printf("  --format FMT   - 'text', 'f32' or 'f64' regardless of the file name\n");
+    printf("  --threads N    - Worker threads (default TERRAFLOW_THREADS or the processor count)\n");
+}
+
+int main(int argc, char *argv[]) {
+    synth_options_t opts;
+    synth_defaults(&opts);
+    const char *ofile = NULL, *format = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        int has_value = i + 1 < argc;
+        if (strcmp(arg, "--size") == 0 && has_value) {
+            opts.size = atoi(argv[++i]);
+        } else if (strcmp(arg, "--seed") == 0 && has_value) {
+            opts.seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(arg, "--octaves") == 0 && has_value) {
+            opts.octaves = atoi(argv[++i]);
+        } else if (strcmp(arg, "--wavelength") == 0 && has_value) {
+            opts.wavelength = atof(argv[++i]);
+        } else if (strcmp(arg, "--base") == 0 && has_value) {
+            opts.base = atof(argv[++i]);
+        } else if (strcmp(arg, "--relief") == 0 && has_value) {
+            opts.relief = atof(argv[++i]);
+        } else if (strcmp(arg, "--basins") == 0 && has_value) {
+            opts.basins = atoi(argv[++i]);
+        } else if (strcmp(arg, "--plateaus") == 0 && has_value) {
+            opts.plateaus = atoi(argv[++i]);
+        } else if (strcmp(arg, "--holes") == 0 && has_value) {
+            opts.holes = atoi(argv[++i]);
+        } else if (strcmp(arg, "--cell") == 0 && has_value) {
+            opts.cell = atof(argv[++i]);
+        } else if (strcmp(arg, "--origin") == 0 && i + 2 < argc) {
+            opts.x0 = atof(argv[++i]);
+            opts.y0 = atof(argv[++i]);
+        } else if (strcmp(arg, "--format") == 0 && has_value) {
+            format = argv[++i];
+        } else if (strcmp(arg, "--threads") == 0 && has_value) {
+            opts.nthreads = atoi(argv[++i]);
+        } else if (arg[0] != '-' && !ofile) {
+            ofile = arg;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (!ofile) {
+        print_usage();
+        return 1;
+    }
+
+    // The format follows the file name unless given
+    if (!format) {
+        const char *ext = strrchr(ofile, '.');
+        format = ext && (strcmp(ext, ".f32") == 0 || strcmp(ext, ".f64") == 0) ? ext + 1 : "text";
+    }
+    raster_type_t type;
+    if (strcmp(format, "text") == 0) {
+        type = 0;
+    } else if (strcmp(format, "f32") == 0) {
+        type = RASTER_FLOAT32;
+    } else if (strcmp(format, "f64") == 0) {
+        type = RASTER_FLOAT64;
+    } else {
+        printf("Error: Unknown format '%s'\n", format);
+        return 1;
+    }
+
+    double start = prof_now();
+    if (synth_write(&opts, ofile, type) != 0) {
+        return 1;
+    }
+    double seconds = prof_now() - start;
+    double cells = (double)opts.size * opts.size;
+    printf("Wrote %s: %d x %d cells, seed %llu, in %.2f s (%.1f Mcells/s)\n", ofile,
+           opts.size, opts.size, (unsigned long long)opts.seed, seconds, cells / seconds / 1e6);
+    return 0;
+}
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include "gridding.h"
+#include "trace.h"
+#include "mem.h"
+
+// Samples a hole needs before inverse distance weighting stops widening its search
+#define GRID_IDW_SAMPLES 4
+
+typedef struct {
+    int rows, cols;
+    const double *sum;      // binned heights, averaged in place
+    const int *count;       // points per cell, 0 for holes
+    long binned;            // cells with at least one point
+    double *out;            // dense output heights
+    grid_fill_t fill;
+} fill_job_t;
+
+/**
+ * Estimates a value for one empty cell from the binned cells around it. The
+ * search walks square rings outwards; once a sample is found it keeps going
+ * until every cell within the Euclidean distance of interest has been seen,
+ * and IDW ignores samples beyond that distance, so the result does not depend
+ * on the ring shape. The search stops early once every binned cell has been seen.
+ */
+static double fill_cell(const fill_job_t *job, int row, int col) {
+    int max_ring = job->rows > job->cols ? job->rows : job->cols;
+    double best_d2 = DBL_MAX, best_z = 0.0;
+    double wsum = 0.0, zsum = 0.0, radius2 = DBL_MAX;
+    int samples = 0, limit = max_ring;
+    long seen = 0;
+
+    for (int k = 1; k <= limit && k <= max_ring && seen < job->binned; k++) {
+        for (int dr = -k; dr <= k; dr++) {
+            int r = row + dr;
+            if (r < 0 || r >= job->rows) {
+                continue;
+            }
+            // Full rows at the top and bottom of the ring, only the ends in between
+            int step = (dr == -k || dr == k) ? 1 : 2 * k;
+            for (int dc = -k; dc <= k; dc += step) {
+                int c = col + dc;
+                if (c < 0 || c >= job->cols) {
+                    continue;
+                }
+                int i = r * job->cols + c;
+                if (!job->count[i]) {
+                    continue;
+                }
+                seen++;
+                double d2 = (double)dr * dr + (double)dc * dc;
+                if (d2 > radius2) {
+                    continue;
+                }
+                if (d2 < best_d2) {
+                    best_d2 = d2;
+                    best_z = job->sum[i];
+                }
+                wsum += 1.0 / d2;
+                zsum += job->sum[i] / d2;
+                samples++;
+            }
+        }
+
+        if (limit == max_ring) {
+            // Nearest: rings up to the best distance may still hold a closer sample.
+            // IDW: wait for enough samples, then cover the circle through the last ring.
+            if (job->fill == GRID_FILL_NEAREST && samples > 0) {
+                limit = (int)ceil(sqrt(best_d2));
+            } else if (job->fill == GRID_FILL_IDW && samples >= GRID_IDW_SAMPLES) {
+                radius2 = 2.0 * k * k;
+                limit = (int)ceil(k * M_SQRT2);
+            }
+        }
+    }
+
+    if (job->fill == GRID_FILL_NEAREST || wsum == 0.0) {
+        return best_z;
+    }
+    return zsum / wsum;
+}
+
+static void fill_rows(void *arg, int thread, int nthreads) {
+    fill_job_t *job = arg;
+    double start = trace_begin();
+
+    // Rows are interleaved across threads because holes tend to cluster
+    for (int row = thread; row < job->rows; row += nthreads) {
+        for (int col = 0; col < job->cols; col++) {
+            int i = row * job->cols + col;
+            job->out[i] = job->count[i] ? job->sum[i] : fill_cell(job, row, col);
+        }
+    }
+    trace_end("grid fill", start, "thread", thread);
+}
+
+/**
+ * Bins scattered points into a regular grid and fills the empty cells, or
+ * marks them NODATA in the validity mask with GRID_FILL_NONE
+ * Inputs:
+ *  - xyz: count points as consecutive x, y, z triples
+ *  - count: number of points
+ *  - opts: cell size, fill method and thread count
+ * Output: dense point cloud with rows running south to north, or NULL on failure
+ */
+pointcloud_t* gridPoints(const double *xyz, long count, const gridding_options_t *opts) {
+    if (!xyz || count <= 0 || !opts) {
+        fprintf(stderr, "Invalid parameters passed to gridPoints\n");
+        return NULL;
+    }
+
+    double min_x = DBL_MAX, max_x = -DBL_MAX, min_y = DBL_MAX, max_y = -DBL_MAX;
+    for (long i = 0; i < count; i++) {
+        const double *p = xyz + 3 * i;
+        if (p[0] < min_x) min_x = p[0];
+        if (p[0] > max_x) max_x = p[0];
+        if (p[1] < min_y) min_y = p[1];
+        if (p[1] > max_y) max_y = p[1];
+    }
+
+    // Without a cell size, use the mean spacing of points spread over the bounding box
+    double cell = opts->cell_size;
+    if (cell <= 0) {
+        double area = (max_x - min_x) * (max_y - min_y);
+        cell = area > 0 ? sqrt(area / count) : 1.0;
+    }
+
+    // Cell centres sit on min + k * cell, so points of a complete grid land one per cell
+    long cols = (long)floor((max_x - min_x) / cell + 0.5) + 1;
+    long rows = (long)floor((max_y - min_y) / cell + 0.5) + 1;
+    if (rows * cols > 0x7FFFFFFFL / (long)sizeof(pcd_t)) {
+        fprintf(stderr, "Error: Grid of %ld x %ld cells is too large, use a bigger cell size\n",
+                rows, cols);
+        return NULL;
+    }
+    size_t n = (size_t)rows * cols;
+
+    double *sum = mem_calloc(MEM_GRID, n, sizeof(double));
+    int *cnt = mem_calloc(MEM_GRID, n, sizeof(int));
+    double *heights = mem_alloc(MEM_GRID, n * sizeof(double));
+    pointcloud_t *pc = mem_calloc(MEM_GRID, 1, sizeof(pointcloud_t));
+    pcd_t *points = mem_alloc(MEM_GRID, n * sizeof(pcd_t));
+    if (!sum || !cnt || !heights || !pc || !points) {
+        fprintf(stderr, "Error: Failed to allocate %zu grid cells\n", n);
+        mem_free(sum);
+        mem_free(cnt);
+        mem_free(heights);
+        mem_free(pc);
+        mem_free(points);
+        return NULL;
+    }
+
+    // Single pass over the points; duplicates in a cell are averaged
+    for (long i = 0; i < count; i++) {
+        const double *p = xyz + 3 * i;
+        long col = (long)floor((p[0] - min_x) / cell + 0.5);
+        long row = (long)floor((p[1] - min_y) / cell + 0.5);
+        size_t c = (size_t)row * cols + col;
+        sum[c] += p[2];
+        cnt[c]++;
+    }
+
+    long filled = 0, duplicates = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (cnt[i] > 1) {
+            duplicates += cnt[i] - 1;
+            sum[i] /= cnt[i];
+        } else if (cnt[i] == 0) {
+            filled++;
+        }
+    }
+
+    fill_job_t job = {
+        .rows = (int)rows, .cols = (int)cols,
+        .sum = sum, .count = cnt, .binned = (long)n - filled, .out = heights, .fill = opts->fill
+    };
+    int nthreads = opts->nthreads > 0 ? opts->nthreads : defaultThreadCount();
+    if (filled > 0 && opts->fill == GRID_FILL_NONE) {
+        pc->valid = pointcloud_mask_alloc(n);
+        if (!pc->valid) {
+            fprintf(stderr, "Error: Failed to allocate validity mask\n");
+            mem_free(sum);
+            mem_free(cnt);
+            mem_free(heights);
+            mem_free(pc);
+            mem_free(points);
+            return NULL;
+        }
+        for (size_t i = 0; i < n; i++) {
+            heights[i] = cnt[i] ? sum[i] : POINTCLOUD_NODATA;
+            if (!cnt[i]) {
+                pc->valid[i >> 6] &= ~(1ULL << (i & 63));
+            }
+        }
+    } else if (filled > 0) {
+        parallelRun(nthreads > rows ? (int)rows : nthreads, fill_rows, &job);
+    } else {
+        memcpy(heights, sum, n * sizeof(double));
+    }
+
+    // Build the dense point cloud
+    pc->water_coef = 0.1;
+    pc->evap_coef = 0.95;
+    pc->rows = (int)rows;
+    pc->cols = (int)cols;
+    pc->points.data = points;
+    pc->points.size = (int)n;
+    pc->points.max_size = (int)n;
+    pc->points.max_element_size = sizeof(pcd_t);
+
+    pc->stats.min_height = DBL_MAX;
+    pc->stats.max_height = -DBL_MAX;
+    double height_sum = 0;
+    for (long row = 0; row < rows; row++) {
+        for (long col = 0; col < cols; col++) {
+            size_t i = (size_t)row * cols + col;
+            double z = heights[i];
+            pcd_t point = {
+                .x = min_x + col * cell, .y = min_y + row * cell, .z = z,
+                .wd = 0.0,
+                .north = NULL, .south = NULL,
+                .east = NULL, .west = NULL
+            };
+            points[i] = point;
+
+            if (!POINTCLOUD_VALID(pc->valid, i)) {
+                continue;
+            }
+            if (z < pc->stats.min_height) pc->stats.min_height = z;
+            if (z > pc->stats.max_height) pc->stats.max_height = z;
+            height_sum += z;
+        }
+    }
+    pc->stats.avg_height = height_sum / (n - (pc->valid ? filled : 0));
+    pc->stats.min_x = min_x;
+    pc->stats.max_x = min_x + (cols - 1) * cell;
+    pc->stats.min_y = min_y;
+    pc->stats.max_y = min_y + (rows - 1) * cell;
+
+    printf("Grid Analysis:\n");
+    printf("Total points: %ld\n", count);
+    printf("Gridded dimensions: %ld rows x %ld columns (cell size %.2f)\n", rows, cols, cell);
+    printf("Duplicate points averaged: %ld\n", duplicates);
+    if (opts->fill == GRID_FILL_NONE) {
+        printf("Empty cells left as NODATA: %ld\n", filled);
+    } else {
+        printf("Empty cells filled (%s): %ld\n",
+               opts->fill == GRID_FILL_NEAREST ? "nearest" : "idw", filled);
+    }
+
+    mem_free(sum);
+    mem_free(cnt);
+    mem_free(heights);
+    return pc;
+}
+
+/**
+ * Reads scattered points in the usual input format (a count line followed by
+ * x y z lines) and grids them. Unlike readPointCloudData the points may come
+ * in any order, have gaps or share cells.
+ * Output: dense point cloud, or NULL if there's an error
+ */
+pointcloud_t* readPointCloudGridded(FILE *stream, const gridding_options_t *opts) {
+    if (stream == NULL) {
+        fprintf(stderr, "Error: NULL stream provided\n");
+        return NULL;
+    }
+
+    // The count is only a capacity hint; scattered files may not honour it
+    long capacity;
+    if (fscanf(stream, "%ld", &capacity) != 1) {
+        fprintf(stderr, "Error: Could not read number of points\n");
+        return NULL;
+    }
+    if (capacity < 16) {
+        capacity = 16;
+    }
+
+    double *xyz = mem_alloc(MEM_GRID, capacity * 3 * sizeof(double));
+    if (!xyz) {
+        fprintf(stderr, "Error: Failed to allocate point buffer\n");
+        return NULL;
+    }
+
+    long count = 0;
+    double x, y, z;
+    while (fscanf(stream, "%lf %lf %lf", &x, &y, &z) == 3) {
+        if (count == capacity) {
+            double *tmp = mem_realloc(MEM_GRID, xyz, capacity * 2 * 3 * sizeof(double));
+            if (!tmp) {
+                fprintf(stderr, "Error: Failed to grow point buffer\n");
+                mem_free(xyz);
+                return NULL;
+            }
+            xyz = tmp;
+            capacity *= 2;
+        }
+        xyz[3 * count] = x;
+        xyz[3 * count + 1] = y;
+        xyz[3 * count + 2] = z;
+        count++;
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "Error: No points found in the input\n");
+        mem_free(xyz);
+        return NULL;
+    }
+
+    pointcloud_t *pc = gridPoints(xyz, count, opts);
+    mem_free(xyz);
+    return pc;
+}
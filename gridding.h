@@ -0,0 +1,23 @@
+#ifndef GRIDDING_H
+#define GRIDDING_H
+
+#include <stdio.h>
+#include "pointcloud.h"
+
+// How cells that received no point are filled
+typedef enum {
+    GRID_FILL_IDW,      // inverse distance weighting of the nearest samples
+    GRID_FILL_NEAREST,  // height of the nearest sample
+    GRID_FILL_NONE      // leave the cell as NODATA
+} grid_fill_t;
+
+typedef struct {
+    double cell_size;   // cell edge length in input units, <= 0 picks the mean point spacing
+    grid_fill_t fill;   // hole filling method
+    int nthreads;       // worker threads for hole filling, 0 for the default
+} gridding_options_t;
+
+pointcloud_t* readPointCloudGridded(FILE *stream, const gridding_options_t *opts);
+pointcloud_t* gridPoints(const double *xyz, long count, const gridding_options_t *opts);
+
+#endif // GRIDDING_H
@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "mem.h"
+
+// Sits in front of every block; the union keeps the block as aligned as malloc's
+typedef union {
+    struct {
+        size_t size;
+        size_t align;       // alignment asked of mem_alloc_aligned, 0 for the other wrappers
+        mem_tag_t tag;
+    } h;
+    max_align_t align;
+} mem_header_t;
+
+// Counters of one subsystem, and of all of them together
+typedef struct {
+    atomic_size_t current;
+    atomic_size_t peak;
+    atomic_uint_fast64_t allocs;
+    atomic_uint_fast64_t reallocs;
+    atomic_uint_fast64_t frees;
+} mem_counters_t;
+
+static const char *const mem_names[MEM_TAGS] = {"ingest", "grid", "sim", "render", "encode", "analysis"};
+
+static mem_counters_t mem_counters[MEM_TAGS];
+static mem_counters_t mem_all;
+
+// Raises a peak to at least value
+static void mem_raise_peak(atomic_size_t *peak, size_t value) {
+    size_t seen = atomic_load_explicit(peak, memory_order_relaxed);
+    while (seen < value &&
+           !atomic_compare_exchange_weak_explicit(peak, &seen, value,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Adds size bytes to a subsystem and to the total
+static void mem_credit(mem_tag_t tag, size_t size) {
+    mem_counters_t *c[2] = {&mem_counters[tag], &mem_all};
+    for (int i = 0; i < 2; i++) {
+        size_t now = atomic_fetch_add_explicit(&c[i]->current, size, memory_order_relaxed) + size;
+        mem_raise_peak(&c[i]->peak, now);
+    }
+}
+
+// Takes size bytes from a subsystem and from the total
+static void mem_debit(mem_tag_t tag, size_t size) {
+    atomic_fetch_sub_explicit(&mem_counters[tag].current, size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&mem_all.current, size, memory_order_relaxed);
+}
+
+static void mem_count(atomic_uint_fast64_t *subsystem, atomic_uint_fast64_t *all) {
+    atomic_fetch_add_explicit(subsystem, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(all, 1, memory_order_relaxed);
+}
+
+static mem_header_t* mem_header(const void *block) {
+    return (mem_header_t *)block - 1;
+}
+
+/**
+ * Allocates size bytes charged to a subsystem
+ * Inputs:
+ *  - tag: the subsystem
+ *  - size: bytes wanted
+ * Returns: the block, or NULL if allocation fails
+ */
+void* mem_alloc(mem_tag_t tag, size_t size) {
+    if (size > SIZE_MAX - sizeof(mem_header_t)) {
+        return NULL;
+    }
+    mem_header_t *h = malloc(sizeof(mem_header_t) + size);
+    if (!h) {
+        return NULL;
+    }
+    h->h.size = size;
+    h->h.align = 0;
+    h->h.tag = tag;
+    mem_credit(tag, size);
+    mem_count(&mem_counters[tag].allocs, &mem_all.allocs);
+    return h + 1;
+}
+
+/**
+ * Allocates size bytes charged to a subsystem, aligned beyond what malloc
+ * guarantees, for structures with _Alignas members. The header sits in the
+ * padding in front of the block.
+ * Inputs:
+ *  - tag: the subsystem
+ *  - align: a power of two
+ *  - size: bytes wanted
+ * Returns: the block, or NULL if allocation fails
+ */
+void* mem_alloc_aligned(mem_tag_t tag, size_t align, size_t size) {
+    if (align <= sizeof(mem_header_t)) {
+        return mem_alloc(tag, size);
+    }
+    void *base;
+    if ((align & (align - 1)) != 0 || size > SIZE_MAX - align ||
+        posix_memalign(&base, align, align + size) != 0) {
+        return NULL;
+    }
+    mem_header_t *h = (mem_header_t *)((char *)base + align) - 1;
+    h->h.size = size;
+    h->h.align = align;
+    h->h.tag = tag;
+    mem_credit(tag, size);
+    mem_count(&mem_counters[tag].allocs, &mem_all.allocs);
+    return h + 1;
+}
+
+// Start of the allocation a block lives in
+static void* mem_base(mem_header_t *h) {
+    return h->h.align ? (char *)(h + 1) - h->h.align : (void *)h;
+}
+
+// Allocates count zeroed elements of size bytes charged to a subsystem
+void* mem_calloc(mem_tag_t tag, size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *block = mem_alloc(tag, count * size);
+    if (block) {
+        memset(block, 0, count * size);
+    }
+    return block;
+}
+
+/**
+ * Resizes a block. The block stays charged to the subsystem it was allocated
+ * for; tag is only used when block is NULL.
+ * Returns: the resized block, or NULL with the block untouched if allocation fails
+ */
+void* mem_realloc(mem_tag_t tag, void *block, size_t size) {
+    if (!block) {
+        return mem_alloc(tag, size);
+    }
+    if (size > SIZE_MAX - sizeof(mem_header_t)) {
+        return NULL;
+    }
+    mem_header_t *h = mem_header(block);
+    size_t old = h->h.size;
+    tag = h->h.tag;
+    if (h->h.align) {
+        // realloc does not keep the alignment, so the block moves
+        void *moved = mem_alloc_aligned(tag, h->h.align, size);
+        if (!moved) {
+            return NULL;
+        }
+        memcpy(moved, block, old < size ? old : size);
+        mem_free(block);
+        return moved;
+    }
+    h = realloc(h, sizeof(mem_header_t) + size);
+    if (!h) {
+        return NULL;
+    }
+    h->h.size = size;
+    if (size > old) {
+        mem_credit(tag, size - old);
+    } else {
+        mem_debit(tag, old - size);
+    }
+    mem_count(&mem_counters[tag].reallocs, &mem_all.reallocs);
+    return h + 1;
+}
+
+// Frees a block from a mem_ wrapper; NULL is ignored
+void mem_free(void *block) {
+    if (!block) {
+        return;
+    }
+    mem_header_t *h = mem_header(block);
+    mem_debit(h->h.tag, h->h.size);
+    mem_count(&mem_counters[h->h.tag].frees, &mem_all.frees);
+    free(mem_base(h));
+}
+
+// Size a block was allocated with, 0 for NULL
+size_t mem_size(const void *block) {
+    return block ? mem_header(block)->h.size : 0;
+}
+
+static void mem_read(const mem_counters_t *c, mem_stats_t *st) {
+    st->current = atomic_load_explicit(&c->current, memory_order_relaxed);
+    st->peak = atomic_load_explicit(&c->peak, memory_order_relaxed);
+    st->allocs = atomic_load_explicit(&c->allocs, memory_order_relaxed);
+    st->reallocs = atomic_load_explicit(&c->reallocs, memory_order_relaxed);
+    st->frees = atomic_load_explicit(&c->frees, memory_order_relaxed);
+}
+
+// Reads the accounting of one subsystem
+void mem_stats(mem_tag_t tag, mem_stats_t *st) {
+    mem_read(&mem_counters[tag], st);
+}
+
+// Reads the accounting of all subsystems together; its peak is the most
+// memory held at once, which is at most the sum of the subsystem peaks
+void mem_total(mem_stats_t *st) {
+    mem_read(&mem_all, st);
+}
+
+const char* mem_name(mem_tag_t tag) {
+    return tag < MEM_TAGS ? mem_names[tag] : "unknown";
+}
+
+// Prints one line per subsystem that allocated anything, then the total
+void mem_print_summary(FILE *out) {
+    fprintf(out, "%-8s %11s %12s %10s %10s %10s\n",
+            "memory", "current MB", "peak MB", "allocs", "reallocs", "frees");
+    mem_stats_t st;
+    for (int t = 0; t <= MEM_TAGS; t++) {
+        if (t < MEM_TAGS) {
+            mem_stats(t, &st);
+            if (st.allocs == 0) {
+                continue;
+            }
+        } else {
+            mem_total(&st);
+        }
+        fprintf(out, "%-8s %11.3f %12.3f %10llu %10llu %10llu\n",
+                t < MEM_TAGS ? mem_names[t] : "total", st.current / 1e6, st.peak / 1e6,
+                (unsigned long long)st.allocs, (unsigned long long)st.reallocs,
+                (unsigned long long)st.frees);
+    }
+}
+
+// Writes the accounting as a JSON object with one member per subsystem and a "total"
+void mem_write_json(FILE *f) {
+    fprintf(f, "{");
+    mem_stats_t st;
+    for (int t = 0; t <= MEM_TAGS; t++) {
+        if (t < MEM_TAGS) {
+            mem_stats(t, &st);
+        } else {
+            mem_total(&st);
+        }
+        fprintf(f, "%s\n    \"%s\": {\"current_bytes\": %zu, \"peak_bytes\": %zu, \"allocs\": %llu, "
+                   "\"reallocs\": %llu, \"frees\": %llu}",
+                t ? "," : "", t < MEM_TAGS ? mem_names[t] : "total", st.current, st.peak,
+                (unsigned long long)st.allocs, (unsigned long long)st.reallocs,
+                (unsigned long long)st.frees);
+    }
+    fprintf(f, "\n  }");
+}
@@ -0,0 +1,49 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Subsystems whose heap memory is accounted separately
+typedef enum {
+    MEM_INGEST,     // point clouds read or generated: the points, their List and the NODATA mask
+    MEM_GRID,       // gridding scattered points: the accumulators, the point buffer and the grid
+    MEM_SIM,        // simulation state: the step grids and the per-step water buffer
+    MEM_RENDER,     // render contexts and per-tile buffers
+    MEM_ENCODE,     // frame writer slots, queues and encoded frames, raster writer and checkpoint buffers
+    MEM_ANALYSIS,   // basin labels and tables, terrain derivative grids and their working buffers
+    MEM_TAGS
+} mem_tag_t;
+
+// Accounting of one subsystem
+typedef struct {
+    size_t current;         // bytes allocated now
+    size_t peak;            // most bytes allocated at once
+    uint64_t allocs;        // allocations, including reallocations of a NULL block
+    uint64_t reallocs;      // reallocations of an existing block
+    uint64_t frees;         // blocks freed
+} mem_stats_t;
+
+/*
+The mem_ wrappers behave like their libc counterparts, but each block carries
+a small header with its size and tag so that mem_free can debit the right
+subsystem. A block from a mem_ wrapper must be freed with mem_free and never
+with free, and the other way around. The counters are atomics, so the
+wrappers are safe on any thread and cost a few uncontended atomic adds on
+top of malloc. Accounting is always on.
+*/
+
+void* mem_alloc(mem_tag_t tag, size_t size);
+void* mem_calloc(mem_tag_t tag, size_t count, size_t size);
+void* mem_alloc_aligned(mem_tag_t tag, size_t align, size_t size);
+void* mem_realloc(mem_tag_t tag, void *block, size_t size);
+void mem_free(void *block);
+size_t mem_size(const void *block);
+void mem_stats(mem_tag_t tag, mem_stats_t *st);
+void mem_total(mem_stats_t *st);
+const char* mem_name(mem_tag_t tag);
+void mem_print_summary(FILE *out);
+void mem_write_json(FILE *f);
+
+#endif // MEM_H
@@ -1,8 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <float.h>
+#include <string.h>
 #include <math.h>
 #include "pointcloud.h"
+#include "render.h"
+#include "trace.h"
+#include "mem.h"
+
+// Points parsed per "parse chunk" span of a trace, a power of two
+#define PARSE_TRACE_POINTS 65536
 
 /**
  * Analyzes point cloud data from standard input
@@ -53,7 +61,7 @@ pointcloud_t* readPointCloudData(FILE *stream) {
         return NULL;
     }
 
-    pointcloud_t *pc = malloc(sizeof(pointcloud_t));
+    pointcloud_t *pc = mem_alloc(MEM_INGEST, sizeof(pointcloud_t));
     if (!pc) {
         fprintf(stderr, "Error: Failed to allocate pointcloud structure\n");
         return NULL;
@@ -61,19 +69,20 @@ pointcloud_t* readPointCloudData(FILE *stream) {
 
     pc->water_coef = 0.1; 
     pc->evap_coef = 0.95; 
+    pc->valid = NULL; 
 
     // Read number of columns
     int total_points;
     if (fscanf(stream, "%d", &total_points) != 1) {
         fprintf(stderr, "Error: Could not read number of points\n");
-        free(pc);
+        mem_free(pc);
         return NULL;
     }
 
     // Initialize points list
     if (!listInit(&pc->points, sizeof(pcd_t))) {
         fprintf(stderr, "Error: Failed to initialize points list\n");
-        free(pc);
+        mem_free(pc);
         return NULL;
     }
 
@@ -86,9 +95,11 @@ pointcloud_t* readPointCloudData(FILE *stream) {
     pc->stats.max_y = -DBL_MAX;
     double height_sum = 0;
     int point_count = 0;
+    int nodata_count = 0;
 
     // First pass: Read all points and find min/max x,y coordinates
     double x, y, z;
+    double chunk = trace_begin();
     while (fscanf(stream, "%lf %lf %lf", &x, &y, &z) == 3) {
         pcd_t point = {
             .x = x, .y = y, .z = z,
@@ -97,18 +108,43 @@ pointcloud_t* readPointCloudData(FILE *stream) {
             .east = NULL, .west = NULL
         };
 
-        // Update statistics
-        if (z < pc->stats.min_height) pc->stats.min_height = z;
-        if (z > pc->stats.max_height) pc->stats.max_height = z;
+        // Update statistics; NODATA heights only count towards the grid layout
         if (x < pc->stats.min_x) pc->stats.min_x = x;
         if (x > pc->stats.max_x) pc->stats.max_x = x;
         if (y < pc->stats.min_y) pc->stats.min_y = y;
         if (y > pc->stats.max_y) pc->stats.max_y = y;
-        
-        height_sum += z;
         point_count++;
-
         listAddEnd(&pc->points, &point);
+        if ((point_count & (PARSE_TRACE_POINTS - 1)) == 0) {
+            trace_end("parse chunk", chunk, "points", point_count);
+            chunk = trace_begin();
+        }
+
+        if (z <= POINTCLOUD_NODATA) {
+            nodata_count++;
+            continue;
+        }
+        if (z < pc->stats.min_height) pc->stats.min_height = z;
+        if (z > pc->stats.max_height) pc->stats.max_height = z;
+        height_sum += z;
+    }
+    trace_end("parse chunk", chunk, "points", point_count);
+
+    // Mark the NODATA points once the final point count is known
+    if (nodata_count > 0) {
+        pc->valid = pointcloud_mask_alloc(point_count);
+        if (!pc->valid) {
+            fprintf(stderr, "Error: Failed to allocate validity mask\n");
+            listFree(&pc->points);
+            mem_free(pc);
+            return NULL;
+        }
+        const pcd_t *points = pc->points.data;
+        for (int i = 0; i < point_count; i++) {
+            if (points[i].z <= POINTCLOUD_NODATA) {
+                pc->valid[i >> 6] &= ~(1ULL << (i & 63));
+            }
+        }
     }
 
     // Calculate grid dimensions
@@ -118,10 +154,13 @@ pointcloud_t* readPointCloudData(FILE *stream) {
     pc->cols = (int)((pc->stats.max_x - pc->stats.min_x) / x_step + 0.5) + 1;
     pc->rows = (int)((pc->stats.max_y - pc->stats.min_y) / y_step + 0.5) + 1;
     
-    pc->stats.avg_height = height_sum / point_count;
+    pc->stats.avg_height = point_count > nodata_count ? height_sum / (point_count - nodata_count) : 0.0;
 
     printf("Grid Analysis:\n");
     printf("Total points: %d\n", point_count);
+    if (nodata_count > 0) {
+        printf("NODATA points: %d\n", nodata_count);
+    }
     printf("Calculated dimensions: %d rows x %d columns\n", pc->rows, pc->cols);
     printf("X step size: %.2f\n", x_step);
     printf("Y step size: %.2f\n", y_step);
@@ -130,16 +169,23 @@ pointcloud_t* readPointCloudData(FILE *stream) {
 }
 
 
+/**
+ * Frees a point cloud, its points and its NODATA mask. Only works on clouds
+ * whose blocks all come from the mem_ wrappers, as readPointCloudData and
+ * the generators build them; a cloud put together with malloc must be freed
+ * by hand.
+ * Inputs:
+ *  - pc: point cloud to free, may be NULL
+ */
 void pointcloud_free(pointcloud_t *pc){
     if (!pc){
         return; 
     }
 
-    if (pc-> points.data){
-        free(pc->points.data); 
-    }
+    listFree(&pc->points); 
+    mem_free(pc->valid); 
 
-    free(pc); 
+    mem_free(pc); 
 }
 
 /**
@@ -156,12 +202,21 @@ void pointcloud_print_stats(const pointcloud_t *pc){
     printf("=====================\n");
     printf("Dimensions: %d rows × %d columns (%d total points)\n", 
            pc->rows, pc->cols, pc->points.size);
+    if (pc->valid) {
+        long valid = pointcloud_valid_count(pc);
+        printf("Valid points: %ld (%ld NODATA)\n", valid, pc->points.size - valid);
+    }
     printf("Height range: %.2f to %.2f (avg: %.2f)\n", 
            pc->stats.min_height, pc->stats.max_height, pc->stats.avg_height);
     printf("X range: %.2f to %.2f\n", pc->stats.min_x, pc->stats.max_x);
     printf("Y range: %.2f to %.2f\n", pc->stats.min_y, pc->stats.max_y);
-    printf("Memory usage: %zu bytes\n", 
-           sizeof(pointcloud_t) + pc->points.size * sizeof(pcd_t));
+    // Allocated sizes, so the List's spare capacity counts; the simulation and
+    // render buffers are accounted per subsystem by mem_print_summary
+    size_t used = (size_t)pc->points.size * pc->points.max_element_size;
+    size_t points = mem_size(pc->points.data);
+    size_t mask = mem_size(pc->valid);
+    printf("Memory usage: %zu bytes (points %zu, of which unused capacity %zu; mask %zu)\n", 
+           mem_size(pc) + points + mask, points, points > used ? points - used : 0, mask);
 
 }
 
@@ -175,100 +230,75 @@ pcd_t* pointcloud_get_point(pointcloud_t *pc, int row, int col) {
 }
 
 /**
- * Generates a visualization of terrain according to given input, maps height values to grayscale
- * Inputs: 
- *  - pc: point cloud data 
- *  - filename: output file name 
+ * Allocates a validity mask for count points with every point marked valid.
+ * Bits past the last point stay clear.
+ * Returns: the mask, or NULL if allocation fails
  */
-void imagePointCloud(pointcloud_t *pc, char *filename) {
-    if (!pc || !pc->points.data || !filename) {
-        fprintf(stderr, "Invalid parameters passed to imagePointCloud\n");
-        return;
+uint64_t* pointcloud_mask_alloc(size_t count) {
+    size_t words = (count + 63) / 64;
+    uint64_t *mask = mem_alloc(MEM_INGEST, (words ? words : 1) * sizeof(uint64_t));
+    if (!mask) {
+        return NULL;
     }
 
-    // Creating the bitmap image 
-    int size = 800;
-    Bitmap *bmp = bm_create(size, size);
-    if (!bmp) {
-        fprintf(stderr, "Failed to create bitmap\n");
-        return;
+    memset(mask, 0xFF, words * sizeof(uint64_t));
+    if (count & 63) {
+        mask[words - 1] = (1ULL << (count & 63)) - 1;
     }
+    return mask;
+}
 
-    //Fill the entire background with black color
-    bm_set_color(bmp, bm_rgb(0, 0, 0));
-    bm_clear(bmp);
-
-    // Scale colors according to heights 
-    // I noticed that doing this significantly improved the contrast and clarity of the image 
-    double scaleX = (double)(size - 1) / (pc->stats.max_x - pc->stats.min_x);
-    double scaleY = (double)(size - 1) / (pc->stats.max_y - pc->stats.min_y);
-    double scale = fmin(scaleX, scaleY);
-
-    // Use a 2D array to work with points
-    double **heightSum = malloc(size * sizeof(double*));
-    int **heightCount = malloc(size * sizeof(int*));
-    for(int i = 0; i < size; i++) {
-        heightSum[i] = calloc(size, sizeof(double));
-        heightCount[i] = calloc(size, sizeof(int));
+/**
+ * Counts the points that hold data
+ */
+long pointcloud_valid_count(const pointcloud_t *pc) {
+    if (!pc) {
+        return 0;
     }
-    
-    if (!heightSum || !heightCount) {
-        printf("It seems like something is wrong with your dataset. Please check.\n");
-        return;
+    if (!pc->valid) {
+        return pc->points.size;
     }
 
-    //Iterate through the points and find the min and max heights of the points 
-    double mappedMin = DBL_MAX;
-    double mappedMax = -DBL_MAX;
-    
-    for (int i = 0; i < pc->points.size; i++) {
-        pcd_t *point = (pcd_t *)listGet(&pc->points, i);
-        if (!point) continue;
-
-        int x = (int)((point->x - pc->stats.min_x) * scale);
-        int y = size - 1 - (int)((point->y - pc->stats.min_y) * scale);
-
-        if (x >= 0 && x < size && y >= 0 && y < size) {
-            heightSum[y][x] += point->z;
-            heightCount[y][x]++;
-            
-            double avgHeight = heightSum[y][x] / heightCount[y][x];
-            if (avgHeight < mappedMin) mappedMin = avgHeight;
-            if (avgHeight > mappedMax) mappedMax = avgHeight;
-        }
+    long count = 0;
+    for (size_t w = 0; w < ((size_t)pc->points.size + 63) / 64; w++) {
+        count += __builtin_popcountll(pc->valid[w]);
     }
+    return count;
+}
 
-    // Render the image 
-    double heightRange = mappedMax - mappedMin;
-    for (int y = 0; y < size; y++) {
-        for (int x = 0; x < size; x++) {
-            if (heightCount[y][x] > 0) {
-                double avgHeight = heightSum[y][x] / heightCount[y][x];
-                
-                // Improve contrast with better scaling
-                int intensity = (int)(((avgHeight - mappedMin) / heightRange) * 255);
-                intensity = intensity < 0 ? 0 : (intensity > 255 ? 255 : intensity);
-                
-                bm_set_color(bmp, bm_rgb(intensity, intensity, intensity));
-                bm_putpixel(bmp, x, y);
-            }
-        }
+/**
+ * Tells whether the grid rows run south to north, i.e. row 0 holds the smallest y.
+ * Images are drawn north up, so such grids are flipped when rendered row by row.
+ */
+int pointcloud_rows_ascending(const pointcloud_t *pc) {
+    if (!pc || !pc->points.data || pc->rows < 2 || pc->points.size < pc->cols + 1) {
+        return 1;
     }
 
-    // Dealloc memory 
-    for(int i = 0; i < size; i++) {
-        free(heightSum[i]);
-        free(heightCount[i]);
+    const pcd_t *points = pc->points.data;
+    return points[pc->cols].y >= points[0].y;
+}
+
+/**
+ * Generates a visualization of terrain according to given input, maps height values to grayscale
+ * Inputs: 
+ *  - pc: point cloud data 
+ *  - filename: output file name 
+ */
+void imagePointCloud(pointcloud_t *pc, char *filename) {
+    if (!pc || !pc->points.data || !filename) {
+        fprintf(stderr, "Invalid parameters passed to imagePointCloud\n");
+        return;
     }
-    free(heightSum);
-    free(heightCount);
 
-    printf("Saving image to %s...\n", filename);
-    if (!bm_save(bmp, filename)) {
-        fprintf(stderr, "Failed to save bitmap\n");
+    render_ctx_t *rc = render_create(pc, RENDER_SIZE);
+    if (!rc) {
+        printf("It seems like something is wrong with your dataset. Please check.\n");
+        return;
     }
 
-    bm_free(bmp);
+    render_save_terrain(rc, filename);
+    render_free(rc);
 }
 
 void update_watershed_coefficients(pointcloud_t *pc, double wcoef, double ecoef){
@@ -290,7 +320,7 @@ void update_watershed_coefficients(pointcloud_t *pc, double wcoef, double ecoef)
 /**
  * Prepares the pointcloud for water simulation: 
  *  - sets initial water to 0 
- *  - establishes pointers to the neighbors 
+ *  - establishes pointers to the neighbors, leaving NODATA points disconnected 
  *  - validates the grid 
  * Input: 
  *  - pc: point cloud to initialize 
@@ -313,30 +343,40 @@ int initializeWatershed(pointcloud_t *pc) {
             // Initialize water to 0
             current->wd = 0.0;
 
+            // Water never flows into or out of a NODATA point
+            if (!POINTCLOUD_VALID(pc->valid, index)) {
+                current->north = current->south = current->east = current->west = NULL;
+                continue;
+            }
+
             // Set north neighbor (row - 1)
             if (row > 0) {
-                current->north = (pcd_t*)listGet(&pc->points, (row-1) * pc->cols + col);
+                current->north = POINTCLOUD_VALID(pc->valid, (row-1) * pc->cols + col) ? 
+                    (pcd_t*)listGet(&pc->points, (row-1) * pc->cols + col) : NULL;
             } else {
                 current->north = NULL;
             }
 
             // Set south neighbor (row + 1)
             if (row < pc->rows - 1) {
-                current->south = (pcd_t*)listGet(&pc->points, (row+1) * pc->cols + col);
+                current->south = POINTCLOUD_VALID(pc->valid, (row+1) * pc->cols + col) ? 
+                    (pcd_t*)listGet(&pc->points, (row+1) * pc->cols + col) : NULL;
             } else {
                 current->south = NULL;
             }
 
             // Set east neighbor (col + 1)
             if (col < pc->cols - 1) {
-                current->east = (pcd_t*)listGet(&pc->points, row * pc->cols + (col+1));
+                current->east = POINTCLOUD_VALID(pc->valid, row * pc->cols + (col+1)) ? 
+                    (pcd_t*)listGet(&pc->points, row * pc->cols + (col+1)) : NULL;
             } else {
                 current->east = NULL;
             }
 
             // Set west neighbor (col - 1)
             if (col > 0) {
-                current->west = (pcd_t*)listGet(&pc->points, row * pc->cols + (col-1));
+                current->west = POINTCLOUD_VALID(pc->valid, row * pc->cols + (col-1)) ? 
+                    (pcd_t*)listGet(&pc->points, row * pc->cols + (col-1)) : NULL;
             } else {
                 current->west = NULL;
             }
@@ -370,7 +410,7 @@ void watershedAddUniformWater(pointcloud_t *pc, double amount) {
 
     for (int i = 0; i < pc->points.size; i++) {
         pcd_t *point = (pcd_t*)listGet(&pc->points, i);
-        if (point) {
+        if (point && POINTCLOUD_VALID(pc->valid, i)) {
             point->wd += amount;
         }
     }
@@ -394,7 +434,7 @@ void watershedStep(pointcloud_t *pc) {
     }
 
     // Allocate memory for new water amounts
-    double *new_water = calloc(pc->points.size, sizeof(double));
+    double *new_water = mem_calloc(MEM_SIM, pc->points.size, sizeof(double));
     if (!new_water) return;
 
     // For each cell C in the pointcloud
@@ -469,11 +509,13 @@ void watershedStep(pointcloud_t *pc) {
     }
 
     // Free temporary array
-    free(new_water);
+    mem_free(new_water);
 }
 
 /**
  * Visualizes the water accumulation, core function to visualize water flow 
+ * Animation frames should keep a render context instead (see render.h), which 
+ * maps the grid onto the image once rather than on every call. 
  */
 void imagePointCloudWater(pointcloud_t* pc, double maxwd, char* filename) {
     if (!pc || !pc->points.data || !filename) {
@@ -481,89 +523,15 @@ void imagePointCloudWater(pointcloud_t* pc, double maxwd, char* filename) {
         return;
     }
 
-    // Create bitmap
-    int size = 800;
-    Bitmap *bmp = bm_create(size, size);
-    if (!bmp) {
+    render_ctx_t *rc = render_create(pc, RENDER_SIZE);
+    if (!rc) {
         fprintf(stderr, "Failed to create bitmap\n");
         return;
     }
 
-    // Calculate scaling factors for x,y coordinates
-    double scaleX = (double)(size - 1) / (pc->stats.max_x - pc->stats.min_x);
-    double scaleY = (double)(size - 1) / (pc->stats.max_y - pc->stats.min_y);
-    double scale = fmin(scaleX, scaleY);
-
-    // Arrays for accumulating heights and water
-    double **heights = malloc(size * sizeof(double*));
-    double **water = malloc(size * sizeof(double*));
-    int **counts = malloc(size * sizeof(int*));
-    
-    for(int i = 0; i < size; i++) {
-        heights[i] = calloc(size, sizeof(double));
-        water[i] = calloc(size, sizeof(double));
-        counts[i] = calloc(size, sizeof(int));
-    }
-
-    // Accumulate values
-    for (int i = 0; i < pc->points.size; i++) {
-        pcd_t *point = (pcd_t*)listGet(&pc->points, i);
-        if (!point) continue;
-
-        int x = (int)((point->x - pc->stats.min_x) * scale);
-        int y = size - 1 - (int)((point->y - pc->stats.min_y) * scale); // Flip Y coordinate
-
-        if (x >= 0 && x < size && y >= 0 && y < size) {
-            heights[y][x] += point->z;
-            water[y][x] += point->wd;
-            counts[y][x]++;
-        }
+    const pcd_t *points = pc->points.data;
+    if (render_water(rc, (const char *)points + offsetof(pcd_t, wd), sizeof(pcd_t), maxwd)) {
+        render_save(rc, filename);
     }
-
-    // Render pixels
-    for (int y = 0; y < size; y++) {
-        for (int x = 0; x < size; x++) {
-            if (counts[y][x] > 0) {
-                double avg_height = heights[y][x] / counts[y][x];
-                double avg_water = water[y][x] / counts[y][x];
-                
-                // Calculate terrain color (grayscale based on height)
-                double height_factor = (avg_height - pc->stats.min_height) / 
-                                     (pc->stats.max_height - pc->stats.min_height);
-                int terrain = (int)(height_factor * 255);
-                terrain = terrain < 0 ? 0 : (terrain > 255 ? 255 : terrain);
-
-                // Calculate water color (blue based on water amount)
-                double water_factor = avg_water / maxwd;
-                water_factor = water_factor > 1.0 ? 1.0 : water_factor;
-                int blue = (int)(water_factor * 255);
-
-                // Blend terrain and water colors
-                int r = terrain * (1 - water_factor);
-                int g = terrain * (1 - water_factor);
-                int b = terrain * (1 - water_factor) + blue;
-
-                bm_set_color(bmp, bm_rgb(r, g, b));
-                bm_putpixel(bmp, x, y);
-            }
-        }
-    }
-
-    // Cleanup
-    for(int i = 0; i < size; i++) {
-        free(heights[i]);
-        free(water[i]);
-        free(counts[i]);
-    }
-    free(heights);
-    free(water);
-    free(counts);
-
-    // Save image
-    printf("Saving water visualization to %s...\n", filename);
-    if (!bm_save(bmp, filename)) {
-        fprintf(stderr, "Failed to save bitmap\n");
-    }
-
-    bm_free(bmp);
-}
\ No newline at end of file
+    render_free(rc);
+}
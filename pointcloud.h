@@ -2,6 +2,7 @@
 #define POINTCLOUD_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include "util.h"
 #include "bmp.h"
 
@@ -17,6 +18,12 @@ typedef struct pcd_t {
     struct pcd_t *west;   // pointer to the west neighbor
 } pcd_t;
 
+// Height marking a cell without data in the input
+#define POINTCLOUD_NODATA -9999.0
+
+// Tests bit i of a validity mask; a NULL mask means every cell is valid
+#define POINTCLOUD_VALID(mask, i) (!(mask) || (((mask)[(i) >> 6] >> ((i) & 63)) & 1))
+
 // Struct to store the statistics for points 
 typedef struct{
     double min_height; 
@@ -35,6 +42,7 @@ typedef struct {
     pointcloud_stats_t stats; // statistics about the pointcloud 
     double water_coef; //water flow coefficient  
     double evap_coef; //evaporation coefficient 
+    uint64_t *valid; // validity bitmask, one bit per point; NULL when every point holds data
 } pointcloud_t; 
 
 // essential functions according to project doc
@@ -51,5 +59,8 @@ void pointcloud_free(pointcloud_t *pc);
 void pointcloud_print_stats(const pointcloud_t *pc); 
 pcd_t* pointcloud_get_point(pointcloud_t *pc, int row, int col); 
 void update_watershed_coefficients(pointcloud_t *pc, double wcoef, double ecoef);
+int pointcloud_rows_ascending(const pointcloud_t *pc); 
+uint64_t* pointcloud_mask_alloc(size_t count); 
+long pointcloud_valid_count(const pointcloud_t *pc); 
 
 #endif // POINTCLOUD_H
\ No newline at end of file
@@ -0,0 +1,576 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "prof.h"
+#include "trace.h"
+#include "mem.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// Change of one counter over the samples of a phase that could read it
+typedef struct {
+    uint64_t total;
+    size_t samples;
+    uint64_t work;          // work done by those samples
+    double seconds;         // time taken by those samples
+} prof_count_t;
+
+// Samples of one phase
+typedef struct {
+    double *seconds;        // duration of every sample, in recording order per thread
+    size_t count;
+    size_t cap;
+    double total;           // sum of the durations
+    uint64_t work;          // units of work over all samples
+    prof_count_t counters[PROF_COUNTERS];
+} prof_series_t;
+
+static const char *const prof_names[PROF_PHASES] = {"parse", "init", "step", "render", "encode"};
+static const char *const prof_units[PROF_PHASES] = {"bytes", "cells", "cells", "pixels", "bytes"};
+static const char *const prof_counter_names[PROF_COUNTERS] = {
+    "cycles", "instructions", "llc_misses", "branch_misses",
+};
+
+// Samples one thread recorded since timing was enabled. The thread appends
+// to them without a lock; the summary and the report merge every thread's.
+typedef struct prof_local {
+    prof_series_t series[PROF_PHASES];
+    struct prof_local *next;
+} prof_local_t;
+
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;   // guards prof_locals
+static prof_local_t *prof_locals;   // samples of every thread, kept after the thread exits
+static atomic_int prof_on;
+static atomic_int prof_counters_on;
+static atomic_long prof_epoch;      // advanced whenever the samples are dropped
+static double prof_start;           // when timing was enabled
+
+static int prof_timing(void) {
+    return atomic_load_explicit(&prof_on, memory_order_relaxed);
+}
+
+static int prof_counting(void) {
+    return atomic_load_explicit(&prof_counters_on, memory_order_relaxed);
+}
+
+// Seconds on the monotonic clock
+double prof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Frees every thread's samples; threads that record again start new ones
+static void prof_clear(void) {
+    pthread_mutex_lock(&prof_lock);
+    while (prof_locals) {
+        prof_local_t *l = prof_locals;
+        prof_locals = l->next;
+        for (int p = 0; p < PROF_PHASES; p++) {
+            free(l->series[p].seconds);
+        }
+        free(l);
+    }
+    atomic_fetch_add_explicit(&prof_epoch, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// Starts timing, dropping any earlier samples; no thread may be recording
+void prof_enable(void) {
+    prof_clear();
+    prof_start = prof_now();
+    atomic_store_explicit(&prof_on, 1, memory_order_relaxed);
+}
+
+// Stops timing and counting and frees the samples; call it once the
+// recording threads have finished
+void prof_disable(void) {
+    atomic_store_explicit(&prof_on, 0, memory_order_relaxed);
+    atomic_store_explicit(&prof_counters_on, 0, memory_order_relaxed);
+    prof_clear();
+}
+
+int prof_enabled(void) {
+    return prof_timing();
+}
+
+// What prof keeps per thread: its perf_event descriptors, -1 for the counters
+// it could not open, and its samples
+typedef struct {
+    int fd[PROF_COUNTERS];
+    int opened;             // the counters have been opened
+    prof_local_t *local;    // samples of the current epoch, owned by prof_locals
+    long epoch;             // prof_epoch when local was started
+} prof_thread_t;
+
+static pthread_key_t prof_thread_key;
+static pthread_once_t prof_key_once = PTHREAD_ONCE_INIT;
+
+static void prof_thread_close(void *arg) {
+    prof_thread_t *t = arg;
+#ifdef __linux__
+    for (int c = 0; c < PROF_COUNTERS; c++) {
+        if (t->fd[c] >= 0) {
+            close(t->fd[c]);
+        }
+    }
+#endif
+    free(t);
+}
+
+static void prof_make_key(void) {
+    pthread_key_create(&prof_thread_key, prof_thread_close);
+}
+
+/**
+ * Opens a counter of the calling thread's user-space work, which
+ * perf_event_paranoid up to 2 allows without privileges
+ * Returns: the descriptor, or -1 when the counter is not available
+ */
+static int prof_open_counter(prof_counter_t counter) {
+#ifdef __linux__
+    static const uint64_t configs[PROF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[counter];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // The enabled and running times scale the count when counters are multiplexed
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+#else
+    (void)counter;
+    return -1;
+#endif
+}
+
+// State of the calling thread, created on its first use
+static prof_thread_t* prof_thread(void) {
+    pthread_once(&prof_key_once, prof_make_key);
+    prof_thread_t *t = pthread_getspecific(prof_thread_key);
+    if (!t) {
+        t = calloc(1, sizeof(prof_thread_t));
+        if (!t) {
+            return NULL;
+        }
+        for (int c = 0; c < PROF_COUNTERS; c++) {
+            t->fd[c] = -1;
+        }
+        pthread_setspecific(prof_thread_key, t);
+    }
+    return t;
+}
+
+// Counters of the calling thread, opened on its first use; NULL without them
+static prof_thread_t* prof_thread_counters(void) {
+    prof_thread_t *t = prof_thread();
+    if (t && !t->opened) {
+        for (int c = 0; c < PROF_COUNTERS; c++) {
+            t->fd[c] = prof_open_counter(c);
+        }
+        t->opened = 1;
+    }
+    return t;
+}
+
+// Samples of the calling thread for the current epoch, registered on first use
+static prof_local_t* prof_local(void) {
+    prof_thread_t *t = prof_thread();
+    if (!t) {
+        return NULL;
+    }
+    long epoch = atomic_load_explicit(&prof_epoch, memory_order_relaxed);
+    if (!t->local || t->epoch != epoch) {
+        // The samples of an earlier epoch were freed by prof_clear
+        prof_local_t *l = calloc(1, sizeof(prof_local_t));
+        if (!l) {
+            t->local = NULL;
+            return NULL;
+        }
+        pthread_mutex_lock(&prof_lock);
+        l->next = prof_locals;
+        prof_locals = l;
+        pthread_mutex_unlock(&prof_lock);
+        t->local = l;
+        t->epoch = epoch;
+    }
+    return t->local;
+}
+
+// Current value of one counter, or PROF_NO_COUNT
+static uint64_t prof_read_counter(int fd) {
+#ifdef __linux__
+    uint64_t v[3];  // value, time enabled, time running
+    if (fd < 0 || read(fd, v, sizeof(v)) != sizeof(v)) {
+        return PROF_NO_COUNT;
+    }
+    if (v[2] > 0 && v[2] < v[1]) {
+        return (uint64_t)((double)v[0] * v[1] / v[2]);
+    }
+    return v[0];
+#else
+    (void)fd;
+    return PROF_NO_COUNT;
+#endif
+}
+
+/**
+ * Turns on the hardware counters for timed sections, from here on and while
+ * timing is on. Each thread opens its counters when it first times a section.
+ * Returns: the number of counters the calling thread could open; counting
+ * stays off when it is 0
+ */
+int prof_enable_counters(void) {
+    prof_thread_t *t = prof_thread_counters();
+    int available = 0;
+    for (int c = 0; t && c < PROF_COUNTERS; c++) {
+        available += t->fd[c] >= 0;
+    }
+    atomic_store_explicit(&prof_counters_on, available > 0, memory_order_relaxed);
+    return available;
+}
+
+/**
+ * Records one sample of a phase in the calling thread's samples; does
+ * nothing while timing is off
+ * Inputs:
+ *  - phase: phase the sample belongs to
+ *  - seconds: duration of the sample
+ *  - work: units of work done, in the phase's unit
+ *  - counts: change of every counter over the sample, PROF_NO_COUNT for those
+ *    not read, or NULL for none
+ */
+void prof_add_counts(prof_phase_t phase, double seconds, uint64_t work,
+                     const uint64_t counts[PROF_COUNTERS]) {
+    if (!prof_timing() || phase < 0 || phase >= PROF_PHASES) {
+        return;
+    }
+    prof_local_t *l = prof_local();
+    if (!l) {
+        return;
+    }
+
+    prof_series_t *s = &l->series[phase];
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 1024;
+        double *seconds_grown = realloc(s->seconds, cap * sizeof(double));
+        if (!seconds_grown) {
+            return;
+        }
+        s->seconds = seconds_grown;
+        s->cap = cap;
+    }
+    s->seconds[s->count++] = seconds;
+    s->total += seconds;
+    s->work += work;
+    for (int c = 0; counts && c < PROF_COUNTERS; c++) {
+        if (counts[c] != PROF_NO_COUNT) {
+            s->counters[c].total += counts[c];
+            s->counters[c].samples++;
+            s->counters[c].work += work;
+            s->counters[c].seconds += seconds;
+        }
+    }
+}
+
+void prof_add(prof_phase_t phase, double seconds, uint64_t work) {
+    prof_add_counts(phase, seconds, work, NULL);
+}
+
+// Starts a timed section on the calling thread
+void prof_begin(prof_mark_t *mark) {
+    prof_thread_t *t = prof_timing() && prof_counting() ? prof_thread_counters() : NULL;
+    for (int c = 0; c < PROF_COUNTERS; c++) {
+        mark->counts[c] = t ? prof_read_counter(t->fd[c]) : PROF_NO_COUNT;
+    }
+    mark->time = prof_now();
+}
+
+// Ends a section started by prof_begin on the same thread and records it,
+// also as a span of the trace when tracing is on
+void prof_end(prof_phase_t phase, const prof_mark_t *mark, uint64_t work) {
+    trace_end(prof_names[phase], mark->time, prof_units[phase], (long)work);
+    if (!prof_timing()) {
+        return;
+    }
+    double seconds = prof_now() - mark->time;
+
+    uint64_t counts[PROF_COUNTERS];
+    prof_thread_t *t = prof_counting() ? prof_thread_counters() : NULL;
+    for (int c = 0; c < PROF_COUNTERS; c++) {
+        uint64_t now = t ? prof_read_counter(t->fd[c]) : PROF_NO_COUNT;
+        counts[c] = now != PROF_NO_COUNT && mark->counts[c] != PROF_NO_COUNT && now >= mark->counts[c]
+                    ? now - mark->counts[c] : PROF_NO_COUNT;
+    }
+    prof_add_counts(phase, seconds, work, counts);
+}
+
+/**
+ * Ends a worker thread's part of a section that another thread times with
+ * prof_begin and prof_end, e.g. one band of a step. The worker's counters
+ * are added to the phase's totals without adding a sample, so the per unit
+ * figures and the IPC cover every thread. The thread that times the section
+ * must not also call this for its own part; its counters are in its sample.
+ * Inputs:
+ *  - phase: phase of the section
+ *  - mark: prof_begin of the worker's part, on the worker
+ */
+void prof_end_share(prof_phase_t phase, const prof_mark_t *mark) {
+    if (!prof_timing() || !prof_counting() || phase < 0 || phase >= PROF_PHASES) {
+        return;
+    }
+    prof_thread_t *t = prof_thread_counters();
+    prof_local_t *l = prof_local();
+    if (!t || !l) {
+        return;
+    }
+    for (int c = 0; c < PROF_COUNTERS; c++) {
+        uint64_t now = prof_read_counter(t->fd[c]);
+        if (now != PROF_NO_COUNT && mark->counts[c] != PROF_NO_COUNT && now >= mark->counts[c]) {
+            l->series[phase].counters[c].total += now - mark->counts[c];
+        }
+    }
+}
+
+// Statistics of one phase's samples
+typedef struct {
+    size_t count;
+    double total, min, median, p99, max;
+    uint64_t work;
+} prof_stats_t;
+
+static int prof_compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Summarizes a phase; the median is the lower middle sample and the
+ * percentile is by nearest rank
+ * Returns: 0 on success, -1 when the samples cannot be sorted
+ */
+static int prof_stats(const prof_series_t *s, prof_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    st->count = s->count;
+    st->total = s->total;
+    st->work = s->work;
+    if (s->count == 0) {
+        return 0;
+    }
+
+    double *sorted = malloc(s->count * sizeof(double));
+    if (!sorted) {
+        return -1;
+    }
+    memcpy(sorted, s->seconds, s->count * sizeof(double));
+    qsort(sorted, s->count, sizeof(double), prof_compare);
+    st->min = sorted[0];
+    st->median = sorted[(s->count - 1) / 2];
+    size_t rank = (s->count * 99 + 99) / 100;
+    st->p99 = sorted[rank - 1];
+    st->max = sorted[s->count - 1];
+    free(sorted);
+    return 0;
+}
+
+/**
+ * Merges the samples of every thread into one series per phase
+ * Returns: 0 on success, -1 when memory runs out; the series must be freed
+ * with prof_merged_free either way
+ */
+static int prof_merge(prof_series_t merged[PROF_PHASES]) {
+    memset(merged, 0, PROF_PHASES * sizeof(prof_series_t));
+    int ok = 1;
+    pthread_mutex_lock(&prof_lock);
+    for (const prof_local_t *l = prof_locals; l; l = l->next) {
+        for (int p = 0; p < PROF_PHASES; p++) {
+            const prof_series_t *s = &l->series[p];
+            prof_series_t *m = &merged[p];
+            if (s->count > 0) {
+                double *grown = realloc(m->seconds, (m->count + s->count) * sizeof(double));
+                if (!grown) {
+                    ok = 0;
+                    continue;
+                }
+                memcpy(grown + m->count, s->seconds, s->count * sizeof(double));
+                m->seconds = grown;
+                m->count += s->count;
+                m->cap = m->count;
+            }
+            m->total += s->total;
+            m->work += s->work;
+            for (int c = 0; c < PROF_COUNTERS; c++) {
+                m->counters[c].total += s->counters[c].total;
+                m->counters[c].samples += s->counters[c].samples;
+                m->counters[c].work += s->counters[c].work;
+                m->counters[c].seconds += s->counters[c].seconds;
+            }
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+    return ok ? 0 : -1;
+}
+
+static void prof_merged_free(prof_series_t merged[PROF_PHASES]) {
+    for (int p = 0; p < PROF_PHASES; p++) {
+        free(merged[p].seconds);
+    }
+}
+
+// Counter per unit of work, or -1 when it was not counted
+static double prof_per_unit(const prof_count_t *k) {
+    return k->samples && k->work ? (double)k->total / k->work : -1.0;
+}
+
+// Prints one line per timed phase, then the counters of the phases that have them
+void prof_print_summary(FILE *out) {
+    prof_series_t series[PROF_PHASES];
+    prof_merge(series);
+    fprintf(out, "%-7s %8s %10s %10s %10s %10s %14s\n",
+            "phase", "count", "total s", "median ms", "p99 ms", "max ms", "per second");
+    for (int p = 0; p < PROF_PHASES; p++) {
+        prof_stats_t st;
+        if (prof_stats(&series[p], &st) != 0 || st.count == 0) {
+            continue;
+        }
+        double rate = st.total > 0 ? st.work / st.total : 0.0;
+        fprintf(out, "%-7s %8zu %10.3f %10.3f %10.3f %10.3f %9.1f M%s\n",
+                prof_names[p], st.count, st.total, st.median * 1e3, st.p99 * 1e3, st.max * 1e3,
+                rate / 1e6, prof_units[p]);
+    }
+
+    int header = 0;
+    for (int p = 0; p < PROF_PHASES; p++) {
+        const prof_count_t *k = series[p].counters;
+        if (!k[PROF_CYCLES].samples && !k[PROF_INSTRUCTIONS].samples &&
+            !k[PROF_LLC_MISSES].samples && !k[PROF_BRANCH_MISSES].samples) {
+            continue;
+        }
+        if (!header) {
+            fprintf(out, "%-7s %8s %6s %12s %12s %12s %12s %10s  (per unit of work)\n", "phase",
+                    "samples", "IPC", "cycles", "instr", "LLC miss", "br miss", "mem GB/s");
+            header = 1;
+        }
+        double ipc = k[PROF_CYCLES].total ? (double)k[PROF_INSTRUCTIONS].total / k[PROF_CYCLES].total : 0;
+        double mem = k[PROF_LLC_MISSES].seconds > 0 ?
+                     (double)k[PROF_LLC_MISSES].total * PROF_CACHE_LINE / k[PROF_LLC_MISSES].seconds : 0;
+        fprintf(out, "%-7s %8zu %6.2f %12.4g %12.4g %12.4g %12.4g %10.2f\n",
+                prof_names[p], k[PROF_CYCLES].samples, ipc,
+                prof_per_unit(&k[PROF_CYCLES]), prof_per_unit(&k[PROF_INSTRUCTIONS]),
+                prof_per_unit(&k[PROF_LLC_MISSES]), prof_per_unit(&k[PROF_BRANCH_MISSES]), mem / 1e9);
+    }
+    prof_merged_free(series);
+}
+
+// Writes a string as a JSON string literal
+static void prof_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; s && *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+// Writes the counters of a phase that has any as a "counters" member
+static void prof_json_counters(FILE *f, const prof_series_t *s) {
+    const prof_count_t *k = s->counters;
+    int any = 0;
+    for (int c = 0; c < PROF_COUNTERS; c++) {
+        if (!k[c].samples) {
+            continue;
+        }
+        fprintf(f, "%s\"%s\": {\"samples\": %zu, \"total\": %llu, \"per_sample\": %.9g, \"per_unit\": %.9g}",
+                any ? ", " : ", \"counters\": {", prof_counter_names[c], k[c].samples,
+                (unsigned long long)k[c].total, (double)k[c].total / k[c].samples,
+                k[c].work ? (double)k[c].total / k[c].work : 0.0);
+        any = 1;
+    }
+    if (!any) {
+        return;
+    }
+    if (k[PROF_CYCLES].total && k[PROF_INSTRUCTIONS].samples) {
+        fprintf(f, ", \"ipc\": %.9g", (double)k[PROF_INSTRUCTIONS].total / k[PROF_CYCLES].total);
+    }
+    if (k[PROF_LLC_MISSES].seconds > 0) {
+        fprintf(f, ", \"memory_bytes_per_s\": %.9g",
+                (double)k[PROF_LLC_MISSES].total * PROF_CACHE_LINE / k[PROF_LLC_MISSES].seconds);
+    }
+    fprintf(f, "}");
+}
+
+/**
+ * Writes the run and the statistics of every phase as JSON. Times are in
+ * seconds; each phase gives its work in its unit and the work per second,
+ * and the change of each hardware counter per sample and per unit of work
+ * when counters were on. The heap accounting of every subsystem follows as
+ * "memory".
+ * Inputs:
+ *  - filename: report file name
+ *  - run: description of the run, or NULL
+ * Returns: 0 on success, -1 on failure
+ */
+int prof_write_report(const char *filename, const prof_run_t *run) {
+    if (!filename) {
+        return -1;
+    }
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s\n", filename);
+        return -1;
+    }
+
+    prof_series_t series[PROF_PHASES];
+    int ok = prof_merge(series) == 0;
+    fprintf(f, "{\n");
+    if (run) {
+        fprintf(f, "  \"input\": ");
+        prof_json_string(f, run->input);
+        fprintf(f, ",\n  \"rows\": %d,\n  \"cols\": %d,\n  \"cells\": %lld,\n",
+                run->rows, run->cols, (long long)run->rows * run->cols);
+        fprintf(f, "  \"steps\": %d,\n  \"threads\": %d,\n", run->steps, run->threads);
+    }
+    fprintf(f, "  \"wall_s\": %.9g,\n  \"phases\": {", prof_now() - prof_start);
+
+    for (int p = 0; p < PROF_PHASES; p++) {
+        prof_stats_t st;
+        ok = ok && prof_stats(&series[p], &st) == 0;
+        fprintf(f, "%s\n    \"%s\": {\"count\": %zu", p ? "," : "", prof_names[p], st.count);
+        if (st.count > 0) {
+            fprintf(f, ", \"total_s\": %.9g, \"min_s\": %.9g, \"median_s\": %.9g, "
+                       "\"p99_s\": %.9g, \"max_s\": %.9g, \"%s\": %llu, \"%s_per_s\": %.9g",
+                    st.total, st.min, st.median, st.p99, st.max,
+                    prof_units[p], (unsigned long long)st.work, prof_units[p],
+                    st.total > 0 ? st.work / st.total : 0.0);
+            prof_json_counters(f, &series[p]);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  },\n  \"memory\": ");
+    mem_write_json(f);
+    fprintf(f, "\n}\n");
+    prof_merged_free(series);
+
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Error: Failed to write %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
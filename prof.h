@@ -0,0 +1,76 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Phases of a run that are timed, each with the unit of work it processes
+typedef enum {
+    PROF_PARSE,     // reading the input file; bytes read
+    PROF_INIT,      // setting up the watershed state; cells
+    PROF_STEP,      // one simulation step; cells
+    PROF_RENDER,    // compositing one image; pixels
+    PROF_ENCODE,    // encoding one image; bytes produced
+    PROF_PHASES
+} prof_phase_t;
+
+// Hardware counters read around each timed section when counters are on
+typedef enum {
+    PROF_CYCLES,
+    PROF_INSTRUCTIONS,
+    PROF_LLC_MISSES,        // last level cache misses, each a cache line from memory
+    PROF_BRANCH_MISSES,
+    PROF_COUNTERS
+} prof_counter_t;
+
+// Bytes moved from memory per last level cache miss, for the memory bandwidth estimate
+#define PROF_CACHE_LINE 64
+
+// Counter value of a counter that could not be read
+#define PROF_NO_COUNT UINT64_MAX
+
+/*
+Timing is off until prof_enable is called, and recording a sample is then a
+monotonic clock read plus an append to samples of the calling thread, which
+take no lock. The summary and the report merge the samples of every thread,
+so they, prof_enable and prof_disable must be called while no other thread
+is recording. Phases that run on several threads at once, like the encoders,
+add up the time of every thread.
+
+With prof_enable_counters, each thread that times a section also opens its
+own perf_event counters, and a section adds the change in the counters of
+the thread that ran it. Workers that do part of a section for the thread
+that times it, like the bands of a step, add their counters to the section
+with prof_end_share. A section whose workers do not, like a render with more
+than one thread, only counts the share of the calling thread.
+*/
+
+// Start of a timed section
+typedef struct {
+    double time;                        // prof_now when the section started
+    uint64_t counts[PROF_COUNTERS];     // the thread's counters when it started, or PROF_NO_COUNT
+} prof_mark_t;
+
+// What the report says about the run besides the timings
+typedef struct {
+    const char *input;      // input file name
+    int rows;               // grid rows
+    int cols;               // grid columns
+    int steps;              // steps run
+    int threads;            // worker threads
+} prof_run_t;
+
+double prof_now(void);
+void prof_enable(void);
+void prof_disable(void);
+int prof_enabled(void);
+int prof_enable_counters(void);
+void prof_add(prof_phase_t phase, double seconds, uint64_t work);
+void prof_add_counts(prof_phase_t phase, double seconds, uint64_t work, const uint64_t counts[PROF_COUNTERS]);
+void prof_begin(prof_mark_t *mark);
+void prof_end(prof_phase_t phase, const prof_mark_t *mark, uint64_t work);
+void prof_end_share(prof_phase_t phase, const prof_mark_t *mark);
+void prof_print_summary(FILE *out);
+int prof_write_report(const char *filename, const prof_run_t *run);
+
+#endif // PROF_H
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "queue.h"
+#include "mem.h"
+
+/**
+ * Sets up an empty queue
+ * Inputs:
+ *  - q: queue to initialize
+ *  - capacity: number of slots, rounded up to a power of two (at least 2)
+ * Returns: 1 on success, 0 on failure
+ */
+int mpmc_queue_init(mpmc_queue_t *q, size_t capacity) {
+    if (!q || capacity == 0 || capacity > SIZE_MAX / 2) {
+        return 0;
+    }
+
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    q->cells = mem_alloc(MEM_ENCODE, size * sizeof(mpmc_cell_t));
+    if (!q->cells) {
+        return 0;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&q->cells[i].seq, i);
+        q->cells[i].value = NULL;
+    }
+    q->mask = size - 1;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    return 1;
+}
+
+/**
+ * Appends a value. A producer claims the slot at enqueue_pos once the slot's
+ * sequence says the consumers are done with it, then publishes the value by
+ * advancing the sequence.
+ * Returns: 1 on success, 0 if the queue is full
+ */
+int mpmc_queue_push(mpmc_queue_t *q, void *value) {
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        mpmc_cell_t *cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->value = value;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 1;
+            }
+            // pos was reloaded by the failed exchange
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Removes the oldest value. The mirror image of push: the slot is ready once
+ * its sequence is one past the position, and is handed back to the producers
+ * a full lap ahead.
+ * Returns: 1 on success, 0 if the queue is empty
+ */
+int mpmc_queue_pop(mpmc_queue_t *q, void **value) {
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        mpmc_cell_t *cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *value = cell->value;
+                atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+void mpmc_queue_destroy(mpmc_queue_t *q) {
+    if (!q) {
+        return;
+    }
+    mem_free(q->cells);
+    q->cells = NULL;
+}
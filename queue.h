@@ -0,0 +1,29 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+// One slot of the ring; seq tells producers and consumers whose turn it is
+typedef struct {
+    atomic_size_t seq;
+    void *value;
+} mpmc_cell_t;
+
+// Bounded lock-free multi-producer multi-consumer FIFO of pointers (Vyukov's
+// array queue). Push and pop never block; they fail when the queue is full or
+// empty. The two positions sit on separate cache lines so producers and
+// consumers do not contend.
+typedef struct {
+    mpmc_cell_t *cells;
+    size_t mask;                            // capacity - 1, capacity is a power of two
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+} mpmc_queue_t;
+
+int mpmc_queue_init(mpmc_queue_t *q, size_t capacity);
+int mpmc_queue_push(mpmc_queue_t *q, void *value);
+int mpmc_queue_pop(mpmc_queue_t *q, void **value);
+void mpmc_queue_destroy(mpmc_queue_t *q);
+
+#endif // QUEUE_H
@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include "raster.h"
+#include "mem.h"
+
+// Tests whether the host stores numbers big-endian; the files are always little-endian
+static int raster_big_endian(void) {
+    const uint16_t one = 1;
+    return *(const uint8_t *)&one == 0;
+}
+
+// Reverses the bytes of each of count samples of the given size
+static void raster_swap(unsigned char *p, int count, size_t size) {
+    for (int i = 0; i < count; i++, p += size) {
+        for (size_t a = 0, b = size - 1; a < b; a++, b--) {
+            unsigned char t = p[a];
+            p[a] = p[b];
+            p[b] = t;
+        }
+    }
+}
+
+static size_t raster_sample_size(raster_type_t type) {
+    return type == RASTER_FLOAT32 ? sizeof(float) : sizeof(double);
+}
+
+/**
+ * Creates an exporter for rasters of a north-up grid that is not held in a
+ * point cloud, such as one written a band at a time with raster_write_samples
+ * Inputs:
+ *  - rows, cols: grid size
+ *  - type: RASTER_FLOAT32 or RASTER_FLOAT64
+ *  - x0, y0: map position of the north-west corner of the grid
+ *  - dx, dy: cell width and height
+ * Returns: the exporter, or NULL on failure
+ */
+raster_writer_t* raster_writer_create_grid(int rows, int cols, raster_type_t type,
+                                           double x0, double y0, double dx, double dy) {
+    if (rows <= 0 || cols <= 0 || (type != RASTER_FLOAT32 && type != RASTER_FLOAT64)) {
+        fprintf(stderr, "Invalid parameters passed to raster_writer_create_grid\n");
+        return NULL;
+    }
+
+    raster_writer_t *rw = mem_calloc(MEM_ENCODE, 1, sizeof(raster_writer_t));
+    if (!rw) {
+        return NULL;
+    }
+    rw->rows = rows;
+    rw->cols = cols;
+    rw->type = type;
+    rw->x0 = x0;
+    rw->y0 = y0;
+    rw->dx = dx;
+    rw->dy = dy;
+
+    size_t row_bytes = (size_t)cols * raster_sample_size(type);
+    rw->chunk_rows = row_bytes < RASTER_CHUNK ? (int)(RASTER_CHUNK / row_bytes) : 1;
+    rw->chunk_rows = rw->chunk_rows < rows ? rw->chunk_rows : rows;
+    rw->buffer = mem_alloc(MEM_ENCODE, rw->chunk_rows * row_bytes);
+    if (!rw->buffer) {
+        mem_free(rw);
+        return NULL;
+    }
+    return rw;
+}
+
+/**
+ * Creates an exporter for rasters with one sample per cell of a grid
+ * Inputs:
+ *  - pc: grid the rasters describe; its validity mask is borrowed, not copied
+ *  - type: RASTER_FLOAT32 or RASTER_FLOAT64
+ * Returns: the exporter, or NULL on failure
+ */
+raster_writer_t* raster_writer_create(const pointcloud_t *pc, raster_type_t type) {
+    if (!pc || !pc->points.data || pc->rows <= 0 || pc->cols <= 0 ||
+        (size_t)pc->rows * pc->cols != (size_t)pc->points.size) {
+        fprintf(stderr, "Invalid parameters passed to raster_writer_create\n");
+        return NULL;
+    }
+
+    // Cell centres of the corner cells give the cell size and the grid's extent
+    const pcd_t *points = pc->points.data;
+    double first_x = points[0].x, last_x = points[pc->cols - 1].x;
+    double first_y = points[0].y, last_y = points[(size_t)(pc->rows - 1) * pc->cols].y;
+    double dx = pc->cols > 1 ? fabs(last_x - first_x) / (pc->cols - 1) : 0.0;
+    double dy = pc->rows > 1 ? fabs(last_y - first_y) / (pc->rows - 1) : 0.0;
+
+    raster_writer_t *rw = raster_writer_create_grid(pc->rows, pc->cols, type,
+                                                    fmin(first_x, last_x) - dx / 2,
+                                                    fmax(first_y, last_y) + dy / 2, dx, dy);
+    if (rw) {
+        rw->flip = pointcloud_rows_ascending(pc);
+        rw->valid = pc->valid;
+    }
+    return rw;
+}
+
+// File name extension of a raster type, without the dot
+const char* raster_extension(raster_type_t type) {
+    return type == RASTER_FLOAT32 ? "f32" : "f64";
+}
+
+/**
+ * Converts one grid row to little-endian samples, NODATA cells included
+ */
+static void raster_convert_row(const raster_writer_t *rw, const char *data, size_t stride,
+                               int row, unsigned char *out) {
+    size_t first = (size_t)row * rw->cols;
+    const char *src = data + first * stride;
+
+    if (rw->type == RASTER_FLOAT32) {
+        float *dst = (float *)out;
+        for (int c = 0; c < rw->cols; c++) {
+            dst[c] = (float)*(const double *)(src + c * stride);
+        }
+        if (rw->valid) {
+            for (int c = 0; c < rw->cols; c++) {
+                if (!POINTCLOUD_VALID(rw->valid, first + c)) {
+                    dst[c] = (float)POINTCLOUD_NODATA;
+                }
+            }
+        }
+    } else {
+        double *dst = (double *)out;
+        for (int c = 0; c < rw->cols; c++) {
+            dst[c] = *(const double *)(src + c * stride);
+        }
+        if (rw->valid) {
+            for (int c = 0; c < rw->cols; c++) {
+                if (!POINTCLOUD_VALID(rw->valid, first + c)) {
+                    dst[c] = POINTCLOUD_NODATA;
+                }
+            }
+        }
+    }
+
+    if (raster_big_endian()) {
+        raster_swap(out, rw->cols, raster_sample_size(rw->type));
+    }
+}
+
+// Name of a raster's ENVI header: the raster's name with its extension replaced by .hdr
+static void raster_header_name(const char *filename, char *hdrfile, size_t size) {
+    snprintf(hdrfile, size - 4, "%s", filename);
+    char *dot = strrchr(hdrfile, '.');
+    char *slash = strrchr(hdrfile, '/');
+    if (dot && (!slash || dot > slash)) {
+        *dot = '\0';
+    }
+    strcat(hdrfile, ".hdr");
+}
+
+/**
+ * Writes the ENVI header of a raster next to it, replacing the extension with .hdr
+ * Returns: 0 on success, -1 on failure
+ */
+int raster_write_header(const raster_writer_t *rw, const char *filename, const char *description) {
+    char hdrfile[512];
+    raster_header_name(filename, hdrfile, sizeof(hdrfile));
+
+    FILE *f = fopen(hdrfile, "w");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s\n", hdrfile);
+        return -1;
+    }
+
+    fprintf(f, "ENVI\n");
+    fprintf(f, "description = {%s}\n", description ? description : "Terraflow raster");
+    fprintf(f, "samples = %d\n", rw->cols);
+    fprintf(f, "lines = %d\n", rw->rows);
+    fprintf(f, "bands = 1\n");
+    fprintf(f, "header offset = 0\n");
+    fprintf(f, "file type = ENVI Standard\n");
+    fprintf(f, "data type = %d\n", rw->type);
+    fprintf(f, "interleave = bsq\n");
+    fprintf(f, "byte order = 0\n");
+    fprintf(f, "data ignore value = %g\n", POINTCLOUD_NODATA);
+    if (rw->dx > 0 && rw->dy > 0) {
+        fprintf(f, "map info = {Arbitrary, 1, 1, %.6f, %.6f, %.9g, %.9g}\n",
+                rw->x0, rw->y0, rw->dx, rw->dy);
+    }
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", hdrfile);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes one field as a raster plus its header. Rows are converted a chunk at
+ * a time and each chunk goes to the file in one unbuffered write; a float64
+ * field that is already in file order is written straight from memory.
+ * Inputs:
+ *  - rw: exporter of the field's grid
+ *  - data: value of cell i is the double at (const char *)data + i * stride
+ *  - stride: distance between consecutive values, in bytes
+ *  - filename: raster file name
+ *  - description: text for the header's description field, or NULL
+ * Returns: 0 on success, -1 on failure
+ */
+int raster_write(raster_writer_t *rw, const void *data, size_t stride,
+                 const char *filename, const char *description) {
+    if (!rw || !data || stride == 0 || !filename) {
+        return -1;
+    }
+
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s\n", filename);
+        return -1;
+    }
+    setvbuf(f, NULL, _IONBF, 0);
+
+    size_t row_bytes = (size_t)rw->cols * raster_sample_size(rw->type);
+    int ok = 1;
+    if (rw->type == RASTER_FLOAT64 && stride == sizeof(double) && !rw->flip && !rw->valid && !raster_big_endian()) {
+        ok = fwrite(data, row_bytes, rw->rows, f) == (size_t)rw->rows;
+    } else {
+        for (int r0 = 0; ok && r0 < rw->rows; r0 += rw->chunk_rows) {
+            int n = rw->rows - r0 < rw->chunk_rows ? rw->rows - r0 : rw->chunk_rows;
+            for (int k = 0; k < n; k++) {
+                int row = rw->flip ? rw->rows - 1 - (r0 + k) : r0 + k;
+                raster_convert_row(rw, (const char *)data, stride, row, rw->buffer + k * row_bytes);
+            }
+            ok = fwrite(rw->buffer, row_bytes, n, f) == (size_t)n;
+        }
+    }
+
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Error: Failed to write %s\n", filename);
+        return -1;
+    }
+    return raster_write_header(rw, filename, description);
+}
+
+/**
+ * Appends samples to an open raster file, converted to the raster's type and
+ * byte order a chunk at a time. NODATA cells are expected to hold the NODATA
+ * value already.
+ * Inputs:
+ *  - rw: exporter of the raster
+ *  - f: raster file, positioned where the samples go
+ *  - data: samples in file order
+ *  - count: number of samples
+ * Returns: 0 on success, -1 on failure
+ */
+int raster_write_samples(raster_writer_t *rw, FILE *f, const double *data, size_t count) {
+    if (!rw || !f || (!data && count > 0)) {
+        return -1;
+    }
+
+    size_t size = raster_sample_size(rw->type);
+    size_t chunk = (size_t)rw->chunk_rows * rw->cols;
+    for (size_t first = 0; first < count; first += chunk) {
+        size_t n = count - first < chunk ? count - first : chunk;
+        if (rw->type == RASTER_FLOAT32) {
+            float *dst = (float *)rw->buffer;
+            for (size_t i = 0; i < n; i++) {
+                dst[i] = (float)data[first + i];
+            }
+        } else {
+            memcpy(rw->buffer, data + first, n * sizeof(double));
+        }
+        if (raster_big_endian()) {
+            raster_swap(rw->buffer, (int)n, size);
+        }
+        if (fwrite(rw->buffer, size, n, f) != n) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Values read from an ENVI header
+typedef struct {
+    int samples, lines, data_type, byte_order;
+    long offset;
+    double x0, y0, dx, dy;  // map info; dx and dy are 0 without one
+    double ignore;          // data ignore value
+} raster_header_t;
+
+/**
+ * Reads the fields of an ENVI header this module can load: single band,
+ * float32 or float64
+ * Returns: 0 on success, -1 on failure
+ */
+static int raster_read_header(const char *hdrfile, raster_header_t *h) {
+    FILE *f = fopen(hdrfile, "r");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s\n", hdrfile);
+        return -1;
+    }
+
+    memset(h, 0, sizeof(*h));
+    h->ignore = POINTCLOUD_NODATA;
+    int bands = 1, ok = 1;
+    char line[1024], first[16] = "";
+    if (!fgets(first, sizeof(first), f) || strncmp(first, "ENVI", 4) != 0) {
+        ok = 0;
+    }
+    while (ok && fgets(line, sizeof(line), f)) {
+        char *eq = strchr(line, '=');
+        if (!eq) {
+            continue;
+        }
+        *eq = '\0';
+        char *key = line, *value = eq + 1;
+        // Trim the key
+        while (*key == ' ' || *key == '\t') {
+            key++;
+        }
+        for (char *end = eq - 1; end >= key && (*end == ' ' || *end == '\t'); end--) {
+            *end = '\0';
+        }
+
+        if (strcmp(key, "samples") == 0) {
+            h->samples = atoi(value);
+        } else if (strcmp(key, "lines") == 0) {
+            h->lines = atoi(value);
+        } else if (strcmp(key, "bands") == 0) {
+            bands = atoi(value);
+        } else if (strcmp(key, "header offset") == 0) {
+            h->offset = atol(value);
+        } else if (strcmp(key, "data type") == 0) {
+            h->data_type = atoi(value);
+        } else if (strcmp(key, "byte order") == 0) {
+            h->byte_order = atoi(value);
+        } else if (strcmp(key, "data ignore value") == 0) {
+            h->ignore = atof(value);
+        } else if (strcmp(key, "map info") == 0) {
+            // {projection, reference x, reference y, easting, northing, dx, dy, ...}
+            char *open = strchr(value, '{');
+            double ref_x, ref_y, e, n, dx, dy;
+            char *field = open ? strchr(open, ',') : NULL;
+            if (field && sscanf(field, ", %lf , %lf , %lf , %lf , %lf , %lf",
+                                &ref_x, &ref_y, &e, &n, &dx, &dy) == 6) {
+                // The reference pixel is 1-based with (1, 1) at the north-west corner
+                h->x0 = e - (ref_x - 1) * dx;
+                h->y0 = n + (ref_y - 1) * dy;
+                h->dx = dx;
+                h->dy = dy;
+            }
+        }
+    }
+    fclose(f);
+
+    if (!ok || h->samples <= 0 || h->lines <= 0 || bands != 1 || h->offset < 0 ||
+        (h->data_type != RASTER_FLOAT32 && h->data_type != RASTER_FLOAT64) ||
+        (h->byte_order != 0 && h->byte_order != 1)) {
+        fprintf(stderr, "Error: %s is not a single band float32 or float64 ENVI header\n", hdrfile);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads a raster with an ENVI header, as written by raster_write, into a
+ * point cloud. The first line of the raster is the north-most row, so the
+ * rows of the point cloud run north to south. Samples equal to the header's
+ * data ignore value, at or below POINTCLOUD_NODATA, or NaN are NODATA. A
+ * raster without map info gets unit cells with the south-west corner at 0, 0.
+ * Inputs:
+ *  - filename: raster file; the header is the same name with the extension .hdr
+ * Returns: the point cloud, or NULL on failure
+ */
+pointcloud_t* raster_read(const char *filename) {
+    if (!filename) {
+        return NULL;
+    }
+    char hdrfile[512];
+    raster_header_name(filename, hdrfile, sizeof(hdrfile));
+    raster_header_t h;
+    if (raster_read_header(hdrfile, &h) != 0) {
+        return NULL;
+    }
+    if (h.dx <= 0 || h.dy <= 0) {
+        h.dx = h.dy = 1.0;
+        h.x0 = 0.0;
+        h.y0 = h.lines;
+    }
+
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s\n", filename);
+        return NULL;
+    }
+
+    size_t n = (size_t)h.lines * h.samples;
+    size_t size = h.data_type == RASTER_FLOAT32 ? sizeof(float) : sizeof(double);
+    pointcloud_t *pc = mem_calloc(MEM_INGEST, 1, sizeof(pointcloud_t));
+    pcd_t *points = n <= INT_MAX ? mem_alloc(MEM_INGEST, n * sizeof(pcd_t)) : NULL;
+    unsigned char *row = mem_alloc(MEM_INGEST, (size_t)h.samples * size);
+    if (!pc || !points || !row || fseek(f, h.offset, SEEK_SET) != 0) {
+        fprintf(stderr, "Error: Cannot load a %d x %d raster\n", h.lines, h.samples);
+        mem_free(pc);
+        mem_free(points);
+        mem_free(row);
+        fclose(f);
+        return NULL;
+    }
+
+    pc->water_coef = 0.1;
+    pc->evap_coef = 0.95;
+    pc->rows = h.lines;
+    pc->cols = h.samples;
+    pc->points.data = points;
+    pc->points.size = (int)n;
+    pc->points.max_size = (int)n;
+    pc->points.max_element_size = sizeof(pcd_t);
+    pc->stats.min_height = DBL_MAX;
+    pc->stats.max_height = -DBL_MAX;
+
+    // Swap when the file's byte order is not the host's
+    int swap = h.byte_order != raster_big_endian();
+    long nodata = 0;
+    double height_sum = 0;
+    int ok = 1;
+    for (int r = 0; ok && r < h.lines; r++) {
+        if (fread(row, size, h.samples, f) != (size_t)h.samples) {
+            ok = 0;
+            break;
+        }
+        if (swap) {
+            raster_swap(row, h.samples, size);
+        }
+        for (int c = 0; c < h.samples; c++) {
+            size_t i = (size_t)r * h.samples + c;
+            double z = size == sizeof(float) ? ((const float *)row)[c] : ((const double *)row)[c];
+            pcd_t point = {
+                .x = h.x0 + (c + 0.5) * h.dx, .y = h.y0 - (r + 0.5) * h.dy, .z = z,
+                .wd = 0.0,
+                .north = NULL, .south = NULL,
+                .east = NULL, .west = NULL
+            };
+
+            if (z != z || z == h.ignore || z <= POINTCLOUD_NODATA) {
+                if (!pc->valid && !(pc->valid = pointcloud_mask_alloc(n))) {
+                    ok = 0;
+                    break;
+                }
+                pc->valid[i >> 6] &= ~(1ULL << (i & 63));
+                point.z = POINTCLOUD_NODATA;
+                nodata++;
+            } else {
+                if (z < pc->stats.min_height) pc->stats.min_height = z;
+                if (z > pc->stats.max_height) pc->stats.max_height = z;
+                height_sum += z;
+            }
+            points[i] = point;
+        }
+    }
+    mem_free(row);
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "Error: Failed to read %s\n", filename);
+        pointcloud_free(pc);
+        return NULL;
+    }
+
+    pc->stats.avg_height = (long)n > nodata ? height_sum / (n - nodata) : 0.0;
+    pc->stats.min_x = h.x0 + 0.5 * h.dx;
+    pc->stats.max_x = h.x0 + (h.samples - 0.5) * h.dx;
+    pc->stats.min_y = h.y0 - (h.lines - 0.5) * h.dy;
+    pc->stats.max_y = h.y0 - 0.5 * h.dy;
+
+    printf("Grid Analysis:\n");
+    printf("Raster dimensions: %d rows x %d columns (%s)\n", pc->rows, pc->cols,
+           h.data_type == RASTER_FLOAT32 ? "float32" : "float64");
+    if (nodata > 0) {
+        printf("NODATA points: %ld\n", nodata);
+    }
+    return pc;
+}
+
+void raster_writer_free(raster_writer_t *rw) {
+    if (!rw) {
+        return;
+    }
+    mem_free(rw->buffer);
+    mem_free(rw);
+}
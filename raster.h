@@ -0,0 +1,47 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <stdint.h>
+#include "pointcloud.h"
+
+// Sample types of an exported raster, numbered like ENVI's "data type" field
+typedef enum {
+    RASTER_FLOAT32 = 4,
+    RASTER_FLOAT64 = 5,
+} raster_type_t;
+
+// Bytes converted per write; the rows of a raster go to the disk in chunks of about this size
+#define RASTER_CHUNK (4 << 20)
+
+/*
+Rasters are headerless little-endian samples, one per grid cell, with the
+north-most row first, so numpy.memmap or GDAL can map them directly. Each
+comes with an ENVI .hdr sidecar giving the size, sample type, NODATA value and
+the map position of the north-west corner.
+*/
+
+// Everything about a raster export that does not change between steps
+typedef struct {
+    int rows;               // grid rows
+    int cols;               // grid columns
+    raster_type_t type;     // sample type written
+    int flip;               // 1 when grid rows run south to north and are written in reverse
+    double x0, y0;          // map position of the north-west corner of the grid
+    double dx, dy;          // cell width and height, 0 for a single column or row
+    const uint64_t *valid;  // validity mask borrowed from the point cloud, NULL when all valid
+    unsigned char *buffer;  // converted samples of the chunk being written
+    int chunk_rows;         // grid rows that fit in the buffer
+} raster_writer_t;
+
+raster_writer_t* raster_writer_create(const pointcloud_t *pc, raster_type_t type);
+raster_writer_t* raster_writer_create_grid(int rows, int cols, raster_type_t type,
+                                           double x0, double y0, double dx, double dy);
+const char* raster_extension(raster_type_t type);
+int raster_write(raster_writer_t *rw, const void *data, size_t stride,
+                 const char *filename, const char *description);
+int raster_write_header(const raster_writer_t *rw, const char *filename, const char *description);
+int raster_write_samples(raster_writer_t *rw, FILE *f, const double *data, size_t count);
+void raster_writer_free(raster_writer_t *rw);
+pointcloud_t* raster_read(const char *filename);
+
+#endif // RASTER_H
@@ -0,0 +1,684 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "prof.h"
+#include "trace.h"
+#include "mem.h"
+#include "render.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Blends a terrain gray level with a water factor in [0, 1]
+static bm_color_t render_blend(int terrain, double water_factor) {
+    int blue = (int)(water_factor * 255);
+    int r = terrain * (1 - water_factor);
+    int g = terrain * (1 - water_factor);
+    int b = terrain * (1 - water_factor) + blue;
+    return bm_rgb(r, g, b);
+}
+
+// Fills the fixed palette: index shade * RENDER_WATER_LEVELS + level holds the
+// blend of evenly spaced terrain shades and water levels; unused indices are black
+static void render_build_palette(bm_color_t palette[256]) {
+    for (int i = 0; i < 256; i++) {
+        palette[i] = bm_rgb(0, 0, 0);
+    }
+    for (int shade = 0; shade < RENDER_SHADES; shade++) {
+        int terrain = shade * 255 / (RENDER_SHADES - 1);
+        for (int level = 0; level < RENDER_WATER_LEVELS; level++) {
+            double water_factor = (double)level / (RENDER_WATER_LEVELS - 1);
+            palette[shade * RENDER_WATER_LEVELS + level] = render_blend(terrain, water_factor);
+        }
+    }
+}
+
+// Converts every palette color to BT.601 studio-range Y, Cb and Cr
+static void render_build_yuv(const bm_color_t palette[256], uint8_t yuv[3][256]) {
+    for (int i = 0; i < 256; i++) {
+        unsigned char r, g, b;
+        bm_get_rgb(palette[i], &r, &g, &b);
+        yuv[0][i] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        yuv[1][i] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        yuv[2][i] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+}
+
+// Pixel and block bounds of one tile
+typedef struct {
+    int x0, x1, y0, y1;     // pixel columns and rows
+    int br0, br1;           // block rows the pixel rows cover
+} render_tile_t;
+
+// A tiled pass over a field that has a value at every grid cell
+typedef struct {
+    const render_ctx_t *rc;
+    const char *data;       // value of cell i is the double at data + i * stride
+    size_t stride;          // bytes between consecutive values
+    double *mean;           // render_create: average of each pixel, NAN if empty
+    int *count;             // render_create: valid cells of each pixel
+    uint8_t *indices;       // render_compose: palette index of each pixel
+    double levels;          // render_compose: water levels per unit of depth
+    double *hsum;           // tile_rows * RENDER_TILE row sums per thread
+    int *hcount;            // as many valid cell counts per thread, NULL without count
+} render_job_t;
+
+static int render_tile_count(const render_ctx_t *rc) {
+    return ((rc->width + RENDER_TILE - 1) / RENDER_TILE) * ((rc->height + RENDER_TILE - 1) / RENDER_TILE);
+}
+
+// Union of the block ranges of pixels first..last-1 of a span array
+static void render_span_union(const int *span, int first, int last, int *lo, int *hi) {
+    *lo = INT_MAX;
+    *hi = INT_MIN;
+    for (int p = first; p < last; p++) {
+        if (span[2 * p] < span[2 * p + 1]) {
+            *lo = span[2 * p] < *lo ? span[2 * p] : *lo;
+            *hi = span[2 * p + 1] > *hi ? span[2 * p + 1] : *hi;
+        }
+    }
+    if (*lo > *hi) {
+        *lo = *hi = 0;
+    }
+}
+
+static void render_tile_bounds(const render_ctx_t *rc, int t, render_tile_t *tile) {
+    int tiles_x = (rc->width + RENDER_TILE - 1) / RENDER_TILE;
+    tile->x0 = (t % tiles_x) * RENDER_TILE;
+    tile->y0 = (t / tiles_x) * RENDER_TILE;
+    tile->x1 = tile->x0 + RENDER_TILE < rc->width ? tile->x0 + RENDER_TILE : rc->width;
+    tile->y1 = tile->y0 + RENDER_TILE < rc->height ? tile->y0 + RENDER_TILE : rc->height;
+    render_span_union(rc->row_span, tile->y0, tile->y1, &tile->br0, &tile->br1);
+}
+
+/**
+ * Sums the valid cells of each row of blocks a tile covers over every pixel
+ * column's span of blocks, and counts them into hcount unless it is NULL
+ */
+static void render_tile_rows(const render_ctx_t *rc, const render_tile_t *tile,
+                             const char *data, size_t stride, double *hsum, int *hcount) {
+    int level = rc->level, tw = tile->x1 - tile->x0;
+    for (int br = tile->br0; br < tile->br1; br++) {
+        double *hsums = hsum + (size_t)(br - tile->br0) * tw;
+        int *hcounts = hcount ? hcount + (size_t)(br - tile->br0) * tw : NULL;
+        memset(hsums, 0, tw * sizeof(double));
+        if (hcounts) {
+            memset(hcounts, 0, tw * sizeof(int));
+        }
+
+        int r0 = br << level;
+        int r1 = ((br + 1) << level) < rc->rows ? (br + 1) << level : rc->rows;
+        for (int r = r0; r < r1; r++) {
+            size_t row = (size_t)r * rc->cols;
+            const char *src = data + row * stride;
+            for (int x = tile->x0; x < tile->x1; x++) {
+                int c0 = rc->col_span[2 * x] << level;
+                int c1 = rc->col_span[2 * x + 1] << level;
+                c1 = c1 < rc->cols ? c1 : rc->cols;
+                double sum = 0.0;
+                int n = 0;
+                if (rc->valid) {
+                    for (int c = c0; c < c1; c++) {
+                        if (POINTCLOUD_VALID(rc->valid, row + c)) {
+                            sum += *(const double *)(src + c * stride);
+                            n++;
+                        }
+                    }
+                } else {
+                    for (int c = c0; c < c1; c++) {
+                        sum += *(const double *)(src + c * stride);
+                    }
+                    n = c1 > c0 ? c1 - c0 : 0;
+                }
+                hsums[x - tile->x0] += sum;
+                if (hcounts) {
+                    hcounts[x - tile->x0] += n;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Box-filters the tiles of one thread separably: each row of blocks is summed
+ * across every pixel column, then the rows are summed down every pixel row
+ */
+static void render_tile_worker(void *arg, int thread, int nthreads) {
+    render_job_t *job = arg;
+    const render_ctx_t *rc = job->rc;
+    size_t rows = (size_t)rc->tile_rows * RENDER_TILE;
+    double *hsum = job->hsum + thread * rows;
+    int *hcount = job->hcount ? job->hcount + thread * rows : NULL;
+
+    int ntiles = render_tile_count(rc);
+    for (int t = thread; t < ntiles; t += nthreads) {
+        double start = trace_begin();
+        render_tile_t tile;
+        render_tile_bounds(rc, t, &tile);
+        render_tile_rows(rc, &tile, job->data, job->stride, hsum, hcount);
+
+        int tw = tile.x1 - tile.x0;
+        for (int y = tile.y0; y < tile.y1; y++) {
+            int rlo = rc->row_span[2 * y] - tile.br0, rhi = rc->row_span[2 * y + 1] - tile.br0;
+            for (int x = tile.x0; x < tile.x1; x++) {
+                size_t p = (size_t)y * rc->width + x;
+                if (job->count) {
+                    double sum = 0.0;
+                    int n = 0;
+                    for (int br = rlo; br < rhi; br++) {
+                        sum += hsum[(size_t)br * tw + (x - tile.x0)];
+                        n += hcount[(size_t)br * tw + (x - tile.x0)];
+                    }
+                    job->count[p] = n;
+                    job->mean[p] = n > 0 ? sum / n : NAN;
+                } else if (rc->count[p] > 0) {
+                    double sum = 0.0;
+                    for (int br = rlo; br < rhi; br++) {
+                        sum += hsum[(size_t)br * tw + (x - tile.x0)];
+                    }
+                    // Nearest water level; NaN and negative depths count as dry
+                    double level = sum / rc->count[p] * job->levels + 0.5;
+                    int index = level > 0 ? (int)level : 0;
+                    index = index < RENDER_WATER_LEVELS ? index : RENDER_WATER_LEVELS - 1;
+                    job->indices[p] = rc->shade[p] + index;
+                }
+            }
+        }
+        trace_end("render tile", start, "tile", t);
+    }
+}
+
+/**
+ * Runs a tiled pass on up to nthreads threads. The scratch of every thread is
+ * allocated up front, so the pass either covers every tile or fails before
+ * writing anything.
+ * Returns: 1 on success, 0 on failure
+ */
+static int render_tiles(render_job_t *job, int nthreads) {
+    const render_ctx_t *rc = job->rc;
+    int ntiles = render_tile_count(rc);
+    nthreads = nthreads < ntiles ? nthreads : ntiles;
+    nthreads = nthreads > 0 ? nthreads : 1;
+
+    size_t rows = (size_t)rc->tile_rows * RENDER_TILE * nthreads;
+    job->hsum = mem_alloc(MEM_RENDER, rows * sizeof(double));
+    job->hcount = job->count ? mem_alloc(MEM_RENDER, rows * sizeof(int)) : NULL;
+    int ok = job->hsum && (!job->count || job->hcount);
+    if (ok) {
+        parallelRun(nthreads, render_tile_worker, job);
+    } else {
+        fprintf(stderr, "Failed to allocate render tile buffers\n");
+    }
+    mem_free(job->hsum);
+    mem_free(job->hcount);
+    return ok;
+}
+
+/**
+ * Fills the block range of every pixel from the pixel each cell projects to
+ * (-1 outside the image); a block belongs to the pixel of its centre cell
+ */
+static void render_spans(const int *cell_pixel, int cells, int level, int pixels, int *span) {
+    for (int p = 0; p < 2 * pixels; p++) {
+        span[p] = 0;
+    }
+
+    int blocks = (cells + (1 << level) - 1) >> level;
+    for (int b = 0; b < blocks; b++) {
+        int centre = (b << level) + ((1 << level) >> 1);
+        int p = cell_pixel[centre < cells ? centre : cells - 1];
+        if (p < 0) {
+            continue;
+        }
+        if (span[2 * p] == span[2 * p + 1]) {
+            span[2 * p] = b;
+            span[2 * p + 1] = b + 1;
+        } else {
+            span[2 * p] = b < span[2 * p] ? b : span[2 * p];
+            span[2 * p + 1] = b + 1 > span[2 * p + 1] ? b + 1 : span[2 * p + 1];
+        }
+    }
+}
+
+/**
+ * Maps the grid of a point cloud onto an image once: the block range of every
+ * pixel row and column, the valid cells of every pixel and its terrain shade
+ * Inputs:
+ *  - pc: point cloud with rows * cols points in grid order; NODATA cells are left out
+ *  - size: edge length of the square image, 0 for RENDER_SIZE, or RENDER_NATIVE
+ *    for a cols x rows image with one pixel per cell
+ * Output: the render context, or NULL on failure
+ */
+render_ctx_t* render_create(const pointcloud_t *pc, int size) {
+    if (!pc || !pc->points.data || size < RENDER_NATIVE || pc->rows <= 0 || pc->cols <= 0 ||
+        (long)pc->rows * pc->cols != pc->points.size) {
+        fprintf(stderr, "Invalid parameters passed to render_create\n");
+        return NULL;
+    }
+    if (size == 0) {
+        size = RENDER_SIZE;
+    }
+
+    int rows = pc->rows, cols = pc->cols;
+    int width = size == RENDER_NATIVE ? cols : size;
+    int height = size == RENDER_NATIVE ? rows : size;
+    if (width > 0xFFFF || height > 0xFFFF) {
+        fprintf(stderr, "Image size %dx%d exceeds the GIF limit of 65535 pixels\n", width, height);
+        return NULL;
+    }
+
+    size_t pixels = (size_t)width * height;
+    render_ctx_t *rc = mem_calloc(MEM_RENDER, 1, sizeof(render_ctx_t));
+    int *col_pixel = mem_alloc(MEM_RENDER, cols * sizeof(int));
+    int *row_pixel = mem_alloc(MEM_RENDER, rows * sizeof(int));
+    if (rc) {
+        rc->width = width;
+        rc->height = height;
+        rc->rows = rows;
+        rc->cols = cols;
+        rc->nthreads = defaultThreadCount();
+        rc->col_span = mem_alloc(MEM_RENDER, 2 * width * sizeof(int));
+        rc->row_span = mem_alloc(MEM_RENDER, 2 * height * sizeof(int));
+        rc->count = mem_alloc(MEM_RENDER, pixels * sizeof(int));
+        rc->elevation = mem_alloc(MEM_RENDER, pixels * sizeof(double));
+        rc->terrain = mem_alloc(MEM_RENDER, pixels);
+        rc->shade = mem_alloc(MEM_RENDER, pixels);
+        rc->indices = mem_alloc(MEM_RENDER, pixels);
+        if (pc->valid) {
+            size_t words = ((size_t)pc->points.size + 63) / 64;
+            rc->valid = mem_alloc(MEM_RENDER, words * sizeof(uint64_t));
+            if (rc->valid) {
+                memcpy(rc->valid, pc->valid, words * sizeof(uint64_t));
+            }
+        }
+    }
+    if (!rc || !col_pixel || !row_pixel || !rc->col_span || !rc->row_span || !rc->count ||
+        !rc->elevation || !rc->terrain || !rc->shade || !rc->indices || (pc->valid && !rc->valid)) {
+        fprintf(stderr, "Failed to allocate render context\n");
+        mem_free(col_pixel);
+        mem_free(row_pixel);
+        render_free(rc);
+        return NULL;
+    }
+
+    const pcd_t *points = pc->points.data;
+    if (size == RENDER_NATIVE) {
+        // North up: grids whose rows run south to north are flipped
+        int ascending = pointcloud_rows_ascending(pc);
+        for (int c = 0; c < cols; c++) {
+            col_pixel[c] = c;
+        }
+        for (int r = 0; r < rows; r++) {
+            row_pixel[r] = ascending ? rows - 1 - r : r;
+        }
+    } else {
+        // Same projection as the point scatter this replaces, applied to the
+        // first cell of every column and row
+        double scaleX = (double)(size - 1) / (pc->stats.max_x - pc->stats.min_x);
+        double scaleY = (double)(size - 1) / (pc->stats.max_y - pc->stats.min_y);
+        double scale = fmin(scaleX, scaleY);
+        for (int c = 0; c < cols; c++) {
+            int x = (int)((points[c].x - pc->stats.min_x) * scale);
+            col_pixel[c] = x >= 0 && x < size ? x : -1;
+        }
+        for (int r = 0; r < rows; r++) {
+            int y = size - 1 - (int)((points[(size_t)r * cols].y - pc->stats.min_y) * scale);
+            row_pixel[r] = y >= 0 && y < size ? y : -1;
+        }
+
+        // Coarsest mip level whose blocks still fit in a pixel
+        double cell_x = cols > 1 ? (pc->stats.max_x - pc->stats.min_x) / (cols - 1) : 0.0;
+        double cell_y = rows > 1 ? (pc->stats.max_y - pc->stats.min_y) / (rows - 1) : 0.0;
+        double per_pixel = fmin(cell_x > 0 ? 1.0 / (cell_x * scale) : HUGE_VAL,
+                                cell_y > 0 ? 1.0 / (cell_y * scale) : HUGE_VAL);
+        int longest = rows > cols ? rows : cols;
+        while (per_pixel >= (double)(2 << rc->level) && (2 << rc->level) <= longest) {
+            rc->level++;
+        }
+    }
+
+    render_spans(col_pixel, cols, rc->level, width, rc->col_span);
+    render_spans(row_pixel, rows, rc->level, height, rc->row_span);
+    mem_free(col_pixel);
+    mem_free(row_pixel);
+
+    // Scratch size for the largest tile
+    int ntiles = render_tile_count(rc);
+    rc->tile_rows = 1;
+    for (int t = 0; t < ntiles; t++) {
+        render_tile_t tile;
+        render_tile_bounds(rc, t, &tile);
+        rc->tile_rows = tile.br1 - tile.br0 > rc->tile_rows ? tile.br1 - tile.br0 : rc->tile_rows;
+    }
+
+    // Average height and valid cell count of every pixel
+    render_job_t job = {
+        .rc = rc, .data = (const char *)points + offsetof(pcd_t, z), .stride = sizeof(pcd_t),
+        .mean = rc->elevation, .count = rc->count,
+    };
+    if (!render_tiles(&job, rc->nthreads)) {
+        render_free(rc);
+        return NULL;
+    }
+
+    double height_range = pc->stats.max_height - pc->stats.min_height;
+    for (size_t p = 0; p < pixels; p++) {
+        if (rc->count[p] == 0) {
+            rc->terrain[p] = 0;
+            rc->shade[p] = RENDER_EMPTY;
+            continue;
+        }
+
+        double height_factor = (rc->elevation[p] - pc->stats.min_height) / height_range;
+        int terrain = (int)(height_factor * 255);
+        terrain = terrain < 0 ? 0 : (terrain > 255 ? 255 : terrain);
+        rc->terrain[p] = (uint8_t)terrain;
+        rc->shade[p] = (uint8_t)((terrain * (RENDER_SHADES - 1) + 127) / 255 * RENDER_WATER_LEVELS);
+        rc->covered++;
+    }
+
+    // Pixels no cell maps to never change
+    memset(rc->indices, RENDER_EMPTY, pixels);
+    render_build_palette(rc->palette);
+    render_build_yuv(rc->palette, rc->yuv);
+    return rc;
+}
+
+/**
+ * Composites one frame: the terrain shade of each covered pixel combined with
+ * its average water depth, mapped through the fixed palette into indices.
+ * Only covered pixels are written, so indices should start out as RENDER_EMPTY.
+ * It only reads rc, so several threads can compose frames at once.
+ * Inputs:
+ *  - rc: render context of the grid the water belongs to
+ *  - wd: water depth of cell i is the double at (const char *)wd + i * stride
+ *  - stride: distance between consecutive depths, in bytes
+ *  - maxwd: depth drawn as full blue
+ *  - indices: width * height palette indices to fill
+ *  - nthreads: threads the tiles are split over
+ * Returns: 1 on success, 0 on failure, with indices untouched
+ */
+int render_compose(const render_ctx_t *rc, const void *wd, size_t stride, double maxwd,
+                   uint8_t *indices, int nthreads) {
+    if (!rc || !wd || stride == 0 || !indices || !(maxwd > 0)) {
+        return 0;
+    }
+
+    prof_mark_t start;
+    prof_begin(&start);
+    render_job_t job = {
+        .rc = rc, .data = wd, .stride = stride,
+        .indices = indices, .levels = (RENDER_WATER_LEVELS - 1) / maxwd,
+    };
+    if (!render_tiles(&job, nthreads)) {
+        return 0;
+    }
+    prof_end(PROF_RENDER, &start, (uint64_t)rc->width * rc->height);
+    return 1;
+}
+
+// Composites one frame into rc->indices; returns 1 on success, 0 on failure
+int render_water(render_ctx_t *rc, const void *wd, size_t stride, double maxwd) {
+    return rc && render_compose(rc, wd, stride, maxwd, rc->indices, rc->nthreads);
+}
+
+// Case-insensitive test for a ".gif" file name
+static int render_is_gif(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    return ext && tolower((unsigned char)ext[1]) == 'g' && tolower((unsigned char)ext[2]) == 'i' &&
+           tolower((unsigned char)ext[3]) == 'f' && ext[4] == '\0';
+}
+
+/**
+ * Saves the last composited frame. GIFs are written straight from the palette
+ * indices; other formats get an RGB copy of the frame.
+ * Returns: 1 on success, 0 on failure
+ */
+int render_save(render_ctx_t *rc, const char *filename) {
+    if (!rc || !filename) {
+        return 0;
+    }
+
+    printf("Saving water visualization to %s...\n", filename);
+    prof_mark_t start;
+    prof_begin(&start);
+    int ok;
+    if (render_is_gif(filename)) {
+        ok = bm_save_gif_indexed(filename, rc->width, rc->height, rc->indices, rc->palette, 256, -1);
+    } else {
+        if (!rc->bmp) {
+            rc->bmp = bm_create(rc->width, rc->height);
+        }
+        ok = rc->bmp != NULL;
+        if (ok) {
+            // bm_save attaches the palette it builds to the bitmap; drop the
+            // previous frame's so each frame gets its own
+            bm_set_palette(rc->bmp, NULL);
+
+            uint32_t *pixels = (uint32_t *)bm_raw_data(rc->bmp);
+            size_t count = (size_t)rc->width * rc->height;
+            for (size_t p = 0; p < count; p++) {
+                pixels[p] = rc->indices[p] == RENDER_EMPTY ? 0 : rc->palette[rc->indices[p]];
+            }
+            ok = bm_save(rc->bmp, filename);
+        }
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Failed to save bitmap\n");
+    } else if (prof_enabled() || trace_enabled()) {
+        struct stat st;
+        prof_end(PROF_ENCODE, &start, stat(filename, &st) == 0 ? (uint64_t)st.st_size : 0);
+    }
+    return ok;
+}
+
+/**
+ * Saves the terrain alone in grayscale, stretched over the range of the pixel
+ * heights; empty pixels are black
+ * Returns: 1 on success, 0 on failure
+ */
+int render_save_terrain(const render_ctx_t *rc, const char *filename) {
+    if (!rc || !filename) {
+        return 0;
+    }
+
+    Bitmap *bmp = bm_create(rc->width, rc->height);
+    if (!bmp) {
+        fprintf(stderr, "Failed to create bitmap\n");
+        return 0;
+    }
+
+    size_t count = (size_t)rc->width * rc->height;
+    double min_height = HUGE_VAL, max_height = -HUGE_VAL;
+    for (size_t p = 0; p < count; p++) {
+        if (rc->count[p] > 0) {
+            min_height = rc->elevation[p] < min_height ? rc->elevation[p] : min_height;
+            max_height = rc->elevation[p] > max_height ? rc->elevation[p] : max_height;
+        }
+    }
+
+    uint32_t *pixels = (uint32_t *)bm_raw_data(bmp);
+    double height_range = max_height - min_height;
+    for (size_t p = 0; p < count; p++) {
+        if (rc->count[p] > 0) {
+            int intensity = (int)(((rc->elevation[p] - min_height) / height_range) * 255);
+            intensity = intensity < 0 ? 0 : (intensity > 255 ? 255 : intensity);
+            pixels[p] = bm_rgb(intensity, intensity, intensity);
+        } else {
+            pixels[p] = bm_rgb(0, 0, 0);
+        }
+    }
+
+    printf("Saving image to %s...\n", filename);
+    int ok = bm_save(bmp, filename);
+    if (!ok) {
+        fprintf(stderr, "Failed to save bitmap\n");
+    }
+    bm_free(bmp);
+    return ok;
+}
+
+// Bytes of one frame of planar YUV 4:2:0: full-size Y, then Cb and Cr at half size
+size_t render_yuv_size(const render_ctx_t *rc) {
+    if (!rc) {
+        return 0;
+    }
+    size_t chroma = (size_t)((rc->width + 1) / 2) * ((rc->height + 1) / 2);
+    return (size_t)rc->width * rc->height + 2 * chroma;
+}
+
+/**
+ * Writes the YUV4MPEG2 stream header for frames of this context: 4:2:0 with
+ * JPEG chroma siting, at the frame rate of the animations
+ * Returns: 1 on success, 0 on failure
+ */
+int render_y4m_header(const render_ctx_t *rc, FILE *stream) {
+    if (!rc || !stream) {
+        return 0;
+    }
+    return fprintf(stream, "YUV4MPEG2 W%d H%d F100:%d Ip A1:1 C420jpeg\n",
+                   rc->width, rc->height, RENDER_FRAME_DELAY) > 0;
+}
+
+/**
+ * Averages the 2x2 blocks of two full-size chroma rows into one half-size row,
+ * rounding up at each of the two steps. An odd last column is paired with itself.
+ */
+static void render_chroma_row(const uint8_t *a, const uint8_t *b, int width, uint8_t *out) {
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i even = _mm_set1_epi16(0x00FF);
+    for (; x + 32 <= width; x += 32) {
+        __m128i v0 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(a + x)),
+                                  _mm_loadu_si128((const __m128i *)(b + x)));
+        __m128i v1 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(a + x + 16)),
+                                  _mm_loadu_si128((const __m128i *)(b + x + 16)));
+        __m128i h0 = _mm_avg_epu16(_mm_and_si128(v0, even), _mm_srli_epi16(v0, 8));
+        __m128i h1 = _mm_avg_epu16(_mm_and_si128(v1, even), _mm_srli_epi16(v1, 8));
+        _mm_storeu_si128((__m128i *)(out + x / 2), _mm_packus_epi16(h0, h1));
+    }
+#endif
+    for (; x < width; x += 2) {
+        int left = (a[x] + b[x] + 1) >> 1;
+        int right = x + 1 < width ? (a[x + 1] + b[x + 1] + 1) >> 1 : left;
+        out[x / 2] = (uint8_t)((left + right + 1) >> 1);
+    }
+}
+
+/**
+ * Converts a frame of palette indices to planar YUV 4:2:0. Luma comes straight
+ * from the palette's Y table; chroma is looked up at full size two rows at a
+ * time and box-filtered down.
+ * Inputs:
+ *  - rc: render context the indices belong to
+ *  - indices: width * height palette indices
+ *  - yuv: render_yuv_size(rc) bytes to fill
+ * Returns: 1 on success, 0 on failure
+ */
+int render_yuv420(const render_ctx_t *rc, const uint8_t *indices, uint8_t *yuv) {
+    if (!rc || !indices || !yuv) {
+        return 0;
+    }
+
+    int w = rc->width, h = rc->height, cw = (w + 1) / 2;
+    uint8_t *rows = mem_alloc(MEM_ENCODE, 4 * (size_t)w);
+    if (!rows) {
+        return 0;
+    }
+
+    size_t pixels = (size_t)w * h;
+    for (size_t p = 0; p < pixels; p++) {
+        yuv[p] = rc->yuv[0][indices[p]];
+    }
+
+    uint8_t *cb = yuv + pixels, *cr = cb + (size_t)cw * ((h + 1) / 2);
+    for (int y = 0; y < h; y += 2) {
+        const uint8_t *top = indices + (size_t)y * w;
+        const uint8_t *bottom = y + 1 < h ? top + w : top;
+        for (int x = 0; x < w; x++) {
+            rows[x] = rc->yuv[1][top[x]];
+            rows[w + x] = rc->yuv[1][bottom[x]];
+            rows[2 * w + x] = rc->yuv[2][top[x]];
+            rows[3 * w + x] = rc->yuv[2][bottom[x]];
+        }
+        render_chroma_row(rows, rows + w, w, cb + (size_t)(y / 2) * cw);
+        render_chroma_row(rows + 2 * w, rows + 3 * w, w, cr + (size_t)(y / 2) * cw);
+    }
+
+    mem_free(rows);
+    return 1;
+}
+
+/**
+ * Starts an animated GIF that render_anim_frame appends the composited frames
+ * to. All frames share the fixed palette, and each frame after the first only
+ * stores the rectangle of pixels that changed.
+ * Returns: 1 on success, 0 on failure
+ */
+int render_anim_open(render_ctx_t *rc, const char *filename) {
+    if (!rc || !filename || rc->anim) {
+        return 0;
+    }
+
+    rc->anim = bm_gif_anim_open(filename, rc->width, rc->height, rc->palette, 256, 0);
+    if (!rc->anim) {
+        fprintf(stderr, "Failed to create %s: %s\n", filename, bm_get_error());
+        return 0;
+    }
+    printf("Saving water animation to %s...\n", filename);
+    return 1;
+}
+
+// Appends a frame of palette indices, e.g. rc->indices, to the open animation
+int render_anim_frame(render_ctx_t *rc, const uint8_t *indices) {
+    if (!rc || !rc->anim || !indices) {
+        return 0;
+    }
+
+    if (!bm_gif_anim_frame(rc->anim, indices, RENDER_FRAME_DELAY, RENDER_TRANSPARENT)) {
+        fprintf(stderr, "Failed to add animation frame: %s\n", bm_get_error());
+        return 0;
+    }
+    return 1;
+}
+
+// Finishes and closes the open animation
+int render_anim_close(render_ctx_t *rc) {
+    if (!rc || !rc->anim) {
+        return 0;
+    }
+
+    int ok = bm_gif_anim_close(rc->anim);
+    rc->anim = NULL;
+    if (!ok) {
+        fprintf(stderr, "Failed to finish animation\n");
+    }
+    return ok;
+}
+
+void render_free(render_ctx_t *rc) {
+    if (!rc) {
+        return;
+    }
+    render_anim_close(rc);
+    mem_free(rc->col_span);
+    mem_free(rc->row_span);
+    mem_free(rc->count);
+    mem_free(rc->valid);
+    mem_free(rc->elevation);
+    mem_free(rc->terrain);
+    mem_free(rc->shade);
+    mem_free(rc->indices);
+    if (rc->bmp) {
+        bm_free(rc->bmp);
+    }
+    mem_free(rc);
+}
@@ -0,0 +1,75 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdint.h>
+#include "pointcloud.h"
+
+// Default edge length of the rendered images in pixels
+#define RENDER_SIZE 800
+
+// Size passed to render_create for one pixel per grid cell
+#define RENDER_NATIVE -1
+
+// Edge length of the square pixel tiles rendered in parallel
+#define RENDER_TILE 64
+
+// Fixed color ramp: terrain shades x water levels, plus an index for empty pixels
+#define RENDER_SHADES 18
+#define RENDER_WATER_LEVELS 14
+#define RENDER_COLORS (RENDER_SHADES * RENDER_WATER_LEVELS)
+#define RENDER_EMPTY 255
+
+// Unused palette index that marks unchanged pixels in animation frames
+#define RENDER_TRANSPARENT 254
+
+// Display time of each animation frame in 1/100 s
+#define RENDER_FRAME_DELAY 10
+
+/*
+Each pixel is the box-filtered average of the grid cells that project onto it.
+The cells are summed in square blocks of 2^level x 2^level cells, the level of
+the mip pyramid whose blocks are no larger than a pixel, and each block belongs
+to the pixel its centre projects to. On a regular grid the blocks of a pixel
+form a rectangle: pixel column x covers block columns col_span[2x] up to, not
+including, col_span[2x + 1], and likewise for the rows.
+*/
+
+// Everything about a water rendering that does not change between frames
+typedef struct {
+    int width;              // image width in pixels
+    int height;             // image height in pixels
+    int covered;            // number of pixels at least one valid cell maps to
+    int rows;               // grid rows
+    int cols;               // grid columns
+    int level;              // mip level the pixels are filtered from
+    int *col_span;          // block column range of each pixel column, 2 * width
+    int *row_span;          // block row range of each pixel row, 2 * height
+    int *count;             // valid cells of each pixel
+    uint64_t *valid;        // copy of the grid's validity mask, NULL if every cell is valid
+    int nthreads;           // threads render_water and render_create use
+    int tile_rows;          // most block rows a tile covers
+    double *elevation;      // average height of each pixel, NAN if empty
+    uint8_t *terrain;       // terrain gray level of each pixel
+    uint8_t *shade;         // first palette index of each pixel's terrain shade, RENDER_EMPTY if empty
+    uint8_t *indices;       // palette index of every pixel of the last frame
+    bm_color_t palette[256]; // color of every palette index
+    uint8_t yuv[3][256];    // Y, Cb and Cr of every palette index
+    Bitmap *bmp;            // RGB copy of the frame for formats other than GIF, made on demand
+    BmGifAnim *anim;        // animated GIF the frames are appended to, if one is open
+} render_ctx_t;
+
+render_ctx_t* render_create(const pointcloud_t *pc, int size);
+int render_compose(const render_ctx_t *rc, const void *wd, size_t stride, double maxwd,
+                   uint8_t *indices, int nthreads);
+int render_water(render_ctx_t *rc, const void *wd, size_t stride, double maxwd);
+int render_save(render_ctx_t *rc, const char *filename);
+int render_save_terrain(const render_ctx_t *rc, const char *filename);
+size_t render_yuv_size(const render_ctx_t *rc);
+int render_y4m_header(const render_ctx_t *rc, FILE *stream);
+int render_yuv420(const render_ctx_t *rc, const uint8_t *indices, uint8_t *yuv);
+int render_anim_open(render_ctx_t *rc, const char *filename);
+int render_anim_frame(render_ctx_t *rc, const uint8_t *indices);
+int render_anim_close(render_ctx_t *rc);
+void render_free(render_ctx_t *rc);
+
+#endif // RENDER_H
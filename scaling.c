@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "pointcloud.h"
+#include "raster.h"
+#include "render.h"
+#include "sim.h"
+#include "synth.h"
+#include "prof.h"
+#include "util.h"
+
+/*
+Scaling harness, built by `make scaling` and run by `make scale`.
+Runs the whole pipeline of a watershed run: loading a float32 raster,
+initializing the watershed, a number of steps and rendering the final image,
+on generated terrains over a sweep of grid sizes and thread counts.
+
+Strong scaling keeps each grid size and adds threads. Weak scaling grows the
+grid with the threads, so every thread keeps the cells it had at the first
+thread count. Speedup is relative to the first thread count of the sweep:
+  speedup = first threads * (cells / time) / (cells / time at the first thread count)
+  efficiency = speedup / threads
+so 1.0 is perfect scaling in both modes.
+
+The step is also placed on a roofline: it moves SCALE_STEP_BYTES per cell,
+and a triad kernel run on the same threads gives the memory bandwidth that
+is on offer. A step close to the triad bandwidth is memory-bound and only
+gets faster with more memory bandwidth; a step well below it gets faster
+with more cores.
+
+Usage: ./scaling [--sizes LIST] [--threads LIST] [--steps N] [--mode strong|weak|both]
+                 [--dir DIR] [--csv FILE] [--json FILE]
+  --sizes LIST    grid edge lengths, e.g. 1k,2k,4k (default 1k,2k,4k), at most
+                  SCALE_MAX_SIZE; a run needs SCALE_CELL_BYTES per cell, so
+                  16k takes about 24 GB and 32k about 94 GB of memory
+  --threads LIST  thread counts (default powers of two up to the processor count)
+  --steps N       steps per run (default 20)
+  --mode MODE     strong, weak or both (default both)
+  --dir DIR       where the generated terrains are written (default .)
+  --csv FILE      also write the table as CSV
+  --json FILE     also write the table as JSON
+*/
+
+#define SCALE_MAX_LIST 16
+#define SCALE_MAX_RUNS (2 * SCALE_MAX_LIST * SCALE_MAX_LIST)
+
+// Bytes a step moves per cell: height and depth read, next depth written,
+// and the written line read into the cache before it is overwritten
+#define SCALE_STEP_BYTES 32
+
+// Floating point operations of a step per interior cell: five levels, four
+// flows, their sum, and the update of the depth
+#define SCALE_STEP_FLOPS 17
+
+// Elements of each triad array, far beyond any last level cache
+#define SCALE_TRIAD_SIZE (1 << 23)
+
+// Bytes held per cell while a run's grid is loaded: the 64-byte points of the
+// point cloud and the three arrays of the step grid
+#define SCALE_CELL_BYTES 88
+
+// Largest grid edge; the point cloud counts its points in an int
+#define SCALE_MAX_SIZE 46340
+
+// Initial water depth of every run
+#define SCALE_WATER 2.0
+
+// One run of the pipeline
+typedef struct {
+    const char *mode;       // "strong" or "weak"
+    int size;               // grid edge length
+    int threads;
+    double cells;
+    double load_s, init_s, step_s, render_s, total_s;   // step_s is per step
+    double step_speedup, step_efficiency;
+    double total_speedup, total_efficiency;
+    double step_gbps;       // memory traffic of the steps
+    double triad_gbps;      // triad bandwidth on the same threads
+} scale_run_t;
+
+static scale_run_t scale_runs[SCALE_MAX_RUNS];
+static int scale_count;
+
+// Every stage of the pipeline takes its thread count from the environment
+static void scale_set_threads(int threads) {
+    char value[16];
+    snprintf(value, sizeof(value), "%d", threads);
+    setenv("TERRAFLOW_THREADS", value, 1);
+}
+
+/**
+ * Parses a comma separated list of positive integers; a k suffix multiplies by 1024
+ * Returns: the number of values, or -1 on a malformed list
+ */
+static int scale_parse_list(const char *text, int *values) {
+    int count = 0;
+    const char *p = text;
+    while (*p) {
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (end == p || v <= 0 || count == SCALE_MAX_LIST) {
+            return -1;
+        }
+        if (*end == 'k' || *end == 'K') {
+            v *= 1024;
+            end++;
+        }
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
+        values[count++] = (int)v;
+        p = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+typedef struct {
+    double *a, *b, *c;
+    size_t n;
+} scale_triad_t;
+
+static void scale_triad_init(void *arg, int thread, int nthreads) {
+    scale_triad_t *t = arg;
+    size_t first = t->n * thread / nthreads, last = t->n * (thread + 1) / nthreads;
+    for (size_t i = first; i < last; i++) {
+        t->a[i] = 0.0;
+        t->b[i] = 1.0;
+        t->c[i] = 2.0;
+    }
+}
+
+static void scale_triad_worker(void *arg, int thread, int nthreads) {
+    scale_triad_t *t = arg;
+    size_t first = t->n * thread / nthreads, last = t->n * (thread + 1) / nthreads;
+    for (size_t i = first; i < last; i++) {
+        t->a[i] = t->b[i] + 3.0 * t->c[i];
+    }
+}
+
+/**
+ * Measures the memory bandwidth a streaming kernel gets on some threads:
+ * the best of five passes of a[i] = b[i] + s * c[i], counted like the step
+ * as two reads, one write and the read of the written line
+ * Returns: GB/s, or 0 when the arrays cannot be allocated
+ */
+static double scale_triad(int threads) {
+    scale_triad_t t = {.n = SCALE_TRIAD_SIZE};
+    t.a = malloc(t.n * sizeof(double));
+    t.b = malloc(t.n * sizeof(double));
+    t.c = malloc(t.n * sizeof(double));
+    double best = 0.0;
+    if (t.a && t.b && t.c) {
+        parallelRun(threads, scale_triad_init, &t);
+        for (int pass = 0; pass < 5; pass++) {
+            double start = prof_now();
+            parallelRun(threads, scale_triad_worker, &t);
+            double seconds = prof_now() - start;
+            double gbps = 4.0 * sizeof(double) * t.n / seconds / 1e9;
+            best = gbps > best ? gbps : best;
+        }
+    }
+    free(t.a);
+    free(t.b);
+    free(t.c);
+    return best;
+}
+
+/**
+ * Runs the pipeline once on a generated terrain
+ * Inputs:
+ *  - file: float32 raster of the terrain
+ *  - steps: steps to run
+ *  - run: receives the phase timings
+ * Returns: 0 on success, -1 on failure
+ */
+static int scale_pipeline(const char *file, int steps, scale_run_t *run) {
+    int saved = quietStdout();
+    double start = prof_now();
+    pointcloud_t *pc = raster_read(file);
+    double loaded = prof_now();
+
+    sim_grid_t *sim = NULL;
+    if (pc && initializeWatershed(pc) == 0) {
+        watershedAddUniformWater(pc, SCALE_WATER);
+        sim = sim_grid_create(pc);
+    }
+    double initialized = prof_now();
+
+    for (int s = 0; sim && s < steps; s++) {
+        sim_grid_step(sim);
+    }
+    double stepped = prof_now();
+
+    render_ctx_t *rc = sim ? render_create(pc, RENDER_SIZE) : NULL;
+    int ok = rc && render_water(rc, sim->wd, sizeof(double), SCALE_WATER * 2);
+    double rendered = prof_now();
+    loudStdout(saved);
+
+    render_free(rc);
+    sim_grid_free(sim);
+    pointcloud_free(pc);
+    if (!ok) {
+        return -1;
+    }
+
+    run->load_s = loaded - start;
+    run->init_s = initialized - loaded;
+    run->step_s = (stepped - initialized) / steps;
+    run->render_s = rendered - stepped;
+    run->total_s = rendered - start;
+    run->step_gbps = run->cells * SCALE_STEP_BYTES / run->step_s / 1e9;
+    return 0;
+}
+
+// Physical memory of the machine in bytes, or a huge value when it is unknown
+static double scale_memory(void) {
+    long pages = sysconf(_SC_PHYS_PAGES), page = sysconf(_SC_PAGESIZE);
+    return pages > 0 && page > 0 ? (double)pages * page : 1e300;
+}
+
+// Fills in speedup and efficiency against the first run of the same sweep
+static void scale_relative(scale_run_t *run, const scale_run_t *first) {
+    double step_rate = run->cells / run->step_s, first_step = first->cells / first->step_s;
+    double total_rate = run->cells / run->total_s, first_total = first->cells / first->total_s;
+    run->step_speedup = first->threads * step_rate / first_step;
+    run->total_speedup = first->threads * total_rate / first_total;
+    run->step_efficiency = run->step_speedup / run->threads;
+    run->total_efficiency = run->total_speedup / run->threads;
+}
+
+static void scale_print_header(void) {
+    printf("%-6s %7s %7s %8s %8s %9s %8s %10s %8s %6s %8s %6s %9s %9s\n",
+           "mode", "size", "threads", "load s", "init s", "step ms", "render s", "Mcells/s",
+           "speedup", "eff", "total x", "eff", "step GB/s", "triad GB/s");
+}
+
+static void scale_print(const scale_run_t *r) {
+    printf("%-6s %7d %7d %8.3f %8.3f %9.3f %8.3f %10.1f %8.2f %6.2f %8.2f %6.2f %9.2f %9.2f\n",
+           r->mode, r->size, r->threads, r->load_s, r->init_s, r->step_s * 1e3, r->render_s,
+           r->cells / r->step_s / 1e6, r->step_speedup, r->step_efficiency,
+           r->total_speedup, r->total_efficiency, r->step_gbps, r->triad_gbps);
+}
+
+static int scale_write_csv(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        return -1;
+    }
+    fprintf(f, "mode,size,threads,cells,load_s,init_s,step_s,render_s,total_s,step_cells_per_s,"
+               "step_speedup,step_efficiency,total_speedup,total_efficiency,step_gbps,triad_gbps\n");
+    for (int i = 0; i < scale_count; i++) {
+        const scale_run_t *r = &scale_runs[i];
+        fprintf(f, "%s,%d,%d,%.0f,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.6g,%.6g,%.6g,%.6g,%.6g,%.6g\n",
+                r->mode, r->size, r->threads, r->cells, r->load_s, r->init_s, r->step_s,
+                r->render_s, r->total_s, r->cells / r->step_s, r->step_speedup,
+                r->step_efficiency, r->total_speedup, r->total_efficiency, r->step_gbps,
+                r->triad_gbps);
+    }
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Failed to write %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+static int scale_write_json(const char *filename, int steps) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        return -1;
+    }
+    fprintf(f, "{\n  \"steps\": %d,\n  \"step_bytes_per_cell\": %d,\n  \"step_flops_per_cell\": %d,\n"
+               "  \"step_flops_per_byte\": %.4f,\n  \"runs\": [",
+            steps, SCALE_STEP_BYTES, SCALE_STEP_FLOPS, (double)SCALE_STEP_FLOPS / SCALE_STEP_BYTES);
+    for (int i = 0; i < scale_count; i++) {
+        const scale_run_t *r = &scale_runs[i];
+        // The memory roof: the step's flops per byte times the bandwidth on offer
+        double roof = (double)SCALE_STEP_FLOPS / SCALE_STEP_BYTES * r->triad_gbps;
+        fprintf(f, "%s\n    {\"mode\": \"%s\", \"size\": %d, \"threads\": %d, \"cells\": %.0f, "
+                   "\"load_s\": %.9g, \"init_s\": %.9g, \"step_s\": %.9g, \"render_s\": %.9g, "
+                   "\"total_s\": %.9g, \"step_cells_per_s\": %.9g, "
+                   "\"step_speedup\": %.6g, \"step_efficiency\": %.6g, "
+                   "\"total_speedup\": %.6g, \"total_efficiency\": %.6g, "
+                   "\"step_gbps\": %.6g, \"triad_gbps\": %.6g, "
+                   "\"step_gflops\": %.6g, \"memory_roof_gflops\": %.6g}",
+                i ? "," : "", r->mode, r->size, r->threads, r->cells, r->load_s, r->init_s,
+                r->step_s, r->render_s, r->total_s, r->cells / r->step_s, r->step_speedup,
+                r->step_efficiency, r->total_speedup, r->total_efficiency, r->step_gbps,
+                r->triad_gbps, r->cells * SCALE_STEP_FLOPS / r->step_s / 1e9, roof);
+    }
+    fprintf(f, "\n  ]\n}\n");
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Failed to write %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Terrain file currently on disk, generated on first use of each size
+static char scale_file[512];
+static int scale_file_size;
+
+// Returns the terrain file of a size, replacing the previous one; size 0 only removes it
+
+static const char* scale_terrain(const char *dir, int size) {
+    if (size == scale_file_size) {
+        return scale_file;
+    }
+    if (scale_file_size) {
+        remove(scale_file);
+        char hdr[512];
+        snprintf(hdr, sizeof(hdr), "%.*s.hdr", (int)(strlen(scale_file) - 4), scale_file);
+        remove(hdr);
+        scale_file_size = 0;
+    }
+    if (size <= 0) {
+        return NULL;
+    }
+
+    synth_options_t opts;
+    synth_defaults(&opts);
+    opts.size = size;
+    opts.basins = 8 + size / 256;
+    opts.plateaus = 4 + size / 512;
+    snprintf(scale_file, sizeof(scale_file), "%s/scaling_%d.f32", dir, size);
+    if (synth_write(&opts, scale_file, RASTER_FLOAT32) != 0) {
+        return NULL;
+    }
+    scale_file_size = size;
+    return scale_file;
+}
+
+int main(int argc, char *argv[]) {
+    int sizes[SCALE_MAX_LIST] = {1024, 2048, 4096}, nsizes = 3;
+    int threads[SCALE_MAX_LIST], nthreads = 0;
+    int steps = 20, strong = 1, weak = 1;
+    const char *dir = ".", *csv = NULL, *json = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        int has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--sizes") == 0 && has_value) {
+            nsizes = scale_parse_list(argv[++i], sizes);
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            nthreads = scale_parse_list(argv[++i], threads);
+        } else if (strcmp(argv[i], "--steps") == 0 && has_value) {
+            steps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mode") == 0 && has_value) {
+            const char *mode = argv[++i];
+            strong = strcmp(mode, "strong") == 0 || strcmp(mode, "both") == 0;
+            weak = strcmp(mode, "weak") == 0 || strcmp(mode, "both") == 0;
+        } else if (strcmp(argv[i], "--dir") == 0 && has_value) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "--csv") == 0 && has_value) {
+            csv = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0 && has_value) {
+            json = argv[++i];
+        } else {
+            nsizes = -1;
+            break;
+        }
+    }
+    if (nsizes <= 0 || nthreads < 0 || steps < 1 || (!strong && !weak)) {
+        fprintf(stderr, "Usage: %s [--sizes LIST] [--threads LIST] [--steps N] "
+                        "[--mode strong|weak|both] [--dir DIR] [--csv FILE] [--json FILE]\n", argv[0]);
+        return 1;
+    }
+    if (nthreads == 0) {
+        int cpus = defaultThreadCount();
+        for (int t = 1; t < cpus && nthreads < SCALE_MAX_LIST - 1; t *= 2) {
+            threads[nthreads++] = t;
+        }
+        threads[nthreads++] = cpus;
+    }
+
+    // Triad bandwidth of every thread count, measured once
+    double triad[SCALE_MAX_LIST];
+    for (int t = 0; t < nthreads; t++) {
+        triad[t] = scale_triad(threads[t]);
+    }
+
+    scale_print_header();
+    for (int pass = 0; pass < 2; pass++) {
+        if ((pass == 0 && !strong) || (pass == 1 && !weak)) {
+            continue;
+        }
+        for (int s = 0; s < nsizes; s++) {
+            const scale_run_t *first = NULL;
+            for (int t = 0; t < nthreads && scale_count < SCALE_MAX_RUNS; t++) {
+                scale_run_t *run = &scale_runs[scale_count];
+                memset(run, 0, sizeof(*run));
+                run->mode = pass == 0 ? "strong" : "weak";
+                run->threads = threads[t];
+                // Weak scaling keeps the cells per thread of the first thread count
+                run->size = pass == 0 ? sizes[s]
+                                      : (int)(sizes[s] * sqrt((double)threads[t] / threads[0]) + 0.5);
+                run->cells = (double)run->size * run->size;
+                run->triad_gbps = triad[t];
+
+                // Runs that cannot fit in memory are skipped rather than left to swap
+                double needed = run->cells * SCALE_CELL_BYTES;
+                if (run->size > SCALE_MAX_SIZE || needed > scale_memory()) {
+                    fprintf(stderr, "Skipping %s scaling of a %d x %d grid: needs %.1f GB, more than "
+                                    "this machine has or a point cloud can hold\n",
+                            run->mode, run->size, run->size, needed / 1e9);
+                    continue;
+                }
+
+                scale_set_threads(threads[t]);
+                const char *file = scale_terrain(dir, run->size);
+                if (!file || scale_pipeline(file, steps, run) != 0) {
+                    fprintf(stderr, "%s scaling of %d cells on %d threads failed\n",
+                            run->mode, run->size, run->threads);
+                    continue;
+                }
+                if (!first) {
+                    first = run;
+                }
+                scale_relative(run, first);
+                scale_print(run);
+                scale_count++;
+            }
+        }
+    }
+    scale_terrain(dir, 0);
+
+    if (csv && scale_write_csv(csv) != 0) {
+        return 1;
+    }
+    if (json && scale_write_json(json, steps) != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim.h"
+#include "util.h"
+#include "trace.h"
+#include "mem.h"
+#include "prof.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Grids with fewer cells than this step on one thread; waking the workers would cost more than it saves
+#define SIM_PARALLEL_CELLS (1 << 16)
+
+/*
+Every kernel below evaluates a cell exactly like watershedStep: the four flows
+are added to 0.0 in west, east, north, south order, then scaled by the flow
+coefficient, added to the cell's water and evaporated. Missing neighbours
+(grid edge or NODATA) contribute nothing, which the vector paths get by
+masking the flow to +0.0; adding +0.0 leaves the running total unchanged.
+*/
+
+// Scalar update of one cell, used on the grid border and for leftover columns
+static double sim_cell(const sim_grid_t *g, int row, int col) {
+    size_t i = (size_t)row * g->cols + col;
+    const double *z = g->z, *wd = g->wd;
+    const uint64_t *valid = g->valid;
+
+    // NODATA cells are disconnected and hold no water
+    if (!POINTCLOUD_VALID(valid, i)) {
+        return 0.0;
+    }
+
+    double level = z[i] + wd[i];
+    double total = 0.0;
+    if (col > 0 && POINTCLOUD_VALID(valid, i - 1)) {
+        total += (z[i - 1] + wd[i - 1]) - level;
+    }
+    if (col < g->cols - 1 && POINTCLOUD_VALID(valid, i + 1)) {
+        total += (z[i + 1] + wd[i + 1]) - level;
+    }
+    if (row > 0 && POINTCLOUD_VALID(valid, i - g->cols)) {
+        total += (z[i - g->cols] + wd[i - g->cols]) - level;
+    }
+    if (row < g->rows - 1 && POINTCLOUD_VALID(valid, i + g->cols)) {
+        total += (z[i + g->cols] + wd[i + g->cols]) - level;
+    }
+
+    total *= g->water_coef;
+    double w = wd[i] + total;
+    w *= g->evap_coef;
+    return w < 0 ? 0 : w;
+}
+
+#if defined(__SSE2__)
+// Lane masks for the 2-bit validity patterns of a cell pair
+static const uint64_t sim_lane_masks[4][2] = {
+    {0, 0}, {~0ULL, 0}, {0, ~0ULL}, {~0ULL, ~0ULL}
+};
+
+// Returns n (<= 4) validity bits starting at cell i
+static inline unsigned sim_bits(const uint64_t *mask, size_t i, int n) {
+    size_t word = i >> 6;
+    int shift = i & 63;
+    uint64_t bits = mask[word] >> shift;
+    if (shift + n > 64) {
+        bits |= mask[word + 1] << (64 - shift);
+    }
+    return (unsigned)bits & ((1u << n) - 1);
+}
+
+static inline __m128d sim_lanes(unsigned bits) {
+    return _mm_castsi128_pd(_mm_loadu_si128((const __m128i *)sim_lane_masks[bits]));
+}
+
+// Interior cells of one row, two at a time, on a grid without NODATA.
+// Returns the first column left for the scalar path.
+static int sim_row_sse2(const sim_grid_t *g, int row) {
+    const double *z = g->z, *wd = g->wd;
+    double *next = g->next;
+    size_t cols = g->cols;
+    __m128d zero = _mm_setzero_pd();
+    __m128d wcoef = _mm_set1_pd(g->water_coef);
+    __m128d ecoef = _mm_set1_pd(g->evap_coef);
+    int col = 1;
+
+    for (; col + 2 <= g->cols - 1; col += 2) {
+        size_t i = row * cols + col;
+        __m128d w = _mm_loadu_pd(wd + i);
+        __m128d level = _mm_add_pd(_mm_loadu_pd(z + i), w);
+        __m128d west = _mm_add_pd(_mm_loadu_pd(z + i - 1), _mm_loadu_pd(wd + i - 1));
+        __m128d east = _mm_add_pd(_mm_loadu_pd(z + i + 1), _mm_loadu_pd(wd + i + 1));
+        __m128d north = _mm_add_pd(_mm_loadu_pd(z + i - cols), _mm_loadu_pd(wd + i - cols));
+        __m128d south = _mm_add_pd(_mm_loadu_pd(z + i + cols), _mm_loadu_pd(wd + i + cols));
+
+        __m128d total = _mm_add_pd(zero, _mm_sub_pd(west, level));
+        total = _mm_add_pd(total, _mm_sub_pd(east, level));
+        total = _mm_add_pd(total, _mm_sub_pd(north, level));
+        total = _mm_add_pd(total, _mm_sub_pd(south, level));
+
+        total = _mm_mul_pd(total, wcoef);
+        w = _mm_mul_pd(_mm_add_pd(w, total), ecoef);
+        // max(0, w) keeps NaN and -0.0 exactly like the scalar "w < 0" clamp
+        _mm_storeu_pd(next + i, _mm_max_pd(zero, w));
+    }
+    return col;
+}
+
+// Same as sim_row_sse2 with each flow and result blended by the validity mask
+static int sim_row_sse2_masked(const sim_grid_t *g, int row) {
+    const double *z = g->z, *wd = g->wd;
+    const uint64_t *valid = g->valid;
+    double *next = g->next;
+    size_t cols = g->cols;
+    __m128d zero = _mm_setzero_pd();
+    __m128d wcoef = _mm_set1_pd(g->water_coef);
+    __m128d ecoef = _mm_set1_pd(g->evap_coef);
+    int col = 1;
+
+    for (; col + 2 <= g->cols - 1; col += 2) {
+        size_t i = row * cols + col;
+
+        // Bits i-1..i+2 cover the west, centre and east lanes
+        unsigned span = sim_bits(valid, i - 1, 4);
+        if (!(span & 6)) {
+            _mm_storeu_pd(next + i, zero);
+            continue;
+        }
+        __m128d mcentre = sim_lanes((span >> 1) & 3);
+        __m128d mwest = sim_lanes(span & 3);
+        __m128d meast = sim_lanes((span >> 2) & 3);
+        __m128d mnorth = sim_lanes(sim_bits(valid, i - cols, 2));
+        __m128d msouth = sim_lanes(sim_bits(valid, i + cols, 2));
+
+        __m128d w = _mm_loadu_pd(wd + i);
+        __m128d level = _mm_add_pd(_mm_loadu_pd(z + i), w);
+        __m128d west = _mm_add_pd(_mm_loadu_pd(z + i - 1), _mm_loadu_pd(wd + i - 1));
+        __m128d east = _mm_add_pd(_mm_loadu_pd(z + i + 1), _mm_loadu_pd(wd + i + 1));
+        __m128d north = _mm_add_pd(_mm_loadu_pd(z + i - cols), _mm_loadu_pd(wd + i - cols));
+        __m128d south = _mm_add_pd(_mm_loadu_pd(z + i + cols), _mm_loadu_pd(wd + i + cols));
+
+        __m128d total = _mm_add_pd(zero, _mm_and_pd(_mm_sub_pd(west, level), mwest));
+        total = _mm_add_pd(total, _mm_and_pd(_mm_sub_pd(east, level), meast));
+        total = _mm_add_pd(total, _mm_and_pd(_mm_sub_pd(north, level), mnorth));
+        total = _mm_add_pd(total, _mm_and_pd(_mm_sub_pd(south, level), msouth));
+
+        total = _mm_mul_pd(total, wcoef);
+        w = _mm_mul_pd(_mm_add_pd(w, total), ecoef);
+        _mm_storeu_pd(next + i, _mm_and_pd(_mm_max_pd(zero, w), mcentre));
+    }
+    return col;
+}
+#endif
+
+// Threads a step of the grid is split over
+static int sim_threads(const sim_grid_t *g) {
+    if ((size_t)g->rows * g->cols < SIM_PARALLEL_CELLS || g->nthreads <= 1) {
+        return 1;
+    }
+    return g->nthreads < g->rows ? g->nthreads : g->rows;
+}
+
+// Band of rows [*first, *last) of one thread; every pass over the grid uses the same bands
+static void sim_band(const sim_grid_t *g, int thread, int nthreads, int *first, int *last) {
+    *first = (int)((long)g->rows * thread / nthreads);
+    *last = (int)((long)g->rows * (thread + 1) / nthreads);
+}
+
+// Pool of nthreads workers for the grid, started or replaced when its size
+// differs, e.g. after nthreads was changed; NULL for one thread or when the
+// workers cannot be started
+static thread_pool_t* sim_pool(sim_grid_t *g, int nthreads) {
+    if (nthreads <= 1) {
+        return NULL;
+    }
+    if (threadPoolSize(g->pool) != nthreads) {
+        threadPoolFree(g->pool);
+        g->pool = threadPoolCreate(nthreads);
+    }
+    return g->pool;
+}
+
+// Runs fn over nthreads bands on the grid's pool. Worker t of the pool always
+// gets band t, so a band is copied and stepped by the same thread.
+static void sim_parallel(sim_grid_t *g, int nthreads, parallel_fn fn, void *arg) {
+    thread_pool_t *pool = sim_pool(g, nthreads);
+    if (pool) {
+        threadPoolRun(pool, fn, arg);
+    } else {
+        parallelRun(nthreads, fn, arg);
+    }
+}
+
+typedef struct {
+    sim_grid_t *g;
+    const pcd_t *points;
+} sim_copy_job_t;
+
+// Copies a band of rows out of the point cloud. Run on the pool worker that
+// steps the band, so its pages are first touched, and placed, on the NUMA
+// node of that worker; the workers are pinned when there is a processor for each.
+static void sim_copy_worker(void *arg, int thread, int nthreads) {
+    sim_copy_job_t *job = arg;
+    sim_grid_t *g = job->g;
+    int first, last;
+    sim_band(g, thread, nthreads, &first, &last);
+    for (size_t i = (size_t)first * g->cols; i < (size_t)last * g->cols; i++) {
+        g->z[i] = job->points[i].z;
+        g->wd[i] = POINTCLOUD_VALID(g->valid, i) ? job->points[i].wd : 0.0;
+    }
+}
+
+/**
+ * Copies the heights and water depths of an initialized point cloud into a
+ * flat grid. The grid borrows pc->valid, so pc must outlive it. Steps are
+ * split over defaultThreadCount() threads, kept in a pool for the life of the
+ * grid; set nthreads to change that, at the cost of the first-touch placement.
+ * Output: the grid, or NULL on failure
+ */
+sim_grid_t* sim_grid_create(const pointcloud_t *pc) {
+    if (!pc || !pc->points.data || pc->rows <= 0 || pc->cols <= 0 ||
+        (long)pc->rows * pc->cols != pc->points.size) {
+        fprintf(stderr, "Invalid parameters passed to sim_grid_create\n");
+        return NULL;
+    }
+
+    size_t n = (size_t)pc->rows * pc->cols;
+    sim_grid_t *g = mem_calloc(MEM_SIM, 1, sizeof(sim_grid_t));
+    if (g) {
+        g->z = mem_alloc(MEM_SIM, n * sizeof(double));
+        g->wd = mem_alloc(MEM_SIM, n * sizeof(double));
+        g->next = mem_alloc(MEM_SIM, n * sizeof(double));
+    }
+    if (!g || !g->z || !g->wd || !g->next) {
+        fprintf(stderr, "Failed to allocate simulation grid\n");
+        sim_grid_free(g);
+        return NULL;
+    }
+
+    g->rows = pc->rows;
+    g->cols = pc->cols;
+    g->valid = pc->valid;
+    g->water_coef = pc->water_coef;
+    g->evap_coef = pc->evap_coef;
+    g->nthreads = defaultThreadCount();
+
+    sim_copy_job_t job = {.g = g, .points = pc->points.data};
+    sim_parallel(g, sim_threads(g), sim_copy_worker, &job);
+    return g;
+}
+
+typedef struct {
+    sim_grid_t *g;
+    int vector;     // use the vector path on interior cells
+    int pooled;     // the bands run on pool workers while the caller waits
+} sim_step_job_t;
+
+// Steps one band of rows; cells only read the current depths, so bands are independent
+static void sim_step_worker(void *arg, int thread, int nthreads) {
+    sim_step_job_t *job = arg;
+    sim_grid_t *g = job->g;
+    int first, last;
+    sim_band(g, thread, nthreads, &first, &last);
+    double start = trace_begin();
+    // The caller times the step; workers add their hardware counters to it
+    prof_mark_t mark;
+    if (job->pooled) {
+        prof_begin(&mark);
+    }
+
+    for (int row = first; row < last; row++) {
+        double *next = g->next + (size_t)row * g->cols;
+        int col = 0;
+
+        if (job->vector && row > 0 && row < g->rows - 1 && g->cols > 2) {
+            next[0] = sim_cell(g, row, 0);
+#if defined(__SSE2__)
+            col = g->valid ? sim_row_sse2_masked(g, row) : sim_row_sse2(g, row);
+#else
+            col = 1;
+#endif
+        }
+        for (; col < g->cols; col++) {
+            next[col] = sim_cell(g, row, col);
+        }
+    }
+    if (job->pooled) {
+        prof_end_share(PROF_STEP, &mark);
+    }
+    trace_end("step band", start, "first_row", first);
+}
+
+// One step over bands of rows on nthreads threads, then the depth buffers swap
+static void sim_run(sim_grid_t *g, int nthreads, int vector) {
+    sim_step_job_t job = {.g = g, .vector = vector, .pooled = sim_pool(g, nthreads) != NULL};
+    sim_parallel(g, nthreads, sim_step_worker, &job);
+
+    double *tmp = g->wd;
+    g->wd = g->next;
+    g->next = tmp;
+}
+
+/**
+ * Advances the water by one step, with the rows split into one band per
+ * thread. Every cell is computed the same way on any number of threads.
+ * Grids without NODATA take the unmasked vector path, so the validity mask
+ * costs nothing when it is absent.
+ */
+void sim_grid_step(sim_grid_t *g) {
+    if (!g) {
+        return;
+    }
+    sim_run(g, sim_threads(g), 1);
+}
+
+// Every cell through sim_cell on one thread: the plainest form of the step
+static void sim_step_scalar(sim_grid_t *g) {
+    sim_run(g, 1, 0);
+}
+
+// The vector path on one thread
+static void sim_step_vector(sim_grid_t *g) {
+    sim_run(g, 1, 1);
+}
+
+// The vector path split over nthreads bands whatever the grid size, so even
+// small grids cross band boundaries
+static void sim_step_banded(sim_grid_t *g) {
+    int nthreads = g->nthreads < g->rows ? g->nthreads : g->rows;
+    sim_run(g, nthreads > 1 ? nthreads : 1, 1);
+}
+
+// Every way of stepping a grid; each must match watershedStep
+const sim_kernel_t sim_kernels[] = {
+    {"scalar", sim_step_scalar, 0.0},
+    {"vector", sim_step_vector, 0.0},
+    {"banded", sim_step_banded, 0.0},
+    {"sim_grid_step", sim_grid_step, 0.0},
+};
+const int sim_kernel_count = sizeof(sim_kernels) / sizeof(sim_kernels[0]);
+
+/**
+ * Writes the current water depths back into the point cloud, e.g. before
+ * rendering or checkpointing it
+ */
+void sim_grid_store(const sim_grid_t *g, pointcloud_t *pc) {
+    if (!g || !pc || !pc->points.data || (long)g->rows * g->cols != pc->points.size) {
+        return;
+    }
+
+    pcd_t *points = pc->points.data;
+    for (size_t i = 0; i < (size_t)pc->points.size; i++) {
+        points[i].wd = g->wd[i];
+    }
+}
+
+void sim_grid_free(sim_grid_t *g) {
+    if (!g) {
+        return;
+    }
+    threadPoolFree(g->pool);
+    mem_free(g->z);
+    mem_free(g->wd);
+    mem_free(g->next);
+    mem_free(g);
+}
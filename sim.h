@@ -0,0 +1,38 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include "pointcloud.h"
+
+// Flat copy of a point cloud's heights and water for the simulation loop.
+// sim_grid_step produces the same water depths as watershedStep, bit for bit.
+typedef struct {
+    int rows;               // grid rows
+    int cols;               // grid columns
+    double *z;              // terrain heights, row-major
+    double *wd;             // water depth of the current step
+    double *next;           // water depth of the step being computed
+    const uint64_t *valid;  // validity mask borrowed from the point cloud, NULL when all valid
+    double water_coef;      // water flow coefficient
+    double evap_coef;       // evaporation coefficient
+    int nthreads;           // threads a step is split over; small grids always use one
+    thread_pool_t *pool;    // workers that step the bands, started when the grid is created
+} sim_grid_t;
+
+// A way of advancing a grid by one step. The differential test in
+// test_pointcloud.c runs every registered kernel against watershedStep on
+// random grids, so a new kernel only needs an entry in sim_kernels.
+typedef struct {
+    const char *name;
+    void (*step)(sim_grid_t *g);
+    double tolerance;       // largest relative difference from watershedStep, 0 for bit for bit
+} sim_kernel_t;
+
+extern const sim_kernel_t sim_kernels[];
+extern const int sim_kernel_count;
+
+sim_grid_t* sim_grid_create(const pointcloud_t *pc);
+void sim_grid_step(sim_grid_t *g);
+void sim_grid_store(const sim_grid_t *g, pointcloud_t *pc);
+void sim_grid_free(sim_grid_t *g);
+
+#endif // SIM_H
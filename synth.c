@@ -0,0 +1,528 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include "synth.h"
+#include "util.h"
+#include "mem.h"
+
+// Cells each thread generates between writes when a terrain goes to a file
+#define SYNTH_BAND_CELLS (1 << 16)
+
+// Longest text a coordinate or height is formatted to, separator included
+#define SYNTH_FIELD_MAX 32
+
+// Octaves shorter than this many cells would only add per-cell noise and are left out
+#define SYNTH_MIN_WAVELENGTH 2.0
+
+typedef enum {
+    SYNTH_BASIN,        // bowl subtracted from the terrain
+    SYNTH_PLATEAU,      // disc flattened to one height, with a smooth rim
+    SYNTH_HOLE          // NODATA blob with a ragged outline
+} synth_kind_t;
+
+typedef struct {
+    synth_kind_t kind;
+    double row, col;    // centre, in cells
+    double radius;      // in cells
+    double level;       // depth of a basin, height of a plateau
+    uint64_t key;       // noise key of a hole's outline
+} synth_feature_t;
+
+// A terrain ready to generate rows from
+typedef struct {
+    synth_options_t opts;
+    double wavelength;          // wavelength of the first octave in cells
+    uint64_t *keys;             // noise key of every octave
+    synth_feature_t *features;  // in the order they are applied
+    int nfeatures;
+} synth_t;
+
+// splitmix64 finalizer; spreads every input bit over the whole output
+static uint64_t synth_mix(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+static uint64_t synth_next(uint64_t *state) {
+    *state += 0x9E3779B97F4A7C15ULL;
+    return synth_mix(*state);
+}
+
+static double synth_uniform(uint64_t *state, double lo, double hi) {
+    return lo + (hi - lo) * (double)(synth_next(state) >> 11) * 0x1.0p-53;
+}
+
+// Value in [-1, 1] at a lattice point of one noise layer
+static double synth_lattice(uint64_t key, int64_t ix, int64_t iy) {
+    uint64_t h = synth_mix(key ^ synth_mix((uint64_t)ix + 0x9E3779B97F4A7C15ULL * (uint64_t)iy));
+    return (double)(h >> 11) * 0x1.0p-52 - 1.0;
+}
+
+static double synth_smooth(double t) {
+    return t * t * (3.0 - 2.0 * t);
+}
+
+// Value noise at one point, in [-1, 1]
+static double synth_noise(uint64_t key, double x, double y) {
+    double fx = floor(x), fy = floor(y);
+    int64_t ix = (int64_t)fx, iy = (int64_t)fy;
+    double sx = synth_smooth(x - fx), sy = synth_smooth(y - fy);
+    double v0 = synth_lattice(key, ix, iy) + (synth_lattice(key, ix, iy + 1) - synth_lattice(key, ix, iy)) * sy;
+    double v1 = synth_lattice(key, ix + 1, iy) + (synth_lattice(key, ix + 1, iy + 1) - synth_lattice(key, ix + 1, iy)) * sy;
+    return v0 + (v1 - v0) * sx;
+}
+
+/**
+ * Adds one octave of value noise along a row. The lattice values at either
+ * end of the lattice cell the row is crossing are kept until it leaves the
+ * cell, so an octave costs two lattice lookups per lattice cell, not per grid
+ * cell.
+ */
+static void synth_octave_row(uint64_t key, double wavelength, double amplitude,
+                             int row, int cols, double *out) {
+    double fy = row / wavelength;
+    int64_t iy = (int64_t)floor(fy);
+    double sy = synth_smooth(fy - floor(fy));
+    int64_t ix = 0;
+    double v0 = 0.0, v1 = 0.0;
+    int started = 0;
+
+    for (int c = 0; c < cols; c++) {
+        double fx = c / wavelength;
+        int64_t jx = (int64_t)floor(fx);
+        if (!started || jx != ix) {
+            if (started && jx == ix + 1) {
+                v0 = v1;
+            } else {
+                double a = synth_lattice(key, jx, iy), b = synth_lattice(key, jx, iy + 1);
+                v0 = a + (b - a) * sy;
+            }
+            double a = synth_lattice(key, jx + 1, iy), b = synth_lattice(key, jx + 1, iy + 1);
+            v1 = a + (b - a) * sy;
+            ix = jx;
+            started = 1;
+        }
+        out[c] += amplitude * (v0 + (v1 - v0) * synth_smooth(fx - jx));
+    }
+}
+
+/**
+ * Generates the heights of one row, NODATA in holes
+ * Inputs:
+ *  - s: terrain
+ *  - row: row from the north edge
+ *  - out: receives opts.size heights
+ */
+static void synth_row(const synth_t *s, int row, double *out) {
+    const synth_options_t *o = &s->opts;
+    int cols = o->size;
+    memset(out, 0, (size_t)cols * sizeof(double));
+
+    double wavelength = s->wavelength, amplitude = 1.0, total = 0.0;
+    for (int k = 0; k < o->octaves && wavelength >= SYNTH_MIN_WAVELENGTH; k++) {
+        synth_octave_row(s->keys[k], wavelength, amplitude, row, cols, out);
+        total += amplitude;
+        wavelength /= 2;
+        amplitude /= 2;
+    }
+    double scale = total > 0 ? o->relief / total : 0.0;
+    for (int c = 0; c < cols; c++) {
+        out[c] = o->base + scale * out[c];
+    }
+
+    for (int i = 0; i < s->nfeatures; i++) {
+        const synth_feature_t *f = &s->features[i];
+        double dy = row - f->row;
+        if (fabs(dy) >= f->radius) {
+            continue;
+        }
+        double r2 = f->radius * f->radius;
+        int c0 = (int)fmax(0.0, ceil(f->col - f->radius));
+        int c1 = (int)fmin(cols - 1.0, floor(f->col + f->radius));
+        for (int c = c0; c <= c1; c++) {
+            double dx = c - f->col, d2 = dx * dx + dy * dy;
+            if (d2 >= r2) {
+                continue;
+            }
+            if (f->kind == SYNTH_BASIN) {
+                double u = 1.0 - d2 / r2;
+                out[c] -= f->level * u * u;
+            } else if (f->kind == SYNTH_PLATEAU) {
+                // Flat out to 70% of the radius, then blended back into the terrain
+                double d = sqrt(d2) / f->radius;
+                double t = d < 0.7 ? 1.0 : synth_smooth((1.0 - d) / 0.3);
+                out[c] += t * (f->level - out[c]);
+            } else {
+                double d = sqrt(d2) / f->radius;
+                double edge = 0.75 + 0.25 * synth_noise(f->key, 4.0 * c / f->radius, 4.0 * row / f->radius);
+                if (d < edge) {
+                    out[c] = POINTCLOUD_NODATA;
+                }
+            }
+        }
+    }
+}
+
+static void synth_free(synth_t *s) {
+    if (s) {
+        mem_free(s->keys);
+        mem_free(s->features);
+        mem_free(s);
+    }
+}
+
+/**
+ * Checks the options and places the features of a terrain. Features are
+ * drawn from the seed in a fixed order, basins first, then plateaus, then
+ * holes, so adding holes does not move the basins.
+ * Returns: the terrain, or NULL on invalid options or allocation failure
+ */
+static synth_t* synth_create(const synth_options_t *opts) {
+    if (!opts || opts->size < 2 || opts->size > (1 << 20) || opts->octaves < 1 ||
+        opts->relief < 0 || opts->basins < 0 || opts->plateaus < 0 || opts->holes < 0 ||
+        !(opts->cell > 0)) {
+        fprintf(stderr, "Invalid parameters passed to synth_create\n");
+        return NULL;
+    }
+
+    synth_t *s = mem_calloc(MEM_INGEST, 1, sizeof(synth_t));
+    if (!s) {
+        return NULL;
+    }
+    s->opts = *opts;
+    s->wavelength = opts->wavelength > 0 ? opts->wavelength : opts->size / 4.0;
+    s->nfeatures = opts->basins + opts->plateaus + opts->holes;
+    s->keys = mem_alloc(MEM_INGEST, opts->octaves * sizeof(uint64_t));
+    s->features = mem_alloc(MEM_INGEST, (s->nfeatures > 0 ? s->nfeatures : 1) * sizeof(synth_feature_t));
+    if (!s->keys || !s->features) {
+        synth_free(s);
+        return NULL;
+    }
+
+    uint64_t state = opts->seed;
+    for (int k = 0; k < opts->octaves; k++) {
+        s->keys[k] = synth_next(&state);
+    }
+
+    double size = opts->size;
+    for (int i = 0; i < s->nfeatures; i++) {
+        synth_feature_t *f = &s->features[i];
+        f->row = synth_uniform(&state, 0.0, size);
+        f->col = synth_uniform(&state, 0.0, size);
+        f->key = synth_next(&state);
+        if (i < opts->basins) {
+            f->kind = SYNTH_BASIN;
+            f->radius = fmax(2.0, synth_uniform(&state, size / 40, size / 10));
+            f->level = opts->relief * synth_uniform(&state, 0.3, 0.8);
+        } else if (i < opts->basins + opts->plateaus) {
+            f->kind = SYNTH_PLATEAU;
+            f->radius = fmax(2.0, synth_uniform(&state, size / 30, size / 8));
+            f->level = opts->base + opts->relief * synth_uniform(&state, 0.2, 0.7);
+        } else {
+            f->kind = SYNTH_HOLE;
+            f->radius = fmax(1.5, synth_uniform(&state, size / 200, size / 40));
+            f->level = 0.0;
+        }
+    }
+    return s;
+}
+
+/**
+ * Fills in the options of a 1000 x 1000 terrain placed like the one
+ * utility_scripts/generate_terrain.py writes
+ */
+void synth_defaults(synth_options_t *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->size = 1000;
+    opts->seed = 1;
+    opts->octaves = 6;
+    opts->wavelength = 0.0;
+    opts->base = 300.0;
+    opts->relief = 50.0;
+    opts->basins = 8;
+    opts->plateaus = 4;
+    opts->holes = 0;
+    opts->cell = 1.0;
+    opts->x0 = 445000.5;
+    opts->y0 = 4650999.5;
+    opts->nthreads = 0;
+}
+
+typedef struct {
+    const synth_t *s;
+    pcd_t *points;
+    int failed;
+} synth_grid_job_t;
+
+static void synth_grid_worker(void *arg, int thread, int nthreads) {
+    synth_grid_job_t *job = arg;
+    const synth_options_t *o = &job->s->opts;
+    int cols = o->size;
+    int first = (int)((long)o->size * thread / nthreads);
+    int last = (int)((long)o->size * (thread + 1) / nthreads);
+
+    double *heights = mem_alloc(MEM_INGEST, (size_t)cols * sizeof(double));
+    if (!heights) {
+        job->failed = 1;
+        return;
+    }
+    for (int r = first; r < last; r++) {
+        synth_row(job->s, r, heights);
+        pcd_t *row = job->points + (size_t)r * cols;
+        for (int c = 0; c < cols; c++) {
+            pcd_t point = {
+                .x = o->x0 + c * o->cell, .y = o->y0 - r * o->cell, .z = heights[c],
+                .wd = 0.0,
+                .north = NULL, .south = NULL,
+                .east = NULL, .west = NULL
+            };
+            row[c] = point;
+        }
+    }
+    mem_free(heights);
+}
+
+/**
+ * Generates a terrain straight into a point cloud, without going through a
+ * file. Rows run north to south, as when the terrain is written and read back.
+ * Inputs:
+ *  - opts: terrain to generate
+ * Returns: the point cloud, or NULL on failure
+ */
+pointcloud_t* synth_pointcloud(const synth_options_t *opts) {
+    synth_t *s = synth_create(opts);
+    if (!s) {
+        return NULL;
+    }
+    size_t n = (size_t)opts->size * opts->size;
+    pointcloud_t *pc = mem_calloc(MEM_INGEST, 1, sizeof(pointcloud_t));
+    pcd_t *points = n <= INT_MAX ? mem_alloc(MEM_INGEST, n * sizeof(pcd_t)) : NULL;
+    if (!pc || !points) {
+        fprintf(stderr, "Error: Cannot allocate a %d x %d terrain\n", opts->size, opts->size);
+        mem_free(pc);
+        mem_free(points);
+        synth_free(s);
+        return NULL;
+    }
+
+    synth_grid_job_t job = {.s = s, .points = points, .failed = 0};
+    parallelRun(opts->nthreads > 0 ? opts->nthreads : defaultThreadCount(), synth_grid_worker, &job);
+    synth_free(s);
+
+    pc->water_coef = 0.1;
+    pc->evap_coef = 0.95;
+    pc->rows = opts->size;
+    pc->cols = opts->size;
+    pc->points.data = points;
+    pc->points.size = (int)n;
+    pc->points.max_size = (int)n;
+    pc->points.max_element_size = sizeof(pcd_t);
+    if (job.failed) {
+        pointcloud_free(pc);
+        return NULL;
+    }
+
+    pc->stats.min_height = DBL_MAX;
+    pc->stats.max_height = -DBL_MAX;
+    double height_sum = 0.0;
+    size_t nodata = 0;
+    for (size_t i = 0; i < n; i++) {
+        double z = points[i].z;
+        if (z <= POINTCLOUD_NODATA) {
+            if (!pc->valid && !(pc->valid = pointcloud_mask_alloc(n))) {
+                pointcloud_free(pc);
+                return NULL;
+            }
+            pc->valid[i >> 6] &= ~(1ULL << (i & 63));
+            nodata++;
+            continue;
+        }
+        if (z < pc->stats.min_height) pc->stats.min_height = z;
+        if (z > pc->stats.max_height) pc->stats.max_height = z;
+        height_sum += z;
+    }
+    pc->stats.avg_height = n > nodata ? height_sum / (n - nodata) : 0.0;
+    pc->stats.min_x = opts->x0;
+    pc->stats.max_x = opts->x0 + (opts->size - 1) * opts->cell;
+    pc->stats.min_y = opts->y0 - (opts->size - 1) * opts->cell;
+    pc->stats.max_y = opts->y0;
+    return pc;
+}
+
+/**
+ * Formats a value with a fixed number of decimals followed by a separator,
+ * several times faster than printf. Values too large for the fast path fall
+ * back to snprintf.
+ * Returns: the end of the formatted text
+ */
+static char* synth_format(char *p, double v, int decimals, char separator) {
+    static const double scales[] = {1, 10, 100, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+    double scaled = v * scales[decimals];
+    if (!(fabs(scaled) < 9e18)) {
+        p += snprintf(p, SYNTH_FIELD_MAX - 1, "%.*g", 17, v);
+        *p++ = separator;
+        return p;
+    }
+
+    long long n = llround(scaled);
+    if (n < 0) {
+        *p++ = '-';
+        n = -n;
+    }
+    char digits[24];
+    int len = 0;
+    do {
+        digits[len++] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n > 0 || len <= decimals);
+    while (len > decimals) {
+        *p++ = digits[--len];
+    }
+    if (decimals > 0) {
+        *p++ = '.';
+        while (len > 0) {
+            *p++ = digits[--len];
+        }
+    }
+    *p++ = separator;
+    return p;
+}
+
+// A band of rows generated by each thread before the main thread writes them in order
+typedef struct {
+    const synth_t *s;
+    int first_row;          // first row of thread 0's band
+    int band_rows;          // rows in each thread's band
+    double **heights;       // heights of each thread's band
+    char **text;            // each thread's band as text, NULL for rasters
+    size_t *text_len;
+} synth_band_job_t;
+
+static void synth_band_worker(void *arg, int thread, int nthreads) {
+    (void)nthreads;
+    synth_band_job_t *job = arg;
+    const synth_options_t *o = &job->s->opts;
+    int cols = o->size;
+    int first = job->first_row + thread * job->band_rows;
+    int last = first + job->band_rows < o->size ? first + job->band_rows : o->size;
+
+    char *p = job->text ? job->text[thread] : NULL;
+    for (int r = first; r < last; r++) {
+        double *heights = job->heights[thread] + (size_t)(r - first) * cols;
+        synth_row(job->s, r, heights);
+        if (!p) {
+            continue;
+        }
+        double y = o->y0 - r * o->cell;
+        for (int c = 0; c < cols; c++) {
+            p = synth_format(p, o->x0 + c * o->cell, 3, ' ');
+            p = synth_format(p, y, 3, ' ');
+            p = synth_format(p, heights[c], 6, '\n');
+        }
+    }
+    if (job->text) {
+        job->text_len[thread] = p - job->text[thread];
+    }
+}
+
+/**
+ * Generates a terrain into a file, a band of rows per thread at a time, so
+ * the terrain never has to fit in memory. Text output is what
+ * readPointCloudData reads: the column count, then one "x y z" line per
+ * cell, north row first, NODATA as -9999. Raster output is a north-up
+ * raster with an ENVI header, as raster_write produces.
+ * Inputs:
+ *  - opts: terrain to generate
+ *  - filename: output file
+ *  - type: RASTER_FLOAT32 or RASTER_FLOAT64 for a raster, 0 for text
+ * Returns: 0 on success, -1 on failure
+ */
+int synth_write(const synth_options_t *opts, const char *filename, raster_type_t type) {
+    if (!filename || (type != 0 && type != RASTER_FLOAT32 && type != RASTER_FLOAT64)) {
+        fprintf(stderr, "Invalid parameters passed to synth_write\n");
+        return -1;
+    }
+    synth_t *s = synth_create(opts);
+    if (!s) {
+        return -1;
+    }
+
+    int size = opts->size;
+    int nthreads = opts->nthreads > 0 ? opts->nthreads : defaultThreadCount();
+    int band_rows = SYNTH_BAND_CELLS / size > 0 ? SYNTH_BAND_CELLS / size : 1;
+    if ((long)band_rows * nthreads > size) {
+        band_rows = (size + nthreads - 1) / nthreads;
+    }
+    size_t band_cells = (size_t)band_rows * size;
+
+    synth_band_job_t job = {.s = s, .band_rows = band_rows};
+    job.heights = mem_calloc(MEM_INGEST, nthreads, sizeof(double *));
+    job.text_len = mem_calloc(MEM_INGEST, nthreads, sizeof(size_t));
+    job.text = type == 0 ? mem_calloc(MEM_INGEST, nthreads, sizeof(char *)) : NULL;
+    raster_writer_t *rw = type != 0 ? raster_writer_create_grid(size, size, type,
+                                                                opts->x0 - opts->cell / 2,
+                                                                opts->y0 + opts->cell / 2,
+                                                                opts->cell, opts->cell) : NULL;
+    FILE *f = fopen(filename, type != 0 ? "wb" : "w");
+    int ok = job.heights && job.text_len && (type != 0 || job.text) && (type == 0 || rw) && f;
+    for (int t = 0; ok && t < nthreads; t++) {
+        job.heights[t] = mem_alloc(MEM_INGEST, band_cells * sizeof(double));
+        if (job.text) {
+            job.text[t] = mem_alloc(MEM_INGEST, band_cells * 3 * SYNTH_FIELD_MAX);
+        }
+        ok = job.heights[t] && (!job.text || job.text[t]);
+    }
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s\n", filename);
+    } else if (!ok) {
+        fprintf(stderr, "Error: Cannot allocate buffers for a %d x %d terrain\n", size, size);
+    }
+
+    if (ok && type == 0) {
+        ok = fprintf(f, "%d\n", size) > 0;
+    }
+    for (int first = 0; ok && first < size; first += band_rows * nthreads) {
+        job.first_row = first;
+        parallelRun(nthreads, synth_band_worker, &job);
+        for (int t = 0; ok && t < nthreads; t++) {
+            int start = first + t * band_rows;
+            if (start >= size) {
+                break;
+            }
+            int rows = start + band_rows < size ? band_rows : size - start;
+            if (job.text) {
+                ok = fwrite(job.text[t], 1, job.text_len[t], f) == job.text_len[t];
+            } else {
+                ok = raster_write_samples(rw, f, job.heights[t], (size_t)rows * size) == 0;
+            }
+        }
+    }
+
+    if (f && fclose(f) != 0) {
+        ok = 0;
+    }
+    if (ok && rw) {
+        char description[64];
+        snprintf(description, sizeof(description), "synthetic terrain, seed %llu",
+                 (unsigned long long)opts->seed);
+        ok = raster_write_header(rw, filename, description) == 0;
+    }
+    if (f && !ok) {
+        fprintf(stderr, "Error: Failed to write %s\n", filename);
+    }
+
+    for (int t = 0; t < nthreads; t++) {
+        if (job.heights) mem_free(job.heights[t]);
+        if (job.text) mem_free(job.text[t]);
+    }
+    mem_free(job.heights);
+    mem_free(job.text);
+    mem_free(job.text_len);
+    raster_writer_free(rw);
+    synth_free(s);
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,34 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdint.h>
+#include "pointcloud.h"
+#include "raster.h"
+
+/*
+Synthetic terrain: multi-octave value noise with bowl shaped basins, flat
+topped plateaus and NODATA holes placed at random. Every height is a function
+of the seed and the cell's row and column alone, so a terrain is the same
+however many threads generate it and whichever rows are generated first.
+*/
+
+typedef struct {
+    int size;           // grid edge length in cells; the grid is square
+    uint64_t seed;      // seed of the noise and of the feature placement
+    int octaves;        // noise octaves, each half the wavelength and amplitude of the last
+    double wavelength;  // wavelength of the first octave in cells, <= 0 for a quarter of the size
+    double base;        // mean height
+    double relief;      // largest departure of the noise from the base height
+    int basins;         // number of basins
+    int plateaus;       // number of plateaus
+    int holes;          // number of NODATA holes
+    double cell;        // cell edge length in map units
+    double x0, y0;      // map position of the centre of the north-west cell
+    int nthreads;       // worker threads, 0 for the default
+} synth_options_t;
+
+void synth_defaults(synth_options_t *opts);
+pointcloud_t* synth_pointcloud(const synth_options_t *opts);
+int synth_write(const synth_options_t *opts, const char *filename, raster_type_t type);
+
+#endif // SYNTH_H
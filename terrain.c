@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "terrain.h"
+#include "mem.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+All derivatives come from one 3x3 window per cell:
+  - gradient p = dz/dx, q = dz/dy with Horn's weighted differences
+  - second derivatives r = d2z/dx2, t = d2z/dy2, s = d2z/dxdy after
+    Zevenbergen & Thorne
+x grows to the east and y to the north; the signed row and column spacing of
+the input turns grid differences into those geographic derivatives. Borders
+replicate the edge cells.
+*/
+
+#define TERRAIN_FLAT 1e-12f
+#define RAD_TO_DEG 57.29577951308232
+
+typedef struct {
+    const float *padded;    // (rows + 2) x (cols + 2) heights with replicated borders
+    terrain_t *tr;
+    float *scratch;         // 2 x cols p and q values per thread
+    float inv_8dx, inv_8dy;     // Horn gradient scales
+    float inv_dx2, inv_dy2;     // second derivative scales
+    float inv_4dxdy;            // cross derivative scale
+    float sun_z;                // sin(altitude)
+    float sun_x, sun_y;         // horizontal components of the light vector
+} terrain_job_t;
+
+/**
+ * Computes every vectorizable derivative for one cell. p and q go to the row
+ * scratch buffers; slope and aspect are finished from them afterwards.
+ * w points at the cell in the padded grid and stride is the padded row length.
+ * The comparisons that pick flat and shadowed cells are false for NaN, so a
+ * cell whose stencil holds a NaN is set to NaN explicitly rather than left 0.
+ */
+static void terrain_cell(const terrain_job_t *job, const float *w, int stride,
+                         float *p_out, float *q_out, float *plan, float *prof, float *shade) {
+    const float *up = w - stride, *dn = w + stride;
+
+    float p = ((up[1] + 2.0f * w[1] + dn[1]) - (up[-1] + 2.0f * w[-1] + dn[-1])) * job->inv_8dx;
+    float q = ((dn[-1] + 2.0f * dn[0] + dn[1]) - (up[-1] + 2.0f * up[0] + up[1])) * job->inv_8dy;
+    float r = (w[-1] - 2.0f * w[0] + w[1]) * job->inv_dx2;
+    float t = (up[0] - 2.0f * w[0] + dn[0]) * job->inv_dy2;
+    float s = ((dn[1] - dn[-1]) - (up[1] - up[-1])) * job->inv_4dxdy;
+
+    float pp = p * p, qq = q * q, pq2s = 2.0f * p * q * s;
+    float g2 = pp + qq;
+    float n2 = 1.0f + g2;
+    float n = sqrtf(n2);
+
+    if (g2 > TERRAIN_FLAT) {
+        float g = sqrtf(g2);
+        *prof = -(pp * r + pq2s + qq * t) / (g2 * (n2 * n));
+        *plan = -(qq * r - pq2s + pp * t) / (g2 * g);
+    } else {
+        *prof = 0.0f;
+        *plan = 0.0f;
+    }
+
+    float light = (job->sun_z - p * job->sun_x - q * job->sun_y) / n;
+    *shade = light > 0.0f ? 255.0f * light : 0.0f;
+    *p_out = p;
+    *q_out = q;
+
+    // p and q skip the centre cell and r and t cover it, so together they see the whole stencil
+    if (isnan(p + q + r + t + s)) {
+        *p_out = *q_out = *plan = *prof = *shade = NAN;
+    }
+}
+
+#if defined(__SSE2__)
+/**
+ * SSE version of terrain_cell for four consecutive cells. It performs the same
+ * operations in the same order, so both paths give identical results.
+ */
+static void terrain_cell4(const terrain_job_t *job, const float *w, int stride,
+                          float *p_out, float *q_out, float *plan, float *prof, float *shade) {
+    const float *up = w - stride, *dn = w + stride;
+    const __m128 two = _mm_set1_ps(2.0f);
+
+    __m128 um = _mm_loadu_ps(up - 1), u0 = _mm_loadu_ps(up), up1 = _mm_loadu_ps(up + 1);
+    __m128 wm = _mm_loadu_ps(w - 1), w0 = _mm_loadu_ps(w), wp = _mm_loadu_ps(w + 1);
+    __m128 dm = _mm_loadu_ps(dn - 1), d0 = _mm_loadu_ps(dn), dp = _mm_loadu_ps(dn + 1);
+
+    __m128 p = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(_mm_add_ps(up1, _mm_mul_ps(two, wp)), dp),
+                                     _mm_add_ps(_mm_add_ps(um, _mm_mul_ps(two, wm)), dm)),
+                          _mm_set1_ps(job->inv_8dx));
+    __m128 q = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(_mm_add_ps(dm, _mm_mul_ps(two, d0)), dp),
+                                     _mm_add_ps(_mm_add_ps(um, _mm_mul_ps(two, u0)), up1)),
+                          _mm_set1_ps(job->inv_8dy));
+    __m128 r = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(wm, _mm_mul_ps(two, w0)), wp), _mm_set1_ps(job->inv_dx2));
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(u0, _mm_mul_ps(two, w0)), d0), _mm_set1_ps(job->inv_dy2));
+    __m128 s = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(dp, dm), _mm_sub_ps(up1, um)), _mm_set1_ps(job->inv_4dxdy));
+
+    __m128 pp = _mm_mul_ps(p, p), qq = _mm_mul_ps(q, q);
+    __m128 pq2s = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(two, p), q), s);
+    __m128 g2 = _mm_add_ps(pp, qq);
+    __m128 n2 = _mm_add_ps(_mm_set1_ps(1.0f), g2);
+    __m128 n = _mm_sqrt_ps(n2);
+    __m128 g = _mm_sqrt_ps(g2);
+    __m128 sloped = _mm_cmpgt_ps(g2, _mm_set1_ps(TERRAIN_FLAT));
+
+    // Flat lanes divide by zero here; the mask clears them afterwards
+    __m128 vprof = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(pp, r), pq2s), _mm_mul_ps(qq, t)),
+                              _mm_mul_ps(g2, _mm_mul_ps(n2, n)));
+    __m128 vplan = _mm_div_ps(_mm_add_ps(_mm_sub_ps(_mm_mul_ps(qq, r), pq2s), _mm_mul_ps(pp, t)),
+                              _mm_mul_ps(g2, g));
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    vprof = _mm_and_ps(sloped, _mm_xor_ps(vprof, sign));
+    vplan = _mm_and_ps(sloped, _mm_xor_ps(vplan, sign));
+
+    __m128 light = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(_mm_set1_ps(job->sun_z),
+                                                    _mm_mul_ps(p, _mm_set1_ps(job->sun_x))),
+                                         _mm_mul_ps(q, _mm_set1_ps(job->sun_y))),
+                              n);
+    __m128 vshade = _mm_mul_ps(_mm_set1_ps(255.0f), _mm_max_ps(light, _mm_setzero_ps()));
+
+    __m128 any = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(p, q), r), t), s);
+    __m128 hole = _mm_cmpunord_ps(any, any);
+    if (_mm_movemask_ps(hole)) {
+        const __m128 nan = _mm_set1_ps(NAN);
+        p = _mm_or_ps(_mm_andnot_ps(hole, p), _mm_and_ps(hole, nan));
+        q = _mm_or_ps(_mm_andnot_ps(hole, q), _mm_and_ps(hole, nan));
+        vplan = _mm_or_ps(_mm_andnot_ps(hole, vplan), _mm_and_ps(hole, nan));
+        vprof = _mm_or_ps(_mm_andnot_ps(hole, vprof), _mm_and_ps(hole, nan));
+        vshade = _mm_or_ps(_mm_andnot_ps(hole, vshade), _mm_and_ps(hole, nan));
+    }
+
+    _mm_storeu_ps(p_out, p);
+    _mm_storeu_ps(q_out, q);
+    _mm_storeu_ps(plan, vplan);
+    _mm_storeu_ps(prof, vprof);
+    _mm_storeu_ps(shade, vshade);
+}
+#endif
+
+// Processes a band of rows: vector stencil first, then slope and aspect
+static void terrain_band(void *arg, int thread, int nthreads) {
+    terrain_job_t *job = arg;
+    terrain_t *tr = job->tr;
+    int cols = tr->cols, stride = cols + 2;
+    int r0 = (int)((long)tr->rows * thread / nthreads);
+    int r1 = (int)((long)tr->rows * (thread + 1) / nthreads);
+
+    float *ps = job->scratch + (size_t)thread * 2 * cols, *qs = ps + cols;
+
+    for (int row = r0; row < r1; row++) {
+        const float *w = job->padded + (size_t)(row + 1) * stride + 1;
+        size_t o = (size_t)row * cols;
+        int col = 0;
+
+#if defined(__SSE2__)
+        for (; col + 4 <= cols; col += 4) {
+            terrain_cell4(job, w + col, stride, ps + col, qs + col,
+                          tr->plan_curv + o + col, tr->prof_curv + o + col, tr->hillshade + o + col);
+        }
+#endif
+        for (; col < cols; col++) {
+            terrain_cell(job, w + col, stride, ps + col, qs + col,
+                         tr->plan_curv + o + col, tr->prof_curv + o + col, tr->hillshade + o + col);
+        }
+
+        for (col = 0; col < cols; col++) {
+            float p = ps[col], q = qs[col];
+            float g2 = p * p + q * q;
+            tr->slope[o + col] = (float)(atanf(sqrtf(g2)) * RAD_TO_DEG);
+            if (g2 > TERRAIN_FLAT) {
+                // Compass bearing of the downhill direction (-p, -q)
+                float a = (float)(atan2f(-p, -q) * RAD_TO_DEG);
+                tr->aspect[o + col] = a < 0.0f ? a + 360.0f : a;
+            } else if (isnan(g2)) {
+                tr->aspect[o + col] = NAN;
+            } else {
+                tr->aspect[o + col] = -1.0f;
+            }
+        }
+    }
+}
+
+/**
+ * Computes slope, aspect, plan and profile curvature and hillshade for every cell
+ * Inputs:
+ *  - pc: point cloud laid out as a regular grid
+ *  - azimuth, altitude: light source for the hillshade in degrees
+ *  - nthreads: worker threads, 0 for the default
+ * Output: the derivative rasters, or NULL on failure
+ */
+terrain_t* terrain_analyze(const pointcloud_t *pc, double azimuth, double altitude, int nthreads) {
+    if (!pc || !pc->points.data || pc->rows <= 0 || pc->cols <= 0 ||
+        (long)pc->rows * pc->cols != pc->points.size) {
+        fprintf(stderr, "Invalid parameters passed to terrain_analyze\n");
+        return NULL;
+    }
+
+    int rows = pc->rows, cols = pc->cols, stride = cols + 2;
+    size_t n = (size_t)rows * cols;
+    const pcd_t *points = pc->points.data;
+
+    terrain_t *tr = mem_calloc(MEM_ANALYSIS, 1, sizeof(terrain_t));
+    float *padded = mem_alloc(MEM_ANALYSIS, (size_t)(rows + 2) * stride * sizeof(float));
+    if (tr) {
+        tr->slope = mem_alloc(MEM_ANALYSIS, n * sizeof(float));
+        tr->aspect = mem_alloc(MEM_ANALYSIS, n * sizeof(float));
+        tr->plan_curv = mem_alloc(MEM_ANALYSIS, n * sizeof(float));
+        tr->prof_curv = mem_alloc(MEM_ANALYSIS, n * sizeof(float));
+        tr->hillshade = mem_alloc(MEM_ANALYSIS, n * sizeof(float));
+    }
+    if (!tr || !padded || !tr->slope || !tr->aspect || !tr->plan_curv ||
+        !tr->prof_curv || !tr->hillshade) {
+        fprintf(stderr, "Failed to allocate terrain rasters\n");
+        mem_free(padded);
+        terrain_free(tr);
+        return NULL;
+    }
+    tr->rows = rows;
+    tr->cols = cols;
+    tr->ascending = pointcloud_rows_ascending(pc);
+
+    // Gather heights into the padded grid, replicating the edges. NODATA
+    // becomes NaN, and the cells whose stencil touches it get NaN derivatives.
+    for (int row = 0; row < rows; row++) {
+        float *line = padded + (size_t)(row + 1) * stride;
+        const pcd_t *src = points + (size_t)row * cols;
+        for (int col = 0; col < cols; col++) {
+            size_t i = (size_t)row * cols + col;
+            line[col + 1] = POINTCLOUD_VALID(pc->valid, i) ? (float)src[col].z : NAN;
+        }
+        line[0] = line[1];
+        line[cols + 1] = line[cols];
+    }
+    memcpy(padded, padded + stride, stride * sizeof(float));
+    memcpy(padded + (size_t)(rows + 1) * stride, padded + (size_t)rows * stride, stride * sizeof(float));
+
+    // Signed cell spacing turns grid differences into geographic derivatives
+    double dx = cols > 1 ? points[1].x - points[0].x : 1.0;
+    double dy = rows > 1 ? points[cols].y - points[0].y : 1.0;
+    if (dx == 0.0) dx = 1.0;
+    if (dy == 0.0) dy = 1.0;
+
+    double az = azimuth / RAD_TO_DEG, alt = altitude / RAD_TO_DEG;
+    terrain_job_t job = {
+        .padded = padded, .tr = tr,
+        .inv_8dx = (float)(1.0 / (8.0 * dx)), .inv_8dy = (float)(1.0 / (8.0 * dy)),
+        .inv_dx2 = (float)(1.0 / (dx * dx)), .inv_dy2 = (float)(1.0 / (dy * dy)),
+        .inv_4dxdy = (float)(1.0 / (4.0 * dx * dy)),
+        .sun_z = (float)sin(alt),
+        .sun_x = (float)(cos(alt) * sin(az)), .sun_y = (float)(cos(alt) * cos(az))
+    };
+
+    if (nthreads <= 0) {
+        nthreads = defaultThreadCount();
+    }
+    if (nthreads > rows) {
+        nthreads = rows;
+    }
+    // Each band's scratch is allocated here so that a failure fails the call
+    job.scratch = mem_alloc(MEM_ANALYSIS, (size_t)nthreads * 2 * cols * sizeof(float));
+    if (!job.scratch) {
+        fprintf(stderr, "Failed to allocate terrain scratch rows\n");
+        mem_free(padded);
+        terrain_free(tr);
+        return NULL;
+    }
+    parallelRun(nthreads, terrain_band, &job);
+
+    mem_free(job.scratch);
+    mem_free(padded);
+    return tr;
+}
+
+void terrain_free(terrain_t *tr) {
+    if (!tr) {
+        return;
+    }
+    mem_free(tr->slope);
+    mem_free(tr->aspect);
+    mem_free(tr->plan_curv);
+    mem_free(tr->prof_curv);
+    mem_free(tr->hillshade);
+    mem_free(tr);
+}
+
+/**
+ * Writes one derivative raster as row-major little-endian float32 values
+ * Returns: 0 on success, -1 on failure
+ */
+int terrain_write_raster(const terrain_t *tr, const float *data, const char *filename) {
+    if (!tr || !data || !filename) {
+        return -1;
+    }
+
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s\n", filename);
+        return -1;
+    }
+
+    size_t n = (size_t)tr->rows * tr->cols;
+    int ok = fwrite(data, sizeof(float), n, f) == n;
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Error: Failed to write %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Renders a derivative raster as grayscale, one pixel per cell, north up.
+ * Values are mapped linearly from [lo, hi] to black..white and clamped.
+ */
+void imageTerrainRaster(const terrain_t *tr, const float *data, float lo, float hi, char *filename) {
+    if (!tr || !data || !filename || hi <= lo) {
+        fprintf(stderr, "Invalid parameters passed to imageTerrainRaster\n");
+        return;
+    }
+
+    Bitmap *bmp = bm_create(tr->cols, tr->rows);
+    if (!bmp) {
+        fprintf(stderr, "Failed to create bitmap\n");
+        return;
+    }
+
+    uint32_t *pixels = (uint32_t *)bm_raw_data(bmp);
+    float scale = 255.0f / (hi - lo);
+    for (int row = 0; row < tr->rows; row++) {
+        int y = tr->ascending ? tr->rows - 1 - row : row;
+        const float *src = data + (size_t)row * tr->cols;
+        uint32_t *line = pixels + (size_t)y * tr->cols;
+        for (int col = 0; col < tr->cols; col++) {
+            float v = (src[col] - lo) * scale;
+            int intensity = !(v > 0.0f) ? 0 : (v > 255.0f ? 255 : (int)v);
+            line[col] = bm_rgb(intensity, intensity, intensity);
+        }
+    }
+
+    printf("Saving terrain raster to %s...\n", filename);
+    if (!bm_save(bmp, filename)) {
+        fprintf(stderr, "Failed to save bitmap\n");
+    }
+
+    bm_free(bmp);
+}
@@ -0,0 +1,28 @@
+#ifndef TERRAIN_H
+#define TERRAIN_H
+
+#include "pointcloud.h"
+
+// Default light source for hillshading (degrees)
+#define TERRAIN_SUN_AZIMUTH 315.0
+#define TERRAIN_SUN_ALTITUDE 45.0
+
+// Terrain derivatives of a grid, one float per cell in row-major grid order.
+// Cells whose stencil touches NODATA hold NaN.
+typedef struct {
+    int rows;           // grid rows
+    int cols;           // grid columns
+    int ascending;      // 1 when grid rows run south to north (row 0 has the smallest y)
+    float *slope;       // slope angle in degrees
+    float *aspect;      // downslope direction in degrees clockwise from north, -1 where flat
+    float *plan_curv;   // plan (contour) curvature, 1/length units
+    float *prof_curv;   // profile curvature, 1/length units
+    float *hillshade;   // illumination 0-255
+} terrain_t;
+
+terrain_t* terrain_analyze(const pointcloud_t *pc, double azimuth, double altitude, int nthreads);
+void terrain_free(terrain_t *tr);
+int terrain_write_raster(const terrain_t *tr, const float *data, const char *filename);
+void imageTerrainRaster(const terrain_t *tr, const float *data, float lo, float hi, char *filename);
+
+#endif // TERRAIN_H
@@ -1,7 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 #include <assert.h>
 #include "pointcloud.h"
+#include "checkpoint.h"
+#include "basin.h"
+#include "terrain.h"
+#include "gridding.h"
+#include "sim.h"
+#include "render.h"
+#include "queue.h"
+#include "frames.h"
+#include "raster.h"
+#include "prof.h"
+#include "synth.h"
+#include "trace.h"
+#include "mem.h"
+#include <pthread.h>
+#include <sched.h>
+#include <math.h>
 
 void test_small_grid() {
     printf("\n=== Testing Small Grid ===\n");
@@ -470,6 +488,1997 @@ void test_image_point_cloud_water() {
     pointcloud_free(pc);
 }
 
+void test_checkpoint_roundtrip() {
+    printf("\n=== Testing Checkpoint Roundtrip ===\n");
+
+    FILE *f = fopen("test_watershed_step.xyz", "r");
+    if (!f) {
+        printf("Failed to open test file\n");
+        return;
+    }
+    pointcloud_t *pc = readPointCloudData(f);
+    fclose(f);
+    assert(pc && "Failed to read test pointcloud");
+
+    initializeWatershed(pc);
+    update_watershed_coefficients(pc, 0.15, 0.92);
+    watershedAddUniformWater(pc, 2.0);
+    for (int step = 0; step < 3; step++) {
+        watershedStep(pc);
+    }
+
+    // Write the checkpoint through the background writer
+    checkpoint_writer_t *cw = checkpoint_writer_create("test_checkpoint.ckpt", pc->points.size);
+    assert(cw && "Failed to create checkpoint writer");
+    assert(checkpoint_writer_submit(cw, pc, 2, 10, 2.0) == 1 && "Snapshot was not queued");
+    checkpoint_writer_free(cw);
+
+    // Restore into a fresh pointcloud
+    f = fopen("test_watershed_step.xyz", "r");
+    pointcloud_t *restored = readPointCloudData(f);
+    fclose(f);
+    initializeWatershed(restored);
+
+    checkpoint_t *ck = checkpoint_open("test_checkpoint.ckpt");
+    assert(ck && "Failed to open checkpoint");
+    assert(ck->header->step == 2 && ck->header->iter == 10 && "Wrong run parameters");
+    assert(checkpoint_restore(ck, restored) == 0 && "Failed to restore checkpoint");
+    checkpoint_close(ck);
+
+    int test_passed = restored->water_coef == 0.15 && restored->evap_coef == 0.92;
+    for (int i = 0; i < pc->points.size; i++) {
+        pcd_t *a = (pcd_t*)listGet(&pc->points, i);
+        pcd_t *b = (pcd_t*)listGet(&restored->points, i);
+        if (a->wd != b->wd) {
+            printf("ERROR: Point %d restored water %.6f, expected %.6f\n", i, b->wd, a->wd);
+            test_passed = 0;
+        }
+    }
+
+    // Both runs must continue identically
+    watershedStep(pc);
+    watershedStep(restored);
+    pcd_t *center = (pcd_t*)listGet(&pc->points, 4);
+    pcd_t *restored_center = (pcd_t*)listGet(&restored->points, 4);
+    if (center->wd != restored_center->wd) {
+        printf("ERROR: Resumed run diverged\n");
+        test_passed = 0;
+    }
+
+    printf("\nCheckpoint roundtrip test: %s\n", test_passed ? "PASSED" : "FAILED");
+
+    pointcloud_free(pc);
+    pointcloud_free(restored);
+}
+
+/**
+ * Checks basin labels against the drainage rules: a cell with a lower
+ * neighbour shares the basin of its steepest one, a flat with an outlet
+ * drains each cell towards its nearest outlet and holds no sink, and a flat
+ * without one is a single basin with its sink on the flat
+ * Returns: 1 if every cell follows the rules, 0 otherwise
+ */
+static int check_basin_rules(const pointcloud_t *pc, const basin_map_t *bm) {
+    const pcd_t *base = pc->points.data;
+    int n = pc->points.size, ok = 1;
+    int *dist = malloc(n * sizeof(int)), *queue = malloc(n * sizeof(int));
+    int *component = malloc(n * sizeof(int));
+    assert(dist && queue && component && "Failed to allocate");
+    for (int i = 0; i < n; i++) {
+        dist[i] = -1;
+        component[i] = -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        const pcd_t *c = &base[i];
+        const pcd_t *nb[4] = {c->west, c->east, c->north, c->south};
+        const pcd_t *next = c;
+        for (int k = 0; k < 4; k++) {
+            if (nb[k] && c->z - nb[k]->z > c->z - next->z) {
+                next = nb[k];
+            }
+        }
+        if (next != c && bm->labels[i] != bm->labels[next - base]) {
+            printf("ERROR: Cell %d is not in the basin of its steepest neighbour\n", i);
+            ok = 0;
+        }
+        if (component[i] >= 0) {
+            continue;
+        }
+
+        // Gather the flat through cell i and the distance of each cell to its outlets
+        int head = 0, tail = 0;
+        queue[tail++] = i;
+        component[i] = i;
+        while (head < tail) {
+            const pcd_t *f = &base[queue[head++]];
+            const pcd_t *fn[4] = {f->west, f->east, f->north, f->south};
+            for (int k = 0; k < 4; k++) {
+                if (fn[k] && fn[k]->z == f->z && component[fn[k] - base] < 0) {
+                    component[fn[k] - base] = i;
+                    queue[tail++] = (int)(fn[k] - base);
+                }
+            }
+        }
+        int cells = tail, outlets = 0;
+        head = tail;
+        for (int q = 0; q < cells; q++) {
+            const pcd_t *f = &base[queue[q]];
+            const pcd_t *fn[4] = {f->west, f->east, f->north, f->south};
+            for (int k = 0; k < 4; k++) {
+                if (fn[k] && fn[k]->z < f->z) {
+                    dist[queue[q]] = 0;
+                    queue[tail++] = queue[q];
+                    outlets++;
+                    break;
+                }
+            }
+        }
+        while (head < tail) {
+            const pcd_t *f = &base[queue[head++]];
+            const pcd_t *fn[4] = {f->west, f->east, f->north, f->south};
+            for (int k = 0; k < 4; k++) {
+                int j = fn[k] ? (int)(fn[k] - base) : -1;
+                if (j >= 0 && component[j] == i && dist[j] < 0) {
+                    dist[j] = dist[f - base] + 1;
+                    queue[tail++] = j;
+                }
+            }
+        }
+
+        for (int q = 0; q < cells; q++) {
+            int j = queue[q];
+            int sink = bm->basins[bm->labels[j]].sink;
+            if (outlets == 0) {
+                if (bm->labels[j] != bm->labels[i] || component[sink] != i) {
+                    printf("ERROR: Closed flat of cell %d is split or drains off the flat\n", i);
+                    ok = 0;
+                }
+                continue;
+            }
+            if (sink == j) {
+                printf("ERROR: Cell %d is a sink on a flat with an outlet\n", j);
+                ok = 0;
+            }
+            if (dist[j] == 0) {
+                continue;
+            }
+            const pcd_t *f = &base[j];
+            const pcd_t *fn[4] = {f->west, f->east, f->north, f->south};
+            int downstream = 0;
+            for (int k = 0; k < 4; k++) {
+                int m = fn[k] ? (int)(fn[k] - base) : -1;
+                downstream |= m >= 0 && component[m] == i && dist[m] == dist[j] - 1 &&
+                              bm->labels[m] == bm->labels[j];
+            }
+            if (!downstream) {
+                printf("ERROR: Flat cell %d does not drain towards its nearest outlet\n", j);
+                ok = 0;
+            }
+        }
+    }
+
+    free(dist);
+    free(queue);
+    free(component);
+    return ok;
+}
+
+void test_basin_labels() {
+    printf("\n=== Testing Basin Labels ===\n");
+
+    // Random terrain with integer heights, so it has flats, labelled with
+    // small tiles so most basins and flats cross tile edges
+    int n = 23;
+    FILE *f = fopen("test_basins.xyz", "w");
+    if (!f) {
+        printf("Failed to create test file\n");
+        return;
+    }
+    srand(27);
+    fprintf(f, "%d\n", n * n);
+    for (int row = 0; row < n; row++) {
+        for (int col = 0; col < n; col++) {
+            fprintf(f, "%d.0 %d.0 %d.0\n", col, row, rand() % 40 + (row - n / 2) * (row - n / 2));
+        }
+    }
+    fclose(f);
+
+    f = fopen("test_basins.xyz", "r");
+    pointcloud_t *pc = readPointCloudData(f);
+    fclose(f);
+    assert(pc && "Failed to read test pointcloud");
+    initializeWatershed(pc);
+    watershedAddUniformWater(pc, 1.0);
+
+    basin_map_t *bm = basin_label(pc, 4, 3);
+    basin_map_t *whole = basin_label(pc, n, 1);
+    assert(bm && whole && "Basin labelling failed");
+
+    int test_passed = check_basin_rules(pc, bm);
+    long total_cells = 0;
+    for (int id = 0; id < bm->count; id++) {
+        total_cells += bm->basins[id].cells;
+        if (bm->labels[bm->basins[id].sink] != id) {
+            test_passed = 0;
+        }
+    }
+    if (total_cells != pc->points.size) {
+        printf("ERROR: Basin table covers %ld of %d cells\n", total_cells, pc->points.size);
+        test_passed = 0;
+    }
+    // Basin ids follow the tile order, but every cell reaches the same sink
+    // whatever the tiling
+    for (int i = 0; i < pc->points.size && whole->count == bm->count; i++) {
+        if (whole->basins[whole->labels[i]].sink != bm->basins[bm->labels[i]].sink) {
+            printf("ERROR: Sink of cell %d depends on the tiling\n", i);
+            test_passed = 0;
+            break;
+        }
+    }
+    if (whole->count != bm->count) {
+        printf("ERROR: %d basins with one tile, %d with 4x4 tiles\n", whole->count, bm->count);
+        test_passed = 0;
+    }
+    printf("Found %d basins\n", bm->count);
+    basin_map_free(bm);
+    basin_map_free(whole);
+    pointcloud_free(pc);
+
+    // A ramp down to a flat valley floor along the west edge, with a flat
+    // shelf half way up: every cell drains to the one valley floor
+    f = fopen("test_basins.xyz", "w");
+    assert(f && "Failed to create test file");
+    fprintf(f, "%d\n", 12 * 12);
+    for (int row = 0; row < 12; row++) {
+        for (int col = 0; col < 12; col++) {
+            int z = col < 2 ? 0 : (col < 5 ? col - 1 : (col < 9 ? 4 : col - 4));
+            fprintf(f, "%d.0 %d.0 %d.0\n", col, row, z);
+        }
+    }
+    fclose(f);
+    f = fopen("test_basins.xyz", "r");
+    pc = readPointCloudData(f);
+    fclose(f);
+    assert(pc && "Failed to read test pointcloud");
+    initializeWatershed(pc);
+    bm = basin_label(pc, 5, 2);
+    assert(bm && "Basin labelling failed");
+    if (bm->count != 1 || !check_basin_rules(pc, bm)) {
+        printf("ERROR: Plateau terrain split into %d basins, expected 1\n", bm->count);
+        test_passed = 0;
+    }
+    basin_map_free(bm);
+    pointcloud_free(pc);
+
+    printf("\nBasin label test: %s\n", test_passed ? "PASSED" : "FAILED");
+}
+
+/**
+ * Writes an n x n cloud of z = 2x + y + a x^2 + b y^2 + c xy at integer x and y,
+ * with NODATA at cell hole (-1 for none), and reads it back
+ */
+static pointcloud_t* terrain_test_cloud(int n, double a, double b, double c, int hole) {
+    FILE *f = fopen("test_terrain.xyz", "w");
+    if (!f) {
+        printf("Failed to create test file\n");
+        return NULL;
+    }
+    fprintf(f, "%d\n", n * n);
+    for (int row = 0; row < n; row++) {
+        for (int col = 0; col < n; col++) {
+            double z = 2.0 * col + row + a * col * col + b * row * row + c * col * row;
+            fprintf(f, "%d.0 %d.0 %.6f\n", col, row, row * n + col == hole ? -9999.0 : z);
+        }
+    }
+    fclose(f);
+
+    f = fopen("test_terrain.xyz", "r");
+    pointcloud_t *pc = readPointCloudData(f);
+    fclose(f);
+    return pc;
+}
+
+// Whether a derivative is within a small relative error of its exact value
+static int terrain_close(float value, double expected) {
+    return fabs(value - expected) <= 1e-3 * fabs(expected) + 1e-5;
+}
+
+void test_terrain_derivatives() {
+    printf("\n=== Testing Terrain Derivatives ===\n");
+
+    // Inclined plane z = 2x + y: constant gradient, no curvature
+    int n = 11;
+    pointcloud_t *pc = terrain_test_cloud(n, 0.0, 0.0, 0.0, -1);
+    assert(pc && "Failed to read test pointcloud");
+
+    terrain_t *tr = terrain_analyze(pc, TERRAIN_SUN_AZIMUTH, TERRAIN_SUN_ALTITUDE, 2);
+    assert(tr && "Terrain analysis failed");
+
+    double expected_slope = atan(sqrt(5.0)) * 180.0 / M_PI;
+    double expected_aspect = atan2(-2.0, -1.0) * 180.0 / M_PI + 360.0;
+    // Light from the north-west 45 degrees up on a face with gradient (2, 1):
+    // (sin 45 + 2 cos 45 sin 45 - cos 45 cos 45) / sqrt(6) of full brightness
+    double expected_shade = 255.0 * (M_SQRT1_2 + 1.0 - 0.5) / sqrt(6.0);
+    int test_passed = 1;
+
+    // Border cells see replicated edges, so only the interior is exact
+    for (int row = 1; row < n - 1; row++) {
+        for (int col = 1; col < n - 1; col++) {
+            int i = row * n + col;
+            if (fabs(tr->slope[i] - expected_slope) > 1e-3 ||
+                fabs(tr->aspect[i] - expected_aspect) > 1e-3 ||
+                fabs(tr->plan_curv[i]) > 1e-5 || fabs(tr->prof_curv[i]) > 1e-5 ||
+                fabs(tr->hillshade[i] - expected_shade) > 1e-3) {
+                printf("ERROR: Cell (%d,%d) slope=%.3f aspect=%.3f plan=%g prof=%g shade=%.3f\n",
+                       row, col, tr->slope[i], tr->aspect[i], tr->plan_curv[i], tr->prof_curv[i],
+                       tr->hillshade[i]);
+                test_passed = 0;
+            }
+        }
+    }
+
+    printf("Slope %.3f (expected %.3f), aspect %.3f (expected %.3f), hillshade %.3f (expected %.3f)\n",
+           tr->slope[n + 1], expected_slope, tr->aspect[n + 1], expected_aspect,
+           tr->hillshade[n + 1], expected_shade);
+    terrain_free(tr);
+    pointcloud_free(pc);
+
+    // Quadratic surface: the finite differences are exact, so every cell has
+    // the closed-form curvatures of its gradient (p, q) and its second
+    // derivatives r = 2a, t = 2b and s = c
+    double a = 0.05, b = -0.02, c = 0.03;
+    pc = terrain_test_cloud(n, a, b, c, -1);
+    assert(pc && "Failed to read test pointcloud");
+    tr = terrain_analyze(pc, TERRAIN_SUN_AZIMUTH, TERRAIN_SUN_ALTITUDE, 2);
+    assert(tr && "Terrain analysis failed");
+    for (int row = 1; row < n - 1; row++) {
+        for (int col = 1; col < n - 1; col++) {
+            int i = row * n + col;
+            double p = 2.0 + 2.0 * a * col + c * row, q = 1.0 + 2.0 * b * row + c * col;
+            double r = 2.0 * a, t = 2.0 * b, g2 = p * p + q * q;
+            double prof = -(p * p * r + 2.0 * p * q * c + q * q * t) / (g2 * pow(1.0 + g2, 1.5));
+            double plan = -(q * q * r - 2.0 * p * q * c + p * p * t) / pow(g2, 1.5);
+            double shade = 255.0 * (M_SQRT1_2 + 0.5 * p - 0.5 * q) / sqrt(1.0 + g2);
+            if (!terrain_close(tr->slope[i], atan(sqrt(g2)) * 180.0 / M_PI) ||
+                !terrain_close(tr->prof_curv[i], prof) || !terrain_close(tr->plan_curv[i], plan) ||
+                !terrain_close(tr->hillshade[i], shade > 0 ? shade : 0.0)) {
+                printf("ERROR: Quadratic cell (%d,%d) plan=%g (expected %g) prof=%g (expected %g) "
+                       "shade=%.3f (expected %.3f)\n", row, col, tr->plan_curv[i], plan,
+                       tr->prof_curv[i], prof, tr->hillshade[i], shade);
+                test_passed = 0;
+            }
+        }
+    }
+    terrain_free(tr);
+    pointcloud_free(pc);
+
+    // A NODATA cell makes every derivative NaN at itself and its neighbours
+    // and nowhere else; the hole sits where both the vector and scalar paths see it
+    for (int hole_col = 4; hole_col <= 9; hole_col += 5) {
+        int hole_row = 5;
+        pc = terrain_test_cloud(n, a, b, c, hole_row * n + hole_col);
+        assert(pc && pc->valid && "Failed to read test pointcloud");
+        tr = terrain_analyze(pc, TERRAIN_SUN_AZIMUTH, TERRAIN_SUN_ALTITUDE, 2);
+        assert(tr && "Terrain analysis failed");
+        for (int i = 0; i < n * n; i++) {
+            int near = abs(i / n - hole_row) <= 1 && abs(i % n - hole_col) <= 1;
+            const float v[5] = {tr->slope[i], tr->aspect[i], tr->plan_curv[i], tr->prof_curv[i],
+                                tr->hillshade[i]};
+            for (int k = 0; k < 5; k++) {
+                if (near != isnan(v[k])) {
+                    printf("ERROR: Derivative %d of cell (%d,%d) is %g next to NODATA at (%d,%d)\n",
+                           k, i / n, i % n, v[k], hole_row, hole_col);
+                    test_passed = 0;
+                }
+            }
+        }
+        terrain_free(tr);
+        pointcloud_free(pc);
+    }
+
+    printf("\nTerrain derivative test: %s\n", test_passed ? "PASSED" : "FAILED");
+}
+
+void test_gridding() {
+    printf("\n=== Testing Scattered Point Gridding ===\n");
+
+    // 5x5 grid of the plane z = x + 10y given in reverse order, with cell (1,2)
+    // sampled twice and the centre cell missing
+    double xyz[3 * 26];
+    long count = 0;
+    for (int row = 4; row >= 0; row--) {
+        for (int col = 4; col >= 0; col--) {
+            if (row == 2 && col == 2) {
+                continue;
+            }
+            double dz = (row == 1 && col == 2) ? -0.5 : 0.0;
+            xyz[3 * count] = col;
+            xyz[3 * count + 1] = row;
+            xyz[3 * count + 2] = col + 10 * row + dz;
+            count++;
+        }
+    }
+    xyz[3 * count] = 2.1;
+    xyz[3 * count + 1] = 0.9;
+    xyz[3 * count + 2] = 12.5;
+    count++;
+    gridding_options_t opts = {.cell_size = 1.0, .fill = GRID_FILL_IDW, .nthreads = 2};
+
+    pointcloud_t *pc = gridPoints(xyz, count, &opts);
+    assert(pc && "Gridding failed");
+    assert(pc->rows == 5 && pc->cols == 5 && "Grid dimensions incorrect");
+    assert(pc->points.size == 25 && "Wrong number of cells");
+
+    int test_passed = 1;
+    pcd_t *dup = pointcloud_get_point(pc, 1, 2);
+    if (dup->z != 12.0) {
+        printf("ERROR: Duplicate cell averaged to %.2f, expected 12\n", dup->z);
+        test_passed = 0;
+    }
+
+    // The samples around the hole are symmetric and lie in a plane, so IDW gives 22
+    pcd_t *hole = pointcloud_get_point(pc, 2, 2);
+    if (fabs(hole->z - 22.0) > 1e-9 || hole->x != 2.0 || hole->y != 2.0) {
+        printf("ERROR: Hole filled with %.4f at (%.1f, %.1f)\n", hole->z, hole->x, hole->y);
+        test_passed = 0;
+    }
+
+    // The dense grid is ready for the simulation
+    assert(initializeWatershed(pc) == 0 && "Gridded cloud failed to initialize");
+    pointcloud_free(pc);
+
+    opts.fill = GRID_FILL_NEAREST;
+    pc = gridPoints(xyz, count, &opts);
+    hole = pointcloud_get_point(pc, 2, 2);
+    if (hole->z != 12.0 && hole->z != 21.0 && hole->z != 23.0 && hole->z != 32.0) {
+        printf("ERROR: Nearest fill gave %.2f\n", hole->z);
+        test_passed = 0;
+    }
+    pointcloud_free(pc);
+
+    // With fewer binned cells than IDW wants, every hole weighs all of them
+    double sparse[9] = {0, 0, 0, 10, 0, 10, 0, 10, 20};
+    opts.fill = GRID_FILL_IDW;
+    pc = gridPoints(sparse, 3, &opts);
+    assert(pc && pc->rows == 11 && pc->cols == 11 && "Sparse gridding failed");
+    hole = pointcloud_get_point(pc, 0, 5);
+    double expected = (10.0 / 25 + 20.0 / 125) / (2.0 / 25 + 1.0 / 125);
+    if (fabs(hole->z - expected) > 1e-9) {
+        printf("ERROR: Sparse IDW fill gave %.4f, expected %.4f\n", hole->z, expected);
+        test_passed = 0;
+    }
+
+    printf("\nGridding test: %s\n", test_passed ? "PASSED" : "FAILED");
+    pointcloud_free(pc);
+}
+
+/**
+ * Runs steps of the reference watershedStep and of the flat grid kernel on
+ * two copies of the same cloud and reports whether the water matches exactly
+ */
+static int compare_sim_kernel(const double *xyz, long count, grid_fill_t fill, int steps) {
+    gridding_options_t opts = {.cell_size = 1.0, .fill = fill, .nthreads = 1};
+    pointcloud_t *ref = gridPoints(xyz, count, &opts);
+    pointcloud_t *pc = gridPoints(xyz, count, &opts);
+    assert(ref && pc && "Gridding failed");
+
+    initializeWatershed(ref);
+    initializeWatershed(pc);
+    update_watershed_coefficients(ref, 0.2, 0.95);
+    update_watershed_coefficients(pc, 0.2, 0.95);
+    watershedAddUniformWater(ref, 3.0);
+    watershedAddUniformWater(pc, 3.0);
+
+    sim_grid_t *sim = sim_grid_create(pc);
+    assert(sim && "Failed to create simulation grid");
+    for (int s = 0; s < steps; s++) {
+        watershedStep(ref);
+        sim_grid_step(sim);
+    }
+    sim_grid_store(sim, pc);
+    sim_grid_free(sim);
+
+    int mismatches = 0;
+    const pcd_t *a = ref->points.data, *b = pc->points.data;
+    for (int i = 0; i < pc->points.size; i++) {
+        if (memcmp(&a[i].wd, &b[i].wd, sizeof(double)) != 0) {
+            if (mismatches++ < 5) {
+                printf("ERROR: Cell %d has %.17g, reference %.17g\n", i, b[i].wd, a[i].wd);
+            }
+        }
+        if (!POINTCLOUD_VALID(pc->valid, i) && b[i].wd != 0.0) {
+            printf("ERROR: NODATA cell %d holds water %.4f\n", i, b[i].wd);
+            mismatches++;
+        }
+    }
+
+    pointcloud_free(ref);
+    pointcloud_free(pc);
+    return mismatches == 0;
+}
+
+void test_nodata_mask() {
+    printf("\n=== Testing NODATA Mask ===\n");
+
+    // 13x17 random terrain with every fifth interior cell missing
+    int rows = 13, cols = 17;
+    double *xyz = malloc(3 * rows * cols * sizeof(double));
+    long count = 0, holes = 0;
+    srand(30);
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+            int edge = row == 0 || col == 0 || row == rows - 1 || col == cols - 1;
+            if (!edge && rand() % 5 == 0) {
+                holes++;
+                continue;
+            }
+            xyz[3 * count] = col;
+            xyz[3 * count + 1] = row;
+            xyz[3 * count + 2] = 100.0 + (rand() % 1000) / 50.0;
+            count++;
+        }
+    }
+
+    gridding_options_t opts = {.cell_size = 1.0, .fill = GRID_FILL_NONE, .nthreads = 1};
+    pointcloud_t *pc = gridPoints(xyz, count, &opts);
+    assert(pc && pc->valid && "NODATA grid should carry a validity mask");
+
+    int test_passed = 1;
+    if (pointcloud_valid_count(pc) != count) {
+        printf("ERROR: %ld valid cells, expected %ld\n", pointcloud_valid_count(pc), count);
+        test_passed = 0;
+    }
+    if (pc->stats.min_height < 100.0) {
+        printf("ERROR: NODATA leaked into the height statistics (min %.2f)\n", pc->stats.min_height);
+        test_passed = 0;
+    }
+
+    // No links lead into or out of a NODATA cell
+    initializeWatershed(pc);
+    const pcd_t *points = pc->points.data;
+    for (int i = 0; i < pc->points.size; i++) {
+        const pcd_t *p = &points[i];
+        const pcd_t *links[4] = {p->north, p->south, p->east, p->west};
+        for (int k = 0; k < 4; k++) {
+            if (links[k] && (!POINTCLOUD_VALID(pc->valid, i) ||
+                             !POINTCLOUD_VALID(pc->valid, links[k] - points))) {
+                printf("ERROR: Cell %d is linked across NODATA\n", i);
+                test_passed = 0;
+            }
+        }
+    }
+
+    // Basins skip NODATA
+    basin_map_t *bm = basin_label(pc, 4, 2);
+    long labelled = 0;
+    for (int i = 0; i < pc->points.size; i++) {
+        if ((bm->labels[i] < 0) == POINTCLOUD_VALID(pc->valid, i)) {
+            printf("ERROR: Cell %d has basin label %d\n", i, bm->labels[i]);
+            test_passed = 0;
+        }
+    }
+    for (int id = 0; id < bm->count; id++) {
+        labelled += bm->basins[id].cells;
+    }
+    if (labelled != count) {
+        printf("ERROR: Basins cover %ld cells, expected %ld\n", labelled, count);
+        test_passed = 0;
+    }
+    basin_map_free(bm);
+    pointcloud_free(pc);
+
+    // The flat kernel matches the reference bit for bit, with and without a mask
+    if (!compare_sim_kernel(xyz, count, GRID_FILL_NONE, 25)) {
+        printf("ERROR: Masked kernel differs from watershedStep\n");
+        test_passed = 0;
+    }
+    if (!compare_sim_kernel(xyz, count, GRID_FILL_NEAREST, 25)) {
+        printf("ERROR: Unmasked kernel differs from watershedStep\n");
+        test_passed = 0;
+    }
+
+    printf("\nNODATA mask test (%ld holes): %s\n", holes, test_passed ? "PASSED" : "FAILED");
+    free(xyz);
+}
+
+/**
+ * Reference box filter: every cell of a 2^level block goes to the pixel the
+ * block's centre cell projects to, accumulated in cell order
+ */
+static void render_reference(const pointcloud_t *pc, int size, int level, const void *field,
+                             size_t stride, double *sum, int *count) {
+    const pcd_t *points = pc->points.data;
+    double scale = fmin((size - 1) / (pc->stats.max_x - pc->stats.min_x),
+                        (size - 1) / (pc->stats.max_y - pc->stats.min_y));
+    memset(sum, 0, (size_t)size * size * sizeof(double));
+    memset(count, 0, (size_t)size * size * sizeof(int));
+    for (int r = 0; r < pc->rows; r++) {
+        for (int c = 0; c < pc->cols; c++) {
+            int half = (1 << level) >> 1;
+            int rc = ((r >> level) << level) + half, cc = ((c >> level) << level) + half;
+            rc = rc < pc->rows ? rc : pc->rows - 1;
+            cc = cc < pc->cols ? cc : pc->cols - 1;
+            int x = (int)((points[cc].x - pc->stats.min_x) * scale);
+            int y = size - 1 - (int)((points[rc * pc->cols].y - pc->stats.min_y) * scale);
+            sum[y * size + x] += *(const double *)((const char *)field + (r * pc->cols + c) * stride);
+            count[y * size + x]++;
+        }
+    }
+}
+
+void test_render_context() {
+    printf("\n=== Testing Render Context ===\n");
+
+    // 30x30 plane z = x + y
+    double xyz[3 * 900];
+    for (int i = 0; i < 900; i++) {
+        xyz[3 * i] = i % 30;
+        xyz[3 * i + 1] = i / 30;
+        xyz[3 * i + 2] = i % 30 + i / 30;
+    }
+    gridding_options_t opts = {.cell_size = 1.0, .fill = GRID_FILL_IDW, .nthreads = 1};
+    pointcloud_t *pc = gridPoints(xyz, 900, &opts);
+    assert(pc && "Gridding failed");
+    const pcd_t *points = pc->points.data;
+
+    // Drawn at 10x10 pixels about three cells fall on a pixel, so the pixels
+    // are filtered from 2x2 blocks
+    render_ctx_t *rc = render_create(pc, 10);
+    assert(rc && "Failed to create render context");
+
+    int test_passed = 1;
+    if (rc->level != 1) {
+        printf("ERROR: Filtered from mip level %d, expected 1\n", rc->level);
+        test_passed = 0;
+    }
+
+    // Every pixel averages the blocks whose centre projects there, and its
+    // terrain shade is the shade of that average height
+    double sum[150 * 150];
+    int count[150 * 150];
+    render_reference(pc, 10, 1, (const char *)points + offsetof(pcd_t, z), sizeof(pcd_t), sum, count);
+    int cells = 0;
+    for (int p = 0; p < 100; p++) {
+        cells += rc->count[p];
+        int shade = count[p] ? (int)((sum[p] / count[p]) / 58.0 * 255) : 0;
+        if (rc->count[p] != count[p] || shade != rc->terrain[p]) {
+            printf("ERROR: Pixel %d has %d cells and shade %d, expected %d and %d\n",
+                   p, rc->count[p], rc->terrain[p], count[p], shade);
+            test_passed = 0;
+        }
+    }
+    if (cells != 900) {
+        printf("ERROR: %d cells mapped, expected 900\n", cells);
+        test_passed = 0;
+    }
+
+    // Full water turns every covered pixel pure blue
+    double *wd = malloc(900 * sizeof(double));
+    for (int i = 0; i < 900; i++) {
+        wd[i] = 2.0;
+    }
+    render_water(rc, wd, sizeof(double), 2.0);
+    for (int p = 0; p < 100; p++) {
+        bm_color_t color = rc->palette[rc->indices[p]];
+        if (rc->count[p] && color != bm_rgb(0, 0, 255)) {
+            printf("ERROR: Pixel %d is %08x under full water\n", p, color);
+            test_passed = 0;
+        }
+    }
+
+    // Dry pixels map to the palette gray nearest their terrain shade
+    for (int i = 0; i < 900; i++) {
+        wd[i] = 0.0;
+    }
+    render_water(rc, wd, sizeof(double), 2.0);
+    for (int p = 0; p < 100; p++) {
+        int gray = rc->palette[rc->indices[p]] & 0xFF;
+        if (rc->count[p] && abs(gray - rc->terrain[p]) > 255 / (RENDER_SHADES - 1) / 2 + 1) {
+            printf("ERROR: Pixel %d has gray %d for terrain %d\n", p, gray, rc->terrain[p]);
+            test_passed = 0;
+        }
+    }
+    // 30 cells over 10 pixels per axis cover the whole image
+    if (rc->covered != 100) {
+        printf("ERROR: %d pixels covered, expected 100\n", rc->covered);
+        test_passed = 0;
+    }
+    render_free(rc);
+
+    // At 150x150 the cells are spread over several tiles with gaps between
+    // them; any thread count gives the exact per-cell average
+    rc = render_create(pc, 150);
+    assert(rc && "Failed to create render context");
+    for (int i = 0; i < 900; i++) {
+        wd[i] = (i * 37 % 101) / 50.0;
+    }
+    render_reference(pc, 150, 0, wd, sizeof(double), sum, count);
+    uint8_t *serial = malloc(150 * 150), *threaded = malloc(150 * 150);
+    memset(serial, RENDER_EMPTY, 150 * 150);
+    memset(threaded, RENDER_EMPTY, 150 * 150);
+    assert(render_compose(rc, wd, sizeof(double), 2.0, serial, 1) &&
+           render_compose(rc, wd, sizeof(double), 2.0, threaded, 3) && "Compositing failed");
+    if (rc->level != 0 || rc->covered != 900 || memcmp(serial, threaded, 150 * 150) != 0) {
+        printf("ERROR: Level %d, %d pixels covered; threaded frame %s the serial one\n",
+               rc->level, rc->covered, memcmp(serial, threaded, 150 * 150) ? "differs from" : "matches");
+        test_passed = 0;
+    }
+    for (int p = 0; p < 150 * 150; p++) {
+        int level = count[p] ? (int)(sum[p] / count[p] * (RENDER_WATER_LEVELS - 1) / 2.0 + 0.5) : 0;
+        int expected = count[p] ? rc->shade[p] + (level < RENDER_WATER_LEVELS ? level : RENDER_WATER_LEVELS - 1)
+                                : RENDER_EMPTY;
+        if (serial[p] != expected) {
+            printf("ERROR: Pixel %d has index %d, expected %d\n", p, serial[p], expected);
+            test_passed = 0;
+            break;
+        }
+    }
+    free(serial);
+    free(threaded);
+    render_free(rc);
+
+    // Native resolution draws one pixel per cell, north up
+    rc = render_create(pc, RENDER_NATIVE);
+    assert(rc && "Failed to create render context");
+    if (rc->width != 30 || rc->height != 30 || rc->level != 0) {
+        printf("ERROR: Native render is %dx%d at level %d\n", rc->width, rc->height, rc->level);
+        test_passed = 0;
+    } else {
+        for (int i = 0; i < 900; i++) {
+            int p = (29 - i / 30) * 30 + i % 30;
+            if (rc->count[p] != 1 || rc->elevation[p] != points[i].z) {
+                printf("ERROR: Native pixel %d has height %g, expected %g\n", p, rc->elevation[p], points[i].z);
+                test_passed = 0;
+                break;
+            }
+        }
+    }
+
+    printf("\nRender context test: %s\n", test_passed ? "PASSED" : "FAILED");
+    free(wd);
+    render_free(rc);
+    pointcloud_free(pc);
+}
+
+void test_gif_indexed_roundtrip() {
+    printf("\n=== Testing Indexed GIF Encoding ===\n");
+
+    // Long enough with enough distinct runs to fill the LZW dictionary and
+    // force clear codes
+    int w = 613, h = 409;
+    unsigned char *indices = malloc(w * h);
+    bm_color_t palette[256];
+    for (int i = 0; i < 256; i++) {
+        palette[i] = bm_rgb(i, 255 - i, (i * 37) & 0xFF);
+    }
+    unsigned seed = 34;
+    for (int i = 0; i < w * h; i++) {
+        seed = seed * 1103515245u + 12345u;
+        // Mostly smooth runs with occasional random bytes
+        indices[i] = (seed >> 24) < 16 ? (seed >> 16) & 0xFF : (i / 7 + i / w) & 0xFF;
+    }
+
+    int test_passed = bm_save_gif_indexed("test_indexed.gif", w, h, indices, palette, 256, -1);
+    Bitmap *bmp = test_passed ? bm_load("test_indexed.gif") : NULL;
+    if (!bmp || bm_width(bmp) != w || bm_height(bmp) != h) {
+        printf("ERROR: Indexed GIF could not be read back: %s\n", bm_get_error());
+        test_passed = 0;
+    } else {
+        int wrong = 0;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                if ((bm_get(bmp, x, y) & 0xFFFFFF) != (palette[indices[y * w + x]] & 0xFFFFFF)) {
+                    wrong++;
+                }
+            }
+        }
+        if (wrong) {
+            printf("ERROR: %d pixels decoded to the wrong color\n", wrong);
+            test_passed = 0;
+        }
+    }
+
+    printf("\nIndexed GIF test: %s\n", test_passed ? "PASSED" : "FAILED");
+    if (bmp) {
+        bm_free(bmp);
+    }
+    free(indices);
+}
+
+// Reads the image descriptor rectangles of a GIF file, up to max of them
+static int read_gif_rects(const char *filename, int rects[][4], int max) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        return -1;
+    }
+
+    unsigned char lsd[13];
+    int count = -1;
+    if (fread(lsd, 1, 13, f) == 13) {
+        if (lsd[10] & 0x80) {
+            fseek(f, 3L << ((lsd[10] & 7) + 1), SEEK_CUR);
+        }
+        count = 0;
+        int c;
+        while ((c = fgetc(f)) != EOF && c != 0x3B) {
+            if (c == 0x21) {
+                fgetc(f);
+            } else if (c == 0x2C) {
+                unsigned char id[9];
+                if (fread(id, 1, 9, f) != 9) {
+                    break;
+                }
+                if (count < max) {
+                    for (int k = 0; k < 4; k++) {
+                        rects[count][k] = id[2 * k] | id[2 * k + 1] << 8;
+                    }
+                }
+                count++;
+                fgetc(f); // LZW minimum code size
+            } else {
+                count = -1;
+                break;
+            }
+            // Skip the data sub-blocks
+            int len;
+            while ((len = fgetc(f)) > 0) {
+                fseek(f, len, SEEK_CUR);
+            }
+        }
+        if (c != 0x3B) {
+            count = -1;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+void test_gif_animation() {
+    printf("\n=== Testing Animated GIF Delta Frames ===\n");
+
+    int w = 40, h = 30;
+    unsigned char *first = malloc(w * h), *second = malloc(w * h);
+    bm_color_t palette[256];
+    for (int i = 0; i < 256; i++) {
+        palette[i] = bm_rgb(i, 255 - i, (i * 37) & 0xFF);
+    }
+    for (int i = 0; i < w * h; i++) {
+        first[i] = second[i] = (i * 7 + i / w) % 200;
+    }
+    // Every pixel of the block x 5..12, y 7..20 changes in the second frame
+    for (int y = 7; y <= 20; y++) {
+        for (int x = 5; x <= 12; x++) {
+            second[y * w + x] = first[y * w + x] + 1;
+        }
+    }
+
+    int test_passed = 1;
+    BmGifAnim *ga = bm_gif_anim_open("test_animation.gif", w, h, palette, 256, 0);
+    if (!ga || !bm_gif_anim_frame(ga, first, 10, RENDER_TRANSPARENT) ||
+        !bm_gif_anim_frame(ga, second, 10, RENDER_TRANSPARENT) ||
+        !bm_gif_anim_frame(ga, second, 10, RENDER_TRANSPARENT)) {
+        printf("ERROR: Failed to write animation: %s\n", bm_get_error());
+        test_passed = 0;
+    }
+    if (ga && !bm_gif_anim_close(ga)) {
+        printf("ERROR: Failed to finish animation\n");
+        test_passed = 0;
+    }
+
+    // Full first frame, then the changed block, then a single pixel for the unchanged frame
+    const int expected[3][4] = {{0, 0, 40, 30}, {5, 7, 8, 14}, {0, 0, 1, 1}};
+    int rects[4][4];
+    int frames = test_passed ? read_gif_rects("test_animation.gif", rects, 4) : -1;
+    if (frames != 3) {
+        printf("ERROR: Expected 3 frames, found %d\n", frames);
+        test_passed = 0;
+    } else {
+        for (int f = 0; f < 3; f++) {
+            if (memcmp(rects[f], expected[f], sizeof(rects[f])) != 0) {
+                printf("ERROR: Frame %d covers %dx%d at (%d, %d), expected %dx%d at (%d, %d)\n", f,
+                       rects[f][2], rects[f][3], rects[f][0], rects[f][1],
+                       expected[f][2], expected[f][3], expected[f][0], expected[f][1]);
+                test_passed = 0;
+            }
+        }
+    }
+
+    // The loader draws the frames over each other, so the block shows the second frame
+    Bitmap *bmp = test_passed ? bm_load("test_animation.gif") : NULL;
+    if (test_passed && !bmp) {
+        printf("ERROR: Animation could not be read back: %s\n", bm_get_error());
+        test_passed = 0;
+    } else if (bmp) {
+        int wrong = 0;
+        for (int y = 7; y <= 20; y++) {
+            for (int x = 5; x <= 12; x++) {
+                if ((bm_get(bmp, x, y) & 0xFFFFFF) != (palette[second[y * w + x]] & 0xFFFFFF)) {
+                    wrong++;
+                }
+            }
+        }
+        if (wrong) {
+            printf("ERROR: %d changed pixels decoded to the wrong color\n", wrong);
+            test_passed = 0;
+        }
+        bm_free(bmp);
+    }
+
+    printf("\nAnimated GIF test: %s\n", test_passed ? "PASSED" : "FAILED");
+    free(first);
+    free(second);
+}
+
+#define QUEUE_TEST_THREADS 4
+#define QUEUE_TEST_ITEMS 20000
+
+typedef struct {
+    mpmc_queue_t *queue;
+    int thread;
+    long sum;       // sum of the values a consumer popped
+    int count;      // number of values a consumer popped
+} queue_test_arg_t;
+
+// Pushes thread + 1, thread + 1 + QUEUE_TEST_THREADS, ..., retrying while the queue is full
+static void* queue_test_producer(void *p) {
+    queue_test_arg_t *arg = p;
+    for (long v = arg->thread + 1; v <= QUEUE_TEST_ITEMS; v += QUEUE_TEST_THREADS) {
+        while (!mpmc_queue_push(arg->queue, (void *)v)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void* queue_test_consumer(void *p) {
+    queue_test_arg_t *arg = p;
+    while (arg->count < QUEUE_TEST_ITEMS / QUEUE_TEST_THREADS) {
+        void *value;
+        if (mpmc_queue_pop(arg->queue, &value)) {
+            arg->sum += (long)value;
+            arg->count++;
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void test_mpmc_queue() {
+    printf("\n=== Testing MPMC Queue ===\n");
+
+    int test_passed = 1;
+    mpmc_queue_t q;
+    assert(mpmc_queue_init(&q, 3) && "Failed to create queue");
+
+    // Capacity rounds up to 4; FIFO order, full and empty are reported
+    void *value;
+    for (long v = 1; v <= 4; v++) {
+        test_passed &= mpmc_queue_push(&q, (void *)v);
+    }
+    test_passed &= !mpmc_queue_push(&q, (void *)5L);
+    for (long v = 1; v <= 4; v++) {
+        test_passed &= mpmc_queue_pop(&q, &value) && (long)value == v;
+    }
+    test_passed &= !mpmc_queue_pop(&q, &value);
+    if (!test_passed) {
+        printf("ERROR: Single-threaded push/pop failed\n");
+    }
+    mpmc_queue_destroy(&q);
+
+    // Every value pushed by several producers is popped exactly once
+    assert(mpmc_queue_init(&q, 64) && "Failed to create queue");
+    pthread_t threads[2 * QUEUE_TEST_THREADS];
+    queue_test_arg_t args[2 * QUEUE_TEST_THREADS];
+    for (int t = 0; t < 2 * QUEUE_TEST_THREADS; t++) {
+        args[t] = (queue_test_arg_t){&q, t % QUEUE_TEST_THREADS, 0, 0};
+        pthread_create(&threads[t], NULL,
+                       t < QUEUE_TEST_THREADS ? queue_test_producer : queue_test_consumer, &args[t]);
+    }
+    long sum = 0;
+    for (int t = 0; t < 2 * QUEUE_TEST_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        sum += args[t].sum;
+    }
+    long expected = (long)QUEUE_TEST_ITEMS * (QUEUE_TEST_ITEMS + 1) / 2;
+    if (sum != expected || mpmc_queue_pop(&q, &value)) {
+        printf("ERROR: Consumers popped a sum of %ld, expected %ld\n", sum, expected);
+        test_passed = 0;
+    }
+    mpmc_queue_destroy(&q);
+
+    printf("\nMPMC queue test: %s\n", test_passed ? "PASSED" : "FAILED");
+}
+
+// Compares two files byte for byte
+static int files_equal(const char *a, const char *b) {
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    int equal = fa && fb;
+    while (equal) {
+        int ca = fgetc(fa), cb = fgetc(fb);
+        equal = ca == cb;
+        if (ca == EOF) {
+            break;
+        }
+    }
+    if (fa) {
+        fclose(fa);
+    }
+    if (fb) {
+        fclose(fb);
+    }
+    return equal;
+}
+
+void test_frame_writer() {
+    printf("\n=== Testing Asynchronous Frame Writer ===\n");
+
+    // 20x20 bowl, so the water moves between frames
+    double xyz[3 * 400];
+    for (int i = 0; i < 400; i++) {
+        int x = i % 20, y = i / 20;
+        xyz[3 * i] = x;
+        xyz[3 * i + 1] = y;
+        xyz[3 * i + 2] = (x - 9.5) * (x - 9.5) + (y - 9.5) * (y - 9.5);
+    }
+    gridding_options_t opts = {.cell_size = 1.0, .fill = GRID_FILL_IDW, .nthreads = 1};
+    pointcloud_t *pc = gridPoints(xyz, 400, &opts);
+    assert(pc && "Gridding failed");
+    initializeWatershed(pc);
+    update_watershed_coefficients(pc, 0.1, 0.95);
+    watershedAddUniformWater(pc, 1.0);
+    sim_grid_t *sim = sim_grid_create(pc);
+    render_ctx_t *rc = render_create(pc, 64);
+    assert(sim && rc && "Failed to set up the simulation");
+
+    // More frames than slots, so the submissions wait for the encoders
+    const int frames = 12;
+    frame_writer_t *fw = frame_writer_create(rc, pc->points.size, 2.0, FRAME_FILES, NULL, 3);
+    assert(fw && "Failed to create frame writer");
+    char filename[64];
+    for (int f = 0; f < frames; f++) {
+        sim_grid_step(sim);
+        snprintf(filename, sizeof(filename), "test_frames_async%d.gif", f);
+        frame_writer_submit(fw, sim->wd, filename);
+
+        // Reference frame written synchronously from the same state
+        render_water(rc, sim->wd, sizeof(double), 2.0);
+        snprintf(filename, sizeof(filename), "test_frames_sync%d.gif", f);
+        render_save(rc, filename);
+    }
+    frame_writer_free(fw);
+
+    int test_passed = 1;
+    char expected[64];
+    for (int f = 0; f < frames; f++) {
+        snprintf(filename, sizeof(filename), "test_frames_async%d.gif", f);
+        snprintf(expected, sizeof(expected), "test_frames_sync%d.gif", f);
+        if (!files_equal(filename, expected)) {
+            printf("ERROR: %s differs from %s\n", filename, expected);
+            test_passed = 0;
+        }
+        remove(filename);
+        remove(expected);
+    }
+
+    printf("\nFrame writer test: %s\n", test_passed ? "PASSED" : "FAILED");
+    sim_grid_free(sim);
+    render_free(rc);
+    pointcloud_free(pc);
+}
+
+void test_y4m_stream() {
+    printf("\n=== Testing Y4M Stream ===\n");
+
+    // 20x20 bowl rendered at an odd size, so the chroma planes have a half block
+    double xyz[3 * 400];
+    for (int i = 0; i < 400; i++) {
+        int x = i % 20, y = i / 20;
+        xyz[3 * i] = x;
+        xyz[3 * i + 1] = y;
+        xyz[3 * i + 2] = (x - 9.5) * (x - 9.5) + (y - 9.5) * (y - 9.5);
+    }
+    gridding_options_t opts = {.cell_size = 1.0, .fill = GRID_FILL_IDW, .nthreads = 1};
+    pointcloud_t *pc = gridPoints(xyz, 400, &opts);
+    assert(pc && "Gridding failed");
+    initializeWatershed(pc);
+    update_watershed_coefficients(pc, 0.1, 0.95);
+    watershedAddUniformWater(pc, 1.0);
+    sim_grid_t *sim = sim_grid_create(pc);
+    render_ctx_t *rc = render_create(pc, 45);
+    assert(sim && rc && "Failed to set up the simulation");
+
+    FILE *stream = tmpfile();
+    assert(stream && "Failed to create the stream file");
+    const int frames = 6;
+    int w = rc->width, h = rc->height, cw = (w + 1) / 2, ch = (h + 1) / 2;
+    size_t size = render_yuv_size(rc);
+    uint8_t *expected = malloc(frames * size);
+    uint8_t *actual = malloc(size);
+    assert(expected && actual && size == (size_t)w * h + 2 * cw * ch);
+
+    frame_writer_t *fw = frame_writer_create(rc, pc->points.size, 2.0, FRAME_Y4M, stream, 2);
+    assert(fw && "Failed to create frame writer");
+    for (int f = 0; f < frames; f++) {
+        sim_grid_step(sim);
+        frame_writer_submit(fw, sim->wd, NULL);
+
+        // Reference conversion of the same frame, one pixel at a time
+        render_water(rc, sim->wd, sizeof(double), 2.0);
+        uint8_t *ref = expected + f * size;
+        for (int p = 0; p < w * h; p++) {
+            ref[p] = rc->yuv[0][rc->indices[p]];
+        }
+        for (int plane = 1; plane <= 2; plane++) {
+            uint8_t *out = ref + w * h + (plane - 1) * cw * ch;
+            for (int y = 0; y < h; y += 2) {
+                for (int x = 0; x < w; x += 2) {
+                    int x1 = x + 1 < w ? x + 1 : x, y1 = y + 1 < h ? y + 1 : y;
+                    int left = (rc->yuv[plane][rc->indices[y * w + x]] +
+                                rc->yuv[plane][rc->indices[y1 * w + x]] + 1) >> 1;
+                    int right = (rc->yuv[plane][rc->indices[y * w + x1]] +
+                                 rc->yuv[plane][rc->indices[y1 * w + x1]] + 1) >> 1;
+                    out[(y / 2) * cw + x / 2] = (left + right + 1) >> 1;
+                }
+            }
+        }
+    }
+    frame_writer_free(fw);
+
+    int test_passed = 1;
+    char line[128], header[128];
+    snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F100:%d Ip A1:1 C420jpeg\n",
+             w, h, RENDER_FRAME_DELAY);
+    rewind(stream);
+    if (!fgets(line, sizeof(line), stream) || strcmp(line, header) != 0) {
+        printf("ERROR: Unexpected stream header\n");
+        test_passed = 0;
+    }
+    for (int f = 0; test_passed && f < frames; f++) {
+        if (!fgets(line, sizeof(line), stream) || strcmp(line, "FRAME\n") != 0 ||
+            fread(actual, 1, size, stream) != size) {
+            printf("ERROR: Frame %d is missing\n", f);
+            test_passed = 0;
+        } else if (memcmp(actual, expected + f * size, size) != 0) {
+            printf("ERROR: Frame %d differs from the reference conversion\n", f);
+            test_passed = 0;
+        }
+    }
+    if (test_passed && fgetc(stream) != EOF) {
+        printf("ERROR: Stream has trailing data\n");
+        test_passed = 0;
+    }
+
+    printf("\nY4M stream test: %s\n", test_passed ? "PASSED" : "FAILED");
+    fclose(stream);
+    free(expected);
+    free(actual);
+    sim_grid_free(sim);
+    render_free(rc);
+    pointcloud_free(pc);
+}
+
+void test_raster_export() {
+    printf("\n=== Testing Raster Export ===\n");
+
+    // 5x5 grid with rows running south to north and one NODATA cell
+    int rows = 5, cols = 5, hole = 7;
+    FILE *f = fopen("test_raster.xyz", "w");
+    if (!f) {
+        printf("Failed to create test file\n");
+        return;
+    }
+    fprintf(f, "%d\n", rows * cols);
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+            int i = row * cols + col;
+            fprintf(f, "%d.0 %d.0 %.1f\n", 10 + col, 2 * row, i == hole ? -9999.0 : i * 0.5);
+        }
+    }
+    fclose(f);
+
+    f = fopen("test_raster.xyz", "r");
+    pointcloud_t *pc = readPointCloudData(f);
+    fclose(f);
+    assert(pc && pc->valid && "Failed to read test pointcloud");
+
+    int test_passed = 1;
+    raster_type_t types[] = {RASTER_FLOAT32, RASTER_FLOAT64};
+    for (int t = 0; t < 2; t++) {
+        raster_writer_t *rw = raster_writer_create(pc, types[t]);
+        assert(rw && "Failed to create raster writer");
+        char filename[64];
+        snprintf(filename, sizeof(filename), "test_raster.%s", raster_extension(types[t]));
+        const pcd_t *points = pc->points.data;
+        if (raster_write(rw, (const char *)points + offsetof(pcd_t, z), sizeof(pcd_t), filename, "test") != 0) {
+            printf("ERROR: Failed to write %s\n", filename);
+            test_passed = 0;
+        }
+        raster_writer_free(rw);
+
+        // North-most row first, NODATA written as the marker value
+        double values[25];
+        f = fopen(filename, "rb");
+        for (int k = 0; f && k < rows * cols; k++) {
+            if (types[t] == RASTER_FLOAT32) {
+                float v;
+                values[k] = fread(&v, sizeof(v), 1, f) == 1 ? v : NAN;
+            } else if (fread(&values[k], sizeof(double), 1, f) != 1) {
+                values[k] = NAN;
+            }
+        }
+        if (!f || fgetc(f) != EOF) {
+            printf("ERROR: %s has the wrong size\n", filename);
+            test_passed = 0;
+        }
+        if (f) {
+            fclose(f);
+        }
+        for (int k = 0; k < rows * cols; k++) {
+            int i = (rows - 1 - k / cols) * cols + k % cols;
+            double expected = i == hole ? POINTCLOUD_NODATA : i * 0.5;
+            if (values[k] != expected) {
+                printf("ERROR: %s sample %d is %g, expected %g\n", filename, k, values[k], expected);
+                test_passed = 0;
+            }
+        }
+    }
+
+    // The header locates the north-west corner of the grid
+    char line[128];
+    int samples = 0, lines = 0, type = 0;
+    double x0 = 0, y0 = 0, dx = 0, dy = 0;
+    f = fopen("test_raster.hdr", "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        sscanf(line, "samples = %d", &samples);
+        sscanf(line, "lines = %d", &lines);
+        sscanf(line, "data type = %d", &type);
+        sscanf(line, "map info = {Arbitrary, 1, 1, %lf, %lf, %lf, %lf}", &x0, &y0, &dx, &dy);
+    }
+    if (f) {
+        fclose(f);
+    }
+    if (samples != cols || lines != rows || type != RASTER_FLOAT64 ||
+        x0 != 9.5 || y0 != 9.0 || dx != 1.0 || dy != 2.0) {
+        printf("ERROR: Header says %dx%d type %d at (%g, %g) cell %gx%g\n",
+               samples, lines, type, x0, y0, dx, dy);
+        test_passed = 0;
+    }
+
+    printf("\nRaster export test: %s\n", test_passed ? "PASSED" : "FAILED");
+    pointcloud_free(pc);
+}
+
+void test_synth_terrain() {
+    printf("\n=== Testing Synthetic Terrain ===\n");
+
+    synth_options_t opts;
+    synth_defaults(&opts);
+    opts.size = 96;
+    opts.seed = 42;
+    opts.holes = 3;
+    opts.nthreads = 1;
+    pointcloud_t *serial = synth_pointcloud(&opts);
+    opts.nthreads = 3;
+    pointcloud_t *threaded = synth_pointcloud(&opts);
+    assert(serial && threaded && "Failed to generate terrain");
+
+    // The same seed gives the same terrain on any number of threads
+    int test_passed = 1, n = serial->points.size;
+    const pcd_t *a = serial->points.data, *b = threaded->points.data;
+    int nodata = 0;
+    for (int i = 0; i < n; i++) {
+        if (a[i].z != b[i].z || a[i].x != b[i].x || a[i].y != b[i].y) {
+            printf("ERROR: Cell %d differs between 1 and 3 threads\n", i);
+            test_passed = 0;
+            break;
+        }
+        int valid = !serial->valid || (serial->valid[i >> 6] >> (i & 63)) & 1;
+        if (valid != (a[i].z > POINTCLOUD_NODATA)) {
+            printf("ERROR: Cell %d has z %g but validity %d\n", i, a[i].z, valid);
+            test_passed = 0;
+            break;
+        }
+        nodata += !valid;
+    }
+    if (nodata == 0 || nodata > n / 4) {
+        printf("ERROR: %d NODATA cells from 3 holes\n", nodata);
+        test_passed = 0;
+    }
+
+    // North-west cell first, rows running south
+    if (a[0].x != opts.x0 || a[0].y != opts.y0 || a[opts.size].y != opts.y0 - opts.cell) {
+        printf("ERROR: First cells at (%g, %g) and (%g, %g)\n", a[0].x, a[0].y, a[opts.size].x, a[opts.size].y);
+        test_passed = 0;
+    }
+
+    // Written as a float64 raster and read back, every cell survives exactly
+    opts.nthreads = 2;
+    pointcloud_t *raster = synth_write(&opts, "test_synth.f64", RASTER_FLOAT64) == 0
+                           ? raster_read("test_synth.f64") : NULL;
+    if (!raster || raster->points.size != n || raster->rows != opts.size) {
+        printf("ERROR: Failed to read back the raster\n");
+        test_passed = 0;
+    } else {
+        const pcd_t *r = raster->points.data;
+        for (int i = 0; i < n; i++) {
+            if (r[i].z != a[i].z || fabs(r[i].x - a[i].x) > 1e-6 || fabs(r[i].y - a[i].y) > 1e-6) {
+                printf("ERROR: Raster cell %d is (%g, %g, %g), expected (%g, %g, %g)\n",
+                       i, r[i].x, r[i].y, r[i].z, a[i].x, a[i].y, a[i].z);
+                test_passed = 0;
+                break;
+            }
+        }
+    }
+
+    // Written as text, it reads back like any other input
+    pointcloud_t *text = NULL;
+    if (synth_write(&opts, "test_synth.xyz", 0) == 0) {
+        FILE *f = fopen("test_synth.xyz", "r");
+        text = f ? readPointCloudData(f) : NULL;
+        if (f) {
+            fclose(f);
+        }
+    }
+    if (!text || text->points.size != n) {
+        printf("ERROR: Failed to read back the text\n");
+        test_passed = 0;
+    } else {
+        const pcd_t *t = text->points.data;
+        for (int i = 0; i < n; i++) {
+            if (fabs(t[i].z - a[i].z) > 1e-6) {
+                printf("ERROR: Text cell %d is %.9f, expected %.9f\n", i, t[i].z, a[i].z);
+                test_passed = 0;
+                break;
+            }
+        }
+    }
+
+    printf("\nSynthetic terrain test: %s\n", test_passed ? "PASSED" : "FAILED");
+    pointcloud_free(serial);
+    pointcloud_free(threaded);
+    pointcloud_free(raster);
+    pointcloud_free(text);
+}
+
+void test_sim_threads() {
+    printf("\n=== Testing Threaded Step Kernel ===\n");
+
+    // Large enough to be split, with holes so both vector paths run
+    synth_options_t opts;
+    synth_defaults(&opts);
+    opts.size = 300;
+    int test_passed = 1;
+    for (int masked = 0; masked < 2; masked++) {
+        opts.holes = masked ? 4 : 0;
+        pointcloud_t *pc = synth_pointcloud(&opts);
+        assert(pc && "Failed to generate terrain");
+        initializeWatershed(pc);
+        watershedAddUniformWater(pc, 2.0);
+
+        sim_grid_t *serial = sim_grid_create(pc);
+        sim_grid_t *threaded = sim_grid_create(pc);
+        assert(serial && threaded && "Failed to create simulation grids");
+        serial->nthreads = 1;
+        threaded->nthreads = 5;
+        for (int s = 0; s < 20; s++) {
+            sim_grid_step(serial);
+            sim_grid_step(threaded);
+        }
+        size_t n = (size_t)pc->points.size;
+        if (memcmp(serial->wd, threaded->wd, n * sizeof(double)) != 0) {
+            printf("ERROR: %s grid differs between 1 and 5 threads\n", masked ? "Masked" : "Complete");
+            test_passed = 0;
+        }
+        sim_grid_free(serial);
+        sim_grid_free(threaded);
+        pointcloud_free(pc);
+    }
+
+    printf("\nThreaded step kernel test: %s\n", test_passed ? "PASSED" : "FAILED");
+}
+
+// Randomized cases run by the differential kernel test
+#define DIFF_CASES 150
+#define DIFF_MAX_EDGE 40
+#define DIFF_MAX_STEPS 30
+
+// One case of the differential kernel test. Every cell's height, water and
+// validity are hashed from the seed and the cell's row and column, so a
+// smaller grid keeps the corner of the larger one it was shrunk from.
+typedef struct {
+    int rows, cols;
+    int steps;
+    int nodata;         // percent of cells that are NODATA
+    int threads;        // nthreads of the grid, for the banded kernels
+    int style;          // terrain: 0 random, 1 nearly flat, 2 slope, 3 large heights
+    double wcoef, ecoef;
+    uint64_t seed;
+} diff_case_t;
+
+// Uniform value in [0, 1) for one cell and one use of it
+static double diff_hash(uint64_t seed, int row, int col, int salt) {
+    uint64_t h = seed ^ ((uint64_t)row << 40) ^ ((uint64_t)col << 16) ^ (uint64_t)salt;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return (h >> 11) * 0x1.0p-53;
+}
+
+static pointcloud_t* diff_build(const diff_case_t *c) {
+    size_t n = (size_t)c->rows * c->cols;
+    pointcloud_t *pc = mem_calloc(MEM_INGEST, 1, sizeof(pointcloud_t));
+    pcd_t *points = mem_calloc(MEM_INGEST, n, sizeof(pcd_t));
+    assert(pc && points && "Failed to allocate test grid");
+    pc->rows = c->rows;
+    pc->cols = c->cols;
+    pc->points.data = points;
+    pc->points.size = (int)n;
+    pc->points.max_size = (int)n;
+    pc->points.max_element_size = sizeof(pcd_t);
+
+    for (int row = 0; row < c->rows; row++) {
+        for (int col = 0; col < c->cols; col++) {
+            size_t i = (size_t)row * c->cols + col;
+            double r = diff_hash(c->seed, row, col, 0);
+            double z = c->style == 0 ? 50.0 * r
+                     : c->style == 1 ? 10.0 + 1e-9 * r
+                     : c->style == 2 ? 0.5 * row + 0.25 * col + r
+                     : 1e6 + 100.0 * r;
+            points[i].x = col;
+            points[i].y = row;
+            points[i].z = z;
+            if (diff_hash(c->seed, row, col, 1) * 100 < c->nodata) {
+                if (!pc->valid) {
+                    pc->valid = pointcloud_mask_alloc(n);
+                    assert(pc->valid && "Failed to allocate mask");
+                }
+                pc->valid[i >> 6] &= ~(1ULL << (i & 63));
+                points[i].z = POINTCLOUD_NODATA;
+            }
+        }
+    }
+
+    // initializeWatershed prints its corner check for every one of the cases
+    int saved = quietStdout();
+    initializeWatershed(pc);
+    loudStdout(saved);
+    update_watershed_coefficients(pc, c->wcoef, c->ecoef);
+    // Uneven water on the valid cells, dry in places
+    for (size_t i = 0; i < n; i++) {
+        double w = diff_hash(c->seed, (int)(i / c->cols), (int)(i % c->cols), 2);
+        points[i].wd = POINTCLOUD_VALID(pc->valid, i) && w > 0.2 ? 5.0 * w : 0.0;
+    }
+    return pc;
+}
+
+/**
+ * Runs watershedStep and one kernel on copies of a case
+ * Inputs:
+ *  - c: the case
+ *  - k: the kernel
+ *  - report: print the first differing cells
+ * Returns: the number of cells whose water differs by more than the kernel allows
+ */
+static int diff_run(const diff_case_t *c, const sim_kernel_t *k, int report) {
+    pointcloud_t *ref = diff_build(c);
+    pointcloud_t *pc = diff_build(c);
+    sim_grid_t *g = sim_grid_create(pc);
+    assert(g && "Failed to create simulation grid");
+    g->nthreads = c->threads;
+    for (int s = 0; s < c->steps; s++) {
+        watershedStep(ref);
+        k->step(g);
+    }
+
+    int mismatches = 0;
+    const pcd_t *points = ref->points.data;
+    for (int i = 0; i < ref->points.size; i++) {
+        double expected = points[i].wd, got = g->wd[i];
+        int same = k->tolerance == 0.0
+                   ? memcmp(&expected, &got, sizeof(double)) == 0
+                   : fabs(got - expected) <= k->tolerance * fmax(1.0, fabs(expected));
+        if (!same && report && mismatches < 5) {
+            printf("ERROR: %s cell (%d, %d) has %.17g, watershedStep %.17g\n", k->name,
+                   i / c->cols, i % c->cols, got, expected);
+        }
+        mismatches += !same;
+    }
+
+    sim_grid_free(g);
+    pointcloud_free(ref);
+    pointcloud_free(pc);
+    return mismatches;
+}
+
+/**
+ * Shrinks a failing case: keeps applying the first reduction of the steps,
+ * grid, NODATA or threads that still fails until none does
+ * Returns: the smallest failing case found
+ */
+static diff_case_t diff_shrink(diff_case_t c, const sim_kernel_t *k) {
+    for (int progress = 1; progress;) {
+        progress = 0;
+        diff_case_t tries[8];
+        for (int t = 0; t < 8; t++) {
+            tries[t] = c;
+        }
+        tries[0].steps = c.steps / 2;
+        tries[1].steps = c.steps - 1;
+        tries[2].rows = c.rows / 2;
+        tries[3].cols = c.cols / 2;
+        tries[4].rows = c.rows - 1;
+        tries[5].cols = c.cols - 1;
+        tries[6].nodata = 0;
+        tries[7].threads = 1;
+        for (int t = 0; t < 8 && !progress; t++) {
+            diff_case_t *d = &tries[t];
+            if (d->steps < 1 || d->rows < 1 || d->cols < 1 || memcmp(d, &c, sizeof(c)) == 0) {
+                continue;
+            }
+            if (diff_run(d, k, 0) > 0) {
+                c = *d;
+                progress = 1;
+            }
+        }
+    }
+    return c;
+}
+
+static void diff_print_case(const diff_case_t *c) {
+    printf("  rows %d, cols %d, steps %d, nodata %d%%, threads %d, style %d, "
+           "wcoef %.17g, ecoef %.17g, seed %llu\n", c->rows, c->cols, c->steps, c->nodata,
+           c->threads, c->style, c->wcoef, c->ecoef, (unsigned long long)c->seed);
+}
+
+// Deliberately wrong kernel that checks the shrinker: it nudges cell (1, 2)
+// of any grid of at least 3 x 4 cells
+static void diff_broken_step(sim_grid_t *g) {
+    sim_grid_step(g);
+    if (g->rows >= 3 && g->cols >= 4) {
+        g->wd[g->cols + 2] = nextafter(g->wd[g->cols + 2], INFINITY);
+    }
+}
+
+void test_kernel_differential() {
+    printf("\n=== Testing Step Kernels Against watershedStep ===\n");
+
+    int test_passed = 1;
+    srand(48);
+    for (int n = 0; n < DIFF_CASES; n++) {
+        diff_case_t c = {
+            .rows = 1 + rand() % DIFF_MAX_EDGE,
+            .cols = 1 + rand() % DIFF_MAX_EDGE,
+            .steps = 1 + rand() % DIFF_MAX_STEPS,
+            .nodata = rand() % 2 ? 0 : 1 + rand() % 40,
+            .threads = 1 + rand() % 6,
+            .style = rand() % 4,
+            // The bounds update_watershed_coefficients accepts, ends included
+            .wcoef = n % 10 == 0 ? 0.2 : 0.2 * rand() / RAND_MAX,
+            .ecoef = n % 10 == 1 ? 0.9 : 0.9 + 0.1 * rand() / RAND_MAX,
+            .seed = (uint64_t)rand() << 32 | (uint64_t)rand(),
+        };
+        for (int k = 0; k < sim_kernel_count; k++) {
+            if (diff_run(&c, &sim_kernels[k], 0) == 0) {
+                continue;
+            }
+            diff_case_t small = diff_shrink(c, &sim_kernels[k]);
+            printf("ERROR: Kernel %s differs from watershedStep; smallest failing case:\n",
+                   sim_kernels[k].name);
+            diff_print_case(&small);
+            diff_run(&small, &sim_kernels[k], 1);
+            test_passed = 0;
+        }
+    }
+
+    // A failing kernel is shrunk to the smallest grid and step count that show it
+    sim_kernel_t broken = {"broken", diff_broken_step, 0.0};
+    diff_case_t c = {.rows = 37, .cols = 29, .steps = 17, .nodata = 20, .threads = 4,
+                     .style = 0, .wcoef = 0.1, .ecoef = 0.95, .seed = 7};
+    diff_case_t small = diff_run(&c, &broken, 0) > 0 ? diff_shrink(c, &broken) : c;
+    if (small.rows != 3 || small.cols != 4 || small.steps != 1 || small.nodata != 0 ||
+        small.threads != 1) {
+        printf("ERROR: Broken kernel shrunk to\n");
+        diff_print_case(&small);
+        test_passed = 0;
+    }
+
+    printf("\nDifferential kernel test (%d cases x %d kernels): %s\n", DIFF_CASES,
+           sim_kernel_count, test_passed ? "PASSED" : "FAILED");
+}
+
+static void trace_test_worker(void *arg, int thread, int nthreads) {
+    (void)arg;
+    (void)nthreads;
+    double start = trace_begin();
+    trace_end("test band", start, "thread", thread);
+}
+
+// Counts the occurrences of a string in a file
+static int count_in_file(const char *filename, const char *text) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    rewind(f);
+    char *data = malloc(len + 1);
+    int count = 0;
+    if (data && fread(data, 1, len, f) == (size_t)len) {
+        data[len] = '\0';
+        for (char *p = strstr(data, text); p; p = strstr(p + 1, text)) {
+            count++;
+        }
+    }
+    free(data);
+    fclose(f);
+    return count;
+}
+
+void test_trace_events() {
+    printf("\n=== Testing Trace Events ===\n");
+
+    int test_passed = 1;
+    double start = trace_begin();
+    trace_end("before enable", start, NULL, 0);
+
+    trace_enable();
+    // Two rounds of workers; their rings are handed back and reused when they exit
+    for (int round = 0; round < 2; round++) {
+        parallelRun(4, trace_test_worker, NULL);
+    }
+    prof_mark_t mark;
+    prof_begin(&mark);
+    prof_end(PROF_STEP, &mark, 1234);
+    if (trace_write("test_trace.json") != 0) {
+        printf("ERROR: Failed to write the trace\n");
+        test_passed = 0;
+    }
+
+    struct {
+        const char *text;
+        int count;
+    } expected[] = {
+        {"\"name\": \"before enable\"", 0},
+        {"\"name\": \"test band\"", 8},
+        {"\"name\": \"parallel wait\"", 2},
+        {"\"name\": \"step\", \"ph\": \"X\"", 1},
+        {"\"args\": {\"cells\": 1234}", 1},
+        {"\"args\": {\"name\": \"main\"}", 1},
+        {"\"dropped_events\": 0}", 1},
+    };
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        int count = count_in_file("test_trace.json", expected[i].text);
+        if (count != expected[i].count) {
+            printf("ERROR: Found %s %d times, expected %d\n", expected[i].text, count, expected[i].count);
+            test_passed = 0;
+        }
+    }
+    // At most one row per worker that ran at the same time, plus main
+    int rows = count_in_file("test_trace.json", "\"name\": \"thread_name\"");
+    if (rows < 2 || rows > 4) {
+        printf("ERROR: Trace has %d thread rows, expected 2 to 4\n", rows);
+        test_passed = 0;
+    }
+
+    // Enabling again drops the earlier events; a full ring keeps the latest
+    trace_enable();
+    for (int i = 0; i < TRACE_EVENTS + 10; i++) {
+        start = trace_begin();
+        trace_end("overflow", start, NULL, 0);
+    }
+    if (trace_write("test_trace.json") != 0) {
+        printf("ERROR: Failed to write the trace\n");
+        test_passed = 0;
+    }
+    if (count_in_file("test_trace.json", "\"name\": \"overflow\"") != TRACE_EVENTS ||
+        count_in_file("test_trace.json", "\"name\": \"test band\"") != 0 ||
+        count_in_file("test_trace.json", "\"dropped_events\": 10}") != 1) {
+        printf("ERROR: Overflowed ring not written as expected\n");
+        test_passed = 0;
+    }
+    trace_disable();
+    if (trace_enabled()) {
+        printf("ERROR: Tracing still enabled\n");
+        test_passed = 0;
+    }
+
+    printf("\nTrace event test: %s\n", test_passed ? "PASSED" : "FAILED");
+}
+
+void test_mem_accounting() {
+    printf("\n=== Testing Memory Accounting ===\n");
+
+    int test_passed = 1;
+    mem_stats_t before, after, total;
+    mem_stats(MEM_GRID, &before);
+    char *a = mem_alloc(MEM_GRID, 1000);
+    uint64_t *b = mem_calloc(MEM_GRID, 100, sizeof(uint64_t));
+    assert(a && b && "Failed to allocate");
+    mem_stats(MEM_GRID, &after);
+    if (after.current != before.current + 1800 || after.allocs != before.allocs + 2 ||
+        mem_size(a) != 1000 || (uintptr_t)a % sizeof(double) != 0) {
+        printf("ERROR: Allocations not accounted: %zu bytes now, %zu before\n",
+               after.current, before.current);
+        test_passed = 0;
+    }
+    for (int i = 0; i < 100; i++) {
+        if (b[i] != 0) {
+            printf("ERROR: mem_calloc block not zeroed\n");
+            test_passed = 0;
+            break;
+        }
+    }
+
+    // A reallocated block stays with its subsystem, whatever tag is passed
+    memset(a, 7, 1000);
+    a = mem_realloc(MEM_SIM, a, 5000);
+    assert(a && "Failed to reallocate");
+    mem_stats(MEM_GRID, &after);
+    if (after.current != before.current + 5800 || after.reallocs != before.reallocs + 1 ||
+        after.peak < after.current || a[999] != 7) {
+        printf("ERROR: Reallocation not accounted\n");
+        test_passed = 0;
+    }
+    size_t peak = after.peak;
+    mem_free(a);
+    mem_free(b);
+
+    // Aligned blocks, as structures with cache-line members need
+    void *c = mem_alloc_aligned(MEM_GRID, 64, 200);
+    assert(c && "Failed to allocate");
+    c = mem_realloc(MEM_GRID, c, 300);
+    assert(c && "Failed to reallocate");
+    if ((uintptr_t)c % 64 != 0 || mem_size(c) != 300) {
+        printf("ERROR: Aligned block at %p is not 64-byte aligned\n", c);
+        test_passed = 0;
+    }
+    mem_free(c);
+    mem_free(NULL);
+    mem_stats(MEM_GRID, &after);
+    mem_total(&total);
+    if (after.current != before.current || after.frees != before.frees + 4 || after.peak != peak ||
+        total.peak < peak) {
+        printf("ERROR: Frees not accounted\n");
+        test_passed = 0;
+    }
+
+    // A parsed cloud is charged to ingest, spare List capacity included,
+    // and hands everything back when freed
+    mem_stats_t ingest, sim;
+    mem_stats(MEM_INGEST, &ingest);
+    mem_stats(MEM_SIM, &sim);
+    FILE *f = fopen("test_mem.xyz", "w");
+    assert(f && "Failed to create test_mem.xyz");
+    fprintf(f, "16\n");
+    for (int i = 0; i < 16; i++) {
+        fprintf(f, "%d.0 %d.0 %d.0\n", i % 4, i / 4, i % 4 + i / 4);
+    }
+    fclose(f);
+    f = fopen("test_mem.xyz", "r");
+    assert(f && "Failed to open test_mem.xyz");
+    pointcloud_t *pc = readPointCloudData(f);
+    fclose(f);
+    assert(pc && "Failed to read pointcloud");
+    mem_stats(MEM_INGEST, &after);
+    size_t held = mem_size(pc) + mem_size(pc->points.data) + mem_size(pc->valid);
+    if (after.current - ingest.current != held ||
+        mem_size(pc->points.data) <= (size_t)pc->points.size * sizeof(pcd_t)) {
+        printf("ERROR: Cloud holds %zu bytes, ingest grew by %zu\n", held, after.current - ingest.current);
+        test_passed = 0;
+    }
+    initializeWatershed(pc);
+    watershedStep(pc);
+    mem_stats(MEM_SIM, &after);
+    if (after.allocs != sim.allocs + 1 || after.frees != sim.frees + 1 || after.current != sim.current) {
+        printf("ERROR: The step buffer was not accounted to the simulation\n");
+        test_passed = 0;
+    }
+    pointcloud_print_stats(pc);
+    pointcloud_free(pc);
+    mem_stats(MEM_INGEST, &after);
+    if (after.current != ingest.current) {
+        printf("ERROR: Freed cloud still holds %zu bytes\n", after.current - ingest.current);
+        test_passed = 0;
+    }
+
+    mem_print_summary(stdout);
+    printf("\nMemory accounting test: %s\n", test_passed ? "PASSED" : "FAILED");
+}
+
+// Nearest palette index by a full scan, with the metric bmp.c documents
+static int palette_nearest_reference(BmPalette *pal, bm_color_t color) {
+    unsigned char R1, G1, B1, R2, G2, B2;
+    bm_get_rgb(color, &R1, &G1, &B1);
+    double best = 1e10;
+    int m = 0;
+    for (int i = 0; i < bm_palette_count(pal); i++) {
+        bm_get_rgb(bm_palette_get(pal, i), &R2, &G2, &B2);
+        int rmean = (R1 + R2) / 2, r = R1 - R2, g = G1 - G2, b = B1 - B2;
+        double d = sqrt((((512 + rmean) * r * r) >> 8) + 4 * g * g + (((767 - rmean) * b * b) >> 8));
+        if (d < best) {
+            best = d;
+            m = i;
+        }
+    }
+    return m;
+}
+
+void test_palette_nearest() {
+    printf("\n=== Testing Nearest Palette Color ===\n");
+
+    // Random palettes of several sizes, with duplicate colors for ties
+    int test_passed = 1;
+    const int sizes[] = {1, 7, 64, 256};
+    srand(41);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        BmPalette *pal = bm_palette_create(sizes[s]);
+        assert(pal && "Failed to create palette");
+        for (int i = 0; i < sizes[s]; i++) {
+            bm_palette_set(pal, i, bm_rgb(rand() % 256, rand() % 256, rand() % 256));
+        }
+        if (sizes[s] > 2) {
+            bm_palette_set(pal, sizes[s] - 1, bm_palette_get(pal, 1));
+        }
+
+        for (int k = 0; k < 100000; k++) {
+            bm_color_t color = bm_rgb(rand() % 256, rand() % 256, rand() % 256);
+            int expected = palette_nearest_reference(pal, color);
+            int actual = bm_palette_nearest_index(pal, color);
+            if (actual != expected) {
+                printf("ERROR: Color %06X in a %d color palette maps to %d, expected %d\n",
+                       color & 0xFFFFFF, sizes[s], actual, expected);
+                test_passed = 0;
+                break;
+            }
+        }
+
+        // Changing a color drops the cached lookups
+        bm_color_t probe = bm_rgb(12, 200, 99);
+        bm_palette_nearest_index(pal, probe);
+        bm_palette_set(pal, 0, probe);
+        if (bm_palette_nearest_index(pal, probe) != 0) {
+            printf("ERROR: Lookup in a %d color palette ignored a changed color\n", sizes[s]);
+            test_passed = 0;
+        }
+        bm_palette_release(pal);
+    }
+
+    printf("\nNearest palette color test: %s\n", test_passed ? "PASSED" : "FAILED");
+}
+
+void test_quantize_mediancut() {
+    printf("\n=== Testing Median Cut Quantization ===\n");
+    int test_passed = 1;
+
+    // An image with few, well separated colors gets exactly those colors
+    Bitmap *few = bm_create(64, 64);
+    assert(few && "Failed to create bitmap");
+    for (int y = 0; y < 64; y++) {
+        for (int x = 0; x < 64; x++) {
+            int i = (x / 8 + y / 8 * 3) % 27;
+            bm_set(few, x, y, bm_rgb(i % 3 * 120, i / 3 % 3 * 120, i / 9 * 120));
+        }
+    }
+    BmPalette *pal = bm_quantize_mediancut(few, 256, 1);
+    assert(pal && "Failed to quantize");
+    if (bm_palette_count(pal) != 27) {
+        printf("ERROR: 27 color image gave %d colors\n", bm_palette_count(pal));
+        test_passed = 0;
+    }
+    for (int i = 0; i < 27 && test_passed; i++) {
+        bm_color_t c = bm_rgb(i % 3 * 120, i / 3 % 3 * 120, i / 9 * 120);
+        if ((bm_palette_nearest_color(pal, c) & 0xFFFFFF) != (c & 0xFFFFFF)) {
+            printf("ERROR: Color %06X missing from the palette\n", c & 0xFFFFFF);
+            test_passed = 0;
+        }
+    }
+    bm_palette_release(pal);
+    bm_free(few);
+
+    // A smooth image with many colors: at most K colors, close to every pixel,
+    // and the same palette however many threads count it
+    Bitmap *many = bm_create(512, 512);
+    assert(many && "Failed to create bitmap");
+    for (int y = 0; y < 512; y++) {
+        for (int x = 0; x < 512; x++) {
+            bm_set(many, x, y, bm_rgb(x / 2, y / 2, (x + y) / 4));
+        }
+    }
+    BmPalette *serial = bm_quantize_mediancut(many, 64, 1);
+    BmPalette *threaded = bm_quantize_mediancut(many, 64, 4);
+    assert(serial && threaded && "Failed to quantize");
+    if (bm_palette_count(serial) != 64 || bm_palette_count(threaded) != 64) {
+        printf("ERROR: Expected 64 colors, got %d and %d\n",
+               bm_palette_count(serial), bm_palette_count(threaded));
+        test_passed = 0;
+    }
+    for (int i = 0; i < bm_palette_count(serial) && test_passed; i++) {
+        if (bm_palette_get(serial, i) != bm_palette_get(threaded, i)) {
+            printf("ERROR: Palettes from 1 and 4 threads differ at %d\n", i);
+            test_passed = 0;
+        }
+    }
+    double worst = 0;
+    for (int y = 0; y < 512; y += 3) {
+        for (int x = 0; x < 512; x += 3) {
+            unsigned char r0, g0, b0, r1, g1, b1;
+            bm_get_rgb(bm_get(many, x, y), &r0, &g0, &b0);
+            bm_get_rgb(bm_palette_nearest_color(serial, bm_get(many, x, y)), &r1, &g1, &b1);
+            double d = sqrt((r0 - r1) * (r0 - r1) + (g0 - g1) * (g0 - g1) + (b0 - b1) * (b0 - b1));
+            worst = d > worst ? d : worst;
+        }
+    }
+    if (worst > 40) {
+        printf("ERROR: A pixel is %.1f away from its nearest palette color\n", worst);
+        test_passed = 0;
+    }
+    bm_palette_release(serial);
+    bm_palette_release(threaded);
+    bm_free(many);
+
+    printf("\nMedian cut quantization test: %s\n", test_passed ? "PASSED" : "FAILED");
+}
+
+void test_prof_report() {
+    printf("\n=== Testing Phase Timing Report ===\n");
+    int test_passed = 1;
+
+    // Nothing is recorded while timing is off
+    prof_add(PROF_STEP, 1.0, 1);
+    prof_enable();
+    for (int i = 100; i >= 1; i--) {
+        prof_add(PROF_STEP, i * 1e-3, 1000);
+    }
+    prof_add(PROF_PARSE, 0.5, 2000000);
+    // Counters may be unavailable here; a section still records its time
+    prof_enable_counters();
+    prof_mark_t mark;
+    prof_begin(&mark);
+    prof_end(PROF_INIT, &mark, 10);
+    const uint64_t counts[PROF_COUNTERS] = {4000, 6000, 25, PROF_NO_COUNT};
+    prof_add_counts(PROF_RENDER, 0.001, 100, counts);
+    prof_add_counts(PROF_RENDER, 0.001, 100, counts);
+
+    const char *filename = "test_report.json";
+    prof_run_t run = {.input = "a \"quoted\" name", .rows = 10, .cols = 100, .steps = 100, .threads = 2};
+    if (prof_write_report(filename, &run) != 0) {
+        printf("ERROR: Failed to write the report\n");
+        test_passed = 0;
+    }
+    prof_disable();
+
+    char text[4096] = {0};
+    FILE *f = fopen(filename, "r");
+    if (f) {
+        if (fread(text, 1, sizeof(text) - 1, f) == 0) {
+            test_passed = 0;
+        }
+        fclose(f);
+    }
+    const char *expected[] = {
+        "\"input\": \"a \\\"quoted\\\" name\"", "\"cells\": 1000", "\"threads\": 2",
+        "\"step\": {\"count\": 100, \"total_s\": 5.05, \"min_s\": 0.001, \"median_s\": 0.05, "
+        "\"p99_s\": 0.099, \"max_s\": 0.1, \"cells\": 100000, \"cells_per_s\": 19801.9802",
+        "\"parse\": {\"count\": 1, \"total_s\": 0.5", "\"bytes_per_s\": 4000000",
+        "\"init\": {\"count\": 1,", "\"encode\": {\"count\": 0}",
+        "\"cycles\": {\"samples\": 2, \"total\": 8000, \"per_sample\": 4000, \"per_unit\": 40}",
+        "\"llc_misses\": {\"samples\": 2, \"total\": 50, \"per_sample\": 25, \"per_unit\": 0.25}, \"ipc\"",
+        "\"ipc\": 1.5, \"memory_bytes_per_s\": 1600000}",
+    };
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        if (!strstr(text, expected[i])) {
+            printf("ERROR: Report is missing %s\n", expected[i]);
+            test_passed = 0;
+        }
+    }
+    remove(filename);
+
+    printf("\nPhase timing report test: %s\n", test_passed ? "PASSED" : "FAILED");
+}
+
 int main() {
     printf("Starting pointcloud tests...\n");
     
@@ -478,6 +2487,26 @@ int main() {
     test_initialize_watershed();
     test_add_uniform_water();
     test_watershed_step();
+    test_checkpoint_roundtrip();
+    test_basin_labels();
+    test_terrain_derivatives();
+    test_gridding();
+    test_nodata_mask();
+    test_render_context();
+    test_gif_indexed_roundtrip();
+    test_palette_nearest();
+    test_quantize_mediancut();
+    test_prof_report();
+    test_trace_events();
+    test_mem_accounting();
+    test_gif_animation();
+    test_mpmc_queue();
+    test_frame_writer();
+    test_y4m_stream();
+    test_raster_export();
+    test_synth_terrain();
+    test_sim_threads();
+    test_kernel_differential();
     test_image_point_cloud_water();  // Add this line
     test_ames_data();
     
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "trace.h"
+#include "prof.h"
+
+// One finished span
+typedef struct {
+    const char *name;       // static string
+    const char *arg_name;   // static string, NULL when the span has no argument
+    long arg;
+    double start, end;      // prof_now times
+} trace_event_t;
+
+// Events of the threads that took turns on one row of the trace
+typedef struct {
+    atomic_int used;            // 1 while a live thread owns the ring
+    const char *name;           // first name a thread gave the row, NULL for a numbered row
+    trace_event_t *events;      // TRACE_EVENTS of them, allocated on first use
+    uint64_t count;             // events ever recorded; the last TRACE_EVENTS are kept
+} trace_ring_t;
+
+static trace_ring_t trace_rings[TRACE_THREADS];
+static atomic_int trace_on;
+static double trace_start;      // when tracing was enabled; timestamps are relative to it
+
+static int trace_active(void) {
+    return atomic_load_explicit(&trace_on, memory_order_relaxed);
+}
+
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+// Hands the ring of an exiting thread back; its events stay until written
+static void trace_release(void *arg) {
+    int slot = (int)(intptr_t)arg - 1;
+    atomic_store_explicit(&trace_rings[slot].used, 0, memory_order_release);
+}
+
+static void trace_make_key(void) {
+    pthread_key_create(&trace_key, trace_release);
+}
+
+// Ring of the calling thread, claimed on its first event; NULL when every ring is taken
+static trace_ring_t* trace_ring(void) {
+    pthread_once(&trace_key_once, trace_make_key);
+    intptr_t slot = (intptr_t)pthread_getspecific(trace_key);
+    if (slot) {
+        // The events of a ring kept across trace_disable are allocated again
+        trace_ring_t *r = &trace_rings[slot - 1];
+        if (!r->events) {
+            r->events = malloc(TRACE_EVENTS * sizeof(trace_event_t));
+        }
+        return r->events ? r : NULL;
+    }
+
+    for (int i = 0; i < TRACE_THREADS; i++) {
+        trace_ring_t *r = &trace_rings[i];
+        int expected = 0;
+        if (atomic_load_explicit(&r->used, memory_order_relaxed) ||
+            !atomic_compare_exchange_strong_explicit(&r->used, &expected, 1,
+                                                     memory_order_acquire, memory_order_relaxed)) {
+            continue;
+        }
+        if (!r->events && !(r->events = malloc(TRACE_EVENTS * sizeof(trace_event_t)))) {
+            atomic_store_explicit(&r->used, 0, memory_order_release);
+            return NULL;
+        }
+        pthread_setspecific(trace_key, (void *)(intptr_t)(i + 1));
+        return r;
+    }
+    return NULL;
+}
+
+// Frees the rings; no thread may be recording
+static void trace_clear(void) {
+    for (int i = 0; i < TRACE_THREADS; i++) {
+        free(trace_rings[i].events);
+        trace_rings[i].events = NULL;
+        trace_rings[i].name = NULL;
+        trace_rings[i].count = 0;
+    }
+}
+
+// Starts tracing, dropping any earlier events; the calling thread is named "main"
+void trace_enable(void) {
+    trace_clear();
+    trace_start = prof_now();
+    atomic_store_explicit(&trace_on, 1, memory_order_relaxed);
+    trace_thread_name("main");
+}
+
+// Stops tracing and frees the events; call it once the recording threads have finished
+void trace_disable(void) {
+    atomic_store_explicit(&trace_on, 0, memory_order_relaxed);
+    trace_clear();
+}
+
+int trace_enabled(void) {
+    return trace_active();
+}
+
+// Start time of a span, 0 when tracing is off
+double trace_begin(void) {
+    return trace_active() ? prof_now() : 0.0;
+}
+
+/**
+ * Records a span of the calling thread that started at trace_begin()
+ * Inputs:
+ *  - name: what ran; the string must outlive the trace
+ *  - start: the value trace_begin returned
+ *  - arg_name: name of an argument shown with the span, or NULL
+ *  - arg: its value
+ */
+void trace_end(const char *name, double start, const char *arg_name, long arg) {
+    if (!trace_active() || start == 0.0) {
+        return;
+    }
+    trace_ring_t *r = trace_ring();
+    if (!r) {
+        return;
+    }
+    trace_event_t *e = &r->events[r->count & (TRACE_EVENTS - 1)];
+    e->name = name;
+    e->arg_name = arg_name;
+    e->arg = arg;
+    e->start = start;
+    e->end = prof_now();
+    r->count++;
+}
+
+// Labels the calling thread's row of the trace, unless an earlier owner of the row labelled it
+void trace_thread_name(const char *name) {
+    if (!trace_active()) {
+        return;
+    }
+    trace_ring_t *r = trace_ring();
+    if (r && !r->name) {
+        r->name = name;
+    }
+}
+
+/**
+ * Writes the recorded spans as Chrome trace_event JSON, which chrome://tracing
+ * and Perfetto open. Each span is a complete ("X") event with its start and
+ * duration in microseconds since trace_enable. Rows get thread_name metadata.
+ * Events overwritten in full rings are counted in otherData.
+ * Returns: 0 on success, -1 on failure
+ */
+int trace_write(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s\n", filename);
+        return -1;
+    }
+
+    int pid = (int)getpid();
+    uint64_t dropped = 0;
+    int first = 1;
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    for (int i = 0; i < TRACE_THREADS; i++) {
+        const trace_ring_t *r = &trace_rings[i];
+        if (!r->events || r->count == 0) {
+            continue;
+        }
+        if (r->name) {
+            fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                       "\"args\": {\"name\": \"%s\"}}", first ? "" : ",", pid, i, r->name);
+        } else {
+            fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                       "\"args\": {\"name\": \"thread %d\"}}", first ? "" : ",", pid, i, i);
+        }
+        first = 0;
+
+        uint64_t kept = r->count < TRACE_EVENTS ? r->count : TRACE_EVENTS;
+        dropped += r->count - kept;
+        for (uint64_t n = r->count - kept; n < r->count; n++) {
+            const trace_event_t *e = &r->events[n & (TRACE_EVENTS - 1)];
+            fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, "
+                       "\"ts\": %.3f, \"dur\": %.3f",
+                    e->name, pid, i, (e->start - trace_start) * 1e6, (e->end - e->start) * 1e6);
+            if (e->arg_name) {
+                fprintf(f, ", \"args\": {\"%s\": %ld}", e->arg_name, e->arg);
+            }
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n], \"otherData\": {\"dropped_events\": %llu}}\n", (unsigned long long)dropped);
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Events kept per thread, a power of two; once a thread records more, its oldest are overwritten
+#define TRACE_EVENTS 65536
+
+// Threads that can record at the same time; threads beyond this record nothing
+#define TRACE_THREADS 256
+
+/*
+Tracing is off until trace_enable is called, and a trace point is then a
+flag test until it is. Each thread records into a ring of its own without
+taking a lock. A thread claims a free ring on its first event and gives it
+back when it exits, so the short-lived parallelRun workers take turns on a
+few rings instead of each getting one; a ring is one row ("tid") of the
+trace and is never written by two threads at once. trace_write writes every
+ring as Chrome trace_event JSON once the threads that recorded have finished.
+*/
+
+void trace_enable(void);
+void trace_disable(void);
+int trace_enabled(void);
+double trace_begin(void);
+void trace_end(const char *name, double start, const char *arg_name, long arg);
+void trace_thread_name(const char *name);
+int trace_write(const char *filename);
+
+#endif // TRACE_H
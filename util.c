@@ -1,7 +1,16 @@
+#ifdef __linux__
+#define _GNU_SOURCE     // pthread_setaffinity_np
+#include <sched.h>
+#endif
 #include <stdio.h> 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "util.h"
+#include "trace.h"
+#include "mem.h"
 
 /*
 Function to allocate space for a 2D array 
@@ -35,7 +44,7 @@ int listInit (List* l, int max_elmt_size){
     l -> max_size = 10; 
     l -> max_element_size = max_elmt_size; 
     l -> size = 0; 
-    l -> data = malloc(l -> max_size * l -> max_element_size); 
+    l -> data = mem_alloc(MEM_INGEST, l -> max_size * l -> max_element_size); 
 
     return l-> data != NULL; 
 }
@@ -43,7 +52,7 @@ int listInit (List* l, int max_elmt_size){
 void listAddEnd(List* l, void* elmt){
     if (l -> size == l -> max_size){ // doubling the size of the array
         int new_max_size = l -> max_size * 2; 
-        void* new_data = realloc(l->data, new_max_size * l->max_element_size);
+        void* new_data = mem_realloc(MEM_INGEST, l->data, (size_t)new_max_size * l->max_element_size);
 
         if (new_data == NULL){
             return; // handle memory allocation failure
@@ -57,10 +66,278 @@ void listAddEnd(List* l, void* elmt){
     l -> size++; 
 }
 
+// Frees the elements of a list; data must come from listInit or mem_alloc
+void listFree(List* l){
+    mem_free(l -> data); 
+    l -> data = NULL; 
+    l -> size = 0; 
+    l -> max_size = 0; 
+}
+
 void *listGet(List* l, int index){
     if (index < 0 || index >= l -> size){
         return NULL;
     }
 
     return (char*)l->data + index * l->max_element_size; 
-}
\ No newline at end of file
+}
+
+/*
+Number of worker threads to use by default: the TERRAFLOW_THREADS environment
+variable if set, otherwise the number of online processors
+*/
+int defaultThreadCount(void){
+    const char *env = getenv("TERRAFLOW_THREADS"); 
+    if (env && atoi(env) > 0){
+        return atoi(env); 
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN); 
+    return cpus > 0 ? (int)cpus : 1; 
+}
+
+typedef struct{
+    parallel_fn fn; 
+    void *arg; 
+    int thread; 
+    int nthreads; 
+} parallel_task; 
+
+static void *parallelMain(void *p){
+    parallel_task *task = p; 
+    task->fn(task->arg, task->thread, task->nthreads); 
+    return NULL; 
+}
+
+/*
+Runs fn(arg, thread, nthreads) on nthreads threads and waits for all of them.
+The calling thread runs thread 0, so nthreads <= 1 runs fn inline. If a thread
+can't be started its share runs on the calling thread instead.
+*/
+void parallelRun(int nthreads, parallel_fn fn, void *arg){
+    if (nthreads <= 1){
+        fn(arg, 0, 1); 
+        return; 
+    }
+
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t)); 
+    parallel_task *tasks = malloc(nthreads * sizeof(parallel_task)); 
+    int *started = calloc(nthreads, sizeof(int)); 
+    if (!threads || !tasks || !started){
+        free(threads); 
+        free(tasks); 
+        free(started); 
+        for (int t = 0; t < nthreads; t++){
+            fn(arg, t, nthreads); 
+        }
+        return; 
+    }
+
+    for (int t = 0; t < nthreads; t++){
+        tasks[t].fn = fn; 
+        tasks[t].arg = arg; 
+        tasks[t].thread = t; 
+        tasks[t].nthreads = nthreads; 
+    }
+    for (int t = 1; t < nthreads; t++){
+        started[t] = pthread_create(&threads[t], NULL, parallelMain, &tasks[t]) == 0; 
+    }
+
+    fn(arg, 0, nthreads); 
+
+    // Time the caller spends waiting for the slowest worker
+    double wait = trace_begin(); 
+    for (int t = 1; t < nthreads; t++){
+        if (started[t]){
+            pthread_join(threads[t], NULL); 
+        } else {
+            fn(arg, t, nthreads); 
+        }
+    }
+
+    trace_end("parallel wait", wait, "threads", nthreads); 
+
+    free(threads); 
+    free(tasks); 
+    free(started); 
+}
+
+/*
+Sends stdout to /dev/null while code that prints progress runs, e.g. in the
+benchmarks and tests. Returns the saved descriptor for loudStdout.
+*/
+int quietStdout(void){
+    fflush(stdout); 
+    int saved = dup(STDOUT_FILENO); 
+    int null = open("/dev/null", O_WRONLY); 
+    if (null >= 0){
+        dup2(null, STDOUT_FILENO); 
+        close(null); 
+    }
+    return saved; 
+}
+
+// Restores the stdout quietStdout saved
+void loudStdout(int saved){
+    fflush(stdout); 
+    if (saved >= 0){
+        dup2(saved, STDOUT_FILENO); 
+        close(saved); 
+    }
+}
+
+/*
+A pool of nthreads workers that run one parallel_fn after another without
+being started again, for loops such as the simulation steps where thread
+start-up would be paid on every pass. The caller waits while the workers
+run, so worker t always runs share t. On Linux each worker is pinned to its
+own processor when there are enough of them, so a share's memory stays on
+the node of the thread that first touched it.
+*/
+struct thread_pool{
+    int nthreads; 
+    pthread_t *threads; 
+    parallel_task *tasks; 
+    pthread_mutex_t lock; 
+    pthread_cond_t posted;      // signalled when a function is posted or stop is set
+    pthread_cond_t finished;    // signalled when the last worker is done with it
+    long generation;            // functions posted so far, guarded by lock
+    int running;                // workers still running the posted function, guarded by lock
+    int stop;                   // guarded by lock
+    parallel_fn fn; 
+    void *arg; 
+}; 
+
+static void *poolMain(void *arg){
+    parallel_task *task = arg; 
+    thread_pool_t *pool = task -> arg; 
+    long seen = 0; 
+    trace_thread_name("pool worker"); 
+    for (;;){
+        pthread_mutex_lock(&pool -> lock); 
+        while (pool -> generation == seen && !pool -> stop){
+            pthread_cond_wait(&pool -> posted, &pool -> lock); 
+        }
+        if (pool -> stop){
+            pthread_mutex_unlock(&pool -> lock); 
+            return NULL; 
+        }
+        seen = pool -> generation; 
+        pthread_mutex_unlock(&pool -> lock); 
+
+        pool -> fn(pool -> arg, task -> thread, task -> nthreads); 
+
+        pthread_mutex_lock(&pool -> lock); 
+        if (--pool -> running == 0){
+            pthread_cond_signal(&pool -> finished); 
+        }
+        pthread_mutex_unlock(&pool -> lock); 
+    }
+}
+
+// Pins a worker to the index-th processor the process may run on, when
+// there is one processor per worker
+static void poolPin(pthread_t thread, int index, int nthreads){
+#ifdef __linux__
+    cpu_set_t allowed, one; 
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) < nthreads){
+        return; 
+    }
+    int seen = 0; 
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if (CPU_ISSET(cpu, &allowed) && seen++ == index){
+            CPU_ZERO(&one); 
+            CPU_SET(cpu, &one); 
+            pthread_setaffinity_np(thread, sizeof(one), &one); 
+            return; 
+        }
+    }
+#else
+    (void)thread; 
+    (void)index; 
+    (void)nthreads; 
+#endif
+}
+
+/**
+ * Starts a pool of worker threads
+ * Inputs:
+ *  - nthreads: number of workers, at least 1
+ * Returns: the pool, or NULL if the threads cannot be started
+ */
+thread_pool_t *threadPoolCreate(int nthreads){
+    if (nthreads < 1){
+        return NULL; 
+    }
+    thread_pool_t *pool = calloc(1, sizeof(thread_pool_t)); 
+    if (!pool){
+        return NULL; 
+    }
+    pool -> threads = malloc(nthreads * sizeof(pthread_t)); 
+    pool -> tasks = malloc(nthreads * sizeof(parallel_task)); 
+    if (!pool -> threads || !pool -> tasks){
+        free(pool -> threads); 
+        free(pool -> tasks); 
+        free(pool); 
+        return NULL; 
+    }
+    pthread_mutex_init(&pool -> lock, NULL); 
+    pthread_cond_init(&pool -> posted, NULL); 
+    pthread_cond_init(&pool -> finished, NULL); 
+
+    // nthreads counts the workers started so far, so a failed start stops just those
+    for (int t = 0; t < nthreads; t++){
+        parallel_task *task = &pool -> tasks[t]; 
+        task -> arg = pool; 
+        task -> thread = t; 
+        task -> nthreads = nthreads; 
+        if (pthread_create(&pool -> threads[t], NULL, poolMain, task) != 0){
+            threadPoolFree(pool); 
+            return NULL; 
+        }
+        pool -> nthreads = t + 1; 
+        poolPin(pool -> threads[t], t, nthreads); 
+    }
+    return pool; 
+}
+
+int threadPoolSize(const thread_pool_t *pool){
+    return pool ? pool -> nthreads : 0; 
+}
+
+// Runs fn(arg, thread, nthreads) on every worker and waits for all of them
+void threadPoolRun(thread_pool_t *pool, parallel_fn fn, void *arg){
+    pthread_mutex_lock(&pool -> lock); 
+    pool -> fn = fn; 
+    pool -> arg = arg; 
+    pool -> running = pool -> nthreads; 
+    pool -> generation++; 
+    pthread_cond_broadcast(&pool -> posted); 
+
+    double wait = trace_begin(); 
+    while (pool -> running > 0){
+        pthread_cond_wait(&pool -> finished, &pool -> lock); 
+    }
+    pthread_mutex_unlock(&pool -> lock); 
+    trace_end("pool wait", wait, "threads", pool -> nthreads); 
+}
+
+// Stops the workers and frees the pool; NULL is ignored
+void threadPoolFree(thread_pool_t *pool){
+    if (!pool){
+        return; 
+    }
+    pthread_mutex_lock(&pool -> lock); 
+    pool -> stop = 1; 
+    pthread_cond_broadcast(&pool -> posted); 
+    pthread_mutex_unlock(&pool -> lock); 
+    for (int t = 0; t < pool -> nthreads; t++){
+        pthread_join(pool -> threads[t], NULL); 
+    }
+    pthread_mutex_destroy(&pool -> lock); 
+    pthread_cond_destroy(&pool -> posted); 
+    pthread_cond_destroy(&pool -> finished); 
+    free(pool -> threads); 
+    free(pool -> tasks); 
+    free(pool); 
+}
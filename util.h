@@ -16,7 +16,25 @@ typedef struct{
 
 int listInit(List* l, int max_elmt_size); 
 void listAddEnd(List* l, void* elmt); 
+void listFree(List* l); 
 void *listGet(List* l, int index); 
 
+// Worker function run by parallelRun on every thread
+typedef void (*parallel_fn)(void *arg, int thread, int nthreads);
+
+int defaultThreadCount(void); 
+void parallelRun(int nthreads, parallel_fn fn, void *arg); 
+
+int quietStdout(void); 
+void loudStdout(int saved); 
+
+// Workers kept alive between parallel passes
+typedef struct thread_pool thread_pool_t; 
+
+thread_pool_t *threadPoolCreate(int nthreads); 
+int threadPoolSize(const thread_pool_t *pool); 
+void threadPoolRun(thread_pool_t *pool, parallel_fn fn, void *arg); 
+void threadPoolFree(thread_pool_t *pool); 
+
 
 #endif // UTIL_H
\ No newline at end of file
@@ -1,3 +1,5 @@
+# Superseded by the gen_terrain program (make gen_terrain), which is much faster,
+# takes a size and seed, and can add basins, plateaus and NODATA holes.
 import math
 
 def generate_terrain_data():
@@ -1,96 +1,515 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <float.h>
+#include <unistd.h>
 #include "pointcloud.h"
+#include "checkpoint.h"
+#include "basin.h"
+#include "terrain.h"
+#include "gridding.h"
+#include "sim.h"
+#include "render.h"
+#include "frames.h"
+#include "raster.h"
+#include "prof.h"
+#include "trace.h"
+#include "mem.h"
+#include "util.h"
+
+// Command line options that follow the positional arguments
+typedef struct {
+    int checkpoint_every;   // write a checkpoint every N steps (0 disables)
+    int resume;             // continue from <ofilebase>.ckpt
+    int basins;             // label drainage basins after the run
+    int terrain;            // write terrain derivative rasters
+    int animate;            // write the seq frames into one animated GIF
+    int y4m;                // stream the seq frames to stdout as YUV4MPEG2
+    int resolution;         // image edge length in pixels, or RENDER_NATIVE
+    raster_type_t raster;   // sample type of the exported height and water rasters, 0 for none
+    int grid;               // grid scattered input points instead of reading an ordered grid
+    gridding_options_t gridding; // cell size and hole filling used with grid
+    const char *report;     // write phase timings as JSON to this file, NULL for none
+    int perf;               // read hardware counters around the timed phases
+    const char *trace;      // write a Chrome trace of every thread to this file, NULL for none
+} run_options_t;
 
 void print_usage() {
-    printf("Usage: ./watershed <ifile> <iter> <iwater> <wcoef> <ecoef> <ofilebase> [seq]\n");
-    printf("  ifile     - Input pointcloud file name\n");
+    printf("Usage: ./watershed <ifile> <iter> <iwater> <wcoef> <ecoef> <ofilebase> [seq] [options]\n");
+    printf("  ifile     - Input pointcloud file name, or a .f32/.f64 raster with an ENVI header\n");
     printf("  iter      - Number of computation steps\n");
     printf("  iwater    - Initial water amount\n");
     printf("  wcoef     - Water flow coefficient (0.0-0.2)\n");
     printf("  ecoef     - Evaporation coefficient (0.9-1.0)\n");
     printf("  ofilebase - Output file base name\n");
     printf("  seq       - Optional: Output interval for intermediate steps\n");
+    printf("Options:\n");
+    printf("  --checkpoint N - Write <ofilebase>.ckpt every N steps in the background\n");
+    printf("  --resume       - Continue the run from <ofilebase>.ckpt\n");
+    printf("  --basins       - Write drainage basins to <ofilebase>_basins.{csv,bin,gif}\n");
+    printf("  --terrain      - Write slope, aspect, curvature and hillshade rasters\n");
+    printf("  --animate      - Write the seq frames into one animated <ofilebase>.gif\n");
+    printf("  --y4m          - Stream the seq frames to stdout as YUV4MPEG2 video; messages go to stderr\n");
+    printf("  --res SIZE     - Render SIZE x SIZE images (default %d), or 'native' for one pixel per cell\n",
+           RENDER_SIZE);
+    printf("  --raster TYPE  - Also write the height and water grids as raw 'f32' or 'f64' rasters\n");
+    printf("  --grid SIZE    - Bin scattered points into SIZE cells ('auto' for the mean spacing)\n");
+    printf("  --fill METHOD  - Fill empty grid cells with 'idw' (default), 'nearest' or 'none' (NODATA)\n");
+    printf("  --report FILE  - Time each phase of the run and write a JSON summary to FILE\n");
+    printf("  --perf         - Also count cycles, instructions and cache and branch misses per phase\n");
+    printf("  --trace FILE   - Record what every thread does and write a Chrome trace to FILE\n");
+}
+
+/**
+ * Splits the command line into positional arguments and options
+ * Returns: number of positional arguments, or -1 on an unknown or malformed option
+ */
+static int parse_arguments(int argc, char *argv[], char *positional[], int max_positional,
+                           run_options_t *opts) {
+    int count = 0;
+    memset(opts, 0, sizeof(*opts));
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            opts->checkpoint_every = atoi(argv[++i]);
+            if (opts->checkpoint_every <= 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            opts->resume = 1;
+        } else if (strcmp(argv[i], "--basins") == 0) {
+            opts->basins = 1;
+        } else if (strcmp(argv[i], "--animate") == 0) {
+            opts->animate = 1;
+        } else if (strcmp(argv[i], "--y4m") == 0) {
+            opts->y4m = 1;
+        } else if (strcmp(argv[i], "--res") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "native") == 0) {
+                opts->resolution = RENDER_NATIVE;
+            } else {
+                // Only 'native' asks for RENDER_NATIVE; a number must be a positive size
+                char *end;
+                long size = strtol(argv[i], &end, 10);
+                if (end == argv[i] || *end != '\0' || size <= 0 || size > 0xFFFF) {
+                    printf("Error: --res needs a size from 1 to 65535 or 'native'\n");
+                    return -1;
+                }
+                opts->resolution = (int)size;
+            }
+        } else if (strcmp(argv[i], "--raster") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "f32") == 0) {
+                opts->raster = RASTER_FLOAT32;
+            } else if (strcmp(argv[i], "f64") == 0) {
+                opts->raster = RASTER_FLOAT64;
+            } else {
+                printf("Error: --raster needs 'f32' or 'f64'\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+            opts->report = argv[++i];
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            opts->perf = 1;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            opts->trace = argv[++i];
+        } else if (strcmp(argv[i], "--terrain") == 0) {
+            opts->terrain = 1;
+        } else if (strcmp(argv[i], "--grid") == 0 && i + 1 < argc) {
+            opts->grid = 1;
+            i++;
+            if (strcmp(argv[i], "auto") != 0) {
+                char *end;
+                opts->gridding.cell_size = strtod(argv[i], &end);
+                if (end == argv[i] || *end != '\0' || !(opts->gridding.cell_size > 0) ||
+                    opts->gridding.cell_size > DBL_MAX) {
+                    printf("Error: --grid needs a positive cell size or 'auto'\n");
+                    return -1;
+                }
+            }
+        } else if (strcmp(argv[i], "--fill") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "idw") == 0) {
+                opts->gridding.fill = GRID_FILL_IDW;
+            } else if (strcmp(argv[i], "nearest") == 0) {
+                opts->gridding.fill = GRID_FILL_NEAREST;
+            } else if (strcmp(argv[i], "none") == 0) {
+                opts->gridding.fill = GRID_FILL_NONE;
+            } else {
+                printf("Error: --fill needs 'idw', 'nearest' or 'none'\n");
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            printf("Error: Unknown option %s\n", argv[i]);
+            return -1;
+        } else if (count < max_positional) {
+            positional[count++] = argv[i];
+        } else {
+            return -1;
+        }
+    }
+    return count;
+}
+
+/**
+ * Labels the drainage basins of the final state and writes the basin table,
+ * the raw basin-id raster and a rendering of it
+ */
+static void write_basins(pointcloud_t *pc, const char *ofilebase) {
+    char filename[256];
+
+    basin_map_t *bm = basin_label(pc, 0, 0);
+    if (!bm) {
+        printf("Error: Failed to label drainage basins\n");
+        return;
+    }
+
+    snprintf(filename, sizeof(filename), "%s_basins.csv", ofilebase);
+    FILE *f = fopen(filename, "w");
+    if (f) {
+        basin_write_table(bm, f);
+        fclose(f);
+    } else {
+        printf("Error: Cannot open %s\n", filename);
+    }
+
+    snprintf(filename, sizeof(filename), "%s_basins.bin", ofilebase);
+    basin_write_labels(bm, filename);
+
+    snprintf(filename, sizeof(filename), "%s_basins.gif", ofilebase);
+    imageBasins(bm, filename);
+
+    printf("Labelled %d drainage basins (%s_basins.{csv,bin,gif})\n", bm->count, ofilebase);
+    basin_map_free(bm);
+}
+
+/**
+ * Computes the terrain derivatives and writes each as a float32 raster, plus
+ * renderings of the hillshade and slope
+ */
+static void write_terrain(pointcloud_t *pc, const char *ofilebase) {
+    char filename[256];
+
+    terrain_t *tr = terrain_analyze(pc, TERRAIN_SUN_AZIMUTH, TERRAIN_SUN_ALTITUDE, 0);
+    if (!tr) {
+        printf("Error: Failed to analyze terrain\n");
+        return;
+    }
+
+    const struct {
+        const char *name;
+        const float *data;
+    } rasters[] = {
+        {"slope", tr->slope},
+        {"aspect", tr->aspect},
+        {"plancurv", tr->plan_curv},
+        {"profcurv", tr->prof_curv},
+        {"hillshade", tr->hillshade},
+    };
+    for (size_t i = 0; i < sizeof(rasters) / sizeof(rasters[0]); i++) {
+        snprintf(filename, sizeof(filename), "%s_%s.f32", ofilebase, rasters[i].name);
+        terrain_write_raster(tr, rasters[i].data, filename);
+    }
+
+    snprintf(filename, sizeof(filename), "%s_hillshade.gif", ofilebase);
+    imageTerrainRaster(tr, tr->hillshade, 0.0f, 255.0f, filename);
+    snprintf(filename, sizeof(filename), "%s_slope.gif", ofilebase);
+    imageTerrainRaster(tr, tr->slope, 0.0f, 90.0f, filename);
+
+    printf("Generated terrain rasters: %s_{slope,aspect,plancurv,profcurv,hillshade}.f32\n", ofilebase);
+    terrain_free(tr);
 }
 
 int main(int argc, char *argv[]) {
+    char *args[7];
+    run_options_t opts;
+
     // Check arguments
-    if (argc != 7 && argc != 8) {
+    int nargs = parse_arguments(argc, argv, args, 7, &opts);
+    if (nargs != 6 && nargs != 7) {
         print_usage();
         return 1;
     }
 
     // Parse arguments
-    char *ifile = argv[1];
-    int iter = atoi(argv[2]);
-    double iwater = atof(argv[3]);
-    double wcoef = atof(argv[4]);
-    double ecoef = atof(argv[5]);
-    char *ofilebase = argv[6];
-    int seq = (argc == 8) ? atoi(argv[7]) : 0;
+    char *ifile = args[0];
+    int iter = atoi(args[1]);
+    double iwater = atof(args[2]);
+    double wcoef = atof(args[3]);
+    double ecoef = atof(args[4]);
+    char *ofilebase = args[5];
+    int seq = (nargs == 7) ? atoi(args[6]) : 0;
 
     // Validate parameters
-    if (iter <= 0 || iwater < 0 || 
-        wcoef < 0.0 || wcoef > 0.2 || 
+    if (iter <= 0 || iwater < 0 ||
+        wcoef < 0.0 || wcoef > 0.2 ||
         ecoef < 0.9 || ecoef > 1.0) {
         printf("Error: Invalid parameters\n");
         print_usage();
         return 1;
     }
 
-    // Read input file
+    if (opts.y4m && (seq <= 0 || opts.animate)) {
+        printf("Error: --y4m needs a seq interval and cannot be combined with --animate\n");
+        return 1;
+    }
+
+    // The video takes over stdout; everything printed from here on goes to stderr
+    FILE *video = NULL;
+    if (opts.y4m) {
+        fflush(stdout);
+        int fd = dup(STDOUT_FILENO);
+        video = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        if (!video || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "Error: Cannot stream video to stdout\n");
+            return 1;
+        }
+        // Every frame goes out in one write, so stdio buffering would only add a copy
+        setvbuf(video, NULL, _IONBF, 0);
+    }
+
+    if (opts.report || opts.perf) {
+        prof_enable();
+    }
+    if (opts.trace) {
+        trace_enable();
+    }
+    if (opts.perf && prof_enable_counters() == 0) {
+        printf("Note: hardware counters are not available (see /proc/sys/kernel/perf_event_paranoid); "
+               "reporting timings only\n");
+    }
+
+    // Read input file; .f32 and .f64 inputs are rasters with an ENVI header
     FILE *f = fopen(ifile, "r");
     if (!f) {
         printf("Error: Cannot open input file %s\n", ifile);
         return 1;
     }
+    const char *ext = strrchr(ifile, '.');
+    int raster_input = !opts.grid && ext && (strcmp(ext, ".f32") == 0 || strcmp(ext, ".f64") == 0);
 
-    pointcloud_t *pc = readPointCloudData(f);
+    prof_mark_t mark;
+    prof_begin(&mark);
+    pointcloud_t *pc;
+    long bytes_read;
+    if (raster_input) {
+        fseek(f, 0, SEEK_END);
+        bytes_read = ftell(f);
+        pc = raster_read(ifile);
+    } else {
+        pc = opts.grid ? readPointCloudGridded(f, &opts.gridding) : readPointCloudData(f);
+        bytes_read = ftell(f);
+    }
     fclose(f);
 
     if (!pc) {
         printf("Error: Failed to read pointcloud data\n");
         return 1;
     }
+    prof_end(PROF_PARSE, &mark, bytes_read > 0 ? (uint64_t)bytes_read : 0);
 
     // Initialize watershed
+    prof_begin(&mark);
     if (initializeWatershed(pc) != 0) {
         printf("Error: Failed to initialize watershed\n");
         pointcloud_free(pc);
         return 1;
     }
+    prof_end(PROF_INIT, &mark, pc->points.size);
 
     //update the coefficients
     update_watershed_coefficients(pc, wcoef, ecoef);
 
-    // Add initial water
-    watershedAddUniformWater(pc, iwater);
+    if (opts.terrain) {
+        write_terrain(pc, ofilebase);
+    }
 
     // Prepare output filename buffer
     char outfile[256];
+    char ckptfile[256];
+    snprintf(ckptfile, sizeof(ckptfile), "%s.ckpt", ofilebase);
+
+    int start = 0;
+    if (opts.resume) {
+        // Continue from the latest checkpoint instead of adding initial water
+        checkpoint_t *ck = checkpoint_open(ckptfile);
+        if (!ck || checkpoint_restore(ck, pc) != 0) {
+            printf("Error: Cannot resume from %s\n", ckptfile);
+            checkpoint_close(ck);
+            pointcloud_free(pc);
+            return 1;
+        }
+        start = (int)ck->header->step + 1;
+        iwater = ck->header->iwater;
+        if (wcoef != ck->header->water_coef || ecoef != ck->header->evap_coef) {
+            printf("Note: using coefficients from checkpoint (wcoef=%.3f, ecoef=%.3f)\n",
+                   ck->header->water_coef, ck->header->evap_coef);
+        }
+        printf("Resuming from %s at step %d of %d\n", ckptfile, start, iter);
+        checkpoint_close(ck);
+    } else {
+        // Add initial water
+        watershedAddUniformWater(pc, iwater);
+    }
+
+    checkpoint_writer_t *cw = NULL;
+    if (opts.checkpoint_every > 0) {
+        cw = checkpoint_writer_create(ckptfile, pc->points.size);
+        if (!cw) {
+            printf("Error: Failed to start checkpoint writer\n");
+            pointcloud_free(pc);
+            return 1;
+        }
+    }
+
+    // The steps run on a flat copy of the grid; water is copied back into the
+    // point cloud only when it is checkpointed. Frames are rendered straight
+    // from the grid through a context that projects the points once.
+    sim_grid_t *sim = sim_grid_create(pc);
+    render_ctx_t *rc = render_create(pc, opts.resolution);
+    if (!sim || !rc) {
+        printf("Error: Failed to set up the simulation grid\n");
+        sim_grid_free(sim);
+        render_free(rc);
+        checkpoint_writer_free(cw);
+        pointcloud_free(pc);
+        return 1;
+    }
+
+    // Raw rasters of the heights, then of the water at every output step
+    raster_writer_t *rw = NULL;
+    if (opts.raster) {
+        rw = raster_writer_create(pc, opts.raster);
+        snprintf(outfile, sizeof(outfile), "%s_height.%s", ofilebase, raster_extension(opts.raster));
+        if (!rw || raster_write(rw, sim->z, sizeof(double), outfile, "Terraflow terrain height") != 0) {
+            printf("Error: Failed to write %s\n", outfile);
+            raster_writer_free(rw);
+            sim_grid_free(sim);
+            render_free(rc);
+            checkpoint_writer_free(cw);
+            pointcloud_free(pc);
+            return 1;
+        }
+    }
+
+    // Animated output collects the seq frames in one file
+    int animate = opts.animate && seq > 0;
+    if (animate) {
+        snprintf(outfile, sizeof(outfile), "%s.gif", ofilebase);
+    }
+
+    // Output frames are rendered, encoded and written by a pool of encoder
+    // threads, so the steps only wait for them when every frame buffer is busy
+    frame_writer_t *fw = NULL;
+    if (seq > 0) {
+        frame_output_t output = video ? FRAME_Y4M : (animate ? FRAME_ANIMATION : FRAME_FILES);
+        if (!animate || render_anim_open(rc, outfile)) {
+            fw = frame_writer_create(rc, pc->points.size, iwater * 2, output, video, 0);
+        }
+        if (!fw) {
+            printf("Error: Failed to start frame output\n");
+            raster_writer_free(rw);
+            sim_grid_free(sim);
+            render_free(rc);
+            checkpoint_writer_free(cw);
+            pointcloud_free(pc);
+            return 1;
+        }
+    }
 
     // Run simulation steps
-    for (int i = 0; i < iter; i++) {
+    for (int i = start; i < iter; i++) {
         // Perform watershed step
-        watershedStep(pc);
+        prof_begin(&mark);
+        sim_grid_step(sim);
+        prof_end(PROF_STEP, &mark, pc->points.size);
+
+        // Snapshot the state for the background checkpoint writer
+        if (cw && (i + 1) % opts.checkpoint_every == 0) {
+            sim_grid_store(sim, pc);
+            checkpoint_writer_submit(cw, pc, i, iter, iwater);
+        }
 
         // Generate output if needed
-        if (seq > 0 && (i % seq == 0 || i == iter - 1)) {
+        if (fw && (i % seq == 0 || i == iter - 1)) {
+            char framefile[256];
             // Create filename with step number
-            snprintf(outfile, sizeof(outfile), "%s%d.gif", ofilebase, i);
-            imagePointCloudWater(pc, iwater * 2, outfile);
-            printf("Generated: %s\n", outfile);
+            snprintf(framefile, sizeof(framefile), "%s%d.gif", ofilebase, i);
+            frame_writer_submit(fw, sim->wd, framefile);
+
+            if (rw) {
+                char description[64];
+                snprintf(framefile, sizeof(framefile), "%s_water%d.%s", ofilebase, i,
+                         raster_extension(opts.raster));
+                snprintf(description, sizeof(description), "Terraflow water depth after step %d", i);
+                raster_write(rw, sim->wd, sizeof(double), framefile, description);
+            }
         }
     }
 
+    // Waits for the queued frames and the last checkpoint to reach the disk
+    frame_writer_free(fw);
+    checkpoint_writer_free(cw);
+
+    if (animate) {
+        render_anim_close(rc);
+        printf("Generated animation: %s\n", outfile);
+    }
+
     // Generate final output if seq was not specified
     if (seq == 0) {
         snprintf(outfile, sizeof(outfile), "%s.gif", ofilebase);
-        imagePointCloudWater(pc, iwater * 2, outfile);
-        printf("Generated final output: %s\n", outfile);
+        if (render_water(rc, sim->wd, sizeof(double), iwater * 2) && render_save(rc, outfile)) {
+            printf("Generated final output: %s\n", outfile);
+        } else {
+            fprintf(stderr, "Error: Failed to render %s\n", outfile);
+        }
+
+        if (rw) {
+            snprintf(outfile, sizeof(outfile), "%s_water.%s", ofilebase, raster_extension(opts.raster));
+            raster_write(rw, sim->wd, sizeof(double), outfile, "Terraflow water depth");
+        }
+    }
+
+    if (rw) {
+        printf("Generated rasters: %s_height.%s and %s_water%s.%s\n", ofilebase,
+               raster_extension(opts.raster), ofilebase, seq > 0 ? "<step>" : "",
+               raster_extension(opts.raster));
+        raster_writer_free(rw);
+    }
+
+    sim_grid_store(sim, pc);
+    sim_grid_free(sim);
+    render_free(rc);
+
+    if (opts.basins) {
+        write_basins(pc, ofilebase);
+    }
+
+    if (opts.report || opts.perf) {
+        prof_run_t run = {
+            .input = ifile, .rows = pc->rows, .cols = pc->cols,
+            .steps = iter - start, .threads = defaultThreadCount(),
+        };
+        prof_print_summary(stdout);
+        mem_print_summary(stdout);
+        if (opts.report && prof_write_report(opts.report, &run) == 0) {
+            printf("Generated report: %s\n", opts.report);
+        }
+        prof_disable();
+    }
+
+    // Every thread that recorded has finished by now
+    if (opts.trace) {
+        if (trace_write(opts.trace) == 0) {
+            printf("Generated trace: %s\n", opts.trace);
+        }
+        trace_disable();
     }
 
     pointcloud_free(pc);
+    if (video) {
+        fclose(video);
+    }
     return 0;
-}
\ No newline at end of file
+}